@@ -17,7 +17,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <list>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -28,6 +35,30 @@
 
 #define DEFAULT_ZENV_LOG_PATH "/tmp/"
 
+/* Garbage collection starts when free space drops below ZENFS_GC_START_PCT
+ * percent of the io zone capacity and continues until ZENFS_GC_STOP_PCT
+ * percent is free again */
+#define ZENFS_GC_START_PCT (20)
+#define ZENFS_GC_STOP_PCT (25)
+
+/* Upper bound for the metadata records written as one group commit */
+#define ZENFS_META_GROUP_MAX_SIZE (1024 * 1024)
+
+/* Size of the write buffer each meta log keeps, must hold a full group */
+#define ZENFS_META_BUFFER_SIZE (ZENFS_META_GROUP_MAX_SIZE + 64 * 1024)
+
+/* Meta logs are read in direct reads of this size when recovering */
+#define ZENFS_META_READ_SIZE (1024 * 1024)
+
+/* Upper bound of the records read ahead of decoding while recovering */
+#define ZENFS_META_PREFETCH_SIZE (64 * 1024 * 1024)
+
+/* Zones holding less garbage than this are not worth collecting */
+#define ZENFS_GC_MIN_GARBAGE_PCT (50)
+
+/* Size of each copy issued when migrating valid data */
+#define ZENFS_GC_COPY_SIZE (1024 * 1024)
+
 namespace ROCKSDB_NAMESPACE {
 
 Status Superblock::DecodeFrom(Slice* input) {
@@ -49,18 +80,21 @@ Status Superblock::DecodeFrom(Slice* input) {
   input->remove_prefix(sizeof(aux_fs_path_));
   GetFixed32(input, &max_active_limit_);
   GetFixed32(input, &max_open_limit_);
+  GetFixed32(input, &nr_devices_);
   memcpy(&reserved_, input->data(), sizeof(reserved_));
   input->remove_prefix(sizeof(reserved_));
   assert(input->size() == 0);
 
   if (magic_ != MAGIC) return Status::Corruption("ZenFS Superblock", "Error: Magic missmatch");
-  if (version_ != CURRENT_VERSION) return Status::Corruption("ZenFS Superblock", "Error: Version missmatch");
+  if (version_ < MIN_VERSION || version_ > CURRENT_VERSION)
+    return Status::Corruption("ZenFS Superblock", "Error: Version missmatch");
 
   return Status::OK();
 }
 
 void Superblock::EncodeTo(std::string* output) {
   sequence_++; /* Ensure that this superblock representation is unique */
+  version_ = CURRENT_VERSION; /* Logs behind this superblock use the current encoding */
   output->clear();
   PutFixed32(output, magic_);
   output->append(uuid_, sizeof(uuid_));
@@ -74,6 +108,7 @@ void Superblock::EncodeTo(std::string* output) {
   output->append(aux_fs_path_, sizeof(aux_fs_path_));
   PutFixed32(output, max_active_limit_);
   PutFixed32(output, max_open_limit_);
+  PutFixed32(output, nr_devices_);
   output->append(reserved_, sizeof(reserved_));
   assert(output->length() == ENCODED_SIZE);
 }
@@ -83,6 +118,8 @@ Status Superblock::CompatibleWith(ZonedBlockDevice* zbd) {
   if (zone_size_ != (zbd->GetZoneSize() / block_size_))
     return Status::Corruption("ZenFS Superblock", "Error: zone size missmatch");
   if (nr_zones_ > zbd->GetNrZones()) return Status::Corruption("ZenFS Superblock", "Error: nr of zones missmatch");
+  if (std::max(nr_devices_, 1u) != zbd->GetNrDevices())
+    return Status::Corruption("ZenFS Superblock", "Error: nr of devices missmatch");
   if (max_active_limit_ > zbd->GetMaxActiveZones())
     return Status::Corruption("ZenFS Superblock", "Error: active zone limit missmatch");
   if (max_open_limit_ > zbd->GetMaxOpenZones())
@@ -91,47 +128,95 @@ Status Superblock::CompatibleWith(ZonedBlockDevice* zbd) {
   return Status::OK();
 }
 
-IOStatus ZenMetaLog::AddRecord(const Slice& slice) {
-  uint32_t record_sz = slice.size();
-  const char* data = slice.data();
-  size_t phys_sz;
-  uint32_t crc = 0;
+IOStatus ZenMetaLog::AddRecords(const Slice* slices, size_t nr_slices) {
+  ZenFSForegroundIO fg(zbd_->GetIOScheduler());
+  size_t phys_sz = 0;
+  size_t pos = 0;
   char* buffer;
-  int ret;
   IOStatus s;
 
-  phys_sz = record_sz + zMetaHeaderSize;
-
+  for (size_t i = 0; i < nr_slices; i++) {
+    /* Don't let a header straddle a block boundary */
+    if (bs_ - phys_sz % bs_ < zMetaHeaderSize) phys_sz += bs_ - phys_sz % bs_;
+    phys_sz += zMetaHeaderSize + slices[i].size();
+  }
   if (phys_sz % bs_) phys_sz += bs_ - phys_sz % bs_;
 
-  assert(data != nullptr);
-  assert((phys_sz % bs_) == 0);
+  if (phys_sz <= ZENFS_META_BUFFER_SIZE) {
+    if (buffer_ == nullptr) {
+      if (posix_memalign((void**)&buffer_, sysconf(_SC_PAGESIZE), ZENFS_META_BUFFER_SIZE))
+        return IOStatus::IOError("Failed to allocate memory");
+    }
+    buffer = buffer_;
+  } else {
+    /* Oversized writes, i.e. large snapshots, get a buffer of their own */
+    if (posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), phys_sz))
+      return IOStatus::IOError("Failed to allocate memory");
+  }
+
+  for (size_t i = 0; i < nr_slices; i++) {
+    uint32_t record_sz = slices[i].size();
+    const char* data = slices[i].data();
+    uint32_t crc = 0;
 
-  ret = posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), phys_sz);
-  if (ret != 0) return IOStatus::IOError("Failed to allocate memory");
+    assert(data != nullptr);
 
-  memset(buffer, 0, phys_sz);
+    if (bs_ - pos % bs_ < zMetaHeaderSize) {
+      memset(buffer + pos, 0, bs_ - pos % bs_);
+      pos += bs_ - pos % bs_;
+    }
 
-  crc = crc32c::Extend(crc, (const char*)&record_sz, sizeof(uint32_t));
-  crc = crc32c::Extend(crc, data, record_sz);
-  crc = crc32c::Mask(crc);
+    crc = crc32c::Extend(crc, (const char*)&record_sz, sizeof(uint32_t));
+    crc = crc32c::Extend(crc, data, record_sz);
+    crc = crc32c::Mask(crc);
 
-  EncodeFixed32(buffer, crc);
-  EncodeFixed32(buffer + sizeof(uint32_t), record_sz);
-  memcpy(buffer + sizeof(uint32_t) * 2, data, record_sz);
+    EncodeFixed32(buffer + pos, crc);
+    EncodeFixed32(buffer + pos + sizeof(uint32_t), record_sz);
+    memcpy(buffer + pos + zMetaHeaderSize, data, record_sz);
+    pos += zMetaHeaderSize + record_sz;
+  }
+  memset(buffer + pos, 0, phys_sz - pos);
 
+  assert((phys_sz % bs_) == 0);
   s = zone_->Append(buffer, phys_sz);
 
-  free(buffer);
+  if (buffer != buffer_) free(buffer);
   return s;
 }
 
+IOStatus ZenMetaLog::FillReadBuffer() {
+  ZbdIOEngine* engine = zbd_->GetIOEngine();
+  uint64_t start = read_pos_ - read_pos_ % bs_;
+  size_t to_read = std::min((uint64_t)ZENFS_META_READ_SIZE, zone_->wp_ - start);
+  size_t read = 0;
+  ssize_t ret;
+
+  if (read_buf_ == nullptr) {
+    if (posix_memalign((void**)&read_buf_, sysconf(_SC_PAGESIZE), ZENFS_META_READ_SIZE))
+      return IOStatus::IOError("Failed to allocate memory");
+  }
+
+  read_buf_start_ = start;
+  read_buf_len_ = 0;
+
+  while (read < to_read) {
+    ret = engine->Read(read_buf_ + read, to_read - read, start + read, true);
+
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return IOStatus::IOError("Read failed");
+
+    read += ret;
+  }
+
+  read_buf_len_ = read;
+  return IOStatus::OK();
+}
+
 IOStatus ZenMetaLog::Read(Slice* slice) {
-  int f = zbd_->GetReadFD();
-  const char* data = slice->data();
+  char* data = (char*)slice->data();
   size_t read = 0;
   size_t to_read = slice->size();
-  int ret;
+  IOStatus s;
 
   if (read_pos_ >= zone_->wp_) {
     // EOF
@@ -144,13 +229,18 @@ IOStatus ZenMetaLog::Read(Slice* slice) {
   }
 
   while (read < to_read) {
-    ret = pread(f, (void*)(data + read), to_read - read, read_pos_);
+    size_t n;
 
-    if (ret == -1 && errno == EINTR) continue;
-    if (ret < 0) return IOStatus::IOError("Read failed");
+    if (read_pos_ < read_buf_start_ || read_pos_ >= read_buf_start_ + read_buf_len_) {
+      if (read_pos_ >= zone_->wp_) return IOStatus::IOError("Record beyond write pointer");
+      s = FillReadBuffer();
+      if (!s.ok()) return s;
+    }
 
-    read += ret;
-    read_pos_ += ret;
+    n = std::min(to_read - read, read_buf_start_ + read_buf_len_ - read_pos_);
+    memcpy(data + read, read_buf_ + (read_pos_ - read_buf_start_), n);
+    read += n;
+    read_pos_ += n;
   }
 
   return IOStatus::OK();
@@ -163,23 +253,32 @@ IOStatus ZenMetaLog::ReadRecord(Slice* record, std::string* scratch) {
   uint32_t actual_crc;
   IOStatus s;
 
-  scratch->clear();
-  record->clear();
+  while (true) {
+    scratch->clear();
+    record->clear();
 
-  scratch->append(zMetaHeaderSize, 0);
-  header = Slice(scratch->c_str(), zMetaHeaderSize);
+    if (bs_ - read_pos_ % bs_ < zMetaHeaderSize) read_pos_ += bs_ - read_pos_ % bs_;
 
-  s = Read(&header);
-  if (!s.ok()) return s;
+    scratch->append(zMetaHeaderSize, 0);
+    header = Slice(scratch->c_str(), zMetaHeaderSize);
 
-  // EOF?
-  if (header.size() == 0) {
-    record->clear();
-    return IOStatus::OK();
-  }
+    s = Read(&header);
+    if (!s.ok()) return s;
+
+    // EOF?
+    if (header.size() == 0) {
+      record->clear();
+      return IOStatus::OK();
+    }
+
+    GetFixed32(&header, &record_crc);
+    GetFixed32(&header, &record_sz);
+
+    if (record_crc != 0 || record_sz != 0) break;
 
-  GetFixed32(&header, &record_crc);
-  GetFixed32(&header, &record_sz);
+    /* Padding, the next record starts on the next block */
+    if (read_pos_ % bs_) read_pos_ += bs_ - (read_pos_ % bs_);
+  }
 
   scratch->clear();
   scratch->append(record_sz, 0);
@@ -195,8 +294,62 @@ IOStatus ZenMetaLog::ReadRecord(Slice* record, std::string* scratch) {
     return IOStatus::IOError("Not a valid record");
   }
 
-  /* Next record starts on a block boundary */
-  if (read_pos_ % bs_) read_pos_ += bs_ - (read_pos_ % bs_);
+  return IOStatus::OK();
+}
+
+ZenMetaLogPrefetcher::ZenMetaLogPrefetcher(ZenMetaLog* log) : log_(log) {
+  thread_ = std::thread(&ZenMetaLogPrefetcher::Run, this);
+}
+
+ZenMetaLogPrefetcher::~ZenMetaLogPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void ZenMetaLogPrefetcher::Run() {
+  std::string scratch;
+  Slice record;
+
+  while (true) {
+    IOStatus s = log_->ReadRecord(&record, &scratch);
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    if (!s.ok() || record.empty()) {
+      status_ = s;
+      eof_ = true;
+      cv_.notify_all();
+      return;
+    }
+
+    cv_.wait(lock, [&] { return stop_ || queued_bytes_ < ZENFS_META_PREFETCH_SIZE; });
+    if (stop_) return;
+
+    /* ReadRecord leaves exactly the record in scratch */
+    assert(record.data() == scratch.data() && record.size() == scratch.size());
+    queued_bytes_ += scratch.size();
+    records_.push_back(std::move(scratch));
+    scratch = std::string();
+    cv_.notify_all();
+  }
+}
+
+IOStatus ZenMetaLogPrefetcher::ReadRecord(Slice* record, std::string* scratch) {
+  std::unique_lock<std::mutex> lock(mtx_);
+
+  cv_.wait(lock, [&] { return eof_ || !records_.empty(); });
+
+  record->clear();
+  if (records_.empty()) return status_;
+
+  scratch->swap(records_.front());
+  records_.pop_front();
+  queued_bytes_ -= scratch->size();
+  *record = Slice(*scratch);
+  cv_.notify_all();
 
   return IOStatus::OK();
 }
@@ -214,12 +367,19 @@ ZenFS::ZenFS(ZonedBlockDevice* zbd, std::shared_ptr<FileSystem> aux_fs, std::sha
 
   metrics_ = metrics;
   zbd_->metrics_ = metrics;
+  zbd_->bg_worker_->SetMetrics(&metrics_->bg_job_wait_latency_reporter_, &metrics_->bg_queue_depth_reporter_);
+  zbd_->GetTracer()->SetReporter(kTraceFlush, &metrics_->flush_latency_reporter_);
+  zbd_->GetTracer()->SetReporter(kTraceZoneAllocWait, &metrics_->zone_alloc_wait_latency_reporter_);
+  zbd_->GetTracer()->SetReporter(kTraceZoneReset, &metrics_->zone_reset_latency_reporter_);
 }
 
 ZenFS::~ZenFS() {
   Status s;
   Info(logger_, "ZenFS shutting down");
+  FlushDeletions();
+  StopGC();
   zbd_->LogZoneUsage();
+  zbd_->LogTraceSummary();
   LogFiles();
 
   op_log_.reset(nullptr);
@@ -228,43 +388,180 @@ ZenFS::~ZenFS() {
   delete zbd_;
 }
 
+void ZenFSFileTable::SplitPath(const std::string& fname, std::string* dir, std::string* base) {
+  size_t pos = fname.rfind('/');
+
+  if (pos == std::string::npos) {
+    dir->clear();
+    *base = fname;
+  } else {
+    *dir = fname.substr(0, pos);
+    *base = fname.substr(pos + 1);
+  }
+}
+
+ZoneFile* ZenFSFileTable::GetLocked(const std::string& fname) {
+  Shard& shard = GetShard(fname);
+  auto it = shard.files.find(fname);
+
+  if (it == shard.files.end()) return nullptr;
+  return it->second;
+}
+
+void ZenFSFileTable::InsertLocked(const std::string& fname, ZoneFile* zoneFile) {
+  std::string dir, base;
+
+  if (!GetShard(fname).files.insert(std::make_pair(fname, zoneFile)).second) return;
+
+  {
+    std::lock_guard<std::mutex> lock(ids_mtx_);
+    ids_[zoneFile->GetID()] = zoneFile;
+  }
+
+  SplitPath(fname, &dir, &base);
+  std::lock_guard<std::mutex> lock(dirs_mtx_);
+  dirs_[dir].insert(base);
+}
+
+void ZenFSFileTable::EraseLocked(const std::string& fname) {
+  Shard& shard = GetShard(fname);
+  std::string dir, base;
+
+  auto file = shard.files.find(fname);
+  if (file == shard.files.end()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(ids_mtx_);
+    auto id = ids_.find(file->second->GetID());
+    if (id != ids_.end() && id->second == file->second) ids_.erase(id);
+  }
+  shard.files.erase(file);
+
+  SplitPath(fname, &dir, &base);
+  std::lock_guard<std::mutex> lock(dirs_mtx_);
+  auto it = dirs_.find(dir);
+  if (it == dirs_.end()) return;
+  it->second.erase(base);
+  if (it->second.empty()) dirs_.erase(it);
+}
+
+void ZenFSFileTable::Rename(ZoneFile* zoneFile, const std::string& from, const std::string& to) {
+  std::mutex& from_mtx = GetMutex(from);
+  std::mutex& to_mtx = GetMutex(to);
+
+  if (&from_mtx == &to_mtx) {
+    std::lock_guard<std::mutex> lock(from_mtx);
+    EraseLocked(from);
+    zoneFile->Rename(to);
+    InsertLocked(to, zoneFile);
+    return;
+  }
+
+  std::lock(from_mtx, to_mtx);
+  EraseLocked(from);
+  zoneFile->Rename(to);
+  InsertLocked(to, zoneFile);
+  from_mtx.unlock();
+  to_mtx.unlock();
+}
+
+ZoneFile* ZenFSFileTable::FindByID(uint64_t id) {
+  std::lock_guard<std::mutex> lock(ids_mtx_);
+  auto it = ids_.find(id);
+
+  if (it == ids_.end()) return nullptr;
+  return it->second;
+}
+
+void ZenFSFileTable::ForEachLocked(const std::function<void(ZoneFile*)>& fn) {
+  for (auto& shard : shards_) {
+    for (auto& f : shard.files) fn(f.second);
+  }
+}
+
+void ZenFSFileTable::ForEach(const std::function<void(ZoneFile*)>& fn) {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    for (auto& f : shard.files) fn(f.second);
+  }
+}
+
+void ZenFSFileTable::GetChildren(const std::string& dir, std::vector<std::string>* result) {
+  std::string key = dir;
+
+  while (!key.empty() && key.back() == '/') key.pop_back();
+
+  std::lock_guard<std::mutex> lock(dirs_mtx_);
+  auto it = dirs_.find(key);
+  if (it == dirs_.end()) return;
+  result->insert(result->end(), it->second.begin(), it->second.end());
+}
+
+void ZenFSFileTable::Clear() {
+  LockAll();
+  for (auto& shard : shards_) {
+    for (auto& f : shard.files) delete f.second;
+    shard.files.clear();
+  }
+  {
+    std::lock_guard<std::mutex> lock(ids_mtx_);
+    ids_.clear();
+  }
+  {
+    std::lock_guard<std::mutex> lock(dirs_mtx_);
+    dirs_.clear();
+  }
+  UnlockAll();
+}
+
+size_t ZenFSFileTable::Size() {
+  size_t size = 0;
+
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    size += shard.files.size();
+  }
+  return size;
+}
+
 void ZenFS::LogFiles() {
-  std::map<std::string, ZoneFile*>::iterator it;
   uint64_t total_size = 0;
 
   Info(logger_, "  Files:\n");
-  for (it = files_.begin(); it != files_.end(); it++) {
-    ZoneFile* zFile = it->second;
-    std::vector<ZoneExtent*> extents = zFile->GetExtents();
+  files_.ForEach([&](ZoneFile* zFile) {
+    std::vector<ZoneExtent> extents = zFile->GetExtents();
 
-    Info(logger_, "    %-45s sz: %lu lh: %d", it->first.c_str(), zFile->GetFileSize(), zFile->GetWriteLifeTimeHint());
+    Info(logger_, "    %-45s sz: %lu lh: %d", zFile->GetFilename().c_str(), zFile->GetFileSize(),
+         zFile->GetWriteLifeTimeHint());
     for (unsigned int i = 0; i < extents.size(); i++) {
-      ZoneExtent* extent = extents[i];
-      Info(logger_, "          Extent %u {start=0x%lx, zone=%u, len=%u} ", i, extent->start_,
-           (uint32_t)(extent->zone_->start_ / zbd_->GetZoneSize()), extent->length_);
+      const ZoneExtent& extent = extents[i];
+      Info(logger_, "          Extent %u {start=0x%lx, zone=%u, len=%u} ", i, extent.start_,
+           (uint32_t)(extent.zone_->start_ / zbd_->GetZoneSize()), extent.length_);
 
-      total_size += extent->length_;
+      total_size += extent.length_;
     }
-  }
+  });
   Info(logger_, "Sum of all files: %lu MB of data \n", total_size / (1024 * 1024));
 }
 
-void ZenFS::ClearFiles() {
-  std::map<std::string, ZoneFile*>::iterator it;
-  files_mtx_.lock();
-  for (it = files_.begin(); it != files_.end(); it++) delete it->second;
-  files_.clear();
-  files_mtx_.unlock();
+void ZenFS::ClearFiles() { files_.Clear(); }
+
+/* Assumes that all files are locked. Only files that changed since their
+ * last snapshot are encoded, the encodings of the others are shared, so the
+ * snapshot can be assembled by EncodeSnapshotTo() without holding the lock */
+void ZenFS::CollectSnapshotLocked(SnapshotParts* parts) {
+  files_.ForEachLocked([&](ZoneFile* file) {
+    parts->push_back(file->GetSnapshotEncoding());
+    file->MetadataSynced();
+  });
 }
 
-/* Assumes that files_mutex_ is held */
+/* Assumes that all files are locked */
 void ZenFS::WriteSnapshotLocked(std::string* snapshot) {
-  EncodeSnapshotTo(snapshot);
+  SnapshotParts parts;
 
-  for (auto& f : files_) {
-    ZoneFile* file = f.second;
-    file->MetadataSynced();
-  }
+  CollectSnapshotLocked(&parts);
+  EncodeSnapshotTo(parts, snapshot);
 }
 
 IOStatus ZenFS::RollSnapshotZone(std::string* snapshot) {
@@ -322,8 +619,10 @@ IOStatus ZenFS::WriteEndRecord(ZenMetaLog* meta_log) {
   return meta_log->AddRecord(endRecord);
 }
 
-/* Assumes the files_mtx_ is held */
-IOStatus ZenFS::RollMetaZoneLocked(bool async) {
+/* Switch to a new op log zone, starting from a snapshot collected by
+ * CollectSnapshotLocked(). Must be the only writer of the op log, i.e. the
+ * metadata group commit leader or mount, but does not need any file locks. */
+IOStatus ZenFS::RollMetaZone(std::shared_ptr<SnapshotParts> snapshot_parts, bool async) {
   Zone* new_op_zone = nullptr;
   IOStatus s;
   LatencyHistGuard guard(&metrics_->roll_latency_reporter_);
@@ -332,10 +631,6 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
   // reserve write pointer to the old op log to close it later
   std::shared_ptr<ZenMetaLog> old_op_log = std::move(op_log_);
 
-  // write snapshot in memory
-  std::shared_ptr<std::string> snapshot(new std::string);
-  WriteSnapshotLocked(snapshot.get());
-
   // allocate new mete zone
   if ((new_op_zone = zbd_->AllocateMetaZone()) == nullptr) {
     assert(false);
@@ -359,9 +654,12 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
         "new op log zone");
   }
 
-  auto RollMetaZoneBackground = [&, old_op_log, snapshot]() {
+  auto RollMetaZoneBackground = [&, old_op_log, snapshot_parts]() {
+    std::shared_ptr<std::string> snapshot(new std::string);
     IOStatus s;
 
+    EncodeSnapshotTo(*snapshot_parts, snapshot.get());
+
     // process write snapshot
     s = snapshot_log_->AddRecord(*snapshot);
 
@@ -387,7 +685,7 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
 
   if (async) {
     // Submit async job for : 1. Finish & reset old zone. 2. Write Snapshot.
-    zbd_->meta_worker_->SubmitJob(RollMetaZoneBackground);
+    zbd_->bg_worker_->SubmitJob(RollMetaZoneBackground, kMetaRollJob);
   } else {
     // Synchronized call for initailization.
     RollMetaZoneBackground();
@@ -396,83 +694,286 @@ IOStatus ZenFS::RollMetaZoneLocked(bool async) {
   return s;
 }
 
-IOStatus ZenFS::PersistRecord(ZenMetaLog* meta_writer, std::string* record) {
+/* Must hold the file table lock of the file the record is about, so records
+ * are queued in the order the file metadata changed and a snapshot taken
+ * while rolling the op log covers every record queued before it. Records
+ * are only queued for changes already made to the file table, e.g. a new
+ * file is inserted before its creation record is queued. */
+void ZenFS::QueueRecordLocked(MetadataRecord* record) {
+  std::lock_guard<std::mutex> lock(metadata_queue_mtx_);
+  metadata_queue_.push_back(record);
+}
+
+/* Wait for a queued record to reach the op log, must not hold file locks.
+ * Whoever finds no commit in progress becomes the leader and writes all
+ * queued records, up to ZENFS_META_GROUP_MAX_SIZE, packed in a single zone
+ * append. Everyone else is acknowledged when the leader is done. */
+IOStatus ZenFS::PersistRecord(MetadataRecord* record) {
+  ZenFSTraceSpan span(zbd_->GetTracer(), kTraceMetaPersist, record->data.size());
+  std::unique_lock<std::mutex> lock(metadata_queue_mtx_);
+
+  while (!record->done) {
+    if (metadata_committing_) {
+      metadata_queue_cv_.wait(lock);
+      continue;
+    }
+
+    std::vector<MetadataRecord*> group;
+    std::vector<Slice> slices;
+    /* Deletion batches, a list so the slices stay valid as it grows */
+    std::list<std::string> batches;
+    std::string batch;
+    uint32_t batch_nr = 0;
+    size_t group_size = 0;
+    IOStatus s;
+
+    auto end_batch = [&]() {
+      if (batch_nr == 0) return;
+      std::string body;
+      PutVarint32(&body, batch_nr);
+      body.append(batch);
+      batches.emplace_back();
+      PutFixed32(&batches.back(), kFileDeletionBatch);
+      PutLengthPrefixedSlice(&batches.back(), Slice(body));
+      slices.push_back(batches.back());
+      batch.clear();
+      batch_nr = 0;
+    };
+
+    metadata_committing_ = true;
+    while (!metadata_queue_.empty()) {
+      MetadataRecord* next = metadata_queue_.front();
+      size_t size = next->data.size() + next->deletion.size();
+      if (!group.empty() && group_size + size > ZENFS_META_GROUP_MAX_SIZE) break;
+      group_size += size;
+      if (!next->deletion.empty()) {
+        batch.append(next->deletion);
+        batch_nr++;
+      } else {
+        end_batch();
+        slices.push_back(next->data);
+      }
+      group.push_back(next);
+      metadata_queue_.pop_front();
+    }
+    end_batch();
+    lock.unlock();
+
+    metrics_->metadata_group_size_reporter_.AddRecord(group.size());
+    s = op_log_->AddRecords(slices.data(), slices.size());
+    if (s == IOStatus::NoSpace()) {
+      std::shared_ptr<SnapshotParts> snapshot_parts(new SnapshotParts);
+
+      Info(logger_, "Current meta zone full, rolling to next meta zone");
+      files_.LockAll();
+      CollectSnapshotLocked(snapshot_parts.get());
+      /* The snapshot covers every record queued so far, none of them need
+       * to be written */
+      lock.lock();
+      group.insert(group.end(), metadata_queue_.begin(), metadata_queue_.end());
+      metadata_queue_.clear();
+      lock.unlock();
+      files_.UnlockAll();
+
+      s = RollMetaZone(snapshot_parts, true);
+    }
+
+    lock.lock();
+    for (auto r : group) {
+      r->status = s;
+      r->done = true;
+    }
+    metadata_committing_ = false;
+    metadata_queue_cv_.notify_all();
+  }
+
+  return record->status;
+}
+
+IOStatus ZenFS::ForceMetaZoneRoll() {
+  std::shared_ptr<SnapshotParts> snapshot_parts(new SnapshotParts);
+  std::vector<MetadataRecord*> group;
+  std::promise<void> snapshot_written;
   IOStatus s;
-  metadata_sync_mtx_.lock();
-  s = meta_writer->AddRecord(*record);
-  if (s == IOStatus::NoSpace()) {
-    Info(logger_, "Current meta zone full, rolling to next meta zone");
-    s = RollMetaZoneLocked(true);
-    /* After a successfull roll, a complete snapshot has been persisted
-     * - no need to write the record update */
-  }
-  metadata_sync_mtx_.unlock();
+
+  /* Take over as group commit leader so nobody writes the op log while it
+   * is rolled */
+  std::unique_lock<std::mutex> lock(metadata_queue_mtx_);
+  metadata_queue_cv_.wait(lock, [this]() { return !metadata_committing_; });
+  metadata_committing_ = true;
+  lock.unlock();
+
+  files_.LockAll();
+  CollectSnapshotLocked(snapshot_parts.get());
+  lock.lock();
+  group.assign(metadata_queue_.begin(), metadata_queue_.end());
+  metadata_queue_.clear();
+  lock.unlock();
+  files_.UnlockAll();
+
+  s = RollMetaZone(snapshot_parts, true);
+
+  lock.lock();
+  for (auto r : group) {
+    r->status = s;
+    r->done = true;
+  }
+  metadata_committing_ = false;
+  metadata_queue_cv_.notify_all();
+  lock.unlock();
+
+  if (!s.ok()) return s;
+
+  /* Meta roll jobs run one at a time in submission order, so this one runs
+   * once the snapshot is out */
+  std::future<void> done = snapshot_written.get_future();
+  zbd_->bg_worker_->SubmitJob([&snapshot_written]() { snapshot_written.set_value(); }, kMetaRollJob);
+  done.wait();
+
   return s;
 }
 
 IOStatus ZenFS::SyncFileMetadata(ZoneFile* zoneFile) {
-		LatencyHistGuard guard(&metrics_->sync_metadata_reporter_);
-
+  LatencyHistGuard guard(&metrics_->sync_metadata_reporter_);
+  MetadataRecord record;
   std::string fileRecord;
-  std::string output;
-
+  uint32_t nr_synced_extents;
   IOStatus s;
 
-  files_mtx_.lock();
+  std::unique_lock<std::mutex> lock(files_.GetMutex(zoneFile->GetFilename()));
 
   zoneFile->SetFileModificationTime(time(0));
-  PutFixed32(&output, kFileUpdate);
+  PutFixed32(&record.data, kFileUpdate);
   zoneFile->EncodeUpdateTo(&fileRecord);
-  PutLengthPrefixedSlice(&output, Slice(fileRecord));
+  PutLengthPrefixedSlice(&record.data, Slice(fileRecord));
 
-  s = PersistRecord(op_log_.get(), &output);
-  if (s.ok()) zoneFile->MetadataSynced();
+  /* Mark the extents synced right away so a concurrent sync of the same file
+   * does not encode them again */
+  nr_synced_extents = zoneFile->GetNrSyncedExtents();
+  zoneFile->MetadataSynced();
+  QueueRecordLocked(&record);
 
-  files_mtx_.unlock();
+  lock.unlock();
+
+  s = PersistRecord(&record);
+  if (!s.ok()) {
+    lock.lock();
+    zoneFile->MetadataUnsynced(nr_synced_extents);
+  }
 
   return s;
 }
 
-/* Must hold files_mtx_ */
-ZoneFile* ZenFS::GetFileInternal(std::string fname) {
+ZoneFile* ZenFS::GetFile(std::string fname) { return files_.Get(fname); }
+
+IOStatus ZenFS::DeleteFile(std::string fname, bool async) {
   ZoneFile* zoneFile = nullptr;
-  if (files_.find(fname) != files_.end()) {
-    zoneFile = files_[fname];
+  IOStatus s;
+
+  std::unique_lock<std::mutex> lock(files_.GetMutex(fname));
+  zoneFile = files_.GetLocked(fname);
+  if (zoneFile == nullptr) return s;
+
+  if (async) {
+    std::unique_ptr<PendingDeletion> deletion(new PendingDeletion);
+
+    deletion->fname = fname;
+    deletion->zoneFile = zoneFile;
+    files_.EraseLocked(fname);
+    EncodeFileDeletionTo(zoneFile, &deletion->record);
+    QueueRecordLocked(&deletion->record);
+    lock.unlock();
+
+    std::lock_guard<std::mutex> deletions_lock(deletions_mtx_);
+    pending_deletions_.push_back(std::move(deletion));
+    if (!deletions_scheduled_) {
+      deletions_scheduled_ = true;
+      zbd_->bg_worker_->SubmitJob([this]() { CommitDeletions(); }, kDefaultJob);
+    }
+    return s;
+  }
+
+  MetadataRecord record;
+
+  files_.EraseLocked(fname);
+  EncodeFileDeletionTo(zoneFile, &record);
+  QueueRecordLocked(&record);
+  lock.unlock();
+
+  s = PersistRecord(&record);
+
+  if (!s.ok()) {
+    /* Failed to persist the delete, return to a consistent state */
+    lock.lock();
+    files_.InsertLocked(fname, zoneFile);
+    return s;
   }
-  return zoneFile;
+
+  ReleaseDeletedFile(zoneFile);
+  return s;
 }
 
-ZoneFile* ZenFS::GetFile(std::string fname) {
-  ZoneFile* zoneFile = nullptr;
-  files_mtx_.lock();
-  zoneFile = GetFileInternal(fname);
-  files_mtx_.unlock();
-  return zoneFile;
+void ZenFS::ReleaseDeletedFile(ZoneFile* zoneFile) {
+  ZenFSReadCache* cache = zbd_->GetReadCache();
+  std::set<Zone*> zones;
+  uint64_t file_id = zoneFile->GetID();
+
+  for (const auto& extent : zoneFile->GetExtents()) zones.insert(extent.zone_);
+
+  /* Learn how long files of this class live */
+  time_t now = time(0);
+  if (zoneFile->GetFileModificationTime() > 0 && now >= zoneFile->GetFileModificationTime())
+    zbd_->GetLifetimePredictor()->RecordDeletion(zoneFile->GetFileClass(), now - zoneFile->GetFileModificationTime());
+  delete zoneFile;
+
+  if (cache != nullptr) cache->EraseFile(file_id);
+
+  /* Zones that held nothing but this file can be reset right away, so that
+   * allocation finds them empty */
+  for (const auto z : zones) zbd_->ResetZoneIfUnused(z);
 }
 
-IOStatus ZenFS::DeleteFile(std::string fname) {
-  ZoneFile* zoneFile = nullptr;
-  IOStatus s;
+/* Write the records of the pending deletions and release the space of the
+ * deleted files. All records are queued already, so the first PersistRecord
+ * commits them all, as a few deletion batch records. */
+void ZenFS::CommitDeletions() {
+  std::vector<std::unique_ptr<PendingDeletion>> deletions;
 
-  files_mtx_.lock();
-  zoneFile = GetFileInternal(fname);
-  if (zoneFile != nullptr) {
-    std::string record;
+  {
+    std::lock_guard<std::mutex> lock(deletions_mtx_);
+    deletions.swap(pending_deletions_);
+  }
 
-    zoneFile = files_[fname];
-    files_.erase(fname);
+  for (auto& deletion : deletions) {
+    IOStatus s = PersistRecord(&deletion->record);
 
-    EncodeFileDeletionTo(zoneFile, &record);
-    s = PersistRecord(op_log_.get(), &record);
-    if (!s.ok()) {
-      /* Failed to persist the delete, return to a consistent state */
-      files_.insert(std::make_pair(fname.c_str(), zoneFile));
+    if (s.ok()) {
+      ReleaseDeletedFile(deletion->zoneFile);
+      continue;
+    }
+
+    /* The file is still on disk, bring it back unless the name was reused */
+    Error(logger_, "Failed to persist deletion of %s: %s", deletion->fname.c_str(), s.ToString().c_str());
+    std::lock_guard<std::mutex> lock(files_.GetMutex(deletion->fname));
+    if (files_.GetLocked(deletion->fname) == nullptr) files_.InsertLocked(deletion->fname, deletion->zoneFile);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(deletions_mtx_);
+    if (pending_deletions_.empty()) {
+      deletions_scheduled_ = false;
+      deletions_cv_.notify_all();
     } else {
-      delete (zoneFile);
+      zbd_->bg_worker_->SubmitJob([this]() { CommitDeletions(); }, kDefaultJob);
     }
   }
-  files_mtx_.unlock();
-  return s;
+
+  MaybeScheduleGC();
+}
+
+void ZenFS::FlushDeletions() {
+  std::unique_lock<std::mutex> lock(deletions_mtx_);
+  deletions_cv_.wait(lock, [this]() { return !deletions_scheduled_; });
 }
 
 IOStatus ZenFS::NewSequentialFile(const std::string& fname, const FileOptions& file_opts,
@@ -499,7 +1000,7 @@ IOStatus ZenFS::NewRandomAccessFile(const std::string& fname, const FileOptions&
     return target()->NewRandomAccessFile(ToAuxPath(fname), file_opts, result, dbg);
   }
 
-  result->reset(new ZonedRandomAccessFile(files_[fname], file_opts));
+  result->reset(new ZonedRandomAccessFile(zoneFile, file_opts));
   return IOStatus::OK();
 }
 
@@ -518,17 +1019,19 @@ IOStatus ZenFS::NewWritableFile(const std::string& fname, const FileOptions& fil
   zoneFile = new ZoneFile(zbd_, fname, next_file_id_++, logger_);
   zoneFile->SetFileModificationTime(time(0));
 
-  /* Persist the creation of the file */
+  /* Persist the creation of the file. It goes into the file table first,
+   * so that a snapshot taken by an op log roll before its record is written
+   * has it, see QueueRecordLocked() */
+  files_.Insert(fname, zoneFile);
+
   s = SyncFileMetadata(zoneFile);
   if (!s.ok()) {
+    std::lock_guard<std::mutex> lock(files_.GetMutex(fname));
+    if (files_.GetLocked(fname) == zoneFile) files_.EraseLocked(fname);
     delete zoneFile;
     return s;
   }
 
-  files_mtx_.lock();
-  files_.insert(std::make_pair(fname.c_str(), zoneFile));
-  files_mtx_.unlock();
-
   result->reset(new ZonedWritableFile(zbd_, !file_opts.use_direct_writes, zoneFile, &metadata_writer_));
 
   return s;
@@ -536,9 +1039,16 @@ IOStatus ZenFS::NewWritableFile(const std::string& fname, const FileOptions& fil
 
 IOStatus ZenFS::ReuseWritableFile(const std::string& fname, const std::string& old_fname, const FileOptions& file_opts,
                                   std::unique_ptr<FSWritableFile>* result, IODebugContext* dbg) {
+  IOStatus s;
+
   Debug(logger_, "Reuse writable file: %s old name: %s\n", fname.c_str(), old_fname.c_str());
 
-  if (GetFile(fname) == nullptr) return IOStatus::NotFound("Old file does not exist");
+  if (GetFile(old_fname) == nullptr) return IOStatus::NotFound("Old file does not exist");
+
+  /* Zones can not be overwritten in place. Dropping the old WAL lets its
+   * zone space be reclaimed, and the new one is written to the WAL zones. */
+  s = DeleteFile(old_fname);
+  if (!s.ok()) return s;
 
   return NewWritableFile(fname, file_opts, result, dbg);
 }
@@ -564,7 +1074,6 @@ IOStatus ZenFS::ReopenWritableFile(const std::string& fname, const FileOptions&
 
 IOStatus ZenFS::GetChildren(const std::string& dir, const IOOptions& options, std::vector<std::string>* result,
                             IODebugContext* dbg) {
-  std::map<std::string, ZoneFile*>::iterator it;
   std::vector<std::string> auxfiles;
   IOStatus s;
 
@@ -579,22 +1088,7 @@ IOStatus ZenFS::GetChildren(const std::string& dir, const IOOptions& options, st
     if (f != "." && f != "..") result->push_back(f);
   }
 
-  files_mtx_.lock();
-  for (it = files_.begin(); it != files_.end(); it++) {
-    std::string fname = it->first;
-    if (fname.rfind(dir, 0) == 0) {
-      if (dir.back() == '/') {
-        fname.erase(0, dir.length());
-      } else {
-        fname.erase(0, dir.length() + 1);
-      }
-      // Don't report grandchildren
-      if (fname.find("/") == std::string::npos) {
-        result->push_back(fname);
-      }
-    }
-  }
-  files_mtx_.unlock();
+  files_.GetChildren(dir, result);
 
   return s;
 }
@@ -612,7 +1106,8 @@ IOStatus ZenFS::DeleteFile(const std::string& fname, const IOOptions& options, I
   if (zoneFile->IsOpenForWR()) {
     s = IOStatus::Busy("Cannot delete, file open for writing: ", fname.c_str());
   } else {
-    s = DeleteFile(fname);
+    /* Compactions delete their inputs one by one, commit them in batches */
+    s = DeleteFile(fname, true);
     zbd_->LogZoneStats();
   }
 
@@ -625,15 +1120,16 @@ IOStatus ZenFS::GetFileModificationTime(const std::string& f, const IOOptions& o
   IOStatus s;
 
   Debug(logger_, "GetFileModificationTime: %s \n", f.c_str());
-  files_mtx_.lock();
-  if (files_.find(f) != files_.end()) {
-    zoneFile = files_[f];
-    *mtime = (uint64_t)zoneFile->GetFileModificationTime();
-  } else {
-    s = target()->GetFileModificationTime(ToAuxPath(f), options, mtime, dbg);
+  {
+    std::lock_guard<std::mutex> lock(files_.GetMutex(f));
+    zoneFile = files_.GetLocked(f);
+    if (zoneFile != nullptr) {
+      *mtime = (uint64_t)zoneFile->GetFileModificationTime();
+      return s;
+    }
   }
-  files_mtx_.unlock();
-  return s;
+
+  return target()->GetFileModificationTime(ToAuxPath(f), options, mtime, dbg);
 }
 
 IOStatus ZenFS::GetFileSize(const std::string& f, const IOOptions& options, uint64_t* size, IODebugContext* dbg) {
@@ -642,16 +1138,16 @@ IOStatus ZenFS::GetFileSize(const std::string& f, const IOOptions& options, uint
 
   Debug(logger_, "GetFileSize: %s \n", f.c_str());
 
-  files_mtx_.lock();
-  if (files_.find(f) != files_.end()) {
-    zoneFile = files_[f];
-    *size = zoneFile->GetFileSize();
-  } else {
-    s = target()->GetFileSize(ToAuxPath(f), options, size, dbg);
+  {
+    std::lock_guard<std::mutex> lock(files_.GetMutex(f));
+    zoneFile = files_.GetLocked(f);
+    if (zoneFile != nullptr) {
+      *size = zoneFile->GetFileSize();
+      return s;
+    }
   }
-  files_mtx_.unlock();
 
-  return s;
+  return target()->GetFileSize(ToAuxPath(f), options, size, dbg);
 }
 
 IOStatus ZenFS::RenameFile(const std::string& f, const std::string& t, const IOOptions& options, IODebugContext* dbg) {
@@ -664,20 +1160,12 @@ IOStatus ZenFS::RenameFile(const std::string& f, const std::string& t, const IOO
   if (zoneFile != nullptr) {
     s = DeleteFile(t);
     if (s.ok()) {
-      files_mtx_.lock();
-      files_.erase(f);
-      zoneFile->Rename(t);
-      files_.insert(std::make_pair(t, zoneFile));
-      files_mtx_.unlock();
+      files_.Rename(zoneFile, f, t);
 
       s = SyncFileMetadata(zoneFile);
       if (!s.ok()) {
         /* Failed to persist the rename, roll back */
-        files_mtx_.lock();
-        files_.erase(t);
-        zoneFile->Rename(f);
-        files_.insert(std::make_pair(f, zoneFile));
-        files_mtx_.unlock();
+        files_.Rename(zoneFile, t, f);
       }
     }
   } else {
@@ -687,16 +1175,11 @@ IOStatus ZenFS::RenameFile(const std::string& f, const std::string& t, const IOO
   return s;
 }
 
-void ZenFS::EncodeSnapshotTo(std::string* output) {
-  std::map<std::string, ZoneFile*>::iterator it;
+void ZenFS::EncodeSnapshotTo(const SnapshotParts& parts, std::string* output) {
   std::string files_string;
   PutFixed32(output, kCompleteFilesSnapshot);
-  for (it = files_.begin(); it != files_.end(); it++) {
-    std::string file_string;
-    ZoneFile* zFile = it->second;
-
-    zFile->EncodeSnapshotTo(&file_string);
-    PutLengthPrefixedSlice(&files_string, Slice(file_string));
+  for (const auto& file_string : parts) {
+    PutLengthPrefixedSlice(&files_string, Slice(*file_string));
   }
   PutLengthPrefixedSlice(output, Slice(files_string));
 }
@@ -704,14 +1187,14 @@ void ZenFS::EncodeSnapshotTo(std::string* output) {
 void ZenFS::EncodeJson(std::ostream& json_stream) {
   bool first_element = true;
   json_stream << "[";
-  for (const auto& file : files_) {
+  files_.ForEach([&](ZoneFile* file) {
     if (first_element) {
       first_element = false;
     } else {
       json_stream << ",";
     }
-    file.second->EncodeJson(json_stream);
-  }
+    file->EncodeJson(json_stream);
+  });
   json_stream << "]";
 }
 
@@ -727,28 +1210,23 @@ Status ZenFS::DecodeFileUpdateFrom(Slice* slice) {
   if (id >= next_file_id_) next_file_id_ = id + 1;
 
   /* Check if this is an update to an existing file */
-  for (auto it = files_.begin(); it != files_.end(); it++) {
-    ZoneFile* zFile = it->second;
-    if (id == zFile->GetID()) {
-      std::string oldName = zFile->GetFilename();
+  ZoneFile* zFile = files_.FindByID(id);
+  if (zFile != nullptr) {
+    std::string oldName = zFile->GetFilename();
 
-      s = zFile->MergeUpdate(update);
-      delete update;
+    s = zFile->MergeUpdate(update);
+    delete update;
 
-      if (!s.ok()) return s;
+    if (!s.ok()) return s;
 
-      if (zFile->GetFilename() != oldName) {
-        files_.erase(oldName);
-        files_.insert(std::make_pair(zFile->GetFilename(), zFile));
-      }
+    if (zFile->GetFilename() != oldName) files_.Rename(zFile, oldName, zFile->GetFilename());
 
-      return Status::OK();
-    }
+    return Status::OK();
   }
 
   /* The update is a new file */
   assert(GetFile(update->GetFilename()) == nullptr);
-  files_.insert(std::make_pair(update->GetFilename(), update));
+  files_.Insert(update->GetFilename(), update);
 
   return Status::OK();
 }
@@ -756,14 +1234,14 @@ Status ZenFS::DecodeFileUpdateFrom(Slice* slice) {
 Status ZenFS::DecodeSnapshotFrom(Slice* input) {
   Slice slice;
 
-  assert(files_.size() == 0);
+  assert(files_.Size() == 0);
 
   while (GetLengthPrefixedSlice(input, &slice)) {
     ZoneFile* zoneFile = new ZoneFile(zbd_, "not_set", 0, logger_);
     Status s = zoneFile->DecodeFrom(&slice);
     if (!s.ok()) return s;
 
-    files_.insert(std::make_pair(zoneFile->GetFilename(), zoneFile));
+    files_.Insert(zoneFile->GetFilename(), zoneFile);
     if (zoneFile->GetID() >= next_file_id_) next_file_id_ = zoneFile->GetID() + 1;
   }
 
@@ -776,50 +1254,100 @@ Status ZenFS::DecodeSnapshotFrom(Slice* input) {
 Status ZenFS::TestSnapshotCorrectness(Slice* input) {
   Slice slice;
 
-  assert(files_.size() == 0);
+  assert(files_.Size() == 0);
 
   while (GetLengthPrefixedSlice(input, &slice)) {
-    ZoneFile* zoneFile = new ZoneFile(zbd_, "not_set", 0, logger_);
-    Status s = zoneFile->DecodeFrom(&slice);
+    ZoneFile zoneFile(zbd_, "not_set", 0, logger_);
+    Status s = zoneFile.DecodeFrom(&slice);
     if (!s.ok()) return s;
   }
 
   return Status::OK();
 }
 
-void ZenFS::EncodeFileDeletionTo(ZoneFile* zoneFile, std::string* output) {
+/* Deletions are written as entries of kFileDeletionBatch records, a varint
+ * count followed by the varint file id and length prefixed name of each
+ * deleted file */
+void ZenFS::EncodeFileDeletionTo(ZoneFile* zoneFile, MetadataRecord* record) {
+  PutVarint64(&record->deletion, zoneFile->GetID());
+  PutLengthPrefixedSlice(&record->deletion, Slice(zoneFile->GetFilename()));
+}
+
+void ZenFS::EncodeFileReplaceTo(ZoneFile* zoneFile, std::string* output) {
   std::string file_string;
 
-  PutFixed64(&file_string, zoneFile->GetID());
-  PutLengthPrefixedSlice(&file_string, Slice(zoneFile->GetFilename()));
+  zoneFile->EncodeSnapshotTo(&file_string);
 
-  PutFixed32(output, kFileDeletion);
+  PutFixed32(output, kFileReplace);
   PutLengthPrefixedSlice(output, Slice(file_string));
 }
 
+Status ZenFS::DecodeFileReplaceFrom(Slice* slice) {
+  ZoneFile* replace = new ZoneFile(zbd_, "not_set", 0, logger_);
+  Status s;
+
+  s = replace->DecodeFrom(slice);
+  if (!s.ok()) {
+    delete replace;
+    return s;
+  }
+
+  ZoneFile* zFile = files_.FindByID(replace->GetID());
+  if (zFile != nullptr) {
+    zFile->ReplaceExtents(replace->GetExtents());
+    delete replace;
+    return Status::OK();
+  }
+
+  delete replace;
+  return Status::Corruption("Zone file replace: no such file");
+}
+
 Status ZenFS::DecodeFileDeletionFrom(Slice* input) {
   uint64_t fileID;
-  std::string fileName;
   Slice slice;
 
   if (!GetFixed64(input, &fileID)) return Status::Corruption("Zone file deletion: file id missing");
 
   if (!GetLengthPrefixedSlice(input, &slice)) return Status::Corruption("Zone file deletion: file name missing");
 
-  fileName = slice.ToString();
-  if (files_.find(fileName) == files_.end()) return Status::Corruption("Zone file deletion: no such file");
+  return ApplyFileDeletion(fileID, slice.ToString());
+}
+
+Status ZenFS::DecodeFileDeletionBatchFrom(Slice* input) {
+  uint32_t nr_deletions;
 
-  ZoneFile* zoneFile = files_[fileName];
+  if (!GetVarint32(input, &nr_deletions)) return Status::Corruption("Zone file deletion batch: count missing");
+
+  for (uint32_t i = 0; i < nr_deletions; i++) {
+    uint64_t fileID;
+    Slice slice;
+
+    if (!GetVarint64(input, &fileID) || !GetLengthPrefixedSlice(input, &slice))
+      return Status::Corruption("Zone file deletion batch: truncated entry");
+
+    Status s = ApplyFileDeletion(fileID, slice.ToString());
+    if (!s.ok()) return s;
+  }
+
+  return Status::OK();
+}
+
+Status ZenFS::ApplyFileDeletion(uint64_t fileID, const std::string& fileName) {
+  std::lock_guard<std::mutex> lock(files_.GetMutex(fileName));
+  ZoneFile* zoneFile = files_.GetLocked(fileName);
+  if (zoneFile == nullptr) return Status::Corruption("Zone file deletion: no such file");
   if (zoneFile->GetID() != fileID) return Status::Corruption("Zone file deletion: file ID missmatch");
 
-  files_.erase(fileName);
+  files_.EraseLocked(fileName);
   delete zoneFile;
 
   return Status::OK();
 }
 
-Status ZenFS::RecoverFrom(ZenMetaLog* log) {
+Status ZenFS::RecoverFrom(ZenMetaLogPrefetcher* log) {
   std::string scratch;
+  std::string last_snapshot_record;
   uint32_t tag = 0;
   Slice record;
   Slice data;
@@ -836,43 +1364,71 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
       return Status::Corruption("ZenFS", "Metadata corruption");
     }
 
-    if (!GetFixed32(&record, &tag)) break;
+    /* EOF */
+    if (record.empty()) break;
 
-    if (tag == kEndRecord) break;
+    /* A record may hold more than one tagged entry */
+    while (!record.empty()) {
+      if (!GetFixed32(&record, &tag)) return Status::Corruption("ZenFS", "No recovery record tag");
 
-    if (!GetLengthPrefixedSlice(&record, &data)) {
-      return Status::Corruption("ZenFS", "No recovery record data");
-    }
-
-    switch (tag) {
-      case kCompleteFilesSnapshot:
-        s = TestSnapshotCorrectness(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode complete snapshot: %s", s.ToString().c_str());
-          return s;
-        }
-        last_snapshot = data;
+      if (tag == kEndRecord) {
+        done = true;
         break;
+      }
 
-      case kFileUpdate:
-        s = DecodeFileUpdateFrom(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode file snapshot: %s", s.ToString().c_str());
-          return s;
-        }
-        break;
+      if (!GetLengthPrefixedSlice(&record, &data)) {
+        return Status::Corruption("ZenFS", "No recovery record data");
+      }
 
-      case kFileDeletion:
-        s = DecodeFileDeletionFrom(&data);
-        if (!s.ok()) {
-          Warn(logger_, "Could not decode file deletion: %s", s.ToString().c_str());
-          return s;
-        }
-        break;
+      switch (tag) {
+        case kCompleteFilesSnapshot:
+          last_snapshot = data;
+          s = TestSnapshotCorrectness(&last_snapshot);
+          if (!s.ok()) {
+            Warn(logger_, "Could not decode complete snapshot: %s", s.ToString().c_str());
+            return s;
+          }
+          /* Keep a copy, scratch is reused by the next record */
+          last_snapshot_record.assign(data.data(), data.size());
+          last_snapshot = Slice(last_snapshot_record);
+          break;
 
-      default:
-        Warn(logger_, "Unexpected metadata record tag: %u", tag);
-        return Status::Corruption("ZenFS", "Unexpected tag");
+        case kFileUpdate:
+          s = DecodeFileUpdateFrom(&data);
+          if (!s.ok()) {
+            Warn(logger_, "Could not decode file snapshot: %s", s.ToString().c_str());
+            return s;
+          }
+          break;
+
+        case kFileDeletion:
+          s = DecodeFileDeletionFrom(&data);
+          if (!s.ok()) {
+            Warn(logger_, "Could not decode file deletion: %s", s.ToString().c_str());
+            return s;
+          }
+          break;
+
+        case kFileDeletionBatch:
+          s = DecodeFileDeletionBatchFrom(&data);
+          if (!s.ok()) {
+            Warn(logger_, "Could not decode file deletion batch: %s", s.ToString().c_str());
+            return s;
+          }
+          break;
+
+        case kFileReplace:
+          s = DecodeFileReplaceFrom(&data);
+          if (!s.ok()) {
+            Warn(logger_, "Could not decode file replace: %s", s.ToString().c_str());
+            return s;
+          }
+          break;
+
+        default:
+          Warn(logger_, "Unexpected metadata record tag: %u", tag);
+          return Status::Corruption("ZenFS", "Unexpected tag");
+      }
     }
   }
 
@@ -883,15 +1439,38 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
   return Status::OK();
 }
 
+/* Read the superblocks of a set of meta zones, all zones in parallel.
+ * Probes of zones without a valid superblock are left empty. */
+void ZenFS::ProbeMetaZones(const std::vector<Zone*>& zones, std::vector<MetaZoneProbe>* probes) {
+  std::vector<std::thread> threads;
+
+  probes->resize(zones.size());
+  for (size_t i = 0; i < zones.size(); i++) {
+    threads.emplace_back([&, i]() {
+      MetaZoneProbe& probe = (*probes)[i];
+      std::unique_ptr<ZenMetaLog> log(new ZenMetaLog(zbd_, zones[i]));
+      std::unique_ptr<Superblock> super_block(new Superblock());
+      std::string scratch;
+      Slice super_record;
+
+      if (!log->ReadRecord(&super_record, &scratch).ok()) return;
+      if (super_record.size() == 0) return;
+      if (!super_block->DecodeFrom(&super_record).ok()) return;
+      if (!super_block->CompatibleWith(zbd_).ok()) return;
+
+      probe.log = std::move(log);
+      probe.super_block = std::move(super_block);
+    });
+  }
+
+  for (auto& t : threads) t.join();
+}
+
 #define ZENV_URI_PATTERN "zenfs://"
 
 /* Mount the filesystem by recovering form the latest valid snapshot zone
  * and metadata zone*/
 Status ZenFS::Mount(bool readonly, bool formating) {
-  std::string scratch;
-  Slice super_record;
-  std::unique_ptr<ZenMetaLog> log;
-  std::unique_ptr<Superblock> super_block;
   uint32_t max_snapshot_seq = 0, max_op_seq = 0;
   Status s;
 
@@ -903,19 +1482,16 @@ Status ZenFS::Mount(bool readonly, bool formating) {
   }
 
   // Iterating snapshot zones to get last one.
-  for (const auto& z : snapshot_zones) {
-    log.reset(new ZenMetaLog(zbd_, z));
-    if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
-    if (super_record.size() == 0) continue;
-    super_block.reset(new Superblock());
-    s = super_block->DecodeFrom(&super_record);
-    if (s.ok()) s = super_block->CompatibleWith(zbd_);
-    if (s.ok() && super_block->GetSeq() > max_snapshot_seq) {
-      max_snapshot_seq = super_block->GetSeq();
-      snapshot_log_.reset(log.release());
-      super_block_.reset(super_block.release());
+  std::vector<MetaZoneProbe> snapshot_probes;
+  ProbeMetaZones(snapshot_zones, &snapshot_probes);
+  for (auto& probe : snapshot_probes) {
+    if (probe.super_block && probe.super_block->GetSeq() > max_snapshot_seq) {
+      max_snapshot_seq = probe.super_block->GetSeq();
+      snapshot_log_.reset(probe.log.release());
+      super_block_.reset(probe.super_block.release());
     }
   }
+  snapshot_probes.clear();
 
   if (max_snapshot_seq == 0) {
     // No avaliable snapshot zone, report error.
@@ -931,19 +1507,16 @@ Status ZenFS::Mount(bool readonly, bool formating) {
   }
 
   // Iterating operation log zones to get last one.
-  for (const auto& z : op_zones) {
-    log.reset(new ZenMetaLog(zbd_, z));
-    if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
-    if (super_record.size() == 0) continue;
-    super_block.reset(new Superblock());
-    s = super_block->DecodeFrom(&super_record);
-    if (s.ok()) s = super_block->CompatibleWith(zbd_);
-    if (s.ok() && super_block->GetSeq() > max_op_seq) {
-      max_op_seq = super_block->GetSeq();
-      op_log_.reset(log.release());
-      if (max_op_seq > max_snapshot_seq) super_block_.reset(super_block.release());
+  std::vector<MetaZoneProbe> op_probes;
+  ProbeMetaZones(op_zones, &op_probes);
+  for (auto& probe : op_probes) {
+    if (probe.super_block && probe.super_block->GetSeq() > max_op_seq) {
+      max_op_seq = probe.super_block->GetSeq();
+      op_log_.reset(probe.log.release());
+      if (max_op_seq > max_snapshot_seq) super_block_.reset(probe.super_block.release());
     }
   }
+  op_probes.clear();
 
   if (max_op_seq == 0) {
     // No avaliable snapshot zone, report error.
@@ -962,16 +1535,22 @@ Status ZenFS::Mount(bool readonly, bool formating) {
   // Recovery could be skipped if one's intend was formating the disk.
   if (!formating) {
     // Normal path, just mount, not format.
-    // Recover snapshot fisrt, then opreation log.
-    s = RecoverFrom(snapshot_log_.get());
-    if (!s.ok() && !readonly) {
-      Error(logger_, "!!!Error : Recover snapshot failed!!!\n%s", s.ToString().c_str());
-      return Status::Corruption("Mount", "Error: Recover snapshot failed.\n");
-    }
-    s = RecoverFrom(op_log_.get());
-    if (!s.ok() && !readonly) {
-      Error(logger_, "!!!Error : Recover opreation log failed!!!\n%s", s.ToString().c_str());
-      return Status::Corruption("Mount", "Error: Recover opreation log failed.");
+    // Recover snapshot fisrt, then opreation log. Both logs are read ahead
+    // in the background while the snapshot is decoded.
+    {
+      ZenMetaLogPrefetcher snapshot_reader(snapshot_log_.get());
+      ZenMetaLogPrefetcher op_reader(op_log_.get());
+
+      s = RecoverFrom(&snapshot_reader);
+      if (!s.ok() && !readonly) {
+        Error(logger_, "!!!Error : Recover snapshot failed!!!\n%s", s.ToString().c_str());
+        return Status::Corruption("Mount", "Error: Recover snapshot failed.\n");
+      }
+      s = RecoverFrom(&op_reader);
+      if (!s.ok() && !readonly) {
+        Error(logger_, "!!!Error : Recover opreation log failed!!!\n%s", s.ToString().c_str());
+        return Status::Corruption("Mount", "Error: Recover opreation log failed.");
+      }
     }
 
     IOOptions foo;
@@ -985,10 +1564,13 @@ Status ZenFS::Mount(bool readonly, bool formating) {
     if (readonly) {
       Info(logger_, "Mounting READ ONLY");
     } else {
-      files_mtx_.lock();
+      std::shared_ptr<SnapshotParts> snapshot_parts(new SnapshotParts);
+
+      files_.LockAll();
+      CollectSnapshotLocked(snapshot_parts.get());
+      files_.UnlockAll();
       // Synchronized call.
-      s = RollMetaZoneLocked(false);
-      files_mtx_.unlock();
+      s = RollMetaZone(snapshot_parts, false);
       if (!s.ok()) {
         Error(logger_, "Failed to roll metadata zone.");
         return s;
@@ -1004,6 +1586,8 @@ Status ZenFS::Mount(bool readonly, bool formating) {
     Info(logger_, "Resetting unused IO Zones..");
     zbd_->ResetUnusedIOZones();
     Info(logger_, "  Done");
+    zbd_->ScheduleWALZoneRefill();
+    MaybeScheduleGC();
   }
 
   LogFiles();
@@ -1104,14 +1688,262 @@ Status ZenFS::MkFS(std::string aux_fs_path, uint32_t finish_threshold, uint32_t
   return Status::OK();
 }
 
+bool ZenFS::NeedsGC() {
+  uint64_t total = zbd_->GetTotalSpace();
+  return zbd_->GetFreeSpace() * 100 < total * ZENFS_GC_START_PCT;
+}
+
+void ZenFS::MaybeScheduleGC() {
+  {
+    std::lock_guard<std::mutex> lk(gc_mtx_);
+    if (gc_scheduled_ || gc_stopped_ || !NeedsGC()) return;
+    gc_scheduled_ = true;
+  }
+  zbd_->bg_worker_->SubmitJob([this]() { GarbageCollect(); }, kGCJob);
+}
+
+/* Waits for a running or queued garbage collection job to bail out */
+void ZenFS::StopGC() {
+  std::unique_lock<std::mutex> lk(gc_mtx_);
+  gc_stopped_ = true;
+  gc_cv_.wait(lk, [this]() { return !gc_scheduled_; });
+}
+
+/* Collects one victim zone per job, so that the finish and reset jobs queued
+ * on the data worker (including the reset of the victim) run in between */
+void ZenFS::GarbageCollect() {
+  bool resubmit = false;
+  bool stopped;
+
+  {
+    std::lock_guard<std::mutex> lk(gc_mtx_);
+    stopped = gc_stopped_;
+  }
+
+  uint64_t total = zbd_->GetTotalSpace();
+  if (!stopped && zbd_->GetFreeSpace() * 100 < total * ZENFS_GC_STOP_PCT) {
+    for (const auto victim : zbd_->GetGCCandidates(ZENFS_GC_MIN_GARBAGE_PCT)) {
+      IOStatus s = MigrateZone(victim);
+      /* A file with data in the victim is open for writing, try the next one */
+      if (s.IsBusy()) continue;
+      if (!s.ok()) {
+        Warn(logger_, "GC: failed to migrate zone %lu: %s", victim->GetZoneNr(), s.ToString().c_str());
+      } else {
+        resubmit = true;
+      }
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lk(gc_mtx_);
+  if (resubmit && !gc_stopped_) {
+    zbd_->bg_worker_->SubmitJob([this]() { GarbageCollect(); }, kGCJob);
+    return;
+  }
+  gc_scheduled_ = false;
+  gc_cv_.notify_all();
+}
+
+IOStatus ZenFS::ForceGarbageCollect(uint32_t min_garbage_pct, uint32_t* nr_zones) {
+  IOStatus s;
+
+  *nr_zones = 0;
+  /* Deleted files only turn into garbage once their deletion is on disk */
+  FlushDeletions();
+
+  /* Keep background garbage collection off the victims meanwhile */
+  {
+    std::unique_lock<std::mutex> lk(gc_mtx_);
+    gc_cv_.wait(lk, [this]() { return !gc_scheduled_; });
+    gc_scheduled_ = true;
+  }
+
+  for (const auto victim : zbd_->GetGCCandidates(min_garbage_pct)) {
+    s = MigrateZone(victim);
+    if (s.IsBusy()) {
+      s = IOStatus::OK();
+      continue;
+    }
+    if (!s.ok()) break;
+    (*nr_zones)++;
+  }
+
+  std::lock_guard<std::mutex> lk(gc_mtx_);
+  gc_scheduled_ = false;
+  gc_cv_.notify_all();
+  return s;
+}
+
+/* Copy one extent of a victim zone to the GC destination zone(s), allocating
+ * new destination zones as they fill up. Copies go through the GC class of
+ * the I/O scheduler to keep foreground latencies flat. */
+IOStatus ZenFS::MigrateExtent(const ZoneExtent& extent, Env::WriteLifeTimeHint lifetime, char* buffer, Zone** dst,
+                              std::vector<ZoneExtent>* new_extents) {
+  uint32_t bs = zbd_->GetBlockSize();
+  ZbdIOEngine* engine = zbd_->GetIOEngine();
+  uint64_t src = extent.start_;
+  uint64_t left = extent.length_;
+  IOStatus s;
+
+  while (left) {
+    if (*dst == nullptr || (*dst)->capacity_ == 0) {
+      if (*dst != nullptr) (*dst)->CloseWR();
+      *dst = zbd_->AllocateZone(lifetime, false);
+      if (*dst == nullptr) return IOStatus::NoSpace("GC: zone allocation failure");
+    }
+
+    uint64_t chunk = std::min(left, (uint64_t)ZENFS_GC_COPY_SIZE);
+    uint64_t aligned = chunk;
+    if (aligned % bs) aligned += bs - (aligned % bs);
+    if (aligned > (*dst)->capacity_) {
+      /* Zone capacity is block aligned, so only the head of the chunk fits */
+      chunk = aligned = (*dst)->capacity_;
+    }
+
+    zbd_->GetIOScheduler()->Admit(kIOClassGC, aligned);
+
+    uint64_t read = 0;
+    while (read < aligned) {
+      ssize_t r = engine->Read(buffer + read, aligned - read, src + read, true);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return IOStatus::IOError("GC: read failed");
+      read += r;
+    }
+
+    uint64_t dst_start = (*dst)->wp_;
+    s = (*dst)->Append(buffer, aligned);
+    if (!s.ok()) return s;
+
+    ZoneExtent* last = new_extents->empty() ? nullptr : &new_extents->back();
+    if (last != nullptr && last->zone_ == *dst && last->start_ + last->length_ == dst_start &&
+        (uint64_t)last->length_ + chunk <= UINT32_MAX) {
+      last->length_ += chunk;
+    } else {
+      new_extents->emplace_back(dst_start, chunk, *dst);
+    }
+
+    src += chunk;
+    left -= chunk;
+  }
+
+  return s;
+}
+
+/* Move all valid data out of a victim zone: copy the live extents of every
+ * owning file, atomically swap each file's extent list through the op log
+ * and finally reset the victim. Reads of the files are not stopped; each
+ * swap waits for the reads that may still use the victim, so the reset
+ * can't pull data from under them. */
+IOStatus ZenFS::MigrateZone(Zone* victim) {
+  struct MigrationTarget {
+    std::string fname;
+    uint64_t id;
+    uint32_t file_class;
+    std::vector<ZoneExtent> extents;
+  };
+  std::vector<MigrationTarget> targets;
+  Zone* dst = nullptr;
+  uint64_t migrated = 0;
+  char* buffer;
+  IOStatus s;
+
+  LatencyHistGuard guard(&metrics_->gc_latency_reporter_);
+
+  bool busy = false;
+  files_.ForEach([&](ZoneFile* zoneFile) {
+    std::vector<ZoneExtent> extents = zoneFile->GetExtents();
+    bool in_victim = false;
+
+    for (const auto& extent : extents) {
+      if (extent.zone_ == victim) {
+        in_victim = true;
+        break;
+      }
+    }
+    if (!in_victim) return;
+
+    if (zoneFile->IsOpenForWR()) {
+      busy = true;
+      return;
+    }
+
+    MigrationTarget target;
+    target.fname = zoneFile->GetFilename();
+    target.id = zoneFile->GetID();
+    target.file_class = zoneFile->GetFileClass();
+    target.extents = std::move(extents);
+    targets.push_back(std::move(target));
+  });
+  if (busy) return IOStatus::Busy("GC: victim zone holds data of a file open for writing");
+
+  Info(logger_, "GC: migrating %lu files out of zone %lu (used: %ld written: %lu)", targets.size(),
+       victim->GetZoneNr(), victim->used_capacity_.load(), victim->wp_ - victim->start_);
+
+  if (posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), ZENFS_GC_COPY_SIZE))
+    return IOStatus::IOError("GC: failed to allocate copy buffer");
+
+  for (auto& target : targets) {
+    std::vector<ZoneExtent> new_extents;
+
+    for (auto& extent : target.extents) {
+      if (extent.zone_ != victim) {
+        new_extents.push_back(extent);
+        continue;
+      }
+      s = MigrateExtent(extent, victim->lifetime_, buffer, &dst, &new_extents);
+      if (!s.ok()) break;
+      migrated += extent.length_;
+      zbd_->GetLifetimePredictor()->AddMigrated(target.file_class, extent.length_);
+    }
+
+    if (s.ok()) {
+      std::unique_lock<std::mutex> lock(files_.GetMutex(target.fname));
+      ZoneFile* zoneFile = files_.GetLocked(target.fname);
+      /* Only commit if the file has not been deleted, replaced or appended to
+       * while copying, otherwise the copied data simply becomes garbage */
+      if (zoneFile != nullptr && zoneFile->GetID() == target.id && !zoneFile->IsOpenForWR() &&
+          zoneFile->GetExtents() == target.extents) {
+        MetadataRecord record;
+
+        zoneFile->ReplaceExtents(new_extents);
+        EncodeFileReplaceTo(zoneFile, &record.data);
+        QueueRecordLocked(&record);
+        lock.unlock();
+
+        /* Cached reads of the old extents are all done and inserted by now */
+        if (zbd_->GetReadCache() != nullptr) zbd_->GetReadCache()->EraseFile(target.id);
+
+        s = PersistRecord(&record);
+        if (!s.ok()) {
+          /* Failed to persist the new extent list, roll back */
+          lock.lock();
+          zoneFile = files_.GetLocked(target.fname);
+          if (zoneFile != nullptr && zoneFile->GetID() == target.id) zoneFile->ReplaceExtents(target.extents);
+        }
+      }
+    }
+
+    if (!s.ok()) break;
+  }
+
+  free(buffer);
+  if (dst != nullptr) dst->CloseWR();
+
+  metrics_->gc_throughput_reporter_.AddCount(migrated);
+  Info(logger_, "GC: migrated %lu bytes out of zone %lu, left used: %ld", migrated, victim->GetZoneNr(),
+       victim->used_capacity_.load());
+
+  if (s.ok()) zbd_->ResetZoneIfUnused(victim);
+
+  return s;
+}
+
 std::map<std::string, Env::WriteLifeTimeHint> ZenFS::GetWriteLifeTimeHints() {
   std::map<std::string, Env::WriteLifeTimeHint> hint_map;
 
-  for (auto it = files_.begin(); it != files_.end(); it++) {
-    ZoneFile* zoneFile = it->second;
-    std::string filename = it->first;
-    hint_map.insert(std::make_pair(filename, zoneFile->GetWriteLifeTimeHint()));
-  }
+  files_.ForEach([&](ZoneFile* zoneFile) {
+    hint_map.insert(std::make_pair(zoneFile->GetFilename(), zoneFile->GetWriteLifeTimeHint()));
+  });
 
   return hint_map;
 }
@@ -1122,19 +1954,14 @@ std::vector<ZoneStat> ZenFS::GetStat() {
   // Store file_id to filename map
   std::map<uint64_t, std::string> filenames;
 
-  files_mtx_.lock();
-
-  for (auto& file_it : files_) {
-    ZoneFile* file = file_it.second;
+  files_.ForEach([&](ZoneFile* file) {
     uint64_t file_id = file->GetID();
     filenames[file_id] = file->GetFilename();
-    for (ZoneExtent* extent : file->GetExtents()) {
-      uint64_t zone_fake_id = extent->zone_->start_;
-      sizes[zone_fake_id][file_id] += extent->length_;
+    for (const ZoneExtent& extent : file->GetExtents()) {
+      uint64_t zone_fake_id = extent.zone_->start_;
+      sizes[zone_fake_id][file_id] += extent.length_;
     }
-  }
-
-  files_mtx_.unlock();
+  });
 
   // Final result vector
   std::vector<ZoneStat> stat = zbd_->GetStat();
@@ -1162,13 +1989,16 @@ static std::string GetLogFilename(std::string bdev) {
   char buf[40];
 
   std::strftime(buf, sizeof(buf), "%Y-%m-%d_%H:%M:%S.log", log_start);
+  /* Emulated device names hold a path */
+  std::replace(bdev.begin(), bdev.end(), '/', '_');
   ss << DEFAULT_ZENV_LOG_PATH << std::string("zenfs_") << bdev << "_" << buf;
 
   return ss.str();
 }
 
 Status NewZenFS(FileSystem** fs, const std::string& bdevname, std::string bytedance_tags,
-                std::shared_ptr<MetricsReporterFactory> metrics_factory) {
+                std::shared_ptr<MetricsReporterFactory> metrics_factory, const std::string& io_engine,
+                size_t read_cache_size, bool shared_zones, uint64_t bg_write_rate) {
   std::shared_ptr<Logger> logger;
   Status s;
 
@@ -1179,11 +2009,14 @@ Status NewZenFS(FileSystem** fs, const std::string& bdevname, std::string byteda
     logger->SetInfoLogLevel(DEBUG_LEVEL);
   }
   ZonedBlockDevice* zbd = new ZonedBlockDevice(bdevname, logger);
-  IOStatus zbd_status = zbd->Open();
+  IOStatus zbd_status = zbd->Open(false, io_engine);
   if (!zbd_status.ok()) {
     Error(logger, "Failed to open zoned block device: %s", zbd_status.ToString().c_str());
     return Status::IOError(zbd_status.ToString());
   }
+  zbd->SetReadCacheSize(read_cache_size);
+  zbd->SetSharedZones(shared_zones);
+  zbd->GetIOScheduler()->SetRate(kIOClassBackground, bg_write_rate);
 
   auto metrics = std::make_shared<BytedanceMetrics>(metrics_factory, bytedance_tags, logger);
 
@@ -1249,13 +2082,47 @@ extern "C" FactoryFunc<FileSystem> zenfs_filesystem_reg;
 FactoryFunc<FileSystem> zenfs_filesystem_reg = ObjectLibrary::Default()->Register<FileSystem>(
     "zenfs://.*", [](const std::string& uri, std::unique_ptr<FileSystem>* f, std::string* errmsg) {
       std::string devID = uri;
+      std::string io_engine;
+      size_t read_cache_size = 0;
+      bool shared_zones = false;
+      uint64_t bg_write_rate = 0;
       FileSystem* fs = nullptr;
       Status s;
 
       devID.replace(0, strlen("zenfs://"), "");
+
+      /* zenfs://dev:nvme0n1?io_engine=io_uring&read_cache_mb=64&shared_zones=1 */
+      size_t opt = devID.find('?');
+      if (opt != std::string::npos) {
+        std::istringstream opts(devID.substr(opt + 1));
+        std::string kv;
+
+        devID.erase(opt);
+        while (std::getline(opts, kv, '&')) {
+          size_t eq = kv.find('=');
+          std::string key = kv.substr(0, eq);
+          std::string value = eq == std::string::npos ? "" : kv.substr(eq + 1);
+
+          if (key == "io_engine") {
+            io_engine = value;
+          } else if (key == "read_cache_mb") {
+            read_cache_size = strtoull(value.c_str(), nullptr, 10) << 20;
+          } else if (key == "shared_zones") {
+            shared_zones = value != "0";
+          } else if (key == "bg_write_mbps") {
+            bg_write_rate = strtoull(value.c_str(), nullptr, 10) << 20;
+          } else {
+            *errmsg = "Unknown option: " + key;
+            f->reset();
+            return f->get();
+          }
+        }
+      }
+
       if (devID.rfind("dev:") == 0) {
         devID.replace(0, strlen("dev:"), "");
-        s = NewZenFS(&fs, devID, "zenfs-testing", std::make_shared<ByteDanceMetricsReporterFactory>());
+        s = NewZenFS(&fs, devID, "zenfs-testing", std::make_shared<ByteDanceMetricsReporterFactory>(), io_engine,
+                     read_cache_size, shared_zones, bg_write_rate);
         std::cerr << "Metrics is not enabled due to using zenfs:// path" << std::endl;
         if (!s.ok()) {
           *errmsg = s.ToString();
@@ -1268,7 +2135,8 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg = ObjectLibrary::Default()->Registe
           *errmsg = "UUID not found";
         } else {
           s = NewZenFS(&fs, zenFileSystems[devID], "zenfs-testing",
-                       std::make_shared<ByteDanceMetricsReporterFactory>());
+                       std::make_shared<ByteDanceMetricsReporterFactory>(), io_engine, read_cache_size,
+                       shared_zones, bg_write_rate);
           std::cerr << "Metrics is not enabled due to using zenfs:// path" << std::endl;
           if (!s.ok()) {
             *errmsg = s.ToString();
@@ -1288,7 +2156,9 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg = ObjectLibrary::Default()->Registe
 
 namespace ROCKSDB_NAMESPACE {
 Status NewZenFS(FileSystem** /*fs*/, const std::string& /*bdevname*/, std::string /*bytedance_tags_*/,
-                std::shared_ptr<MetricsReporterFactory> /*metrics_reporter_factory_*/) {
+                std::shared_ptr<MetricsReporterFactory> /*metrics_reporter_factory_*/,
+                const std::string& /*io_engine*/, size_t /*read_cache_size*/, bool /*shared_zones*/,
+                uint64_t /*bg_write_rate*/) {
   return Status::NotSupported("Not built with ZenFS support\n");
 }
 std::map<std::string, std::string> ListZenFileSystems() {
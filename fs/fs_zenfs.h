@@ -6,7 +6,13 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include "io_zenfs.h"
 #include "rocksdb/env.h"
 #include "rocksdb/file_system.h"
@@ -31,12 +37,17 @@ class Superblock {
   char aux_fs_path_[256] = {0};
   uint32_t max_active_limit_ = 0;
   uint32_t max_open_limit_ = 0;
-  char reserved_[179] = {0};
+  uint32_t nr_devices_ = 0; /* 0 in superblocks of single device file systems predating this field */
+  char reserved_[175] = {0};
 
  public:
   const uint32_t MAGIC = 0x5a454e46; /* ZENF */
   const uint32_t ENCODED_SIZE = 512;
-  const uint32_t CURRENT_VERSION = 1;
+  /* Version 2 packs meta log records, version 3 delta encodes extent lists,
+   * version 4 batches file deletions. Logs of older versions are still
+   * readable */
+  const uint32_t CURRENT_VERSION = 4;
+  const uint32_t MIN_VERSION = 1;
   const uint32_t DEFAULT_FLAGS = 0;
 
   Superblock() {}
@@ -59,6 +70,7 @@ class Superblock {
     block_size_ = zbd->GetBlockSize();
     zone_size_ = zbd->GetZoneSize() / block_size_;
     nr_zones_ = zbd->GetNrZones();
+    nr_devices_ = zbd->GetNrDevices();
 
     if (max_open_limit == 0) {
       max_open_limit_ = zbd->GetMaxOpenZones();
@@ -93,8 +105,19 @@ class ZenMetaLog {
   ZonedBlockDevice* zbd_;
   size_t bs_;
 
+  /* Aligned write buffer, kept for the lifetime of the log */
+  char* buffer_ = nullptr;
+
+  /* Records are read out of large direct reads of the zone, read_buf_
+   * holds the zone data from read_buf_start_ on */
+  char* read_buf_ = nullptr;
+  uint64_t read_buf_start_ = 0;
+  size_t read_buf_len_ = 0;
+
   /* Every meta log record is prefixed with a CRC(32 bits) and record length (32
-   * bits) */
+   * bits). Records written together are packed back to back, only the last
+   * block of a write is padded. A zero header, or less than a header left in
+   * a block, marks padding up to the next block. */
   const size_t zMetaHeaderSize = sizeof(uint32_t) * 2;
 
  public:
@@ -106,29 +129,125 @@ class ZenMetaLog {
     read_pos_ = zone->start_;
   }
 
-  virtual ~ZenMetaLog() { zone_->open_for_write_ = false; }
+  virtual ~ZenMetaLog() {
+    zone_->open_for_write_ = false;
+    free(buffer_);
+    free(read_buf_);
+  }
 
-  IOStatus AddRecord(const Slice& slice);
+  IOStatus AddRecord(const Slice& slice) { return AddRecords(&slice, 1); }
+  /* Write several records with a single zone append */
+  IOStatus AddRecords(const Slice* slices, size_t nr_slices);
   IOStatus ReadRecord(Slice* record, std::string* scratch);
 
   Zone* GetZone() { return zone_; };
 
  private:
   IOStatus Read(Slice* slice);
+  IOStatus FillReadBuffer();
+};
+
+/* Reads the records of a meta log in a background thread, ahead of the
+ * caller, so reading the log overlaps with decoding the records */
+class ZenMetaLogPrefetcher {
+  ZenMetaLog* log_;
+  std::thread thread_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<std::string> records_;
+  size_t queued_bytes_ = 0;
+  IOStatus status_;
+  bool eof_ = false;
+  bool stop_ = false;
+
+  void Run();
+
+ public:
+  explicit ZenMetaLogPrefetcher(ZenMetaLog* log);
+  ~ZenMetaLogPrefetcher();
+
+  /* Same as ZenMetaLog::ReadRecord() */
+  IOStatus ReadRecord(Slice* record, std::string* scratch);
+};
+
+#define ZENFS_FILE_TABLE_SHARDS (32)
+
+/* The file table, sharded by file name so that operations on different
+ * files don't contend. A file, and its entry, is protected by the mutex of
+ * its shard. Locking all shards gives a consistent view of all files.
+ * Files are also indexed by directory and by file id. */
+class ZenFSFileTable {
+  struct Shard {
+    std::mutex mtx;
+    std::unordered_map<std::string, ZoneFile*> files;
+  };
+  Shard shards_[ZENFS_FILE_TABLE_SHARDS];
+
+  /* File names by directory, protected by dirs_mtx_ which nests inside the
+   * shard mutexes */
+  std::mutex dirs_mtx_;
+  std::map<std::string, std::set<std::string>> dirs_;
+
+  /* Files by id, for the records of the op log that refer to files by id.
+   * Protected by ids_mtx_, which nests inside the shard mutexes */
+  std::mutex ids_mtx_;
+  std::unordered_map<uint64_t, ZoneFile*> ids_;
+
+  Shard& GetShard(const std::string& fname) {
+    return shards_[std::hash<std::string>()(fname) % ZENFS_FILE_TABLE_SHARDS];
+  }
+  static void SplitPath(const std::string& fname, std::string* dir, std::string* base);
+
+ public:
+  std::mutex& GetMutex(const std::string& fname) { return GetShard(fname).mtx; }
+
+  void LockAll() {
+    for (auto& shard : shards_) shard.mtx.lock();
+  }
+  void UnlockAll() {
+    for (auto& shard : shards_) shard.mtx.unlock();
+  }
+
+  /* Must hold the mutex of fname */
+  ZoneFile* GetLocked(const std::string& fname);
+  void InsertLocked(const std::string& fname, ZoneFile* zoneFile);
+  void EraseLocked(const std::string& fname);
+
+  ZoneFile* Get(const std::string& fname) {
+    std::lock_guard<std::mutex> lock(GetMutex(fname));
+    return GetLocked(fname);
+  }
+  void Insert(const std::string& fname, ZoneFile* zoneFile) {
+    std::lock_guard<std::mutex> lock(GetMutex(fname));
+    InsertLocked(fname, zoneFile);
+  }
+
+  ZoneFile* FindByID(uint64_t id);
+  /* Move a file to a new name, locks both names */
+  void Rename(ZoneFile* zoneFile, const std::string& from, const std::string& to);
+
+  /* Visit all files, must hold all shards */
+  void ForEachLocked(const std::function<void(ZoneFile*)>& fn);
+  /* Visit all files, one shard locked at a time */
+  void ForEach(const std::function<void(ZoneFile*)>& fn);
+
+  /* Names of the files in dir, relative to dir */
+  void GetChildren(const std::string& dir, std::vector<std::string>* result);
+
+  /* Delete all files */
+  void Clear();
+  size_t Size();
 };
 
 class ZenFS : public FileSystemWrapper {
   ZonedBlockDevice* zbd_;
-  std::map<std::string, ZoneFile*> files_;
-  std::map<std::string, ZoneFile*> mirror_;
-  std::mutex files_mtx_;
+  ZenFSFileTable files_;
   std::shared_ptr<Logger> logger_;
   std::atomic<uint64_t> next_file_id_;
 
   Zone* cur_meta_zone_ = nullptr;
   std::unique_ptr<ZenMetaLog> op_log_;
   std::unique_ptr<ZenMetaLog> snapshot_log_;
-  std::mutex metadata_sync_mtx_;
   std::unique_ptr<Superblock> super_block_;
 
   std::shared_ptr<Logger> GetLogger() { return logger_; }
@@ -146,33 +265,99 @@ class ZenFS : public FileSystemWrapper {
 
   MetadataWriter metadata_writer_;
 
+  /* A metadata record waiting to be written to the op log */
+  struct MetadataRecord {
+    std::string data;
+    /* Set instead of data for file deletions, which are merged with the
+     * deletions next to them into a single kFileDeletionBatch record */
+    std::string deletion;
+    IOStatus status;
+    bool done = false;
+  };
+
+  /* Deletions that return before their record is written. The file is gone
+   * from the file table right away, its space is released once the record
+   * is on disk. */
+  struct PendingDeletion {
+    MetadataRecord record;
+    std::string fname;
+    ZoneFile* zoneFile;
+  };
+  std::mutex deletions_mtx_;
+  std::condition_variable deletions_cv_;
+  std::vector<std::unique_ptr<PendingDeletion>> pending_deletions_;
+  bool deletions_scheduled_ = false;
+
+  /* Group commit of metadata records. Records are queued in the order they
+   * are encoded and the first waiter to find no commit in progress writes
+   * everything queued so far with a single write. */
+  std::mutex metadata_queue_mtx_;
+  std::condition_variable metadata_queue_cv_;
+  std::deque<MetadataRecord*> metadata_queue_;
+  bool metadata_committing_ = false;
+
   enum ZenFSTag : uint32_t {
     kCompleteFilesSnapshot = 1,
     kFileUpdate = 2,
     kFileDeletion = 3,
     kEndRecord = 4,
+    kFileReplace = 5,
+    kFileDeletionBatch = 6,
   };
 
+  /* Garbage collection state, jobs run on the zbd data worker */
+  bool gc_scheduled_ = false;
+  bool gc_stopped_ = false;
+  std::mutex gc_mtx_;
+  std::condition_variable gc_cv_;
+
   void LogFiles();
   void ClearFiles();
+  /* Snapshot encodings of all files, shared with the files themselves */
+  typedef std::vector<std::shared_ptr<const std::string>> SnapshotParts;
+  void CollectSnapshotLocked(SnapshotParts* parts);
   void WriteSnapshotLocked(std::string* snapshot);
   IOStatus WriteEndRecord(ZenMetaLog* meta_log);
-  IOStatus RollMetaZoneLocked(bool async);
+  IOStatus RollMetaZone(std::shared_ptr<SnapshotParts> snapshot_parts, bool async);
   IOStatus RollSnapshotZone(std::string* snapshot);
-  /* experimental function only! */
-  IOStatus PersistRecord(ZenMetaLog* meta_writer, std::string* record);
+  void QueueRecordLocked(MetadataRecord* record);
+  IOStatus PersistRecord(MetadataRecord* record);
   IOStatus SyncFileMetadata(ZoneFile* zoneFile);
 
-  void EncodeSnapshotTo(std::string* output);
-  void EncodeFileDeletionTo(ZoneFile* zoneFile, std::string* output);
+  void EncodeSnapshotTo(const SnapshotParts& parts, std::string* output);
+  void EncodeFileDeletionTo(ZoneFile* zoneFile, MetadataRecord* record);
+  /* Release the space of a file whose deletion is on disk */
+  void ReleaseDeletedFile(ZoneFile* zoneFile);
+  void CommitDeletions();
+  /* Wait for all deletions in flight */
+  void FlushDeletions();
+  void EncodeFileReplaceTo(ZoneFile* zoneFile, std::string* output);
+
+  bool NeedsGC();
+  void MaybeScheduleGC();
+  void StopGC();
+  void GarbageCollect();
+  IOStatus MigrateZone(Zone* victim);
+  IOStatus MigrateExtent(const ZoneExtent& extent, Env::WriteLifeTimeHint lifetime, char* buffer, Zone** dst,
+                         std::vector<ZoneExtent>* new_extents);
 
   Status TestSnapshotCorrectness(Slice* input);
   
   Status DecodeSnapshotFrom(Slice* input);
   Status DecodeFileUpdateFrom(Slice* slice);
   Status DecodeFileDeletionFrom(Slice* slice);
+  Status DecodeFileDeletionBatchFrom(Slice* slice);
+  Status ApplyFileDeletion(uint64_t file_id, const std::string& fname);
+  Status DecodeFileReplaceFrom(Slice* slice);
 
-  Status RecoverFrom(ZenMetaLog* log);
+  Status RecoverFrom(ZenMetaLogPrefetcher* log);
+
+  /* A meta zone and its superblock, if it has a valid one */
+  struct MetaZoneProbe {
+    std::unique_ptr<ZenMetaLog> log;
+    std::unique_ptr<Superblock> super_block;
+  };
+  void ProbeMetaZones(const std::vector<Zone*>& zones, std::vector<MetaZoneProbe>* probes);
 
   std::string ToAuxPath(std::string path) {
     return super_block_->GetAuxFsPath() + path;
@@ -184,9 +369,10 @@ class ZenFS : public FileSystemWrapper {
     return path;
   }
 
-  ZoneFile* GetFileInternal(std::string fname);
   ZoneFile* GetFile(std::string fname);
-  IOStatus DeleteFile(std::string fname);
+  /* With async set the deletion returns once its record is queued, and is
+   * group committed with the deletions that follow it */
+  IOStatus DeleteFile(std::string fname, bool async = false);
 
  public:
   explicit ZenFS(ZonedBlockDevice* zbd, std::shared_ptr<FileSystem> aux_fs,
@@ -197,6 +383,13 @@ class ZenFS : public FileSystemWrapper {
   Status MkFS(std::string aux_fs_path, uint32_t finish_threshold,
               uint32_t max_open_limit, uint32_t max_active_limit);
   std::map<std::string, Env::WriteLifeTimeHint> GetWriteLifeTimeHints();
+  /* Roll to a new op log zone right away and wait for the snapshot to be
+   * written, for tools and benchmarks */
+  IOStatus ForceMetaZoneRoll();
+  /* Collect every full zone holding at least min_garbage_pct percent of
+   * garbage right away, whatever the free space, for tools and tests.
+   * nr_zones is set to the number of zones collected. */
+  IOStatus ForceGarbageCollect(uint32_t min_garbage_pct, uint32_t* nr_zones);
 
   const char* Name() const override {
     return "ZenFS - The Zoned-enabled File System";
@@ -375,12 +568,22 @@ class ZenFS : public FileSystemWrapper {
   std::vector<ZoneStat> GetStat();
 
   ZonedBlockDevice* GetZonedBlockDevice() { return zbd_; }
+  /* For tools that read a file straight off the device while the file system
+   * is mounted exclusively */
+  ZoneFile* GetZoneFile(const std::string& fname) { return GetFile(fname); }
 };
 #endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
 
+// io_engine selects the data path (sync, libaio, io_uring or io_uring_sqpoll),
+// empty for the default. read_cache_size is the memory budget of the ZenFS
+// read cache, 0 disables it. shared_zones lets files share open zones.
+// bg_write_rate limits background writes to that many bytes per second, 0
+// leaves them unlimited.
 Status NewZenFS(
     FileSystem** fs, const std::string& bdevname, std::string bytedance_tags_,
-    std::shared_ptr<MetricsReporterFactory> metrics_reporter_factory_);
+    std::shared_ptr<MetricsReporterFactory> metrics_reporter_factory_,
+    const std::string& io_engine = "", size_t read_cache_size = 0,
+    bool shared_zones = false, uint64_t bg_write_rate = 0);
 std::map<std::string, std::string> ListZenFileSystems();
 
 }  // namespace ROCKSDB_NAMESPACE
@@ -0,0 +1,810 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "io_engine.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <libaio.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef ZENFS_HAVE_URING
+#include <liburing.h>
+#endif
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Finish a read that came back short, or did not get issued at all */
+static void CompleteRead(ZbdIOEngine *engine, ZbdReadRequest *req) {
+  size_t read = req->res;
+
+  if (req->res < 0) return;
+
+  while (read < req->size) {
+    ssize_t r = engine->Read(req->buf + read, req->size - read, req->pos + read, req->direct);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) {
+      req->res = -1;
+      return;
+    }
+    if (r == 0) break;
+    read += r;
+  }
+
+  req->res = read;
+}
+
+void ZbdIOEngine::ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) {
+  for (size_t i = 0; i < nr_reqs; i++) {
+    reqs[i].res = 0;
+    CompleteRead(this, &reqs[i]);
+  }
+}
+
+/* Plain pread/pwrite, asynchronous writes are done synchronously */
+class SyncWriteQueue : public ZoneWriteQueue {
+ public:
+  explicit SyncWriteQueue(ZbdIOEngine *engine) : engine_(engine) {}
+
+  IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) override {
+    uint32_t left = size;
+
+    while (left) {
+      ssize_t ret = engine_->Write(data, left, pos);
+      if (ret < 0) {
+        fprintf(stderr, "Failed to complete io - pwrite failed!\n");
+        return IOStatus::IOError("Write failed");
+      }
+      data += ret;
+      pos += ret;
+      left -= ret;
+    }
+
+    if (seq) *seq = ++submitted_;
+    return IOStatus::OK();
+  }
+
+  IOStatus SyncTo(uint64_t /*seq*/) override { return IOStatus::OK(); }
+  IOStatus Sync() override { return IOStatus::OK(); }
+
+ private:
+  ZbdIOEngine *engine_;
+  uint64_t submitted_ = 0;
+};
+
+class SyncIOEngine : public ZbdIOEngine {
+ protected:
+  int read_f_ = -1;
+  int read_direct_f_ = -1;
+  int write_f_ = -1;
+
+ public:
+  const char *Name() override { return ZENFS_IO_ENGINE_SYNC; }
+
+  IOStatus Open(int read_f, int read_direct_f, int write_f) override {
+    read_f_ = read_f;
+    read_direct_f_ = read_direct_f;
+    write_f_ = write_f;
+    return IOStatus::OK();
+  }
+
+  ssize_t Read(char *buf, size_t size, uint64_t pos, bool direct) override {
+    return pread(direct ? read_direct_f_ : read_f_, buf, size, pos);
+  }
+
+  ssize_t Write(const char *buf, size_t size, uint64_t pos) override { return pwrite(write_f_, buf, size, pos); }
+
+  ZoneWriteQueue *NewWriteQueue(uint64_t /*zone_start*/) override { return new SyncWriteQueue(this); }
+};
+
+/* One libaio context per zone, with ZENFS_ZONE_QUEUE_DEPTH iocb slots */
+class AioWriteQueue : public ZoneWriteQueue {
+ private:
+  struct iocb iocb_[ZENFS_ZONE_QUEUE_DEPTH];
+  /* Submission sequence number of the write in each slot, 0 if free */
+  uint64_t seq_[ZENFS_ZONE_QUEUE_DEPTH];
+  io_context_t io_ctx_;
+  bool io_ctx_ok_;
+  int inflight_;
+  /* Sequence number of the last submitted write */
+  uint64_t submitted_;
+  int fd_;
+
+  /* Reap at least min_nr completions, and whatever else is done already */
+  IOStatus ReapCompletions(int min_nr) {
+    struct io_event events[ZENFS_ZONE_QUEUE_DEPTH];
+    struct timespec timeout;
+    IOStatus s;
+    int ret;
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+
+    if (min_nr > inflight_) min_nr = inflight_;
+
+    ret = io_getevents(io_ctx_, min_nr, inflight_, events, &timeout);
+    if (ret < min_nr) {
+      fprintf(stderr, "Failed to complete io - timeout ret: %d\n", ret);
+      return IOStatus::IOError("Failed to complete io - timeout?");
+    }
+
+    for (int i = 0; i < ret; i++) {
+      int slot = (int)(uintptr_t)events[i].data;
+      long res = (long)events[i].res;
+
+      if (res != (long)(iocb_[slot].u.c.nbytes)) {
+        if (res >= 0) {
+          /* TODO: we need to handle this case and keep on submittin' until we're done*/
+          fprintf(stderr, "failed to complete io - short write\n");
+          s = IOStatus::IOError("Failed to complete io - short write");
+        } else {
+          s = IOStatus::IOError("Failed to complete io - io error");
+        }
+      }
+
+      seq_[slot] = 0;
+      inflight_--;
+    }
+
+    return s;
+  }
+
+  uint64_t OldestInflight() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < ZENFS_ZONE_QUEUE_DEPTH; i++) {
+      if (seq_[i] && seq_[i] < oldest) oldest = seq_[i];
+    }
+    return oldest;
+  }
+
+ public:
+  explicit AioWriteQueue(int fd) : io_ctx_ok_(true), inflight_(0), submitted_(0), fd_(fd) {
+    memset(&io_ctx_, 0, sizeof(io_ctx_));
+    memset(seq_, 0, sizeof(seq_));
+
+    if (io_setup(ZENFS_ZONE_QUEUE_DEPTH, &io_ctx_) < 0) {
+      fprintf(stderr, "Failed to allocate io context\n");
+      io_ctx_ok_ = false;
+    }
+  }
+
+  ~AioWriteQueue() {
+    if (io_ctx_ok_) {
+      Sync();
+      io_destroy(io_ctx_);
+    }
+  }
+
+  IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) override {
+    struct iocb *iocb;
+    int slot;
+    int ret;
+    IOStatus s;
+
+    if (!io_ctx_ok_) return IOStatus::IOError("No io context");
+
+    /* Make room in the queue if all slots are taken */
+    if (inflight_ == ZENFS_ZONE_QUEUE_DEPTH) {
+      s = ReapCompletions(1);
+      if (!s.ok()) return s;
+    }
+
+    for (slot = 0; slot < ZENFS_ZONE_QUEUE_DEPTH; slot++) {
+      if (seq_[slot] == 0) break;
+    }
+    assert(slot < ZENFS_ZONE_QUEUE_DEPTH);
+
+    iocb = &iocb_[slot];
+    io_prep_pwrite(iocb, fd_, (void *)data, size, pos);
+    iocb->data = (void *)(uintptr_t)slot;
+
+    ret = io_submit(io_ctx_, 1, &iocb);
+    if (ret < 0) {
+      fprintf(stderr, "Failed to submit io\n");
+      return IOStatus::IOError("Failed to submit io");
+    }
+
+    seq_[slot] = ++submitted_;
+    inflight_++;
+    if (seq) *seq = submitted_;
+
+    return IOStatus::OK();
+  }
+
+  IOStatus SyncTo(uint64_t seq) override {
+    IOStatus s;
+
+    while (inflight_ > 0 && OldestInflight() <= seq) {
+      s = ReapCompletions(1);
+      if (!s.ok()) return s;
+    }
+
+    return IOStatus::OK();
+  }
+
+  IOStatus Sync() override {
+    while (inflight_ > 0) {
+      IOStatus s = ReapCompletions(inflight_);
+      if (!s.ok()) return s;
+    }
+
+    return IOStatus::OK();
+  }
+};
+
+/* Synchronous reads and writes, with asynchronous zone writes and read
+ * batches through libaio */
+class AioIOEngine : public SyncIOEngine {
+ private:
+  /* Contexts for read batches, set up on demand and reused */
+  std::mutex read_ctx_mtx_;
+  std::vector<io_context_t> read_ctxs_;
+
+  bool GetReadContext(io_context_t *ctx) {
+    {
+      std::lock_guard<std::mutex> lock(read_ctx_mtx_);
+      if (!read_ctxs_.empty()) {
+        *ctx = read_ctxs_.back();
+        read_ctxs_.pop_back();
+        return true;
+      }
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    return io_setup(ZENFS_READ_BATCH_DEPTH, ctx) == 0;
+  }
+
+  void PutReadContext(io_context_t ctx) {
+    std::lock_guard<std::mutex> lock(read_ctx_mtx_);
+    read_ctxs_.push_back(ctx);
+  }
+
+ public:
+  ~AioIOEngine() {
+    for (auto ctx : read_ctxs_) io_destroy(ctx);
+  }
+
+  const char *Name() override { return ZENFS_IO_ENGINE_LIBAIO; }
+  ZoneWriteQueue *NewWriteQueue(uint64_t /*zone_start*/) override { return new AioWriteQueue(write_f_); }
+
+  void ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) override {
+    struct iocb iocbs[ZENFS_READ_BATCH_DEPTH];
+    struct iocb *iocbps[ZENFS_READ_BATCH_DEPTH];
+    struct io_event events[ZENFS_READ_BATCH_DEPTH];
+    io_context_t ctx;
+
+    if (nr_reqs <= 1 || !GetReadContext(&ctx)) {
+      ZbdIOEngine::ReadBatch(reqs, nr_reqs);
+      return;
+    }
+
+    for (size_t done = 0; done < nr_reqs;) {
+      int nr = std::min(nr_reqs - done, (size_t)ZENFS_READ_BATCH_DEPTH);
+      int submitted, reaped = 0;
+
+      for (int i = 0; i < nr; i++) {
+        ZbdReadRequest *req = &reqs[done + i];
+        req->res = 0;
+        io_prep_pread(&iocbs[i], req->direct ? read_direct_f_ : read_f_, req->buf, req->size, req->pos);
+        iocbs[i].data = req;
+        iocbps[i] = &iocbs[i];
+      }
+
+      submitted = io_submit(ctx, nr, iocbps);
+      if (submitted < 0) submitted = 0;
+
+      while (reaped < submitted) {
+        int ret = io_getevents(ctx, submitted - reaped, submitted - reaped, events, nullptr);
+        if (ret < 0) {
+          if (ret == -EINTR) continue;
+          break;
+        }
+        for (int i = 0; i < ret; i++) {
+          ZbdReadRequest *req = (ZbdReadRequest *)events[i].data;
+          long res = (long)events[i].res;
+          req->res = res;
+          if (res < 0) {
+            errno = -res;
+            req->res = -1;
+          }
+        }
+        reaped += ret;
+      }
+
+      /* Anything not submitted, or short, is finished synchronously */
+      for (int i = 0; i < nr; i++) {
+        ZbdReadRequest *req = &reqs[done + i];
+        if (req->res >= 0 && (size_t)req->res < req->size) CompleteRead(this, req);
+      }
+
+      done += nr;
+    }
+
+    PutReadContext(ctx);
+  }
+};
+
+#ifdef ZENFS_HAVE_URING
+
+#define ZENFS_URING_DEPTH (256)
+#define ZENFS_URING_MAX_BUFFERS (1024)
+#define ZENFS_URING_SQPOLL_IDLE_MS (50)
+
+struct UringRequest {
+  std::atomic<bool> done{true};
+  int res = 0;
+};
+
+/* All I/O goes through a single ring with the device files registered as
+ * fixed files. Submissions and completions are serialized separately, and
+ * whoever waits for a request reaps completions on behalf of everybody. */
+class UringIOEngine : public ZbdIOEngine {
+ private:
+  enum { kReadFile = 0, kReadDirectFile, kWriteFile, kNrFiles };
+
+  struct io_uring ring_;
+  bool ring_ok_ = false;
+  bool sqpoll_;
+  /* Index of each device file in the fixed file table, -1 if not open */
+  int file_idx_[kNrFiles];
+
+  std::mutex sq_mtx_;
+  std::mutex cq_mtx_;
+
+  /* Registered buffers by start address, size and index */
+  bool fixed_buffers_ = false;
+  std::mutex buf_mtx_;
+  std::map<uintptr_t, std::pair<size_t, int>> buffers_;
+  std::vector<int> free_buf_idx_;
+
+  int LookupBuffer(const char *buf, size_t size) {
+    if (!fixed_buffers_) return -1;
+
+    std::lock_guard<std::mutex> lock(buf_mtx_);
+    auto it = buffers_.upper_bound((uintptr_t)buf);
+    if (it == buffers_.begin()) return -1;
+    --it;
+    if ((uintptr_t)buf + size > it->first + it->second.first) return -1;
+    return it->second.second;
+  }
+
+  /* Queue a request without submitting it, sq_mtx_ must be held */
+  void PrepLocked(UringRequest *req, int file, bool write, const char *buf, size_t size, uint64_t pos) {
+    struct io_uring_sqe *sqe;
+
+    req->done.store(false, std::memory_order_relaxed);
+
+    while ((sqe = io_uring_get_sqe(&ring_)) == nullptr) {
+      /* Submission queue full, hand what we have to the kernel */
+      SubmitLocked();
+      if (sqpoll_) io_uring_sqring_wait(&ring_);
+    }
+
+    if (write) {
+      int buf_idx = LookupBuffer(buf, size);
+      if (buf_idx >= 0)
+        io_uring_prep_write_fixed(sqe, file_idx_[file], buf, size, pos, buf_idx);
+      else
+        io_uring_prep_write(sqe, file_idx_[file], buf, size, pos);
+    } else {
+      io_uring_prep_read(sqe, file_idx_[file], (void *)buf, size, pos);
+    }
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+  }
+
+  IOStatus Submit(UringRequest *req, int file, bool write, const char *buf, size_t size, uint64_t pos) {
+    int ret;
+
+    if (file_idx_[file] < 0) {
+      errno = EBADF;
+      return IOStatus::IOError("Device file not open");
+    }
+
+    std::lock_guard<std::mutex> lock(sq_mtx_);
+    PrepLocked(req, file, write, buf, size, pos);
+
+    ret = SubmitLocked();
+    if (ret < 0) {
+      errno = -ret;
+      return IOStatus::IOError("Failed to submit io");
+    }
+
+    return IOStatus::OK();
+  }
+
+  /* Hand queued requests to the kernel, sq_mtx_ must be held. The kernel
+   * pushes back while the completion queue is overflowing, keep trying
+   * until the waiters have reaped. */
+  int SubmitLocked() {
+    int ret;
+
+    while ((ret = io_uring_submit(&ring_)) == -EINTR || ret == -EAGAIN || ret == -EBUSY) std::this_thread::yield();
+
+    return ret;
+  }
+
+  /* Reap a batch of completions, waiting for at least one */
+  void Reap() {
+    struct io_uring_cqe *cqes[ZENFS_URING_DEPTH];
+    struct io_uring_cqe *cqe;
+    unsigned nr;
+
+    nr = io_uring_peek_batch_cqe(&ring_, cqes, ZENFS_URING_DEPTH);
+    if (nr == 0) {
+      if (io_uring_wait_cqe(&ring_, &cqe) < 0) return;
+      cqes[0] = cqe;
+      nr = 1;
+    }
+
+    for (unsigned i = 0; i < nr; i++) {
+      UringRequest *req = (UringRequest *)io_uring_cqe_get_data(cqes[i]);
+      req->res = cqes[i]->res;
+      req->done.store(true, std::memory_order_release);
+    }
+    io_uring_cq_advance(&ring_, nr);
+  }
+
+ public:
+  explicit UringIOEngine(bool sqpoll) : sqpoll_(sqpoll) {
+    for (int i = 0; i < kNrFiles; i++) file_idx_[i] = -1;
+  }
+
+  ~UringIOEngine() {
+    if (ring_ok_) io_uring_queue_exit(&ring_);
+  }
+
+  const char *Name() override { return sqpoll_ ? ZENFS_IO_ENGINE_URING_SQPOLL : ZENFS_IO_ENGINE_URING; }
+
+  IOStatus Open(int read_f, int read_direct_f, int write_f) override {
+    struct io_uring_params params;
+    int fds[kNrFiles] = {read_f, read_direct_f, write_f};
+    int files[kNrFiles];
+    int nr_files = 0;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    if (sqpoll_) {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = ZENFS_URING_SQPOLL_IDLE_MS;
+    }
+
+    ret = io_uring_queue_init_params(ZENFS_URING_DEPTH, &ring_, &params);
+    if (ret < 0) return IOStatus::IOError("Failed to set up io_uring: " + std::string(strerror(-ret)));
+    ring_ok_ = true;
+
+    for (int i = 0; i < kNrFiles; i++) {
+      if (fds[i] < 0) continue;
+      file_idx_[i] = nr_files;
+      files[nr_files++] = fds[i];
+    }
+
+    ret = io_uring_register_files(&ring_, files, nr_files);
+    if (ret < 0) return IOStatus::IOError("Failed to register files with io_uring: " + std::string(strerror(-ret)));
+
+    /* Sparse buffer tables need a recent kernel, do without if missing */
+    if (io_uring_register_buffers_sparse(&ring_, ZENFS_URING_MAX_BUFFERS) == 0) {
+      fixed_buffers_ = true;
+      for (int i = ZENFS_URING_MAX_BUFFERS - 1; i >= 0; i--) free_buf_idx_.push_back(i);
+    }
+
+    return IOStatus::OK();
+  }
+
+  /* Wait for a submitted request to complete */
+  void Wait(UringRequest *req) {
+    while (!req->done.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(cq_mtx_);
+      if (!req->done.load(std::memory_order_acquire)) Reap();
+    }
+  }
+
+  IOStatus SubmitWrite(UringRequest *req, const char *buf, size_t size, uint64_t pos) {
+    return Submit(req, kWriteFile, true, buf, size, pos);
+  }
+
+  ssize_t Read(char *buf, size_t size, uint64_t pos, bool direct) override {
+    UringRequest req;
+
+    if (!Submit(&req, direct ? kReadDirectFile : kReadFile, false, buf, size, pos).ok()) return -1;
+    Wait(&req);
+
+    if (req.res < 0) {
+      errno = -req.res;
+      return -1;
+    }
+    return req.res;
+  }
+
+  ssize_t Write(const char *buf, size_t size, uint64_t pos) override {
+    UringRequest req;
+
+    if (!SubmitWrite(&req, buf, size, pos).ok()) return -1;
+    Wait(&req);
+
+    if (req.res < 0) {
+      errno = -req.res;
+      return -1;
+    }
+    return req.res;
+  }
+
+  /* All reads of the batch go out with a single submission */
+  void ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) override {
+    std::vector<UringRequest> ureqs(nr_reqs);
+    int ret;
+
+    {
+      std::lock_guard<std::mutex> lock(sq_mtx_);
+      for (size_t i = 0; i < nr_reqs; i++) {
+        int file = reqs[i].direct ? kReadDirectFile : kReadFile;
+        if (file_idx_[file] < 0) continue;
+        PrepLocked(&ureqs[i], file, false, reqs[i].buf, reqs[i].size, reqs[i].pos);
+      }
+      ret = SubmitLocked();
+    }
+
+    if (ret < 0) {
+      for (size_t i = 0; i < nr_reqs; i++) reqs[i].res = -1;
+      errno = -ret;
+      return;
+    }
+
+    for (size_t i = 0; i < nr_reqs; i++) {
+      Wait(&ureqs[i]);
+      reqs[i].res = ureqs[i].res;
+      if (ureqs[i].res < 0) {
+        errno = -ureqs[i].res;
+        reqs[i].res = -1;
+      } else if ((size_t)reqs[i].res < reqs[i].size) {
+        CompleteRead(this, &reqs[i]);
+      }
+    }
+  }
+
+  ZoneWriteQueue *NewWriteQueue(uint64_t zone_start) override;
+
+  void RegisterBuffer(void *buf, size_t size) override {
+    struct iovec iov;
+
+    if (!fixed_buffers_) return;
+
+    std::lock_guard<std::mutex> lock(buf_mtx_);
+    if (free_buf_idx_.empty()) return;
+
+    int idx = free_buf_idx_.back();
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    if (io_uring_register_buffers_update_tag(&ring_, idx, &iov, nullptr, 1) != 1) return;
+
+    free_buf_idx_.pop_back();
+    buffers_[(uintptr_t)buf] = std::make_pair(size, idx);
+  }
+
+  void UnregisterBuffer(void *buf) override {
+    struct iovec iov;
+
+    if (!fixed_buffers_) return;
+
+    std::lock_guard<std::mutex> lock(buf_mtx_);
+    auto it = buffers_.find((uintptr_t)buf);
+    if (it == buffers_.end()) return;
+
+    iov.iov_base = nullptr;
+    iov.iov_len = 0;
+    io_uring_register_buffers_update_tag(&ring_, it->second.second, &iov, nullptr, 1);
+
+    free_buf_idx_.push_back(it->second.second);
+    buffers_.erase(it);
+  }
+};
+
+class UringWriteQueue : public ZoneWriteQueue {
+ private:
+  UringIOEngine *engine_;
+  UringRequest reqs_[ZENFS_ZONE_QUEUE_DEPTH];
+  /* Submission sequence number of the write in each slot, 0 if free */
+  uint64_t seq_[ZENFS_ZONE_QUEUE_DEPTH];
+  uint32_t size_[ZENFS_ZONE_QUEUE_DEPTH];
+  int inflight_ = 0;
+  uint64_t submitted_ = 0;
+
+  /* Free the slots of completed writes */
+  IOStatus Sweep() {
+    IOStatus s;
+
+    for (int i = 0; i < ZENFS_ZONE_QUEUE_DEPTH; i++) {
+      if (seq_[i] == 0 || !reqs_[i].done.load(std::memory_order_acquire)) continue;
+
+      if (reqs_[i].res != (int)size_[i]) {
+        if (reqs_[i].res >= 0) {
+          fprintf(stderr, "failed to complete io - short write\n");
+          s = IOStatus::IOError("Failed to complete io - short write");
+        } else {
+          s = IOStatus::IOError("Failed to complete io - io error");
+        }
+      }
+
+      seq_[i] = 0;
+      inflight_--;
+    }
+
+    return s;
+  }
+
+ public:
+  explicit UringWriteQueue(UringIOEngine *engine) : engine_(engine) { memset(seq_, 0, sizeof(seq_)); }
+
+  ~UringWriteQueue() { Sync(); }
+
+  IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) override {
+    IOStatus s;
+    int slot;
+
+    if (inflight_ == ZENFS_ZONE_QUEUE_DEPTH) {
+      uint64_t oldest = UINT64_MAX;
+      int oldest_slot = 0;
+      for (int i = 0; i < ZENFS_ZONE_QUEUE_DEPTH; i++) {
+        if (seq_[i] && seq_[i] < oldest) {
+          oldest = seq_[i];
+          oldest_slot = i;
+        }
+      }
+      engine_->Wait(&reqs_[oldest_slot]);
+    }
+
+    s = Sweep();
+    if (!s.ok()) return s;
+
+    for (slot = 0; slot < ZENFS_ZONE_QUEUE_DEPTH; slot++) {
+      if (seq_[slot] == 0) break;
+    }
+    assert(slot < ZENFS_ZONE_QUEUE_DEPTH);
+
+    s = engine_->SubmitWrite(&reqs_[slot], data, size, pos);
+    if (!s.ok()) return s;
+
+    seq_[slot] = ++submitted_;
+    size_[slot] = size;
+    inflight_++;
+    if (seq) *seq = submitted_;
+
+    return IOStatus::OK();
+  }
+
+  IOStatus SyncTo(uint64_t seq) override {
+    for (int i = 0; i < ZENFS_ZONE_QUEUE_DEPTH; i++) {
+      if (seq_[i] && seq_[i] <= seq) engine_->Wait(&reqs_[i]);
+    }
+    return Sweep();
+  }
+
+  IOStatus Sync() override { return SyncTo(submitted_); }
+};
+
+ZoneWriteQueue *UringIOEngine::NewWriteQueue(uint64_t /*zone_start*/) { return new UringWriteQueue(this); }
+
+#endif  // ZENFS_HAVE_URING
+
+/* Translates the positions of a device queue into the concatenated address
+ * space */
+class ConcatWriteQueue : public ZoneWriteQueue {
+ public:
+  ConcatWriteQueue(ZoneWriteQueue *queue, uint64_t start) : queue_(queue), start_(start) {}
+
+  IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) override {
+    return queue_->Submit(data, size, pos - start_, seq);
+  }
+  IOStatus SyncTo(uint64_t seq) override { return queue_->SyncTo(seq); }
+  IOStatus Sync() override { return queue_->Sync(); }
+
+ private:
+  std::unique_ptr<ZoneWriteQueue> queue_;
+  uint64_t start_;
+};
+
+void ZbdConcatIOEngine::AddDevice(uint64_t start, uint64_t size, std::unique_ptr<ZbdIOEngine> &&engine) {
+  assert(devices_.empty() || devices_.back().start + devices_.back().size == start);
+  devices_.push_back({start, size, std::move(engine)});
+}
+
+ZbdConcatIOEngine::Device *ZbdConcatIOEngine::GetDevice(uint64_t pos) {
+  auto it = std::upper_bound(devices_.begin(), devices_.end(), pos,
+                             [](uint64_t p, const Device &dev) { return p < dev.start + dev.size; });
+  if (it == devices_.end()) return nullptr;
+  return &(*it);
+}
+
+ssize_t ZbdConcatIOEngine::Read(char *buf, size_t size, uint64_t pos, bool direct) {
+  Device *dev = GetDevice(pos);
+  if (dev == nullptr) return 0;
+  size = std::min(size, dev->start + dev->size - pos);
+  return dev->engine->Read(buf, size, pos - dev->start, direct);
+}
+
+ssize_t ZbdConcatIOEngine::Write(const char *buf, size_t size, uint64_t pos) {
+  Device *dev = GetDevice(pos);
+  if (dev == nullptr) {
+    errno = ENOSPC;
+    return -1;
+  }
+  size = std::min(size, dev->start + dev->size - pos);
+  return dev->engine->Write(buf, size, pos - dev->start);
+}
+
+void ZbdConcatIOEngine::ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) {
+  std::vector<std::vector<ZbdReadRequest>> dev_reqs(devices_.size());
+  std::vector<std::vector<size_t>> dev_idx(devices_.size());
+
+  for (size_t i = 0; i < nr_reqs; i++) {
+    Device *dev = GetDevice(reqs[i].pos);
+    reqs[i].res = 0;
+    if (dev == nullptr) continue;
+
+    size_t d = dev - devices_.data();
+    ZbdReadRequest req = reqs[i];
+    req.size = std::min(req.size, dev->start + dev->size - req.pos);
+    req.pos -= dev->start;
+    dev_reqs[d].push_back(req);
+    dev_idx[d].push_back(i);
+  }
+
+  for (size_t d = 0; d < devices_.size(); d++) {
+    if (dev_reqs[d].empty()) continue;
+    devices_[d].engine->ReadBatch(dev_reqs[d].data(), dev_reqs[d].size());
+    for (size_t i = 0; i < dev_reqs[d].size(); i++) reqs[dev_idx[d][i]].res = dev_reqs[d][i].res;
+  }
+
+  /* Reads crossing a device boundary continue on the next device */
+  for (size_t i = 0; i < nr_reqs; i++) CompleteRead(this, &reqs[i]);
+}
+
+ZoneWriteQueue *ZbdConcatIOEngine::NewWriteQueue(uint64_t zone_start) {
+  Device *dev = GetDevice(zone_start);
+  assert(dev != nullptr);
+  return new ConcatWriteQueue(dev->engine->NewWriteQueue(zone_start - dev->start), dev->start);
+}
+
+void ZbdConcatIOEngine::RegisterBuffer(void *buf, size_t size) {
+  for (auto &dev : devices_) dev.engine->RegisterBuffer(buf, size);
+}
+
+void ZbdConcatIOEngine::UnregisterBuffer(void *buf) {
+  for (auto &dev : devices_) dev.engine->UnregisterBuffer(buf);
+}
+
+IOStatus ZbdIOEngine::Create(const std::string &name, std::unique_ptr<ZbdIOEngine> *engine) {
+  if (name.empty() || name == ZENFS_IO_ENGINE_LIBAIO) {
+    engine->reset(new AioIOEngine());
+  } else if (name == ZENFS_IO_ENGINE_SYNC) {
+    engine->reset(new SyncIOEngine());
+  } else if (name == ZENFS_IO_ENGINE_URING || name == ZENFS_IO_ENGINE_URING_SQPOLL) {
+#ifdef ZENFS_HAVE_URING
+    engine->reset(new UringIOEngine(name == ZENFS_IO_ENGINE_URING_SQPOLL));
+#else
+    return IOStatus::NotSupported("ZenFS was built without io_uring support");
+#endif
+  } else {
+    return IOStatus::InvalidArgument("Unknown I/O engine: " + name);
+  }
+
+  return IOStatus::OK();
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
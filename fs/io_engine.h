@@ -0,0 +1,120 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rocksdb/io_status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Max number of asynchronous writes in flight per open zone. Writes are
+ * submitted in write pointer order and kept in order by mq-deadline */
+#define ZENFS_ZONE_QUEUE_DEPTH (8)
+
+#define ZENFS_IO_ENGINE_SYNC "sync"
+#define ZENFS_IO_ENGINE_LIBAIO "libaio"
+#define ZENFS_IO_ENGINE_URING "io_uring"
+#define ZENFS_IO_ENGINE_URING_SQPOLL "io_uring_sqpoll"
+
+#define ZENFS_DEFAULT_IO_ENGINE ZENFS_IO_ENGINE_LIBAIO
+
+/* Max number of reads of a batch that are in flight at the same time */
+#define ZENFS_READ_BATCH_DEPTH (64)
+
+/* One read of a batch. res is set like the return value of Read(), short
+ * reads are only reported at end of device. */
+struct ZbdReadRequest {
+  char *buf;
+  size_t size;
+  uint64_t pos;
+  bool direct;
+  ssize_t res;
+};
+
+/* Asynchronous write queue for a single open zone. Every write gets a
+ * sequence number, and SyncTo(seq) returns once that write and all writes
+ * submitted before it have completed. */
+class ZoneWriteQueue {
+ public:
+  virtual ~ZoneWriteQueue() {}
+
+  /* data must stay valid until the write has been synced */
+  virtual IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) = 0;
+  virtual IOStatus SyncTo(uint64_t seq) = 0;
+  virtual IOStatus Sync() = 0;
+};
+
+/* Data path to the zoned block device. Read and Write follow pread/pwrite
+ * semantics: they return the number of bytes transferred, or -1 with errno
+ * set. */
+class ZbdIOEngine {
+ public:
+  virtual ~ZbdIOEngine() {}
+
+  static IOStatus Create(const std::string &name, std::unique_ptr<ZbdIOEngine> *engine);
+
+  virtual const char *Name() = 0;
+  /* write_f is -1 for read only devices */
+  virtual IOStatus Open(int read_f, int read_direct_f, int write_f) = 0;
+
+  virtual ssize_t Read(char *buf, size_t size, uint64_t pos, bool direct) = 0;
+  virtual ssize_t Write(const char *buf, size_t size, uint64_t pos) = 0;
+  /* Issue a batch of reads and wait for all of them */
+  virtual void ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs);
+
+  /* Queue for the zone starting at zone_start */
+  virtual ZoneWriteQueue *NewWriteQueue(uint64_t zone_start) = 0;
+
+  /* Long lived I/O buffers, e.g. write buffers, may be registered with the
+   * engine so it can skip mapping them on every request */
+  virtual void RegisterBuffer(void * /*buf*/, size_t /*size*/) {}
+  virtual void UnregisterBuffer(void * /*buf*/) {}
+};
+
+/* Several devices concatenated into one address space, each device driven
+ * by an engine of its own. Requests are split at device boundaries, so
+ * reads and writes crossing one come back short. */
+class ZbdConcatIOEngine : public ZbdIOEngine {
+  struct Device {
+    uint64_t start;
+    uint64_t size;
+    std::unique_ptr<ZbdIOEngine> engine;
+  };
+  std::vector<Device> devices_;
+
+  /* Device holding pos, nullptr beyond the last one */
+  Device *GetDevice(uint64_t pos);
+
+ public:
+  /* Devices must be added in address order, before any I/O */
+  void AddDevice(uint64_t start, uint64_t size, std::unique_ptr<ZbdIOEngine> &&engine);
+
+  const char *Name() override { return devices_.empty() ? "" : devices_.front().engine->Name(); }
+  /* Devices are opened by their own engines */
+  IOStatus Open(int /*read_f*/, int /*read_direct_f*/, int /*write_f*/) override { return IOStatus::OK(); }
+
+  ssize_t Read(char *buf, size_t size, uint64_t pos, bool direct) override;
+  ssize_t Write(const char *buf, size_t size, uint64_t pos) override;
+  void ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) override;
+
+  ZoneWriteQueue *NewWriteQueue(uint64_t zone_start) override;
+
+  void RegisterBuffer(void *buf, size_t size) override;
+  void UnregisterBuffer(void *buf) override;
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,79 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include "io_sched.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace ROCKSDB_NAMESPACE {
+
+ZenFSIOScheduler::ZenFSIOScheduler() {
+  for (auto &bucket : buckets_) bucket.last = std::chrono::steady_clock::now();
+  SetRate(kIOClassGC, ZENFS_QOS_GC_RATE);
+}
+
+void ZenFSIOScheduler::SetRate(ZenFSIOClass io_class, uint64_t rate) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  TokenBucket &bucket = buckets_[io_class];
+
+  bucket.rate = rate;
+  bucket.tokens = (double)rate * ZENFS_QOS_BURST_MS / 1000;
+  bucket.last = std::chrono::steady_clock::now();
+}
+
+uint64_t ZenFSIOScheduler::GetRate(ZenFSIOClass io_class) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return buckets_[io_class].rate;
+}
+
+void ZenFSIOScheduler::EndForeground() {
+  if (--fg_inflight_ == 0) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    fg_idle_.notify_all();
+  }
+}
+
+void ZenFSIOScheduler::Admit(ZenFSIOClass io_class, uint64_t size) {
+  std::chrono::microseconds wait(0);
+
+  if (io_class == kIOClassForeground) return;
+
+  {
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    if (fg_inflight_.load() > 0) {
+      deferred_++;
+      fg_idle_.wait_for(lock, std::chrono::microseconds(ZENFS_QOS_MAX_DEFER_US),
+                        [this] { return fg_inflight_.load() == 0; });
+    }
+
+    TokenBucket &bucket = buckets_[io_class];
+    if (bucket.rate == 0 || size == 0) return;
+
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+    double burst = (double)bucket.rate * ZENFS_QOS_BURST_MS / 1000;
+
+    bucket.last = now;
+    bucket.tokens = std::min(burst, bucket.tokens + elapsed * bucket.rate);
+    /* Take the tokens right away, going into debt if short, so that
+     * concurrent callers queue up behind each other */
+    bucket.tokens -= size;
+    if (bucket.tokens < 0) wait = std::chrono::microseconds((uint64_t)(-bucket.tokens * 1000000 / bucket.rate));
+  }
+
+  if (wait.count() > 0) {
+    throttled_us_ += wait.count();
+    std::this_thread::sleep_for(wait);
+  }
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,96 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Longest a background I/O waits for foreground I/O to drain before it is
+ * issued anyway */
+#define ZENFS_QOS_MAX_DEFER_US (2000)
+
+/* Token buckets hold up to this much of a second worth of their rate */
+#define ZENFS_QOS_BURST_MS (100)
+
+/* Default rate limit of garbage collection copies */
+#define ZENFS_QOS_GC_RATE (128 * 1024 * 1024)
+
+enum ZenFSIOClass {
+  /* WALs, metadata and I/O that RocksDB marks high priority, e.g. flushes */
+  kIOClassForeground = 0,
+  /* Compaction and other low priority writes */
+  kIOClassBackground,
+  /* Garbage collection copies and zone resets */
+  kIOClassGC,
+  kNrIOClasses,
+};
+
+/* Prioritizes foreground I/O over background I/O sharing the device.
+ * Foreground I/O is never held back and marks itself in flight with a
+ * ZenFSForegroundIO guard. Background and GC I/O is admitted through Admit,
+ * which holds it back while foreground I/O is in flight, for up to
+ * ZENFS_QOS_MAX_DEFER_US, and then paces it through the token bucket of its
+ * class. */
+class ZenFSIOScheduler {
+  struct TokenBucket {
+    uint64_t rate = 0; /* bytes per second, 0 is unlimited */
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+  };
+
+  std::mutex mtx_;
+  std::condition_variable fg_idle_;
+  std::atomic<int> fg_inflight_{0};
+  TokenBucket buckets_[kNrIOClasses];
+
+  std::atomic<uint64_t> deferred_{0};
+  std::atomic<uint64_t> throttled_us_{0};
+
+ public:
+  ZenFSIOScheduler();
+
+  /* Rate limit of a background class in bytes per second, 0 is unlimited */
+  void SetRate(ZenFSIOClass io_class, uint64_t rate);
+  uint64_t GetRate(ZenFSIOClass io_class);
+
+  void StartForeground() { fg_inflight_++; }
+  void EndForeground();
+
+  /* Block a background I/O of size bytes until it may be issued. A size of
+   * 0 only waits for foreground I/O, e.g. for zone resets. */
+  void Admit(ZenFSIOClass io_class, uint64_t size);
+
+  /* Background I/Os held back for foreground I/O */
+  uint64_t GetDeferred() { return deferred_; }
+  /* Total time background I/O spent waiting for tokens */
+  uint64_t GetThrottledMicros() { return throttled_us_; }
+};
+
+/* Marks foreground I/O in flight for its scope */
+class ZenFSForegroundIO {
+  ZenFSIOScheduler* sched_;
+
+ public:
+  explicit ZenFSForegroundIO(ZenFSIOScheduler* sched) : sched_(sched) {
+    if (sched_) sched_->StartForeground();
+  }
+  ~ZenFSForegroundIO() {
+    if (sched_) sched_->EndForeground();
+  }
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
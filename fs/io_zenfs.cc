@@ -19,9 +19,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -41,12 +43,7 @@ Status ZoneExtent::DecodeFrom(Slice* input) {
   return Status::OK();
 }
 
-void ZoneExtent::EncodeTo(std::string* output) {
-  PutFixed64(output, start_);
-  PutFixed32(output, length_);
-}
-
-void ZoneExtent::EncodeJson(std::ostream& json_stream) {
+void ZoneExtent::EncodeJson(std::ostream& json_stream) const {
   json_stream << "{";
   json_stream << "\"start\":" << start_ << ",";
   json_stream << "\"length\":" << length_;
@@ -60,8 +57,75 @@ enum ZoneFileTag : uint32_t {
   kWriteLifeTimeHint = 4,
   kExtent = 5,
   kModificationTime = 6,
+  kExtentList = 7,
 };
 
+static uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+/* Extents are encoded relative to the previous extent of the list: the
+ * zone number delta, then the start offset within the zone, or the gap
+ * after the previous extent if that lives in the same zone, and the
+ * length. All varints, so an extent following the previous one in its zone
+ * takes a handful of bytes. */
+void ZoneFile::EncodeExtents(std::string* output, const ZoneExtent* extents,
+                             size_t nr_extents, uint64_t zone_sz) {
+  uint64_t prev_zone_nr = 0;
+  uint64_t prev_end = 0;
+
+  PutVarint32(output, nr_extents);
+  for (size_t i = 0; i < nr_extents; i++) {
+    const ZoneExtent& extent = extents[i];
+    uint64_t zone_nr = extent.start_ / zone_sz;
+
+    PutVarint64(output, ZigZag((int64_t)(zone_nr - prev_zone_nr)));
+    if (i > 0 && zone_nr == prev_zone_nr)
+      PutVarint64(output, ZigZag((int64_t)(extent.start_ - prev_end)));
+    else
+      PutVarint64(output, extent.start_ - zone_nr * zone_sz);
+    PutVarint32(output, extent.length_);
+
+    prev_zone_nr = zone_nr;
+    prev_end = extent.start_ + extent.length_;
+  }
+}
+
+Status ZoneFile::DecodeExtents(Slice* input) {
+  uint64_t zone_sz = zbd_->GetZoneSize();
+  uint64_t prev_zone_nr = 0;
+  uint64_t prev_end = 0;
+  uint32_t nr_extents;
+
+  if (!GetVarint32(input, &nr_extents))
+    return Status::Corruption("ZoneFile", "Missing extent count");
+
+  for (uint32_t i = 0; i < nr_extents; i++) {
+    uint64_t zone_delta, offset;
+    uint32_t length;
+
+    if (!GetVarint64(input, &zone_delta) || !GetVarint64(input, &offset) ||
+        !GetVarint32(input, &length))
+      return Status::Corruption("ZoneFile", "Truncated extent list");
+
+    uint64_t zone_nr = prev_zone_nr + UnZigZag(zone_delta);
+    uint64_t start;
+    if (i > 0 && zone_nr == prev_zone_nr)
+      start = prev_end + UnZigZag(offset);
+    else
+      start = zone_nr * zone_sz + offset;
+
+    Zone* zone = zbd_->GetIOZone(start);
+    if (!zone) return Status::Corruption("ZoneFile", "Invalid zone extent");
+    zone->AddUsedCapacity(length);
+    AddExtent(ZoneExtent(start, length, zone));
+
+    prev_zone_nr = zone_nr;
+    prev_end = start + length;
+  }
+
+  return Status::OK();
+}
+
 void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
   PutFixed32(output, kFileID);
   PutFixed64(output, file_id_);
@@ -75,12 +139,14 @@ void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
   PutFixed32(output, kWriteLifeTimeHint);
   PutFixed32(output, (uint32_t)lifetime_);
 
-  for (uint32_t i = extent_start; i < extents_.size(); i++) {
-    std::string extent_str;
+  ZoneExtentList extents = GetExtentList();
+  if (extent_start < extents.size()) {
+    std::string extents_str;
 
-    PutFixed32(output, kExtent);
-    extents_[i]->EncodeTo(&extent_str);
-    PutLengthPrefixedSlice(output, Slice(extent_str));
+    PutFixed32(output, kExtentList);
+    EncodeExtents(&extents_str, extents.begin() + extent_start,
+                  extents.size() - extent_start, zbd_->GetZoneSize());
+    PutLengthPrefixedSlice(output, Slice(extents_str));
   }
 
   PutFixed32(output, kModificationTime);
@@ -89,6 +155,16 @@ void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
    * as files will always be read-only after mount */
 }
 
+std::shared_ptr<const std::string> ZoneFile::GetSnapshotEncoding() {
+  if (snapshot_encoding_) return snapshot_encoding_;
+
+  std::shared_ptr<std::string> encoding(new std::string);
+  EncodeSnapshotTo(encoding.get());
+  if (!open_for_wr_) snapshot_encoding_ = encoding;
+
+  return encoding;
+}
+
 void ZoneFile::EncodeJson(std::ostream& json_stream) {
   json_stream << "{";
   json_stream << "\"id\":" << file_id_ << ",";
@@ -98,13 +174,13 @@ void ZoneFile::EncodeJson(std::ostream& json_stream) {
   json_stream << "\"extents\":[";
 
   bool first_element = true;
-  for (ZoneExtent* extent : extents_) {
+  for (const ZoneExtent& extent : GetExtentList()) {
     if (first_element) {
       first_element = false;
     } else {
       json_stream << ",";
     }
-    extent->EncodeJson(json_stream);
+    extent.EncodeJson(json_stream);
   }
   json_stream << "]}";
 }
@@ -118,7 +194,7 @@ Status ZoneFile::DecodeFrom(Slice* input) {
 
   while (true) {
     Slice slice;
-    ZoneExtent* extent;
+    ZoneExtent extent(0, 0, nullptr);
     Status s;
 
     if (!GetFixed32(input, &tag)) break;
@@ -140,20 +216,23 @@ Status ZoneFile::DecodeFrom(Slice* input) {
         if (!GetFixed32(input, &lt))
           return Status::Corruption("ZoneFile", "Missing life time hint");
         lifetime_ = (Env::WriteLifeTimeHint)lt;
+        UpdateFileClass();
         break;
       case kExtent:
-        extent = new ZoneExtent(0, 0, nullptr);
         GetLengthPrefixedSlice(input, &slice);
-        s = extent->DecodeFrom(&slice);
-        if (!s.ok()) {
-          delete extent;
-          return s;
-        }
-        extent->zone_ = zbd_->GetIOZone(extent->start_);
-        if (!extent->zone_)
+        s = extent.DecodeFrom(&slice);
+        if (!s.ok()) return s;
+        extent.zone_ = zbd_->GetIOZone(extent.start_);
+        if (!extent.zone_)
           return Status::Corruption("ZoneFile", "Invalid zone extent");
-        extent->zone_->used_capacity_ += extent->length_;
-        extents_.push_back(extent);
+        extent.zone_->AddUsedCapacity(extent.length_);
+        AddExtent(extent);
+        break;
+      case kExtentList:
+        if (!GetLengthPrefixedSlice(input, &slice))
+          return Status::Corruption("ZoneFile", "Missing extent list");
+        s = DecodeExtents(&slice);
+        if (!s.ok()) return s;
         break;
       case kModificationTime:
         uint64_t ct;
@@ -179,12 +258,9 @@ Status ZoneFile::MergeUpdate(ZoneFile* update) {
   SetWriteLifeTimeHint(update->GetWriteLifeTimeHint());
   SetFileModificationTime(update->GetFileModificationTime());
 
-  std::vector<ZoneExtent*> update_extents = update->GetExtents();
-  for (long unsigned int i = 0; i < update_extents.size(); i++) {
-    ZoneExtent* extent = update_extents[i];
-    Zone* zone = extent->zone_;
-    zone->used_capacity_ += extent->length_;
-    extents_.push_back(new ZoneExtent(extent->start_, extent->length_, zone));
+  for (const auto& extent : update->GetExtentList()) {
+    extent.zone_->AddUsedCapacity(extent.length_);
+    AddExtent(extent);
   }
 
   MetadataSynced();
@@ -192,9 +268,38 @@ Status ZoneFile::MergeUpdate(ZoneFile* update) {
   return Status::OK();
 }
 
-inline bool ends_with(std::string const& value, std::string const& ending) {
-  if (ending.size() > value.size()) return false;
-  return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+void ZoneFile::ReplaceExtents(const std::vector<ZoneExtent>& extents) {
+  ZoneExtentList old_extents = GetExtentList();
+  ZoneExtentBlock* block = NewExtentBlock(std::max(extents.size(), (size_t)ZENFS_EXTENT_BLOCK_MIN_SIZE));
+  uint64_t file_offset = 0;
+
+  /* Account the new extents first so that no zone shared by the old and the
+   * new list is ever seen as unused */
+  for (size_t i = 0; i < extents.size(); i++) {
+    extents[i].zone_->AddUsedCapacity(extents[i].length_);
+    block->extents[i] = extents[i];
+    block->offsets[i] = file_offset;
+    file_offset += extents[i].length_;
+  }
+  block->size.store(extents.size(), std::memory_order_relaxed);
+  extents_.store(block);
+  snapshot_encoding_.reset();
+
+  /* Reads that found the old extents may still be reading them, and their
+   * zones may be reset once they are no longer accounted as used */
+  WaitForExtentReaders();
+
+  for (const auto& extent : old_extents) {
+    assert(extent.zone_->used_capacity_ >= extent.length_);
+    extent.zone_->AddUsedCapacity(-(long)extent.length_);
+  }
+
+  /* Nothing can see the retired blocks anymore, the new one is the last */
+  std::unique_ptr<ZoneExtentBlock> live = std::move(extent_blocks_.back());
+  extent_blocks_.clear();
+  extent_blocks_.push_back(std::move(live));
+
+  MetadataSynced();
 }
 
 ZoneFile::ZoneFile(ZonedBlockDevice* zbd, std::string filename,
@@ -204,6 +309,8 @@ ZoneFile::ZoneFile(ZonedBlockDevice* zbd, std::string filename,
       extent_start_(0),
       extent_filepos_(0),
       lifetime_(Env::WLTH_NOT_SET),
+      file_class_(0),
+      io_class_(kIOClassBackground),
       fileSize(0),
       file_id_(file_id),
       nr_synced_extents_(0),
@@ -211,56 +318,156 @@ ZoneFile::ZoneFile(ZonedBlockDevice* zbd, std::string filename,
       logger_(logger),
       filename_(filename),
       is_wal_(false) {
-  // Generally, we should let our user to decide whether a file is WAL
-  // or not. However, current TerarkDB environment doesn't provide such
-  // capability to hint. Therefore, we simply check the suffix of filename
-  // here.
-  if (ends_with(filename_, ".log")) {
-    is_wal_ = true;
-  }
+  UpdateFileClass();
+}
+
+/* Generally, we should let our user decide whether a file is a WAL or not,
+ * but the TerarkDB environment doesn't provide such a hint. The file kind is
+ * derived from the file name instead. */
+void ZoneFile::UpdateFileClass() {
+  ZenFSFileKind kind = ZenFSLifetimePredictor::GetFileKind(filename_);
+
+  is_wal_ = kind == kFileKindWAL;
+  if (is_wal_) io_class_ = kIOClassForeground;
+  file_class_ = ZenFSLifetimePredictor::GetFileClass(kind, lifetime_);
+}
+
+/* Place the file by its learned lifetime once its class has one */
+Zone* ZoneFile::AllocateZone() {
+  Env::WriteLifeTimeHint lifetime = zbd_->GetLifetimePredictor()->Predict(file_class_, lifetime_);
+
+  /* WALs have a zone pool of their own */
+  shared_zone_ = zbd_->GetSharedZones() && !is_wal_;
+  if (shared_zone_) return zbd_->AllocateSharedZone(lifetime);
+  return zbd_->AllocateZone(lifetime, is_wal_);
+}
+
+void ZoneFile::ReleaseZone() {
+  if (shared_zone_)
+    zbd_->ReleaseSharedZone(active_zone_);
+  else
+    active_zone_->CloseWR();
 }
 
 std::string ZoneFile::GetFilename() { return filename_; }
-void ZoneFile::Rename(std::string name) { filename_ = name; }
+void ZoneFile::Rename(std::string name) {
+  filename_ = name;
+  UpdateFileClass();
+  snapshot_encoding_.reset();
+}
 time_t ZoneFile::GetFileModificationTime() { return m_time_; }
 
 uint64_t ZoneFile::GetFileSize() { return fileSize; }
-void ZoneFile::SetFileSize(uint64_t sz) { fileSize = sz; }
-void ZoneFile::SetFileModificationTime(time_t mt) { m_time_ = mt; }
+void ZoneFile::SetFileSize(uint64_t sz) {
+  fileSize = sz;
+  snapshot_encoding_.reset();
+}
+void ZoneFile::SetFileModificationTime(time_t mt) {
+  m_time_ = mt;
+  snapshot_encoding_.reset();
+}
 
 ZoneFile::~ZoneFile() {
-  for (auto e = std::begin(extents_); e != std::end(extents_); ++e) {
-    Zone* zone = (*e)->zone_;
+  for (const auto& extent : GetExtentList()) {
+    Zone* zone = extent.zone_;
 
-    assert(zone && zone->used_capacity_ >= (*e)->length_);
-    zone->used_capacity_ -= (*e)->length_;
-    delete *e;
+    assert(zone && zone->used_capacity_ >= extent.length_);
+    zone->AddUsedCapacity(-(long)extent.length_);
   }
   CloseWR();
 }
 
 void ZoneFile::CloseWR() {
   if (active_zone_) {
-    active_zone_->CloseWR();
+    ReleaseZone();
     active_zone_ = NULL;
   }
   open_for_wr_ = false;
 }
 
-void ZoneFile::OpenWR() { open_for_wr_ = true; }
+void ZoneFile::OpenWR() {
+  open_for_wr_ = true;
+  snapshot_encoding_.reset();
+}
 
 bool ZoneFile::IsOpenForWR() { return open_for_wr_; }
 
-ZoneExtent* ZoneFile::GetExtent(uint64_t file_offset, uint64_t* dev_offset) {
-  for (unsigned int i = 0; i < extents_.size(); i++) {
-    if (file_offset < extents_[i]->length_) {
-      *dev_offset = extents_[i]->start_ + file_offset;
-      return extents_[i];
-    } else {
-      file_offset -= extents_[i]->length_;
+const ZoneExtent* ZoneExtentList::Find(uint64_t file_offset, uint64_t* dev_offset, size_t* idx) const {
+  if (size_ == 0) return NULL;
+
+  /* Find the last extent starting at or before file_offset */
+  const uint64_t* offsets = block_->offsets.data();
+  const uint64_t* it = std::upper_bound(offsets, offsets + size_, file_offset);
+  if (it == offsets) return NULL;
+
+  size_t i = (it - offsets) - 1;
+  const ZoneExtent& extent = block_->extents[i];
+  uint64_t extent_offset = file_offset - offsets[i];
+  if (extent_offset >= extent.length_) return NULL;
+
+  *dev_offset = extent.start_ + extent_offset;
+  if (idx) *idx = i;
+  return &extent;
+}
+
+/* Reads count themselves in the current epoch and then load the extent
+ * list. Flipping the epoch after publishing a new list leaves the readers
+ * of the old epoch as the only ones that may have loaded an older list, and
+ * later reads of that epoch load the new one. Replacements are serialized
+ * by the file table lock. */
+void ZoneFile::WaitForExtentReaders() {
+  uint32_t epoch = read_epoch_.fetch_xor(1);
+
+  while (extent_readers_[epoch].load() != 0) std::this_thread::yield();
+}
+
+ZoneExtentBlock* ZoneFile::NewExtentBlock(size_t capacity) {
+  extent_blocks_.emplace_back(new ZoneExtentBlock(capacity));
+  return extent_blocks_.back().get();
+}
+
+/* Only called by the writer of the file, readers see the extent once the
+ * size covering it is published */
+void ZoneFile::AddExtent(const ZoneExtent& extent) {
+  ZoneExtentBlock* block = extents_.load(std::memory_order_relaxed);
+  size_t n = block ? block->size.load(std::memory_order_relaxed) : 0;
+  uint64_t file_offset = n ? block->offsets[n - 1] + block->extents[n - 1].length_ : 0;
+
+  if (block && n < block->extents.size()) {
+    block->extents[n] = extent;
+    block->offsets[n] = file_offset;
+    block->size.store(n + 1, std::memory_order_release);
+  } else {
+    ZoneExtentBlock* grown = NewExtentBlock(std::max(2 * n, (size_t)ZENFS_EXTENT_BLOCK_MIN_SIZE));
+    for (size_t i = 0; i < n; i++) {
+      grown->extents[i] = block->extents[i];
+      grown->offsets[i] = block->offsets[i];
     }
+    grown->extents[n] = extent;
+    grown->offsets[n] = file_offset;
+    grown->size.store(n + 1, std::memory_order_relaxed);
+    extents_.store(grown, std::memory_order_release);
   }
-  return NULL;
+
+  snapshot_encoding_.reset();
+}
+
+const ZoneExtent* ZoneFile::GetExtent(uint64_t file_offset, uint64_t* dev_offset, size_t* idx) {
+  return GetExtentList().Find(file_offset, dev_offset, idx);
+}
+
+bool ZoneFile::GetExtentRange(uint64_t file_offset, uint64_t* start,
+                              uint64_t* end) {
+  ExtentReadGuard read_guard(this);
+  ZoneExtentList extents = GetExtentList();
+  uint64_t dev_offset;
+  size_t idx;
+
+  if (!extents.Find(file_offset, &dev_offset, &idx)) return false;
+
+  *start = extents.GetOffset(idx);
+  *end = *start + extents[idx].length_;
+  return true;
 }
 
 IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
@@ -268,15 +475,83 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
   LatencyHistGuard guard(&zbd_->metrics_->read_latency_reporter_);
   zbd_->metrics_->read_qps_reporter_.AddCount(1);
 
+  if (zbd_->GetReadCache() != nullptr && !open_for_wr_ &&
+      n <= ZENFS_READ_CACHE_MAX_READ && offset < fileSize)
+    return CachedRead(offset, n, result, scratch, direct);
+
+  return DeviceRead(offset, n, result, scratch, direct);
+}
+
+/* Read through the read cache a cache block at a time. Missing blocks are
+ * read whole and inserted. The read guard is held up to the inserts, so a
+ * block read from a list that is being replaced is in the cache before
+ * ReplaceExtents() returns, and dropped by whoever replaced the list. */
+IOStatus ZoneFile::CachedRead(uint64_t offset, size_t n, Slice* result,
+                              char* scratch, bool direct) {
+  ZenFSReadCache* cache = zbd_->GetReadCache();
+  ExtentReadGuard read_guard(this);
+  uint64_t end = std::min(offset + n, fileSize);
+  uint64_t pos = offset;
+  char* block_buf = nullptr;
+  IOStatus s;
+
+  while (pos < end) {
+    uint64_t block = pos / ZENFS_READ_CACHE_BLOCK_SIZE;
+    uint64_t block_start = block * ZENFS_READ_CACHE_BLOCK_SIZE;
+    size_t off = pos - block_start;
+    size_t len = std::min(end - pos, (uint64_t)ZENFS_READ_CACHE_BLOCK_SIZE - off);
+
+    if (cache->Lookup(file_id_, block, off, len, scratch + (pos - offset))) {
+      zbd_->metrics_->read_cache_hit_qps_reporter_.AddCount(1);
+    } else {
+      size_t block_len = std::min(fileSize - block_start,
+                                  (uint64_t)ZENFS_READ_CACHE_BLOCK_SIZE);
+      Slice block_data;
+
+      zbd_->metrics_->read_cache_miss_qps_reporter_.AddCount(1);
+      if (block_buf == nullptr &&
+          posix_memalign((void**)&block_buf, sysconf(_SC_PAGESIZE),
+                         ZENFS_READ_CACHE_BLOCK_SIZE)) {
+        return IOStatus::IOError("Failed to allocate read cache buffer");
+      }
+
+      s = DeviceRead(block_start, block_len, &block_data, block_buf, direct);
+      if (!s.ok()) break;
+
+      /* The block is not all synced yet */
+      if (block_data.size() < block_len) {
+        len = block_data.size() > off ? std::min(len, block_data.size() - off) : 0;
+        memcpy(scratch + (pos - offset), block_buf + off, len);
+        pos += len;
+        break;
+      }
+
+      cache->Insert(file_id_, block, block_buf, block_len);
+      memcpy(scratch + (pos - offset), block_buf + off, len);
+    }
+
+    pos += len;
+  }
 
-  int f = zbd_->GetReadFD();
-  int f_direct = zbd_->GetReadDirectFD();
+  free(block_buf);
+
+  *result = Slice(scratch, s.ok() ? pos - offset : 0);
+  return s;
+}
+
+IOStatus ZoneFile::DeviceRead(uint64_t offset, size_t n, Slice* result,
+                              char* scratch, bool direct) {
+  ZbdIOEngine* engine = zbd_->GetIOEngine();
+  ExtentReadGuard read_guard(this);
+  /* The extents as of the start of the read, the writer may add more */
+  ZoneExtentList extents = GetExtentList();
   char* ptr;
   uint64_t r_off;
   size_t r_sz;
   ssize_t r = 0;
   size_t read = 0;
-  ZoneExtent* extent;
+  const ZoneExtent* extent;
+  size_t extent_idx;
   uint64_t extent_end;
   IOStatus s;
 
@@ -289,7 +564,7 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
   }
 
   r_off = 0;
-  extent = GetExtent(offset, &r_off);
+  extent = extents.Find(offset, &r_off, &extent_idx);
   if (!extent) {
     /* read start beyond end of (synced) file data*/
     *result = Slice(scratch, 0);
@@ -314,11 +589,7 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
      * so fall back on non-direct-io in that case.
      */
     bool aligned = (pread_sz % zbd_->GetBlockSize() == 0);
-    if (direct && aligned) {
-      r = pread(f_direct, ptr, pread_sz, r_off);
-    } else {
-      r = pread(f, ptr, pread_sz, r_off);
-    }
+    r = engine->Read(ptr, pread_sz, r_off, direct && aligned);
 
     if (r <= 0) {
       if (r == -1 && errno == EINTR) {
@@ -334,11 +605,11 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
     r_off += pread_sz;
 
     if (read != r_sz && r_off == extent_end) {
-      extent = GetExtent(offset + read, &r_off);
-      if (!extent) {
+      if (++extent_idx >= extents.size()) {
         /* read beyond end of (synced) file data */
         break;
       }
+      extent = &extents[extent_idx];
       r_off = extent->start_;
       extent_end = extent->start_ + extent->length_;
       assert(((size_t)r_off % zbd_->GetBlockSize()) == 0);
@@ -365,22 +636,75 @@ void ZoneFile::PushExtent() {
   if (length == 0) return;
 
   assert(length <= (active_zone_->wp_ - extent_start_));
-  extents_.push_back(new ZoneExtent(extent_start_, length, active_zone_));
+  AddExtent(ZoneExtent(extent_start_, length, active_zone_));
 
-  active_zone_->used_capacity_ += length;
+  active_zone_->AddUsedCapacity(length);
   extent_start_ = active_zone_->wp_;
   extent_filepos_ = fileSize;
 }
 
+/* Writes to a shared zone are interleaved with the writes of other files,
+ * so the pending extent, from extent_start_ on, is pushed whenever a write
+ * does not continue it. Appends are synchronous. */
+IOStatus ZoneFile::AppendShared(void* data, int data_size, int valid_size) {
+  uint32_t left = data_size;
+  uint32_t offset = 0;
+  IOStatus s;
+
+  while (left) {
+    uint64_t dev_offset;
+    uint32_t written;
+
+    if (active_zone_ == NULL) {
+      active_zone_ = AllocateZone();
+      if (!active_zone_) {
+        Warn(logger_, "Shared zone allocation failure, filename=%s, left=%d\n", filename_.c_str(), left);
+        return IOStatus::NoSpace("Zone allocation failure\n");
+      }
+    }
+
+    s = active_zone_->AppendShared((char*)data + offset, left, &dev_offset, &written);
+    if (!s.ok()) return s;
+    if (written == 0) {
+      PushExtent();
+      ReleaseZone();
+      active_zone_ = NULL;
+      continue;
+    }
+
+    /* Padding at the end of the data is written, but not part of the file */
+    uint32_t length = 0;
+    if ((int)offset < valid_size) length = std::min(written, (uint32_t)valid_size - offset);
+
+    if (length > 0) {
+      if (extent_start_ + (fileSize - extent_filepos_) != dev_offset) {
+        PushExtent();
+        extent_start_ = dev_offset;
+        extent_filepos_ = fileSize;
+      }
+      fileSize += length;
+    }
+
+    left -= written;
+    offset += written;
+  }
+
+  zbd_->GetLifetimePredictor()->AddWritten(file_class_, data_size);
+  return IOStatus::OK();
+}
+
 /* Assumes that data and size are block aligned */
 IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
-                          bool async) {
+                          bool async, ZoneWriteTicket* ticket) {
   uint32_t left = data_size;
   uint32_t wr_size, offset = 0;
   IOStatus s;
 
+  zbd_->GetIOScheduler()->Admit(io_class_, data_size);
+  if (zbd_->GetSharedZones() && !is_wal_) return AppendShared(data, data_size, valid_size);
+
   if (active_zone_ == NULL) {
-    active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_);
+    active_zone_ = AllocateZone();
     if (!active_zone_) {
       Warn(logger_,
            "Zone allocation failure upon append starting, filename=%s, "
@@ -396,8 +720,8 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
     if (active_zone_->capacity_ == 0) {
       PushExtent();
 
-      active_zone_->CloseWR();
-      active_zone_ = zbd_->AllocateZone(lifetime_, is_wal_);
+      ReleaseZone();
+      active_zone_ = AllocateZone();
       if (!active_zone_) {
         Warn(logger_,
              "Zone allocation failure when appending, filename=%s, left=%d\n",
@@ -412,7 +736,14 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
     if (wr_size > active_zone_->capacity_) wr_size = active_zone_->capacity_;
 
     if (async) {
-      s = active_zone_->Append_async((char*)data + offset, wr_size);
+      uint64_t seq;
+      s = active_zone_->Append_async((char*)data + offset, wr_size, &seq);
+      /* Writes to earlier zones are synced when the zone is closed, so the
+       * last write covers the whole buffer */
+      if (s.ok() && ticket) {
+        ticket->zone = active_zone_;
+        ticket->seq = seq;
+      }
     } else {
       s = active_zone_->Append((char*)data + offset, wr_size);
     }
@@ -424,14 +755,163 @@ IOStatus ZoneFile::Append(void* data, int data_size, int valid_size,
   }
 
   fileSize -= (data_size - valid_size);
+  zbd_->GetLifetimePredictor()->AddWritten(file_class_, data_size);
+  return IOStatus::OK();
+}
+
+/* Max size of a single merged read of a MultiRead batch */
+#define ZENFS_MULTIREAD_MAX_IO (1024 * 1024)
+
+IOStatus ZoneFile::MultiRead(FSReadRequest* reqs, size_t num_reqs,
+                             bool direct) {
+  LatencyHistGuard guard(&zbd_->metrics_->read_latency_reporter_);
+  zbd_->metrics_->read_qps_reporter_.AddCount(num_reqs);
+
+  /* A request range mapped to the device, within a single extent */
+  struct Segment {
+    uint64_t dev_off;
+    size_t len;
+    char* dst;
+    size_t req;
+  };
+  /* A device read covering one or more segments */
+  struct DeviceRead {
+    uint64_t start;
+    uint64_t end;
+    size_t first_seg;
+    size_t nr_segs;
+    char* buf;
+  };
+
+  uint32_t bs = zbd_->GetBlockSize();
+  uint64_t zone_sz = zbd_->GetZoneSize();
+  ExtentReadGuard read_guard(this);
+  ZoneExtentList extents = GetExtentList();
+  std::vector<Segment> segs;
+  std::vector<size_t> mapped(num_reqs, 0);
+
+  for (size_t i = 0; i < num_reqs; i++) {
+    uint64_t offset = reqs[i].offset;
+    uint64_t dev_off;
+    size_t idx;
+    size_t r_sz;
+    const ZoneExtent* extent;
+
+    reqs[i].status = IOStatus::OK();
+    if (offset >= fileSize) continue;
+
+    r_sz = reqs[i].len;
+    if (offset + r_sz > fileSize) r_sz = fileSize - offset;
+
+    extent = extents.Find(offset, &dev_off, &idx);
+    while (extent && mapped[i] < r_sz) {
+      size_t len = std::min((uint64_t)(r_sz - mapped[i]),
+                            extent->start_ + extent->length_ - dev_off);
+      segs.push_back({dev_off, len, reqs[i].scratch + mapped[i], i});
+      mapped[i] += len;
+
+      if (++idx >= extents.size()) break;
+      extent = &extents[idx];
+      dev_off = extent->start_;
+    }
+  }
+
+  /* Merge segments that are adjacent or overlapping in the same zone once
+   * rounded out to block boundaries */
+  std::sort(segs.begin(), segs.end(), [](const Segment& a, const Segment& b) {
+    return a.dev_off < b.dev_off;
+  });
+
+  std::vector<DeviceRead> ios;
+  for (size_t i = 0; i < segs.size(); i++) {
+    uint64_t start = segs[i].dev_off - (segs[i].dev_off % bs);
+    uint64_t end = segs[i].dev_off + segs[i].len;
+    if (end % bs) end += bs - (end % bs);
+
+    if (!ios.empty()) {
+      DeviceRead& last = ios.back();
+      if (start <= last.end && start / zone_sz == last.start / zone_sz &&
+          std::max(end, last.end) - last.start <= ZENFS_MULTIREAD_MAX_IO) {
+        last.end = std::max(end, last.end);
+        last.nr_segs++;
+        continue;
+      }
+    }
+    ios.push_back({start, end, i, 1, nullptr});
+  }
+
+  /* Single segment reads that are already aligned go straight to the
+   * request buffer, everything else is read into a bounce buffer */
+  size_t bounce_sz = 0;
+  for (auto& io : ios) {
+    const Segment& seg = segs[io.first_seg];
+    if (io.nr_segs == 1 && seg.dev_off == io.start && seg.len == io.end - io.start &&
+        ((uintptr_t)seg.dst % bs) == 0) {
+      io.buf = seg.dst;
+    } else {
+      bounce_sz += io.end - io.start;
+    }
+  }
+
+  char* bounce = nullptr;
+  if (bounce_sz) {
+    if (posix_memalign((void**)&bounce, bs, bounce_sz)) {
+      return IOStatus::IOError("failed allocating multiread buffer\n");
+    }
+  }
+
+  std::vector<ZbdReadRequest> dev_reqs(ios.size());
+  char* next = bounce;
+  for (size_t i = 0; i < ios.size(); i++) {
+    if (ios[i].buf == nullptr) {
+      ios[i].buf = next;
+      next += ios[i].end - ios[i].start;
+    }
+    dev_reqs[i] = {ios[i].buf, ios[i].end - ios[i].start, ios[i].start, direct, 0};
+  }
+
+  zbd_->GetIOEngine()->ReadBatch(dev_reqs.data(), dev_reqs.size());
+
+  for (size_t i = 0; i < ios.size(); i++) {
+    for (size_t j = ios[i].first_seg; j < ios[i].first_seg + ios[i].nr_segs; j++) {
+      const Segment& seg = segs[j];
+      uint64_t seg_off = seg.dev_off - ios[i].start;
+
+      if (dev_reqs[i].res < 0 || (uint64_t)dev_reqs[i].res < seg_off + seg.len) {
+        reqs[seg.req].status = IOStatus::IOError("pread error\n");
+        continue;
+      }
+      if (seg.dst != ios[i].buf) memcpy(seg.dst, ios[i].buf + seg_off, seg.len);
+    }
+  }
+
+  free(bounce);
+
+  for (size_t i = 0; i < num_reqs; i++) {
+    if (reqs[i].status.ok()) {
+      reqs[i].result = Slice(reqs[i].scratch, mapped[i]);
+    } else {
+      reqs[i].result = Slice(reqs[i].scratch, 0);
+    }
+  }
+
   return IOStatus::OK();
 }
 
 IOStatus ZoneFile::SetWriteLifeTimeHint(Env::WriteLifeTimeHint lifetime) {
   lifetime_ = lifetime;
+  UpdateFileClass();
+  snapshot_encoding_.reset();
   return IOStatus::OK();
 }
 
+/* Write buffers start at ZENFS_WRITE_BUFFER_MIN_BLOCKS and double for each
+ * buffer that fills up, up to a maximum chosen by the lifetime hint. Long
+ * lived files are typically large compaction outputs. */
+#define ZENFS_WRITE_BUFFER_MIN_BLOCKS (32)
+#define ZENFS_WRITE_BUFFER_MAX_SIZE (1024 * 1024)
+#define ZENFS_WRITE_BUFFER_MAX_SIZE_LONG (4 * 1024 * 1024)
+
 ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
                                      ZoneFile* zoneFile,
                                      MetadataWriter* metadata_writer) {
@@ -441,27 +921,22 @@ ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
 
   buffered = _buffered;
   block_sz = zbd->GetBlockSize();
-  buffer_sz = block_sz * 32;
+  buffer = nullptr;
+  buffer_sz = 0;
   buffer_pos = 0;
+  min_buffer_sz_ = block_sz * ZENFS_WRITE_BUFFER_MIN_BLOCKS;
+  target_buffer_sz_ = min_buffer_sz_;
 
   zoneFile_ = zoneFile;
-  // For SST files, we use larger buffer size
-  if (!zoneFile_->is_wal_) {
-    buffer_sz = block_sz * 256;
-  }
-
-  // TODO: add an Open() method so we can handle out of memory gracefully
-  if (buffered) {
-    int ret;
 
-    ret = posix_memalign((void**)&b1, block_sz, buffer_sz);
-    assert(ret == 0);
-    ret = posix_memalign((void**)&b2, block_sz, buffer_sz);
-    assert(ret == 0);
-    (void)ret;
-    assert(b1 != nullptr && b2 != nullptr);
+  // WALs are synced often and rarely have more than one buffer in flight
+  nr_buffers_ = zoneFile_->is_wal_ ? 2 : ZENFS_WRITE_BUFFERS;
+  ring_sz_ = nr_buffers_;
+  cur_buffer_ = 0;
 
-    buffer = b1;
+  for (int i = 0; i < ZENFS_WRITE_BUFFERS; i++) {
+    buffers_[i] = nullptr;
+    buffer_szs_[i] = 0;
   }
 
   metadata_writer_ = metadata_writer;
@@ -474,11 +949,19 @@ IOStatus ZoneFile::Sync() {
   return IOStatus::OK();
 }
 
+IOStatus ZoneFile::Sync(const ZoneWriteTicket& ticket) {
+  /* If the file moved on to another zone, the old one was synced on close */
+  if (ticket.zone && ticket.zone == active_zone_)
+    return active_zone_->SyncTo(ticket.seq);
+  return IOStatus::OK();
+}
+
 ZonedWritableFile::~ZonedWritableFile() {
   zoneFile_->CloseWR();
   if (buffered) {
-    free(b1);
-    free(b2);
+    for (int i = 0; i < nr_buffers_; i++) {
+      if (buffers_[i]) zoneFile_->GetZbd()->PutWriteBuffer(buffers_[i], buffer_szs_[i]);
+    }
   }
   closed_ = true;
 };
@@ -488,14 +971,30 @@ ZonedWritableFile::MetadataWriter::~MetadataWriter() {}
 IOStatus ZonedWritableFile::Truncate(uint64_t size,
                                      const IOOptions& /*options*/,
                                      IODebugContext* /*dbg*/) {
+  ZenFSReadCache* cache = zoneFile_->GetZbd()->GetReadCache();
+
   zoneFile_->SetFileSize(size);
+  /* Drops what open readers have read ahead */
+  zoneFile_->NewGeneration();
+  if (cache != nullptr) cache->EraseFile(zoneFile_->GetID());
   return IOStatus::OK();
 }
 
 
-IOStatus ZonedWritableFile::Fsync(const IOOptions& /*options*/,
+/* WALs, and files or writes that RocksDB marks high priority, e.g. flushes,
+ * are foreground I/O */
+ZenFSIOClass ZonedWritableFile::GetIOClass(const IOOptions& options) {
+  if (zoneFile_->is_wal_ || options.prio == IOPriority::kIOHigh || GetIOPriority() == Env::IO_HIGH)
+    return kIOClassForeground;
+  return kIOClassBackground;
+}
+
+IOStatus ZonedWritableFile::Fsync(const IOOptions& options,
                                   IODebugContext* /*dbg*/) {
   IOStatus s;
+  ZenFSTraceSpan span(zoneFile_->GetZbd()->GetTracer(), kTraceSync);
+  ZenFSIOClass io_class = GetIOClass(options);
+  ZenFSForegroundIO fg(io_class == kIOClassForeground ? zoneFile_->GetZbd()->GetIOScheduler() : nullptr);
   LatencyHistGuard guard(zoneFile_->is_wal_
                              ? &zoneFile_->GetMetrics()->fg_sync_latency_reporter_
                              : &zoneFile_->GetMetrics()->bg_sync_latency_reporter_);
@@ -503,10 +1002,12 @@ IOStatus ZonedWritableFile::Fsync(const IOOptions& /*options*/,
 
   buffer_mtx_.lock();
   uint64_t wp0 = wp;
+  zoneFile_->SetIOClass(io_class);
   s = FlushBuffer();
   if (s.ok()) {
     s = zoneFile_->Sync();
   }
+  if (s.ok() && buffered) ReleaseSpareBuffers();
   buffer_mtx_.unlock();
 
   if (!s.ok()) return s;
@@ -548,48 +1049,133 @@ IOStatus ZonedWritableFile::Close(const IOOptions& options,
   return IOStatus::OK();
 }
 
+size_t ZonedWritableFile::MaxBufferSize() {
+  size_t max_sz = ZENFS_WRITE_BUFFER_MAX_SIZE;
+
+  if (!zoneFile_->is_wal_ && zoneFile_->GetWriteLifeTimeHint() >= Env::WLTH_LONG)
+    max_sz = ZENFS_WRITE_BUFFER_MAX_SIZE_LONG;
+
+  return std::max(max_sz, min_buffer_sz_);
+}
+
+/* Make sure the current buffer is allocated and of the target size. The
+ * buffer must not be in flight. */
+IOStatus ZonedWritableFile::PrepareBuffer() {
+  ZonedBlockDevice* zbd = zoneFile_->GetZbd();
+  size_t sz = target_buffer_sz_;
+
+  if (buffers_[cur_buffer_] && buffer_szs_[cur_buffer_] == sz) {
+    buffer = buffers_[cur_buffer_];
+    buffer_sz = sz;
+    return IOStatus::OK();
+  }
+
+  if (buffers_[cur_buffer_]) {
+    zbd->PutWriteBuffer(buffers_[cur_buffer_], buffer_szs_[cur_buffer_]);
+    buffers_[cur_buffer_] = nullptr;
+  }
+
+  if (sz > min_buffer_sz_ && zbd->WriteBufferBudgetExceeded(sz)) {
+    sz = min_buffer_sz_;
+    target_buffer_sz_ = sz;
+  }
+
+  buffers_[cur_buffer_] = zbd->GetWriteBuffer(sz);
+  if (buffers_[cur_buffer_] == nullptr) {
+    buffer = nullptr;
+    buffer_sz = 0;
+    return IOStatus::IOError("Failed allocating write buffer");
+  }
+  buffer_szs_[cur_buffer_] = sz;
+
+  buffer = buffers_[cur_buffer_];
+  buffer_sz = sz;
+  return IOStatus::OK();
+}
+
+/* Called once all writes are synced. A file that is synced before it fills
+ * up a buffer gains nothing from having more than one, so drop the others
+ * until it streams again. */
+void ZonedWritableFile::ReleaseSpareBuffers() {
+  ZonedBlockDevice* zbd = zoneFile_->GetZbd();
+
+  if (ring_sz_ == 1) return;
+
+  for (int i = 0; i < nr_buffers_; i++) {
+    tickets_[i] = ZoneWriteTicket();
+    if (i == cur_buffer_ || !buffers_[i]) continue;
+    zbd->PutWriteBuffer(buffers_[i], buffer_szs_[i]);
+    buffers_[i] = nullptr;
+    buffer_szs_[i] = 0;
+  }
+
+  if (cur_buffer_ != 0) {
+    buffers_[0] = buffers_[cur_buffer_];
+    buffer_szs_[0] = buffer_szs_[cur_buffer_];
+    buffers_[cur_buffer_] = nullptr;
+    buffer_szs_[cur_buffer_] = 0;
+    cur_buffer_ = 0;
+  }
+
+  ring_sz_ = 1;
+}
+
 IOStatus ZonedWritableFile::FlushBuffer() {
   uint32_t align, pad_sz = 0, wr_sz;
   IOStatus s;
 
   if (!buffer_pos) return IOStatus::OK();
 
+  ZenFSTraceSpan span(zoneFile_->GetZbd()->GetTracer(), kTraceFlush, buffer_pos);
   align = buffer_pos % block_sz;
   if (align) pad_sz = block_sz - align;
 
   if (pad_sz) memset((char*)buffer + buffer_pos, 0x0, pad_sz);
 
   wr_sz = buffer_pos + pad_sz;
-  s = zoneFile_->Append((char*)buffer, wr_sz, buffer_pos, false);
+  s = zoneFile_->Append((char*)buffer, wr_sz, buffer_pos, true,
+                        &tickets_[cur_buffer_]);
   if (!s.ok()) {
     return s;
   }
 
-  s = zoneFile_->Sync();
-  if (!s.ok()) return s;
-
-  if (buffer == b1) {
-    buffer = b2;
-  } else {
-    buffer = b1;
+  /* Full buffers mean the file is streaming: grow the buffers and use the
+   * whole ring. Mostly empty ones are flushed by syncs, shrink them. */
+  if (buffer_pos == buffer_sz) {
+    target_buffer_sz_ = std::min(target_buffer_sz_ * 2, MaxBufferSize());
+    ring_sz_ = nr_buffers_;
+  } else if (buffer_pos < buffer_sz / 2) {
+    target_buffer_sz_ = std::max(target_buffer_sz_ / 2, min_buffer_sz_);
   }
 
   wp += buffer_pos;
   buffer_pos = 0;
 
-  return IOStatus::OK();
+  cur_buffer_ = (cur_buffer_ + 1) % ring_sz_;
+
+  /* The next buffer may still be in flight from its previous round */
+  s = zoneFile_->Sync(tickets_[cur_buffer_]);
+  tickets_[cur_buffer_] = ZoneWriteTicket();
+  if (!s.ok()) return s;
+
+  return PrepareBuffer();
 }
 
 IOStatus ZonedWritableFile::BufferedWrite(const Slice& slice) {
-  uint32_t buffer_left = buffer_sz - buffer_pos;
+  uint32_t buffer_left;
   uint32_t data_left = slice.size();
   char* data = (char*)slice.data();
   uint32_t tobuffer;
-  int blocks, aligned_sz;
-  int ret;
-  void* alignbuf;
+  uint32_t aligned_sz;
   IOStatus s;
 
+  if (buffer == nullptr) {
+    s = PrepareBuffer();
+    if (!s.ok()) return s;
+  }
+
+  buffer_left = buffer_sz - buffer_pos;
+
   if (buffer_pos || data_left <= buffer_left) {
     if (data_left < buffer_left) {
       tobuffer = data_left;
@@ -611,19 +1197,12 @@ IOStatus ZonedWritableFile::BufferedWrite(const Slice& slice) {
     if (!s.ok()) return s;
   }
 
-  if (data_left >= buffer_sz) {
-    blocks = data_left / block_sz;
-    aligned_sz = block_sz * blocks;
-
-    ret = posix_memalign(&alignbuf, sysconf(_SC_PAGESIZE), aligned_sz);
-    if (ret) {
-      return IOStatus::IOError("failed allocating alignment write buffer\n");
-    }
-
-    memcpy(alignbuf, data, aligned_sz);
-    s = zoneFile_->Append(alignbuf, aligned_sz, aligned_sz);
-    free(alignbuf);
+  if (data_left >= buffer_sz && ((uintptr_t)data % block_sz) == 0) {
+    /* Aligned input can be written straight from the caller's buffer. The
+     * append is synchronous as the buffer is only ours until we return. */
+    aligned_sz = block_sz * (data_left / block_sz);
 
+    s = zoneFile_->Append(data, aligned_sz, aligned_sz);
     if (!s.ok()) return s;
 
     wp += aligned_sz;
@@ -631,6 +1210,19 @@ IOStatus ZonedWritableFile::BufferedWrite(const Slice& slice) {
     data += aligned_sz;
   }
 
+  /* Anything else is staged through the write buffers, which keeps the
+   * writes asynchronous and avoids allocating a buffer for the whole write */
+  while (data_left >= buffer_sz) {
+    memcpy(buffer, data, buffer_sz);
+    buffer_pos = buffer_sz;
+
+    s = FlushBuffer();
+    if (!s.ok()) return s;
+
+    data_left -= buffer_sz;
+    data += buffer_sz;
+  }
+
   if (data_left) {
     memcpy(buffer, data, data_left);
     buffer_pos = data_left;
@@ -640,9 +1232,12 @@ IOStatus ZonedWritableFile::BufferedWrite(const Slice& slice) {
 }
 
 IOStatus ZonedWritableFile::Append(const Slice& data,
-                                   const IOOptions& /*options*/,
+                                   const IOOptions& options,
                                    IODebugContext* /*dbg*/) {
   IOStatus s;
+  ZenFSTraceSpan span(zoneFile_->GetZbd()->GetTracer(), kTraceAppend, data.size());
+  ZenFSIOClass io_class = GetIOClass(options);
+  ZenFSForegroundIO fg(io_class == kIOClassForeground ? zoneFile_->GetZbd()->GetIOScheduler() : nullptr);
   zoneFile_->GetMetrics()->write_qps_reporter_.AddCount(1);
   zoneFile_->GetMetrics()->write_throughput_reporter_.AddCount(data.size());
   LatencyHistGuard guard(zoneFile_->is_wal_
@@ -651,9 +1246,11 @@ IOStatus ZonedWritableFile::Append(const Slice& data,
 
   if (buffered) {
     buffer_mtx_.lock();
+    zoneFile_->SetIOClass(io_class);
     s = BufferedWrite(data);
     buffer_mtx_.unlock();
   } else {
+    zoneFile_->SetIOClass(io_class);
     s = zoneFile_->Append((void*)data.data(), data.size(), data.size());
     if (s.ok()) wp += data.size();
   }
@@ -662,9 +1259,11 @@ IOStatus ZonedWritableFile::Append(const Slice& data,
 }
 
 IOStatus ZonedWritableFile::PositionedAppend(const Slice& data, uint64_t offset,
-                                             const IOOptions& /*options*/,
+                                             const IOOptions& options,
                                              IODebugContext* /*dbg*/) {
   IOStatus s;
+  ZenFSIOClass io_class = GetIOClass(options);
+  ZenFSForegroundIO fg(io_class == kIOClassForeground ? zoneFile_->GetZbd()->GetIOScheduler() : nullptr);
 
   if (offset != wp) {
     assert(false);
@@ -673,9 +1272,11 @@ IOStatus ZonedWritableFile::PositionedAppend(const Slice& data, uint64_t offset,
 
   if (buffered) {
     buffer_mtx_.lock();
+    zoneFile_->SetIOClass(io_class);
     s = BufferedWrite(data);
     buffer_mtx_.unlock();
   } else {
+    zoneFile_->SetIOClass(io_class);
     s = zoneFile_->Append((void*)data.data(), data.size(), data.size());
     if (s.ok()) wp += data.size();
   }
@@ -687,12 +1288,209 @@ void ZonedWritableFile::SetWriteLifeTimeHint(Env::WriteLifeTimeHint hint) {
   zoneFile_->SetWriteLifeTimeHint(hint);
 }
 
+/* Readahead window bounds, the max is also the size of each buffer */
+#define ZENFS_READAHEAD_MIN (64 * 1024)
+#define ZENFS_READAHEAD_MAX (1024 * 1024)
+
+ZoneFileReadahead::ZoneFileReadahead(ZoneFile* zoneFile, bool direct)
+    : zoneFile_(zoneFile), direct_(direct), window_(ZENFS_READAHEAD_MIN) {}
+
+ZoneFileReadahead::~ZoneFileReadahead() {
+  free(buf_[0]);
+  free(buf_[1]);
+}
+
+void ZoneFileReadahead::Stop() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  stopped_ = true;
+  fill_cv_.wait(lock, [this] { return !filling_; });
+}
+
+/* mtx_ must be held. Serve the read if a buffer holds all of it, and was
+ * filled since the file was last truncated */
+bool ZoneFileReadahead::Lookup(uint64_t offset, size_t n, Slice* result,
+                               char* scratch) {
+  uint64_t gen = zoneFile_->GetGeneration();
+
+  for (int i = 0; i < 2; i++) {
+    int b = (cur_ + i) % 2;
+
+    if (filling_ && b != cur_) continue;
+    if (gen_[b] != gen) continue;
+    if (offset < start_[b] || offset + n > end_[b]) continue;
+
+    memcpy(scratch, buf_[b] + (offset - start_[b]), n);
+    *result = Slice(scratch, n);
+    cur_ = b;
+    return true;
+  }
+
+  return false;
+}
+
+/* mtx_ must be held. Claim the fill target buffer for a window starting at
+ * offset, clipped to the extent holding offset */
+bool ZoneFileReadahead::StartFill(uint64_t offset, size_t len) {
+  uint32_t bs = zoneFile_->GetBlockSize();
+  uint64_t ext_start, ext_end, start;
+  int t = 1 - cur_;
+
+  if (filling_ || stopped_) return false;
+  if (!zoneFile_->GetExtentRange(offset, &ext_start, &ext_end)) return false;
+
+  /* Extents start block aligned on the device, keep the fill aligned too */
+  start = ext_start + ((offset - ext_start) / bs) * bs;
+  len += offset - start;
+  if (len > ZENFS_READAHEAD_MAX) len = ZENFS_READAHEAD_MAX;
+  if (start + len > ext_end) len = ext_end - start;
+
+  if (!buf_[t]) {
+    if (posix_memalign((void**)&buf_[t], bs, ZENFS_READAHEAD_MAX)) {
+      buf_[t] = nullptr;
+      return false;
+    }
+  }
+
+  start_[t] = end_[t] = start;
+  gen_[t] = zoneFile_->GetGeneration();
+  fill_start_ = start;
+  fill_len_ = len;
+  filling_ = true;
+  return true;
+}
+
+void ZoneFileReadahead::DoFill() {
+  uint32_t bs = zoneFile_->GetBlockSize();
+  uint64_t start, dev_offset;
+  size_t len, dev_len, read = 0;
+  char* buf;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (stopped_) {
+      filling_ = false;
+      fill_cv_.notify_all();
+      return;
+    }
+    start = fill_start_;
+    len = fill_len_;
+    buf = buf_[1 - cur_];
+  }
+
+  /* The extent tail is padded up to the next block on the device, so the
+   * whole window can be read with a single aligned read */
+  dev_len = len;
+  if (dev_len % bs) dev_len += bs - (dev_len % bs);
+
+  ZoneFile::ExtentReadGuard read_guard(zoneFile_);
+  if (zoneFile_->GetExtent(start, &dev_offset)) {
+    ZbdIOEngine* engine = zoneFile_->GetZbd()->GetIOEngine();
+    while (read < dev_len) {
+      ssize_t r = engine->Read(buf + read, dev_len - read, dev_offset + read, direct_);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) break;
+      read += r;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    end_[1 - cur_] = start + std::min(read, len);
+    filling_ = false;
+  }
+  fill_cv_.notify_all();
+}
+
+IOStatus ZoneFileReadahead::Read(uint64_t offset, size_t n, Slice* result,
+                                 char* scratch) {
+  std::unique_lock<std::mutex> lock(mtx_);
+  bool sequential = (offset == last_end_);
+  bool hit;
+
+  last_end_ = offset + n;
+  if (sequential)
+    window_ = std::min(window_ * 2, (size_t)ZENFS_READAHEAD_MAX);
+  else
+    window_ = ZENFS_READAHEAD_MIN;
+
+  /* The data may be on its way already */
+  if (filling_ && offset < fill_start_ + fill_len_ && offset + n > fill_start_)
+    fill_cv_.wait(lock, [this] { return !filling_; });
+
+  hit = Lookup(offset, n, result, scratch);
+  if (!hit && sequential && n <= ZENFS_READAHEAD_MAX / 2) {
+    fill_cv_.wait(lock, [this] { return !filling_; });
+    if (StartFill(offset, std::max(window_, n))) {
+      lock.unlock();
+      DoFill();
+      lock.lock();
+      hit = Lookup(offset, n, result, scratch);
+    }
+  }
+
+  if (!hit) {
+    lock.unlock();
+    return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
+  }
+
+  /* Fetch the next window while this one is consumed */
+  if (sequential && !filling_) {
+    uint64_t next = end_[cur_];
+    int other = 1 - cur_;
+    bool buffered = start_[other] == next && end_[other] > next;
+
+    if (!buffered && next < zoneFile_->GetFileSize() && StartFill(next, window_)) {
+      auto self = shared_from_this();
+      zoneFile_->GetZbd()->readahead_worker_->SubmitJob([self]() { self->DoFill(); });
+    }
+  }
+
+  return IOStatus::OK();
+}
+
+IOStatus ZoneFileReadahead::ReadPrefetched(uint64_t offset, size_t n, Slice* result,
+                                           char* scratch) {
+  if (prefetched_.load(std::memory_order_acquire)) {
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    if (filling_ && offset < fill_start_ + fill_len_ && offset + n > fill_start_)
+      fill_cv_.wait(lock, [this] { return !filling_; });
+    if (Lookup(offset, n, result, scratch)) return IOStatus::OK();
+  }
+
+  return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
+}
+
+void ZoneFileReadahead::Prefetch(uint64_t offset, size_t n) {
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  for (int b = 0; b < 2; b++) {
+    if (filling_ && b != cur_) continue;
+    if (gen_[b] == zoneFile_->GetGeneration() && offset >= start_[b] && offset + n <= end_[b]) return;
+  }
+
+  if (StartFill(offset, n)) {
+    auto self = shared_from_this();
+    prefetched_.store(true, std::memory_order_release);
+    zoneFile_->GetZbd()->readahead_worker_->SubmitJob([self]() { self->DoFill(); });
+  }
+}
+
+void ZoneFileReadahead::Invalidate(uint64_t offset, size_t n) {
+  std::unique_lock<std::mutex> lock(mtx_);
+  fill_cv_.wait(lock, [this] { return !filling_; });
+
+  for (int b = 0; b < 2; b++) {
+    if (offset < end_[b] && offset + n > start_[b]) start_[b] = end_[b] = 0;
+  }
+}
+
 IOStatus ZonedSequentialFile::Read(size_t n, const IOOptions& /*options*/,
                                    Slice* result, char* scratch,
                                    IODebugContext* /*dbg*/) {
   IOStatus s;
 
-  s = zoneFile_->PositionedRead(rp, n, result, scratch, direct_);
+  s = readahead_->Read(rp, n, result, scratch);
   if (s.ok()) rp += result->size();
 
   return s;
@@ -709,14 +1507,20 @@ IOStatus ZonedSequentialFile::PositionedRead(uint64_t offset, size_t n,
                                              const IOOptions& /*options*/,
                                              Slice* result, char* scratch,
                                              IODebugContext* /*dbg*/) {
-  return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
+  return readahead_->Read(offset, n, result, scratch);
 }
 
 IOStatus ZonedRandomAccessFile::Read(uint64_t offset, size_t n,
                                      const IOOptions& /*options*/,
                                      Slice* result, char* scratch,
                                      IODebugContext* /*dbg*/) const {
-  return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
+  return readahead_->ReadPrefetched(offset, n, result, scratch);
+}
+
+IOStatus ZonedRandomAccessFile::MultiRead(FSReadRequest* reqs, size_t num_reqs,
+                                          const IOOptions& /*options*/,
+                                          IODebugContext* /*dbg*/) {
+  return zoneFile_->MultiRead(reqs, num_reqs, direct_);
 }
 
 size_t ZoneFile::GetUniqueId(char* id, size_t max_size) {
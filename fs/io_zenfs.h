@@ -15,6 +15,8 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -26,6 +28,12 @@
 
 namespace ROCKSDB_NAMESPACE {
 
+/* Max number of write buffers per writable file, WALs use two */
+#define ZENFS_WRITE_BUFFERS (4)
+
+/* Initial capacity of the extent list of a file, doubled as it fills up */
+#define ZENFS_EXTENT_BLOCK_MIN_SIZE (4)
+
 class ZoneExtent {
  public:
   uint64_t start_;
@@ -33,21 +41,88 @@ class ZoneExtent {
   Zone* zone_;
 
   explicit ZoneExtent(uint64_t start, uint32_t length, Zone* zone);
+  /* Fixed size encoding of file systems before superblock version 3 */
   Status DecodeFrom(Slice* input);
-  void EncodeTo(std::string* output);
-  void EncodeJson(std::ostream& json_stream);
+  void EncodeJson(std::ostream& json_stream) const;
+
+  bool operator==(const ZoneExtent& other) const {
+    return start_ == other.start_ && length_ == other.length_ && zone_ == other.zone_;
+  }
+};
+
+/* Storage of the extent list of a file, in file order, with the file offset
+ * of the first byte of each extent. Published slots, those below size, never
+ * change: the writer fills the slot at size and then bumps it, or publishes a
+ * copy of the list in a new block when this one is full or the list is
+ * replaced. */
+struct ZoneExtentBlock {
+  explicit ZoneExtentBlock(size_t capacity)
+      : extents(capacity, ZoneExtent(0, 0, nullptr)), offsets(capacity, 0) {}
+
+  std::atomic<size_t> size{0};
+  std::vector<ZoneExtent> extents;
+  std::vector<uint64_t> offsets;
+};
+
+/* Consistent view of the extent list of a file, taken without a lock or a
+ * reference while the file is being written. Views stay valid as long as
+ * the file exists. */
+class ZoneExtentList {
+  const ZoneExtentBlock* block_ = nullptr;
+  size_t size_ = 0;
+
+ public:
+  ZoneExtentList() {}
+  ZoneExtentList(const ZoneExtentBlock* block, size_t size) : block_(block), size_(size) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const ZoneExtent& operator[](size_t i) const { return block_->extents[i]; }
+  const ZoneExtent& back() const { return block_->extents[size_ - 1]; }
+  const ZoneExtent* begin() const { return size_ ? block_->extents.data() : nullptr; }
+  const ZoneExtent* end() const { return begin() + size_; }
+  /* File offset of the first byte of extent i */
+  uint64_t GetOffset(size_t i) const { return block_->offsets[i]; }
+
+  /* Extent holding file_offset, nullptr if it is beyond the last one */
+  const ZoneExtent* Find(uint64_t file_offset, uint64_t* dev_offset, size_t* idx = nullptr) const;
+};
+
+/* Identifies an asynchronous append so that the writer can wait for it to
+ * complete before reusing the data buffer */
+struct ZoneWriteTicket {
+  Zone* zone = nullptr;
+  uint64_t seq = 0;
 };
 
 class ZoneFile {
  protected:
   ZonedBlockDevice* zbd_;
-  std::vector<ZoneExtent*> extents_;
+  /* Published extent list, read through GetExtentList(). Readers hold no
+   * references, so replaced blocks are retired to extent_blocks_. Blocks
+   * double in size as the list grows, so all blocks retired by growth take
+   * less memory than the live one, and ReplaceExtents() frees the retired
+   * blocks once the reads that may use them are done. */
+  std::atomic<ZoneExtentBlock*> extents_{nullptr};
+  std::vector<std::unique_ptr<ZoneExtentBlock>> extent_blocks_;
+  /* Reads of file data in flight, counted in the slot of the read epoch
+   * they started in, see ExtentReadGuard */
+  std::atomic<uint32_t> read_epoch_{0};
+  std::atomic<uint32_t> extent_readers_[2] = {};
   Zone* active_zone_;
+  /* active_zone_ is shared with other files, see AppendShared */
+  bool shared_zone_ = false;
   uint64_t extent_start_;
   uint64_t extent_filepos_;
 
   Env::WriteLifeTimeHint lifetime_;
+  /* Lifetime class of the file, see ZenFSLifetimePredictor */
+  uint32_t file_class_;
+  /* Scheduling class of the writes of the file, see ZenFSIOScheduler */
+  ZenFSIOClass io_class_;
   uint64_t fileSize;
+  /* Bumped by truncation, see GetGeneration() */
+  std::atomic<uint64_t> generation_{0};
   uint64_t file_id_;
 
   uint32_t nr_synced_extents_;
@@ -56,10 +131,47 @@ class ZoneFile {
 
   std::shared_ptr<Logger> logger_;
 
+  /* Snapshot encoding of the file, reused by snapshots until the file
+   * changes. Never kept while the file is open for writing. */
+  std::shared_ptr<const std::string> snapshot_encoding_;
+
+  void AddExtent(const ZoneExtent& extent);
+  ZoneExtentBlock* NewExtentBlock(size_t capacity);
+  /* Wait for the reads that may still use a list replaced before the call */
+  void WaitForExtentReaders();
+  static void EncodeExtents(std::string* output, const ZoneExtent* extents,
+                            size_t nr_extents, uint64_t zone_sz);
+  Status DecodeExtents(Slice* input);
+
+  IOStatus CachedRead(uint64_t offset, size_t n, Slice* result, char* scratch,
+                      bool direct);
+  IOStatus DeviceRead(uint64_t offset, size_t n, Slice* result, char* scratch,
+                      bool direct);
+  Zone* AllocateZone();
+  void ReleaseZone();
+  IOStatus AppendShared(void* data, int data_size, int valid_size);
+  void UpdateFileClass();
+
  public:
   std::string filename_;
   bool is_wal_;
 
+  /* Held by reads of file data, from looking up the extents to the end of
+   * the device reads. A list replaced by ReplaceExtents() keeps its zones
+   * accounted as used until no read that may have seen it is left, so they
+   * are not reset under the read. Never blocks. */
+  class ExtentReadGuard {
+    ZoneFile* file_;
+    uint32_t epoch_;
+
+   public:
+    explicit ExtentReadGuard(ZoneFile* file) : file_(file) {
+      epoch_ = file_->read_epoch_.load();
+      file_->extent_readers_[epoch_].fetch_add(1);
+    }
+    ~ExtentReadGuard() { file_->extent_readers_[epoch_].fetch_sub(1); }
+  };
+
  public:
   explicit ZoneFile(ZonedBlockDevice* zbd, std::string filename,
                     uint64_t file_id_, std::shared_ptr<Logger> logger);
@@ -71,9 +183,11 @@ class ZoneFile {
   bool IsOpenForWR();
 
   IOStatus Append(void* data, int data_size, int valid_size,
-                  bool async = false);
+                  bool async = false, ZoneWriteTicket* ticket = nullptr);
   IOStatus SetWriteLifeTimeHint(Env::WriteLifeTimeHint lifetime);
   IOStatus Sync();
+  /* Wait for an asynchronous append and everything submitted before it */
+  IOStatus Sync(const ZoneWriteTicket& ticket);
 
   std::string GetFilename();
   void Rename(std::string name);
@@ -81,14 +195,36 @@ class ZoneFile {
   void SetFileModificationTime(time_t mt);
   uint64_t GetFileSize();
   void SetFileSize(uint64_t sz);
+  /* Data buffered by readers of the file is only valid for the generation
+   * it was read in, a truncation starts a new one */
+  uint64_t GetGeneration() { return generation_.load(std::memory_order_acquire); }
+  void NewGeneration() { generation_.fetch_add(1, std::memory_order_acq_rel); }
 
   uint32_t GetBlockSize() { return zbd_->GetBlockSize(); }
-  std::vector<ZoneExtent*> GetExtents() { return extents_; }
+  ZoneExtentList GetExtentList() const {
+    /* Ordered after the read epoch of an ExtentReadGuard */
+    ZoneExtentBlock* block = extents_.load();
+    if (block == nullptr) return ZoneExtentList();
+    return ZoneExtentList(block, block->size.load(std::memory_order_acquire));
+  }
+  std::vector<ZoneExtent> GetExtents() {
+    ZoneExtentList extents = GetExtentList();
+    return std::vector<ZoneExtent>(extents.begin(), extents.end());
+  }
   Env::WriteLifeTimeHint GetWriteLifeTimeHint() { return lifetime_; }
+  uint32_t GetFileClass() { return file_class_; }
+  void SetIOClass(ZenFSIOClass io_class) { io_class_ = io_class; }
+  ZenFSIOClass GetIOClass() { return io_class_; }
 
   IOStatus PositionedRead(uint64_t offset, size_t n, Slice* result,
                           char* scratch, bool direct);
-  ZoneExtent* GetExtent(uint64_t file_offset, uint64_t* dev_offset);
+  /* Read a batch of ranges with one round trip to the device, ranges that
+   * are adjacent on the device are merged into a single read */
+  IOStatus MultiRead(FSReadRequest* reqs, size_t num_reqs, bool direct);
+  /* The extent stays valid as long as the caller holds an ExtentReadGuard */
+  const ZoneExtent* GetExtent(uint64_t file_offset, uint64_t* dev_offset, size_t* idx = nullptr);
+  /* File offset range of the extent holding file_offset */
+  bool GetExtentRange(uint64_t file_offset, uint64_t* start, uint64_t* end);
   void PushExtent();
 
   void EncodeTo(std::string* output, uint32_t extent_start);
@@ -96,11 +232,20 @@ class ZoneFile {
     EncodeTo(output, nr_synced_extents_);
   };
   void EncodeSnapshotTo(std::string* output) { EncodeTo(output, 0); };
+  std::shared_ptr<const std::string> GetSnapshotEncoding();
   void EncodeJson(std::ostream& json_stream);
-  void MetadataSynced() { nr_synced_extents_ = extents_.size(); };
+  void MetadataSynced() { nr_synced_extents_ = GetExtentList().size(); };
+  uint32_t GetNrSyncedExtents() { return nr_synced_extents_; };
+  /* Roll back a MetadataSynced() whose update failed to persist */
+  void MetadataUnsynced(uint32_t nr_synced_extents) { nr_synced_extents_ = nr_synced_extents; };
 
   Status DecodeFrom(Slice* input);
   Status MergeUpdate(ZoneFile* update);
+  /* Swap in a new extent list, e.g. after the valid data of the file has been
+   * moved by garbage collection. Waits for reads that may use the old list
+   * and frees it, must hold the file table lock of the file, which every
+   * user of the list that is not a read holds too. */
+  void ReplaceExtents(const std::vector<ZoneExtent>& extents);
 
   uint64_t GetID() { return file_id_; }
   size_t GetUniqueId(char* id, size_t max_size);
@@ -164,12 +309,26 @@ class ZonedWritableFile : public FSWritableFile {
  private:
   IOStatus BufferedWrite(const Slice& data);
   IOStatus FlushBuffer();
+  ZenFSIOClass GetIOClass(const IOOptions& options);
+  IOStatus PrepareBuffer();
+  void ReleaseSpareBuffers();
+  size_t MaxBufferSize();
 
   bool buffered;
   char* buffer;
-  char* b1;
-  char* b2;
-  size_t buffer_sz;
+  /* Ring of write buffers, flushed asynchronously. A buffer is reused once
+   * the write from its previous round has completed. Buffers are allocated
+   * on first use and resized to target_buffer_sz_ when reused. */
+  char* buffers_[ZENFS_WRITE_BUFFERS];
+  size_t buffer_szs_[ZENFS_WRITE_BUFFERS];
+  ZoneWriteTicket tickets_[ZENFS_WRITE_BUFFERS];
+  int nr_buffers_;
+  /* Buffers in use, one for writers that sync before filling a buffer */
+  int ring_sz_;
+  int cur_buffer_;
+  size_t buffer_sz; /* size of the current buffer */
+  size_t min_buffer_sz_;
+  size_t target_buffer_sz_;
   uint32_t block_sz;
   uint32_t buffer_pos;
   uint64_t wp;
@@ -185,15 +344,75 @@ class ZonedWritableFile : public FSWritableFile {
   std::mutex buffer_mtx_;
 };
 
+/* Readahead for a file opened for reading. Sequential reads grow the
+ * readahead window from ZENFS_READAHEAD_MIN up to ZENFS_READAHEAD_MAX and
+ * the next window is fetched in the background while the current one is
+ * consumed. Windows never cross an extent boundary, so each fill is a
+ * single device read. Random reads bypass the buffers.
+ *
+ * Sequential detection is only meant for a single reader, i.e. sequential
+ * files. Random access files are read by many threads at once and only go
+ * through ReadPrefetched(), which serves what Prefetch() fetched. */
+class ZoneFileReadahead
+    : public std::enable_shared_from_this<ZoneFileReadahead> {
+ public:
+  ZoneFileReadahead(ZoneFile* zoneFile, bool direct);
+  ~ZoneFileReadahead();
+
+  IOStatus Read(uint64_t offset, size_t n, Slice* result, char* scratch);
+  /* Read from the buffers if they hold the data, without sequential
+   * detection. Lock free until something is prefetched. */
+  IOStatus ReadPrefetched(uint64_t offset, size_t n, Slice* result, char* scratch);
+  /* Start fetching [offset, offset + n) in the background */
+  void Prefetch(uint64_t offset, size_t n);
+  void Invalidate(uint64_t offset, size_t n);
+  /* Wait for background fills, must be called before the file goes away */
+  void Stop();
+
+ private:
+  ZoneFile* zoneFile_;
+  bool direct_;
+
+  std::mutex mtx_;
+  std::condition_variable fill_cv_;
+
+  /* Buffer cur_ is served from, the other one is the fill target */
+  char* buf_[2] = {nullptr, nullptr};
+  uint64_t start_[2] = {0, 0};
+  uint64_t end_[2] = {0, 0};
+  /* File generation each buffer was filled in */
+  uint64_t gen_[2] = {0, 0};
+  int cur_ = 0;
+
+  bool filling_ = false;
+  bool stopped_ = false;
+  /* Set once Prefetch() started a fill */
+  std::atomic<bool> prefetched_{false};
+  uint64_t fill_start_ = 0;
+  size_t fill_len_ = 0;
+
+  uint64_t last_end_ = UINT64_MAX;
+  size_t window_;
+
+  bool Lookup(uint64_t offset, size_t n, Slice* result, char* scratch);
+  bool StartFill(uint64_t offset, size_t len);
+  void DoFill();
+};
+
 class ZonedSequentialFile : public FSSequentialFile {
  private:
   ZoneFile* zoneFile_;
   uint64_t rp;
   bool direct_;
+  std::shared_ptr<ZoneFileReadahead> readahead_;
 
  public:
   explicit ZonedSequentialFile(ZoneFile* zoneFile, const FileOptions& file_opts)
-      : zoneFile_(zoneFile), rp(0), direct_(file_opts.use_direct_reads) {}
+      : zoneFile_(zoneFile),
+        rp(0),
+        direct_(file_opts.use_direct_reads),
+        readahead_(std::make_shared<ZoneFileReadahead>(zoneFile, direct_)) {}
+  ~ZonedSequentialFile() { readahead_->Stop(); }
 
   IOStatus Read(size_t n, const IOOptions& options, Slice* result,
                 char* scratch, IODebugContext* dbg) override;
@@ -208,7 +427,8 @@ class ZonedSequentialFile : public FSSequentialFile {
     return zoneFile_->GetBlockSize();
   }
 
-  IOStatus InvalidateCache(size_t /*offset*/, size_t /*length*/) override {
+  IOStatus InvalidateCache(size_t offset, size_t length) override {
+    readahead_->Invalidate(offset, length);
     return IOStatus::OK();
   }
 };
@@ -217,19 +437,26 @@ class ZonedRandomAccessFile : public FSRandomAccessFile {
  private:
   ZoneFile* zoneFile_;
   bool direct_;
+  std::shared_ptr<ZoneFileReadahead> readahead_;
 
  public:
   explicit ZonedRandomAccessFile(ZoneFile* zoneFile,
                                  const FileOptions& file_opts)
-      : zoneFile_(zoneFile), direct_(file_opts.use_direct_reads) {}
+      : zoneFile_(zoneFile),
+        direct_(file_opts.use_direct_reads),
+        readahead_(std::make_shared<ZoneFileReadahead>(zoneFile, direct_)) {}
+  ~ZonedRandomAccessFile() { readahead_->Stop(); }
 
   IOStatus Read(uint64_t offset, size_t n, const IOOptions& options,
                 Slice* result, char* scratch,
                 IODebugContext* dbg) const override;
 
-  IOStatus Prefetch(uint64_t /*offset*/, size_t /*n*/,
-                    const IOOptions& /*options*/,
+  IOStatus MultiRead(FSReadRequest* reqs, size_t num_reqs,
+                     const IOOptions& options, IODebugContext* dbg) override;
+
+  IOStatus Prefetch(uint64_t offset, size_t n, const IOOptions& /*options*/,
                     IODebugContext* /*dbg*/) override {
+    readahead_->Prefetch(offset, n);
     return IOStatus::OK();
   }
 
@@ -239,7 +466,8 @@ class ZonedRandomAccessFile : public FSRandomAccessFile {
     return zoneFile_->GetBlockSize();
   }
 
-  IOStatus InvalidateCache(size_t /*offset*/, size_t /*length*/) override {
+  IOStatus InvalidateCache(size_t offset, size_t length) override {
+    readahead_->Invalidate(offset, length);
     return IOStatus::OK();
   }
 
@@ -0,0 +1,79 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include "lifetime.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+static bool HasSuffix(const std::string &name, const std::string &suffix) {
+  return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+ZenFSFileKind ZenFSLifetimePredictor::GetFileKind(const std::string &filename) {
+  size_t slash = filename.find_last_of('/');
+  std::string name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+
+  if (HasSuffix(name, ".log")) return kFileKindWAL;
+  if (HasSuffix(name, ".sst")) return kFileKindSST;
+  if (HasSuffix(name, ".blob")) return kFileKindBlob;
+  if (name.compare(0, 8, "MANIFEST") == 0) return kFileKindManifest;
+  return kFileKindOther;
+}
+
+Env::WriteLifeTimeHint ZenFSLifetimePredictor::Predict(uint32_t file_class, Env::WriteLifeTimeHint hint) {
+  ClassStats &stats = classes_[file_class];
+
+  if (stats.samples.load() < ZENFS_LIFETIME_MIN_SAMPLES) return hint;
+
+  uint64_t lifetime = GetLifetime(file_class);
+  if (lifetime < ZENFS_LIFETIME_SHORT_S) return Env::WLTH_SHORT;
+  if (lifetime < ZENFS_LIFETIME_MEDIUM_S) return Env::WLTH_MEDIUM;
+  if (lifetime < ZENFS_LIFETIME_LONG_S) return Env::WLTH_LONG;
+  return Env::WLTH_EXTREME;
+}
+
+void ZenFSLifetimePredictor::RecordDeletion(uint32_t file_class, uint64_t lifetime_s) {
+  ClassStats &stats = classes_[file_class];
+  int64_t sample = (int64_t)(lifetime_s << 8);
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  /* Plain average until the class is trusted, so that the first few files
+   * do not dominate */
+  uint64_t n = stats.samples++;
+  int64_t avg = (int64_t)stats.avg_lifetime.load();
+  if (n < ZENFS_LIFETIME_MIN_SAMPLES)
+    avg += (sample - avg) / (int64_t)(n + 1);
+  else
+    avg += (sample - avg) * ZENFS_LIFETIME_EWMA_WEIGHT / 256;
+  stats.avg_lifetime = (uint64_t)avg;
+}
+
+void ZenFSLifetimePredictor::EncodeJson(std::ostream &json_stream) {
+  static const char *kinds[kNrFileKinds] = {"other", "wal", "manifest", "sst", "blob"};
+  bool first_element = true;
+
+  json_stream << "[";
+  for (uint32_t c = 0; c < ZENFS_NR_FILE_CLASSES; c++) {
+    ClassStats &stats = classes_[c];
+    if (stats.samples == 0 && stats.written == 0) continue;
+
+    if (first_element) {
+      first_element = false;
+    } else {
+      json_stream << ",";
+    }
+    json_stream << "{\"kind\":\"" << kinds[c / ZENFS_NR_LIFETIME_HINTS] << "\",\"hint\":" << c % ZENFS_NR_LIFETIME_HINTS
+                << ",\"samples\":" << stats.samples << ",\"lifetime_s\":" << GetLifetime(c)
+                << ",\"written\":" << stats.written << ",\"migrated\":" << stats.migrated << "}";
+  }
+  json_stream << "]";
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
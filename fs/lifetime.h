@@ -0,0 +1,90 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "rocksdb/env.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* A class needs this many deletions before its learned lifetime is trusted
+ * over the write lifetime hint */
+#define ZENFS_LIFETIME_MIN_SAMPLES (8)
+
+/* Weight of a new sample in the lifetime average, in 1/256ths */
+#define ZENFS_LIFETIME_EWMA_WEIGHT (32)
+
+/* Upper bounds of the predicted lifetime, in seconds, for files to be placed
+ * as short, medium and long lived. Files that live longer are extreme. */
+#define ZENFS_LIFETIME_SHORT_S (5 * 60)
+#define ZENFS_LIFETIME_MEDIUM_S (60 * 60)
+#define ZENFS_LIFETIME_LONG_S (24 * 60 * 60)
+
+enum ZenFSFileKind : uint32_t {
+  kFileKindOther = 0,
+  kFileKindWAL = 1,
+  kFileKindManifest = 2,
+  kFileKindSST = 3,
+  kFileKindBlob = 4,
+  kNrFileKinds = 5,
+};
+
+#define ZENFS_NR_LIFETIME_HINTS (Env::WLTH_EXTREME + 1)
+#define ZENFS_NR_FILE_CLASSES (kNrFileKinds * ZENFS_NR_LIFETIME_HINTS)
+
+/* Learns the lifetime of each class of files, a file kind derived from the
+ * file name combined with the write lifetime hint which RocksDB derives from
+ * the output level, from the time between the last modification and the
+ * deletion of files. Once a class has enough samples its files are placed by
+ * the predicted lifetime rather than the hint, so files expected to die at
+ * about the same time share zones.
+ *
+ * Also counts the data written and the data copied by garbage collection
+ * per class, to keep track of the write amplification of each. */
+class ZenFSLifetimePredictor {
+  struct ClassStats {
+    std::atomic<uint64_t> samples{0};
+    /* Average lifetime in seconds, fixed point with 8 fractional bits */
+    std::atomic<uint64_t> avg_lifetime{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> migrated{0};
+  };
+
+  std::mutex mtx_;
+  ClassStats classes_[ZENFS_NR_FILE_CLASSES];
+
+ public:
+  static ZenFSFileKind GetFileKind(const std::string& filename);
+  static uint32_t GetFileClass(ZenFSFileKind kind, Env::WriteLifeTimeHint hint) {
+    return kind * ZENFS_NR_LIFETIME_HINTS + (hint < ZENFS_NR_LIFETIME_HINTS ? hint : Env::WLTH_NOT_SET);
+  }
+
+  /* Lifetime to place a file of the class by, the hint until the class has
+   * enough samples */
+  Env::WriteLifeTimeHint Predict(uint32_t file_class, Env::WriteLifeTimeHint hint);
+  void RecordDeletion(uint32_t file_class, uint64_t lifetime_s);
+  void AddWritten(uint32_t file_class, uint64_t bytes) { classes_[file_class].written += bytes; }
+  void AddMigrated(uint32_t file_class, uint64_t bytes) { classes_[file_class].migrated += bytes; }
+
+  /* Learned lifetime in seconds, 0 without samples */
+  uint64_t GetLifetime(uint32_t file_class) { return classes_[file_class].avg_lifetime >> 8; }
+
+  /* Per class samples, lifetime, bytes written and bytes migrated by GC */
+  void EncodeJson(std::ostream& json_stream);
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -28,21 +28,32 @@ class BytedanceMetrics {
         io_alloc_non_wal_actual_latency_reporter_(
             *factory_->BuildHistReporter(io_alloc_non_wal_actual_lat_label, bytedance_tags_)),
         roll_latency_reporter_(*factory_->BuildHistReporter(roll_lat_label, bytedance_tags_)),
+        gc_latency_reporter_(*factory_->BuildHistReporter(gc_lat_label, bytedance_tags_)),
+        bg_job_wait_latency_reporter_(*factory_->BuildHistReporter(bg_job_wait_lat_label, bytedance_tags_)),
+        flush_latency_reporter_(*factory_->BuildHistReporter(flush_lat_label, bytedance_tags_)),
+        zone_alloc_wait_latency_reporter_(*factory_->BuildHistReporter(zone_alloc_wait_lat_label, bytedance_tags_)),
+        zone_reset_latency_reporter_(*factory_->BuildHistReporter(zone_reset_lat_label, bytedance_tags_)),
         write_qps_reporter_(*factory_->BuildCountReporter(write_qps_label, bytedance_tags_)),
         read_qps_reporter_(*factory_->BuildCountReporter(read_qps_label, bytedance_tags_)),
         sync_qps_reporter_(*factory_->BuildCountReporter(sync_qps_label, bytedance_tags_)),
         meta_alloc_qps_reporter_(*factory_->BuildCountReporter(meta_alloc_qps_label, bytedance_tags_)),
         io_alloc_qps_reporter_(*factory_->BuildCountReporter(io_alloc_qps_label, bytedance_tags_)),
         roll_qps_reporter_(*factory_->BuildCountReporter(roll_qps_label, bytedance_tags_)),
+        read_cache_hit_qps_reporter_(*factory_->BuildCountReporter(read_cache_hit_qps_label, bytedance_tags_)),
+        read_cache_miss_qps_reporter_(*factory_->BuildCountReporter(read_cache_miss_qps_label, bytedance_tags_)),
         write_throughput_reporter_(*factory_->BuildCountReporter(write_throughput_label, bytedance_tags_)),
         roll_throughput_reporter_(*factory_->BuildCountReporter(roll_throughput_label, bytedance_tags_)),
+        gc_throughput_reporter_(*factory_->BuildCountReporter(gc_throughput_label, bytedance_tags_)),
         active_zones_reporter_(*factory_->BuildHistReporter(active_zones_label, bytedance_tags_)),
         open_zones_reporter_(*factory_->BuildHistReporter(open_zones_label, bytedance_tags_)),
         zbd_free_space_reporter_(*factory_->BuildHistReporter(zbd_free_space_label, bytedance_tags_)),
         zbd_used_space_reporter_(*factory_->BuildHistReporter(zbd_used_space_label, bytedance_tags_)),
         zbd_reclaimable_space_reporter_(
             *factory_->BuildHistReporter(zbd_reclaimable_space_label, bytedance_tags_)),
-        zbd_resetable_zones_reporter_(*factory_->BuildHistReporter(zbd_resetable_zones_label, bytedance_tags_)) {}
+        zbd_resetable_zones_reporter_(*factory_->BuildHistReporter(zbd_resetable_zones_label, bytedance_tags_)),
+        metadata_group_size_reporter_(*factory_->BuildHistReporter(metadata_group_size_label, bytedance_tags_)),
+        write_buffer_memory_reporter_(*factory_->BuildHistReporter(write_buffer_memory_label, bytedance_tags_)),
+        bg_queue_depth_reporter_(*factory_->BuildHistReporter(bg_queue_depth_label, bytedance_tags_)) {}
 
  public:
   std::string fg_write_lat_label = "zenfs_fg_write_latency";
@@ -58,6 +69,11 @@ class BytedanceMetrics {
   std::string meta_alloc_lat_label = "zenfs_meta_alloc_latency";
   std::string sync_metadata_lat_label = "zenfs_metadata_sync_latency";
   std::string roll_lat_label = "zenfs_roll_latency";
+  std::string gc_lat_label = "zenfs_gc_latency";
+  std::string bg_job_wait_lat_label = "zenfs_bg_job_wait_latency";
+  std::string flush_lat_label = "zenfs_flush_latency";
+  std::string zone_alloc_wait_lat_label = "zenfs_zone_alloc_wait_latency";
+  std::string zone_reset_lat_label = "zenfs_zone_reset_latency";
 
   std::string write_qps_label = "zenfs_write_qps";
   std::string read_qps_label = "zenfs_read_qps";
@@ -65,9 +81,12 @@ class BytedanceMetrics {
   std::string io_alloc_qps_label = "zenfs_io_alloc_qps";
   std::string meta_alloc_qps_label = "zenfs_meta_alloc_qps";
   std::string roll_qps_label = "zenfs_roll_qps";
+  std::string read_cache_hit_qps_label = "zenfs_read_cache_hit_qps";
+  std::string read_cache_miss_qps_label = "zenfs_read_cache_miss_qps";
 
   std::string write_throughput_label = "zenfs_write_throughput";
   std::string roll_throughput_label = "zenfs_roll_throughput";
+  std::string gc_throughput_label = "zenfs_gc_throughput";
 
   std::string active_zones_label = "zenfs_active_zones";
   std::string open_zones_label = "zenfs_open_zones";
@@ -75,6 +94,9 @@ class BytedanceMetrics {
   std::string zbd_used_space_label = "zenfs_used_space";
   std::string zbd_reclaimable_space_label = "zenfs_reclaimable_space";
   std::string zbd_resetable_zones_label = "zenfs_resetable_zones";
+  std::string metadata_group_size_label = "zenfs_metadata_group_size";
+  std::string write_buffer_memory_label = "zenfs_write_buffer_memory";
+  std::string bg_queue_depth_label = "zenfs_bg_queue_depth";
 
  public:
   std::string bytedance_tags_;
@@ -96,6 +118,11 @@ class BytedanceMetrics {
   LatencyReporter io_alloc_non_wal_latency_reporter_;
   LatencyReporter io_alloc_non_wal_actual_latency_reporter_;
   LatencyReporter roll_latency_reporter_;
+  LatencyReporter gc_latency_reporter_;
+  LatencyReporter bg_job_wait_latency_reporter_;
+  LatencyReporter flush_latency_reporter_;
+  LatencyReporter zone_alloc_wait_latency_reporter_;
+  LatencyReporter zone_reset_latency_reporter_;
 
   using QPSReporter = CountReporterHandle &;
   QPSReporter write_qps_reporter_;
@@ -104,10 +131,13 @@ class BytedanceMetrics {
   QPSReporter meta_alloc_qps_reporter_;
   QPSReporter io_alloc_qps_reporter_;
   QPSReporter roll_qps_reporter_;
+  QPSReporter read_cache_hit_qps_reporter_;
+  QPSReporter read_cache_miss_qps_reporter_;
 
   using ThroughputReporter = CountReporterHandle &;
   ThroughputReporter write_throughput_reporter_;
   ThroughputReporter roll_throughput_reporter_;
+  ThroughputReporter gc_throughput_reporter_;
 
   using DataReporter = HistReporterHandle &;
   DataReporter active_zones_reporter_;
@@ -116,6 +146,9 @@ class BytedanceMetrics {
   DataReporter zbd_used_space_reporter_;
   DataReporter zbd_reclaimable_space_reporter_;
   DataReporter zbd_resetable_zones_reporter_;
+  DataReporter metadata_group_size_reporter_;
+  DataReporter write_buffer_memory_reporter_;
+  DataReporter bg_queue_depth_reporter_;
 };
 
 }  // namespace ROCKSDB_NAMESPACE
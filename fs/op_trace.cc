@@ -0,0 +1,180 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include "op_trace.h"
+
+#include <algorithm>
+
+namespace ROCKSDB_NAMESPACE {
+
+static std::atomic<uint64_t> next_tracer_id{1};
+static std::atomic<uint32_t> next_trace_tid{1};
+
+/* Ring of the tracer the calling thread recorded to last */
+struct ThreadRingCache {
+  uint64_t tracer_id = 0;
+  void *ring = nullptr;
+};
+static thread_local ThreadRingCache ring_cache;
+static thread_local uint32_t trace_tid = 0;
+
+ZenFSTracer::ZenFSTracer() : id_(next_tracer_id++) {
+  for (uint32_t i = 0; i < kNrTraceOps; i++) reporters_[i] = nullptr;
+}
+
+ZenFSTracer::~ZenFSTracer() {
+  for (auto ring : rings_) delete ring;
+}
+
+const char *ZenFSTracer::OpName(ZenFSTraceOp op) {
+  switch (op) {
+    case kTraceAppend:
+      return "append";
+    case kTraceFlush:
+      return "flush";
+    case kTraceSync:
+      return "sync";
+    case kTraceMetaPersist:
+      return "meta_persist";
+    case kTraceZoneAllocWait:
+      return "zone_alloc_wait";
+    case kTraceZoneAlloc:
+      return "zone_alloc";
+    case kTraceZoneReset:
+      return "zone_reset";
+    default:
+      return "unknown";
+  }
+}
+
+ZenFSTracer::ThreadRing *ZenFSTracer::GetThreadRing() {
+  if (ring_cache.tracer_id == id_) return (ThreadRing *)ring_cache.ring;
+
+  if (trace_tid == 0) trace_tid = next_trace_tid++;
+
+  std::lock_guard<std::mutex> lock(rings_mtx_);
+  ThreadRing *ring = nullptr;
+  for (auto r : rings_) {
+    if (r->tid == trace_tid) {
+      ring = r;
+      break;
+    }
+  }
+  if (ring == nullptr) {
+    ring = new ThreadRing();
+    ring->tid = trace_tid;
+    rings_.push_back(ring);
+  }
+
+  ring_cache.tracer_id = id_;
+  ring_cache.ring = ring;
+  return ring;
+}
+
+void ZenFSTracer::Record(ZenFSTraceOp op, uint64_t start_ns, uint64_t duration_ns, uint64_t arg) {
+  ThreadRing *ring = GetThreadRing();
+  OpStats &stats = ring->stats[op];
+
+  /* Single writer, no need for read-modify-write operations */
+  stats.count.store(stats.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  stats.total_ns.store(stats.total_ns.load(std::memory_order_relaxed) + duration_ns, std::memory_order_relaxed);
+  if (duration_ns > stats.max_ns.load(std::memory_order_relaxed))
+    stats.max_ns.store(duration_ns, std::memory_order_relaxed);
+
+  HistReporterHandle *reporter = reporters_[op].load(std::memory_order_relaxed);
+  if (reporter) reporter->AddRecord(duration_ns / 1000);
+
+  if (++ring->sample[op] < ZENFS_TRACE_SAMPLE && duration_ns < ZENFS_TRACE_SLOW_NS) return;
+  ring->sample[op] = 0;
+
+  uint64_t i = ring->published.load(std::memory_order_relaxed);
+  Slot &slot = ring->slots[i % ZENFS_TRACE_RING_SIZE];
+
+  ring->claimed.store(i + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.start_ns.store(start_ns, std::memory_order_relaxed);
+  slot.duration_ns.store(duration_ns, std::memory_order_relaxed);
+  slot.arg.store(arg, std::memory_order_relaxed);
+  slot.op.store(op, std::memory_order_relaxed);
+  ring->published.store(i + 1, std::memory_order_release);
+}
+
+void ZenFSTracer::GetSpans(std::vector<Span> *spans) {
+  std::lock_guard<std::mutex> lock(rings_mtx_);
+
+  for (auto ring : rings_) {
+    std::vector<Span> copied;
+    uint64_t published = ring->published.load(std::memory_order_acquire);
+    uint64_t first = published > ZENFS_TRACE_RING_SIZE ? published - ZENFS_TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = first; i < published; i++) {
+      Slot &slot = ring->slots[i % ZENFS_TRACE_RING_SIZE];
+      Span span;
+      span.tid = ring->tid;
+      span.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+      span.duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+      span.arg = slot.arg.load(std::memory_order_relaxed);
+      span.op = (ZenFSTraceOp)slot.op.load(std::memory_order_relaxed);
+      copied.push_back(span);
+    }
+
+    /* Drop the spans the thread started overwriting while we copied */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t claimed = ring->claimed.load(std::memory_order_relaxed);
+    uint64_t valid = claimed > ZENFS_TRACE_RING_SIZE ? claimed - ZENFS_TRACE_RING_SIZE : 0;
+    if (valid > first) copied.erase(copied.begin(), copied.begin() + std::min(valid - first, (uint64_t)copied.size()));
+
+    spans->insert(spans->end(), copied.begin(), copied.end());
+  }
+
+  std::sort(spans->begin(), spans->end(), [](const Span &a, const Span &b) { return a.start_ns < b.start_ns; });
+}
+
+void ZenFSTracer::GetSummary(Summary summary[kNrTraceOps]) {
+  std::lock_guard<std::mutex> lock(rings_mtx_);
+
+  for (uint32_t op = 0; op < kNrTraceOps; op++) summary[op] = Summary();
+
+  for (auto ring : rings_) {
+    for (uint32_t op = 0; op < kNrTraceOps; op++) {
+      summary[op].count += ring->stats[op].count.load(std::memory_order_relaxed);
+      summary[op].total_ns += ring->stats[op].total_ns.load(std::memory_order_relaxed);
+      summary[op].max_ns = std::max(summary[op].max_ns, ring->stats[op].max_ns.load(std::memory_order_relaxed));
+    }
+  }
+}
+
+void ZenFSTracer::EncodeJson(std::ostream &json_stream) {
+  Summary summary[kNrTraceOps];
+  std::vector<Span> spans;
+
+  GetSummary(summary);
+  GetSpans(&spans);
+
+  json_stream << "{\"summary\":[";
+  for (uint32_t op = 0; op < kNrTraceOps; op++) {
+    const Summary &s = summary[op];
+    if (op) json_stream << ",";
+    json_stream << "{\"op\":\"" << OpName((ZenFSTraceOp)op) << "\",\"count\":" << s.count;
+    json_stream << ",\"mean_us\":" << (s.count ? (double)s.total_ns / s.count / 1000 : 0);
+    json_stream << ",\"max_us\":" << s.max_ns / 1000.0 << "}";
+  }
+  json_stream << "],\"spans\":[";
+  for (size_t i = 0; i < spans.size(); i++) {
+    const Span &span = spans[i];
+    if (i) json_stream << ",";
+    json_stream << "{\"tid\":" << span.tid << ",\"op\":\"" << OpName(span.op) << "\",\"start_us\":"
+                << span.start_ns / 1000.0 << ",\"duration_us\":" << span.duration_ns / 1000.0
+                << ",\"arg\":" << span.arg << "}";
+  }
+  json_stream << "]}";
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,133 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "rocksdb/metrics_reporter.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Number of spans kept per thread */
+#define ZENFS_TRACE_RING_SIZE (1024)
+
+/* One in ZENFS_TRACE_SAMPLE spans of an operation is kept in the ring, as is
+ * every span slower than ZENFS_TRACE_SLOW_NS */
+#define ZENFS_TRACE_SAMPLE (64)
+#define ZENFS_TRACE_SLOW_NS (10 * 1000 * 1000)
+
+enum ZenFSTraceOp : uint32_t {
+  kTraceAppend = 0,
+  kTraceFlush,
+  kTraceSync,
+  kTraceMetaPersist,
+  kTraceZoneAllocWait,
+  kTraceZoneAlloc,
+  kTraceZoneReset,
+  kNrTraceOps
+};
+
+/* Always on tracing of file system operations. Every thread records into
+ * its own ring of spans and its own counters, so recording takes no locks
+ * and shares no cache lines. Readers copy the rings while they are being
+ * written and drop the spans that were overwritten meanwhile. */
+class ZenFSTracer {
+  struct Slot {
+    std::atomic<uint64_t> start_ns{0};
+    std::atomic<uint64_t> duration_ns{0};
+    std::atomic<uint64_t> arg{0};
+    std::atomic<uint32_t> op{0};
+  };
+
+  struct OpStats {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+  };
+
+  /* Written by its thread only. Slot i % ZENFS_TRACE_RING_SIZE holds span
+   * i, which is complete once published > i and valid until claimed goes
+   * past i + ZENFS_TRACE_RING_SIZE. */
+  struct ThreadRing {
+    uint32_t tid;
+    std::atomic<uint64_t> claimed{0};
+    std::atomic<uint64_t> published{0};
+    uint32_t sample[kNrTraceOps] = {};
+    OpStats stats[kNrTraceOps];
+    Slot slots[ZENFS_TRACE_RING_SIZE];
+  };
+
+  const uint64_t id_;
+  std::mutex rings_mtx_;
+  std::vector<ThreadRing *> rings_;
+  std::atomic<HistReporterHandle *> reporters_[kNrTraceOps];
+
+  ThreadRing *GetThreadRing();
+
+ public:
+  struct Span {
+    uint32_t tid;
+    ZenFSTraceOp op;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t arg;
+  };
+
+  struct Summary {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+  };
+
+  ZenFSTracer();
+  ~ZenFSTracer();
+
+  static const char *OpName(ZenFSTraceOp op);
+  static uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /* Every span of op is also recorded, in microseconds, to reporter */
+  void SetReporter(ZenFSTraceOp op, HistReporterHandle *reporter) { reporters_[op] = reporter; }
+
+  void Record(ZenFSTraceOp op, uint64_t start_ns, uint64_t duration_ns, uint64_t arg);
+
+  /* Kept spans of all threads, oldest first */
+  void GetSpans(std::vector<Span> *spans);
+  void GetSummary(Summary summary[kNrTraceOps]);
+  void EncodeJson(std::ostream &json_stream);
+};
+
+/* Traces the lifetime of the object. tracer may be nullptr. */
+class ZenFSTraceSpan {
+  ZenFSTracer *tracer_;
+  ZenFSTraceOp op_;
+  uint64_t arg_;
+  uint64_t start_ns_;
+
+ public:
+  ZenFSTraceSpan(ZenFSTracer *tracer, ZenFSTraceOp op, uint64_t arg = 0)
+      : tracer_(tracer), op_(op), arg_(arg), start_ns_(tracer ? ZenFSTracer::NowNanos() : 0) {}
+  ~ZenFSTraceSpan() {
+    if (tracer_) tracer_->Record(op_, start_ns_, ZenFSTracer::NowNanos() - start_ns_, arg_);
+  }
+  void SetArg(uint64_t arg) { arg_ = arg; }
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,126 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include "read_cache.h"
+
+#include <assert.h>
+#include <string.h>
+
+namespace ROCKSDB_NAMESPACE {
+
+ZenFSReadCache::ZenFSReadCache(size_t capacity) : shard_capacity_(capacity / ZENFS_READ_CACHE_SHARDS) {}
+
+ZenFSReadCache::~ZenFSReadCache() {
+  for (auto &shard : shards_) {
+    for (auto &it : shard.entries) delete it.second;
+  }
+}
+
+void ZenFSReadCache::Remove(Shard &shard, Entry *entry) {
+  shard.entries.erase(std::make_pair(entry->file_id, entry->block));
+  shard.clock[entry->slot] = nullptr;
+  shard.free_slots.push_back(entry->slot);
+  shard.usage -= entry->size;
+  delete entry;
+}
+
+/* Make room for size bytes. Referenced entries get a second chance, so
+ * blocks that are read once are the first to go. */
+void ZenFSReadCache::Evict(Shard &shard, size_t size) {
+  while (shard.usage + size > shard_capacity_ && !shard.entries.empty()) {
+    if (shard.hand >= shard.clock.size()) shard.hand = 0;
+
+    Entry *entry = shard.clock[shard.hand++];
+    if (entry == nullptr) continue;
+
+    if (entry->referenced) {
+      entry->referenced = false;
+      continue;
+    }
+    Remove(shard, entry);
+  }
+}
+
+bool ZenFSReadCache::Lookup(uint64_t file_id, uint64_t block, size_t off, size_t len, char *buf) {
+  Shard &shard = GetShard(file_id, block);
+  std::lock_guard<std::mutex> lock(shard.mtx);
+
+  auto it = shard.entries.find(std::make_pair(file_id, block));
+  if (it == shard.entries.end() || off + len > it->second->size) {
+    misses_++;
+    return false;
+  }
+
+  it->second->referenced = true;
+  memcpy(buf, it->second->data.get() + off, len);
+  hits_++;
+  return true;
+}
+
+void ZenFSReadCache::Insert(uint64_t file_id, uint64_t block, const char *data, size_t size) {
+  assert(size > 0 && size <= ZENFS_READ_CACHE_BLOCK_SIZE);
+  if (size > shard_capacity_) return;
+
+  Shard &shard = GetShard(file_id, block);
+  std::lock_guard<std::mutex> lock(shard.mtx);
+
+  auto it = shard.entries.find(std::make_pair(file_id, block));
+  if (it != shard.entries.end()) {
+    if (it->second->size >= size) return;
+    /* The file has grown since the block was cached */
+    Remove(shard, it->second);
+  }
+
+  Evict(shard, size);
+
+  Entry *entry = new Entry();
+  entry->file_id = file_id;
+  entry->block = block;
+  entry->size = size;
+  entry->referenced = false;
+  entry->data.reset(new char[size]);
+  memcpy(entry->data.get(), data, size);
+
+  if (shard.free_slots.empty()) {
+    entry->slot = shard.clock.size();
+    shard.clock.push_back(entry);
+  } else {
+    entry->slot = shard.free_slots.back();
+    shard.free_slots.pop_back();
+    shard.clock[entry->slot] = entry;
+  }
+
+  shard.entries[std::make_pair(file_id, block)] = entry;
+  shard.usage += size;
+}
+
+void ZenFSReadCache::EraseFile(uint64_t file_id) {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.entries.lower_bound(std::make_pair(file_id, (uint64_t)0));
+
+    while (it != shard.entries.end() && it->first.first == file_id) {
+      Entry *entry = (it++)->second;
+      Remove(shard, entry);
+    }
+  }
+}
+
+uint64_t ZenFSReadCache::GetUsage() {
+  uint64_t usage = 0;
+
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    usage += shard.usage;
+  }
+  return usage;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
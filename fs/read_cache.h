@@ -0,0 +1,87 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace ROCKSDB_NAMESPACE {
+
+#define ZENFS_READ_CACHE_SHARDS (16)
+
+/* Files are cached in blocks of ZENFS_READ_CACHE_BLOCK_SIZE bytes. Reads
+ * larger than ZENFS_READ_CACHE_MAX_READ, e.g. compaction reads and
+ * readahead, bypass the cache. */
+#define ZENFS_READ_CACHE_BLOCK_SIZE (16 * 1024)
+#define ZENFS_READ_CACHE_MAX_READ (64 * 1024)
+
+/* Cache of file data keyed by file id and block number, for data that is
+ * read over and over with direct reads, e.g. small files and filter and
+ * index blocks. Blocks are only ever cached for files that are not open for
+ * writing, and must be dropped with EraseFile when the file data changes.
+ * Sharded by block, each shard evicts with the CLOCK algorithm. */
+class ZenFSReadCache {
+  struct Entry {
+    uint64_t file_id;
+    uint64_t block;
+    size_t size;
+    size_t slot;
+    bool referenced;
+    std::unique_ptr<char[]> data;
+  };
+
+  struct Shard {
+    std::mutex mtx;
+    std::map<std::pair<uint64_t, uint64_t>, Entry *> entries;
+    /* Clock of cached entries, nullptr for free slots */
+    std::vector<Entry *> clock;
+    std::vector<size_t> free_slots;
+    size_t hand = 0;
+    size_t usage = 0;
+  };
+
+  const size_t shard_capacity_;
+  Shard shards_[ZENFS_READ_CACHE_SHARDS];
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  Shard &GetShard(uint64_t file_id, uint64_t block) {
+    return shards_[((file_id * 0x9e3779b97f4a7c15ULL) ^ block) % ZENFS_READ_CACHE_SHARDS];
+  }
+  /* The shard mutex must be held */
+  void Remove(Shard &shard, Entry *entry);
+  void Evict(Shard &shard, size_t size);
+
+ public:
+  /* capacity is the memory budget in bytes */
+  explicit ZenFSReadCache(size_t capacity);
+  ~ZenFSReadCache();
+
+  /* Copy len bytes at offset off of a cached block to buf. False if the
+   * block is not cached, or cached with less data. */
+  bool Lookup(uint64_t file_id, uint64_t block, size_t off, size_t len, char *buf);
+  /* size is less than ZENFS_READ_CACHE_BLOCK_SIZE for the last block of a
+   * file only */
+  void Insert(uint64_t file_id, uint64_t block, const char *data, size_t size);
+  void EraseFile(uint64_t file_id);
+
+  uint64_t GetUsage();
+  uint64_t GetHits() { return hits_; }
+  uint64_t GetMisses() { return misses_; }
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -0,0 +1,489 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include "zbd_emu.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+#define MB (1024 * 1024)
+
+/* Identifies the zone state file of an emulated device, "ZENFSEMU" */
+#define ZENFS_EMU_MAGIC (0x554d4553464e455aULL)
+#define ZENFS_EMU_VERSION (1)
+
+namespace ROCKSDB_NAMESPACE {
+
+static void EmuDelay(uint32_t us) {
+  if (us) std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+/* Direct I/O where the file system supports it, tmpfs does not */
+static int OpenDirect(const std::string &path, int flags) {
+  int fd = open(path.c_str(), flags | O_DIRECT);
+  if (fd < 0 && errno == EINVAL) fd = open(path.c_str(), flags);
+  return fd;
+}
+
+static bool IsOpen(uint32_t cond) { return cond == ZBD_ZONE_COND_IMP_OPEN || cond == ZBD_ZONE_COND_EXP_OPEN; }
+
+ZbdEmuDevice::~ZbdEmuDevice() {
+  if (header_) munmap(header_, state_sz_);
+  if (state_f_ >= 0) close(state_f_);
+  if (read_f_ >= 0) close(read_f_);
+  if (read_direct_f_ >= 0) close(read_direct_f_);
+  if (write_f_ >= 0) close(write_f_);
+}
+
+IOStatus ZbdEmuDevice::Open(const std::string &name, bool readonly, struct zbd_info *info,
+                            std::unique_ptr<ZbdEmuDevice> *dev) {
+  std::unique_ptr<ZbdEmuDevice> emu(new ZbdEmuDevice());
+  std::istringstream opts(name.substr(strlen(ZENFS_EMU_PREFIX)));
+  std::string opt;
+  std::string file;
+  Header geometry;
+  struct stat st;
+
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.magic = ZENFS_EMU_MAGIC;
+  geometry.version = ZENFS_EMU_VERSION;
+  geometry.block_size = ZENFS_EMU_BLOCK_SIZE;
+  geometry.zone_size = (uint64_t)ZENFS_EMU_ZONE_MB * MB;
+  geometry.nr_zones = ZENFS_EMU_NR_ZONES;
+  geometry.max_open = ZENFS_EMU_MAX_OPEN;
+  geometry.max_active = ZENFS_EMU_MAX_ACTIVE;
+
+  while (std::getline(opts, opt, ',')) {
+    if (opt.empty()) continue;
+
+    size_t eq = opt.find('=');
+    if (eq == std::string::npos) return IOStatus::InvalidArgument("Malformed emulated device option: " + opt);
+
+    std::string key = opt.substr(0, eq);
+    std::string value = opt.substr(eq + 1);
+    if (key == "file") {
+      file = value;
+      continue;
+    }
+
+    char *end;
+    errno = 0;
+    uint64_t v = strtoull(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || errno)
+      return IOStatus::InvalidArgument("Invalid value of emulated device option " + key + ": " + value);
+
+    if (key == "zones") {
+      geometry.nr_zones = v;
+    } else if (key == "zone_mb") {
+      geometry.zone_size = v * MB;
+    } else if (key == "cap_mb") {
+      geometry.zone_capacity = v * MB;
+    } else if (key == "block") {
+      geometry.block_size = v;
+    } else if (key == "max_active") {
+      geometry.max_active = v;
+    } else if (key == "max_open") {
+      geometry.max_open = v;
+    } else if (key == "read_us") {
+      emu->latency_.read_us = v;
+    } else if (key == "write_us") {
+      emu->latency_.write_us = v;
+    } else if (key == "reset_us") {
+      emu->latency_.reset_us = v;
+    } else if (key == "finish_us") {
+      emu->latency_.finish_us = v;
+    } else {
+      return IOStatus::InvalidArgument("Unknown emulated device option: " + key);
+    }
+  }
+
+  if (file.empty()) return IOStatus::InvalidArgument("Emulated device needs a file=<path> option");
+  if (geometry.zone_capacity == 0) geometry.zone_capacity = geometry.zone_size;
+
+  emu->readonly_ = readonly;
+
+  std::string state_path = file + ".zones";
+  emu->state_f_ = open(state_path.c_str(), readonly ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  if (emu->state_f_ < 0) return IOStatus::IOError("Failed to open " + state_path + ": " + strerror(errno));
+
+  /* Exclusive writers, like the O_EXCL open of real devices */
+  if (!readonly && flock(emu->state_f_, LOCK_EX | LOCK_NB))
+    return IOStatus::IOError("Emulated device " + file + " is in use");
+
+  if (fstat(emu->state_f_, &st)) return IOStatus::IOError("Failed to stat " + state_path + ": " + strerror(errno));
+
+  bool create = st.st_size == 0;
+  if (create) {
+    if (readonly) return IOStatus::InvalidArgument("No emulated device at " + file);
+
+    uint32_t bs = geometry.block_size;
+    if (bs < 512 || (bs & (bs - 1)) || geometry.zone_size == 0 || geometry.zone_size % bs ||
+        geometry.zone_capacity > geometry.zone_size || geometry.zone_capacity % bs)
+      return IOStatus::InvalidArgument("Invalid emulated zone geometry");
+    if (geometry.nr_zones == 0 || geometry.max_active == 0 || geometry.max_open == 0 ||
+        geometry.max_open > geometry.max_active)
+      return IOStatus::InvalidArgument("Invalid emulated zone limits");
+
+    emu->state_sz_ = sizeof(Header) + (size_t)geometry.nr_zones * sizeof(ZoneState);
+    if (ftruncate(emu->state_f_, emu->state_sz_))
+      return IOStatus::IOError("Failed to size " + state_path + ": " + strerror(errno));
+  } else {
+    Header header;
+    if (pread(emu->state_f_, &header, sizeof(header), 0) != sizeof(header) || header.magic != ZENFS_EMU_MAGIC ||
+        header.version != ZENFS_EMU_VERSION)
+      return IOStatus::Corruption("Not an emulated device state file: " + state_path);
+
+    emu->state_sz_ = sizeof(Header) + (size_t)header.nr_zones * sizeof(ZoneState);
+    if ((size_t)st.st_size != emu->state_sz_) return IOStatus::Corruption("Truncated state file: " + state_path);
+  }
+
+  void *state = mmap(nullptr, emu->state_sz_, readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED,
+                     emu->state_f_, 0);
+  if (state == MAP_FAILED) return IOStatus::IOError("Failed to map " + state_path + ": " + strerror(errno));
+  emu->header_ = (Header *)state;
+  emu->zones_ = (ZoneState *)(emu->header_ + 1);
+
+  if (create) {
+    *emu->header_ = geometry;
+    for (uint32_t i = 0; i < geometry.nr_zones; i++) {
+      emu->zones_[i].wp = i * geometry.zone_size;
+      emu->zones_[i].cond = ZBD_ZONE_COND_EMPTY;
+    }
+  }
+
+  Header *header = emu->header_;
+  uint64_t dev_sz = (uint64_t)header->nr_zones * header->zone_size;
+
+  if (!readonly) {
+    int fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return IOStatus::IOError("Failed to open " + file + ": " + strerror(errno));
+    /* Sparse, reset zones are punched out again */
+    bool sized = fstat(fd, &st) == 0 && ((uint64_t)st.st_size >= dev_sz || ftruncate(fd, dev_sz) == 0);
+    close(fd);
+    if (!sized) return IOStatus::IOError("Failed to size " + file);
+  }
+
+  emu->read_f_ = open(file.c_str(), O_RDONLY);
+  emu->read_direct_f_ = OpenDirect(file, O_RDONLY);
+  emu->write_f_ = readonly ? -1 : OpenDirect(file, O_WRONLY);
+  if (emu->read_f_ < 0 || emu->read_direct_f_ < 0 || (!readonly && emu->write_f_ < 0))
+    return IOStatus::IOError("Failed to open " + file + ": " + strerror(errno));
+
+  for (uint32_t i = 0; i < header->nr_zones; i++) {
+    uint32_t cond = emu->zones_[i].cond;
+    if (IsOpen(cond)) emu->nr_open_++;
+    if (IsOpen(cond) || cond == ZBD_ZONE_COND_CLOSED) emu->nr_active_++;
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->nr_sectors = dev_sz >> 9;
+  info->lblock_size = header->block_size;
+  info->pblock_size = header->block_size;
+  info->zone_size = header->zone_size;
+  info->zone_sectors = header->zone_size >> 9;
+  info->nr_zones = header->nr_zones;
+  info->max_nr_open_zones = header->max_open;
+  info->max_nr_active_zones = header->max_active;
+  info->model = ZBD_DM_HOST_MANAGED;
+
+  *dev = std::move(emu);
+  return IOStatus::OK();
+}
+
+void ZbdEmuDevice::FillZone(uint32_t idx, struct zbd_zone *zone) {
+  ZoneState &z = zones_[idx];
+
+  memset(zone, 0, sizeof(*zone));
+  zone->start = idx * header_->zone_size;
+  zone->len = header_->zone_size;
+  zone->capacity = header_->zone_capacity;
+  zone->wp = z.cond == ZBD_ZONE_COND_FULL ? zone->start + zone->len : z.wp;
+  zone->type = ZBD_ZONE_TYPE_SWR;
+  zone->cond = z.cond;
+}
+
+int ZbdEmuDevice::ZoneRange(off_t ofst, off_t len, uint32_t *first, uint32_t *nr) {
+  uint64_t zone_sz = header_->zone_size;
+
+  if (ofst < 0 || len <= 0 || ofst % zone_sz || (uint64_t)ofst / zone_sz >= header_->nr_zones) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *first = ofst / zone_sz;
+  *nr = std::min<uint64_t>((len + zone_sz - 1) / zone_sz, header_->nr_zones - *first);
+  return 0;
+}
+
+int ZbdEmuDevice::ListZones(off_t ofst, off_t len, struct zbd_zone **zones, unsigned int *nr_zones) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint32_t first, nr;
+
+  if (ZoneRange(ofst, len, &first, &nr)) return -1;
+
+  *zones = (struct zbd_zone *)calloc(nr, sizeof(struct zbd_zone));
+  if (*zones == nullptr) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for (uint32_t i = 0; i < nr; i++) FillZone(first + i, &(*zones)[i]);
+  *nr_zones = nr;
+  return 0;
+}
+
+int ZbdEmuDevice::ReportZones(off_t ofst, off_t len, struct zbd_zone *zones, unsigned int *nr_zones) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint32_t first, nr;
+
+  if (ZoneRange(ofst, len, &first, &nr)) return -1;
+
+  nr = std::min(nr, *nr_zones);
+  for (uint32_t i = 0; i < nr; i++) FillZone(first + i, &zones[i]);
+  *nr_zones = nr;
+  return 0;
+}
+
+void ZbdEmuDevice::CloseZoneLocked(uint32_t idx) {
+  ZoneState &z = zones_[idx];
+
+  nr_open_--;
+  if (z.wp == idx * header_->zone_size) {
+    z.cond = ZBD_ZONE_COND_EMPTY;
+    nr_active_--;
+  } else {
+    z.cond = ZBD_ZONE_COND_CLOSED;
+  }
+}
+
+int ZbdEmuDevice::OpenZoneLocked(uint32_t idx) {
+  ZoneState &z = zones_[idx];
+
+  if (IsOpen(z.cond)) return 0;
+
+  if (z.cond == ZBD_ZONE_COND_EMPTY && nr_active_ >= header_->max_active) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (nr_open_ >= header_->max_open) {
+    uint32_t victim = header_->nr_zones;
+    for (uint32_t i = 0; i < header_->nr_zones; i++) {
+      if (zones_[i].cond == ZBD_ZONE_COND_IMP_OPEN) {
+        victim = i;
+        break;
+      }
+    }
+    if (victim == header_->nr_zones) {
+      errno = EBUSY;
+      return -1;
+    }
+    CloseZoneLocked(victim);
+  }
+
+  if (z.cond == ZBD_ZONE_COND_EMPTY) nr_active_++;
+  nr_open_++;
+  z.cond = ZBD_ZONE_COND_IMP_OPEN;
+  return 0;
+}
+
+int ZbdEmuDevice::ResetZones(off_t ofst, off_t len) {
+  uint32_t first, nr;
+
+  if (readonly_) {
+    errno = EBADF;
+    return -1;
+  }
+
+  EmuDelay(latency_.reset_us);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (ZoneRange(ofst, len, &first, &nr)) return -1;
+
+  for (uint32_t i = first; i < first + nr; i++) {
+    ZoneState &z = zones_[i];
+    uint64_t start = i * header_->zone_size;
+
+    if (z.cond == ZBD_ZONE_COND_OFFLINE || z.cond == ZBD_ZONE_COND_READONLY) {
+      errno = EIO;
+      return -1;
+    }
+
+    if (IsOpen(z.cond)) nr_open_--;
+    if (IsOpen(z.cond) || z.cond == ZBD_ZONE_COND_CLOSED) nr_active_--;
+    z.wp = start;
+    z.cond = ZBD_ZONE_COND_EMPTY;
+
+    /* Give the space back, reads of the zone return zeroes like on a device */
+    int ret = fallocate(write_f_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, header_->zone_size);
+    (void)ret;
+  }
+
+  return 0;
+}
+
+int ZbdEmuDevice::FinishZones(off_t ofst, off_t len) {
+  uint32_t first, nr;
+
+  if (readonly_) {
+    errno = EBADF;
+    return -1;
+  }
+
+  EmuDelay(latency_.finish_us);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (ZoneRange(ofst, len, &first, &nr)) return -1;
+
+  for (uint32_t i = first; i < first + nr; i++) {
+    ZoneState &z = zones_[i];
+
+    if (z.cond == ZBD_ZONE_COND_OFFLINE || z.cond == ZBD_ZONE_COND_READONLY) {
+      errno = EIO;
+      return -1;
+    }
+
+    if (IsOpen(z.cond)) nr_open_--;
+    if (IsOpen(z.cond) || z.cond == ZBD_ZONE_COND_CLOSED) nr_active_--;
+    z.wp = (i + 1) * header_->zone_size;
+    z.cond = ZBD_ZONE_COND_FULL;
+  }
+
+  return 0;
+}
+
+int ZbdEmuDevice::CloseZones(off_t ofst, off_t len) {
+  uint32_t first, nr;
+
+  if (readonly_) {
+    errno = EBADF;
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (ZoneRange(ofst, len, &first, &nr)) return -1;
+
+  for (uint32_t i = first; i < first + nr; i++) {
+    if (IsOpen(zones_[i].cond)) CloseZoneLocked(i);
+  }
+
+  return 0;
+}
+
+int ZbdEmuDevice::StartWrite(uint64_t pos, size_t size) {
+  if (readonly_) {
+    errno = EBADF;
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint64_t idx = pos / header_->zone_size;
+
+  if (idx >= header_->nr_zones) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ZoneState &z = zones_[idx];
+  uint64_t end = idx * header_->zone_size + header_->zone_capacity;
+
+  if (z.cond == ZBD_ZONE_COND_FULL || z.cond == ZBD_ZONE_COND_OFFLINE || z.cond == ZBD_ZONE_COND_READONLY ||
+      pos != z.wp || pos + size > end) {
+    errno = EIO;
+    return -1;
+  }
+
+  return OpenZoneLocked(idx);
+}
+
+void ZbdEmuDevice::CompleteWrite(uint64_t pos, size_t size) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  uint64_t idx = pos / header_->zone_size;
+  ZoneState &z = zones_[idx];
+
+  z.wp += size;
+  if (z.wp >= idx * header_->zone_size + header_->zone_capacity) {
+    if (IsOpen(z.cond)) {
+      nr_open_--;
+      nr_active_--;
+    }
+    z.cond = ZBD_ZONE_COND_FULL;
+  }
+}
+
+/* Writes are checked and accounted at submission, and complete write_us
+ * after the previous one */
+class EmuWriteQueue : public ZoneWriteQueue {
+  ZbdEmuDevice *dev_;
+  std::unique_ptr<ZoneWriteQueue> queue_;
+  std::chrono::steady_clock::time_point done_;
+
+  void WaitDone() { std::this_thread::sleep_until(done_); }
+
+ public:
+  EmuWriteQueue(ZbdEmuDevice *dev, ZoneWriteQueue *queue) : dev_(dev), queue_(queue) {}
+
+  IOStatus Submit(const char *data, uint32_t size, uint64_t pos, uint64_t *seq) override {
+    if (dev_->StartWrite(pos, size))
+      return IOStatus::IOError("Emulated zone write failed: " + std::string(strerror(errno)));
+
+    IOStatus s = queue_->Submit(data, size, pos, seq);
+    if (!s.ok()) return s;
+
+    dev_->CompleteWrite(pos, size);
+    done_ = std::max(done_, std::chrono::steady_clock::now()) + std::chrono::microseconds(dev_->GetLatency().write_us);
+    return s;
+  }
+
+  IOStatus SyncTo(uint64_t seq) override {
+    IOStatus s = queue_->SyncTo(seq);
+    WaitDone();
+    return s;
+  }
+
+  IOStatus Sync() override {
+    IOStatus s = queue_->Sync();
+    WaitDone();
+    return s;
+  }
+};
+
+ssize_t ZbdEmuIOEngine::Read(char *buf, size_t size, uint64_t pos, bool direct) {
+  EmuDelay(dev_->GetLatency().read_us);
+  return engine_->Read(buf, size, pos, direct);
+}
+
+ssize_t ZbdEmuIOEngine::Write(const char *buf, size_t size, uint64_t pos) {
+  if (dev_->StartWrite(pos, size)) return -1;
+
+  EmuDelay(dev_->GetLatency().write_us);
+  ssize_t ret = engine_->Write(buf, size, pos);
+  if (ret > 0) dev_->CompleteWrite(pos, ret);
+  return ret;
+}
+
+void ZbdEmuIOEngine::ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) {
+  if (nr_reqs) EmuDelay(dev_->GetLatency().read_us);
+  engine_->ReadBatch(reqs, nr_reqs);
+}
+
+ZoneWriteQueue *ZbdEmuIOEngine::NewWriteQueue(uint64_t zone_start) {
+  return new EmuWriteQueue(dev_, engine_->NewWriteQueue(zone_start));
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
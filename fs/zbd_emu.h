@@ -0,0 +1,161 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved.
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
+
+#include <libzbd/zbd.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "io_engine.h"
+#include "rocksdb/io_status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Device names starting with this select an emulated zoned device */
+#define ZENFS_EMU_PREFIX "emu,"
+
+/* Defaults of the emulated device geometry and limits */
+#define ZENFS_EMU_NR_ZONES (64)
+#define ZENFS_EMU_ZONE_MB (64)
+#define ZENFS_EMU_BLOCK_SIZE (4096)
+#define ZENFS_EMU_MAX_ACTIVE (14)
+#define ZENFS_EMU_MAX_OPEN (14)
+
+/* Latency added to each operation on an emulated device, in microseconds */
+struct ZbdEmuLatency {
+  uint32_t read_us = 0;
+  uint32_t write_us = 0;
+  uint32_t reset_us = 0;
+  uint32_t finish_us = 0;
+};
+
+/* A host managed zoned device emulated over a regular file, e.g. one on
+ * tmpfs to emulate it in memory. The device is named
+ *
+ *   emu,file=<path>[,zones=N][,zone_mb=N][,cap_mb=N][,block=N]
+ *      [,max_active=N][,max_open=N][,read_us=N][,write_us=N][,reset_us=N]
+ *      [,finish_us=N]
+ *
+ * Zone data is stored in the file at its device offset. The zone state is
+ * kept in <path>.zones, mapped shared so that it persists across opens and
+ * is seen live by read only opens, like a real device would report it. The
+ * geometry and limits are fixed when the state file is created, latencies
+ * apply to the open they are given to.
+ *
+ * Writes must be at the write pointer and within the zone capacity, and
+ * implicitly open the zone, within the open and active zone limits. As on
+ * ZNS devices, an implicitly opened zone is closed to make room for another
+ * one when the open limit is reached. Violations fail with EIO, or EBUSY for
+ * the limits. */
+class ZbdEmuDevice {
+  /* Layout of the state file */
+  struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t zone_size;
+    uint64_t zone_capacity;
+    uint32_t nr_zones;
+    uint32_t max_open;
+    uint32_t max_active;
+    uint32_t reserved;
+  };
+  struct ZoneState {
+    uint64_t wp;
+    uint32_t cond;
+    uint32_t reserved;
+  };
+
+  std::mutex mtx_;
+  Header *header_ = nullptr;
+  ZoneState *zones_ = nullptr;
+  size_t state_sz_ = 0;
+  int state_f_ = -1;
+  bool readonly_ = true;
+  uint32_t nr_open_ = 0;
+  uint32_t nr_active_ = 0;
+  ZbdEmuLatency latency_;
+
+  int read_f_ = -1;
+  int read_direct_f_ = -1;
+  int write_f_ = -1;
+
+  ZbdEmuDevice() {}
+
+  void FillZone(uint32_t idx, struct zbd_zone *zone);
+  /* Implicitly open a zone for writing, closing another one if needed */
+  int OpenZoneLocked(uint32_t idx);
+  void CloseZoneLocked(uint32_t idx);
+  /* Validate a zone range, returning its first zone and number of zones */
+  int ZoneRange(off_t ofst, off_t len, uint32_t *first, uint32_t *nr);
+
+ public:
+  ~ZbdEmuDevice();
+
+  static bool IsEmulated(const std::string &name) {
+    return name.compare(0, strlen(ZENFS_EMU_PREFIX), ZENFS_EMU_PREFIX) == 0;
+  }
+  static IOStatus Open(const std::string &name, bool readonly, struct zbd_info *info,
+                       std::unique_ptr<ZbdEmuDevice> *dev);
+
+  /* Owned by the emulated device, write_f is -1 if opened read only */
+  int GetReadFd() { return read_f_; }
+  int GetReadDirectFd() { return read_direct_f_; }
+  int GetWriteFd() { return write_f_; }
+  const ZbdEmuLatency &GetLatency() { return latency_; }
+
+  /* Zone management, following the semantics of their libzbd counterparts */
+  int ListZones(off_t ofst, off_t len, struct zbd_zone **zones, unsigned int *nr_zones);
+  int ReportZones(off_t ofst, off_t len, struct zbd_zone *zones, unsigned int *nr_zones);
+  int ResetZones(off_t ofst, off_t len);
+  int FinishZones(off_t ofst, off_t len);
+  int CloseZones(off_t ofst, off_t len);
+
+  /* Check that a write of size bytes may be issued at pos, opening the zone
+   * if needed. Returns 0, or -1 with errno set. */
+  int StartWrite(uint64_t pos, size_t size);
+  /* Account size bytes written at pos */
+  void CompleteWrite(uint64_t pos, size_t size);
+};
+
+/* Enforces the zone semantics of an emulated device on the writes of the
+ * engine doing the I/O, and adds the latencies of the device. Writes queued
+ * to a zone complete write_us after their submission, one after the other;
+ * reads of a batch are issued together and take read_us in total. */
+class ZbdEmuIOEngine : public ZbdIOEngine {
+  ZbdEmuDevice *dev_;
+  std::unique_ptr<ZbdIOEngine> engine_;
+
+ public:
+  ZbdEmuIOEngine(ZbdEmuDevice *dev, std::unique_ptr<ZbdIOEngine> &&engine) : dev_(dev), engine_(std::move(engine)) {}
+
+  const char *Name() override { return engine_->Name(); }
+  IOStatus Open(int read_f, int read_direct_f, int write_f) override {
+    return engine_->Open(read_f, read_direct_f, write_f);
+  }
+
+  ssize_t Read(char *buf, size_t size, uint64_t pos, bool direct) override;
+  ssize_t Write(const char *buf, size_t size, uint64_t pos) override;
+  void ReadBatch(ZbdReadRequest *reqs, size_t nr_reqs) override;
+
+  ZoneWriteQueue *NewWriteQueue(uint64_t zone_start) override;
+
+  void RegisterBuffer(void *buf, size_t size) override { engine_->RegisterBuffer(buf, size); }
+  void UnregisterBuffer(void *buf) override { engine_->UnregisterBuffer(buf); }
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && defined(OS_LINUX)
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <algorithm>
 #include <ctime>
 #include <iostream>
 #include <map>
@@ -36,9 +37,6 @@
 #define KB (1024)
 #define MB (1024 * KB)
 
-#define ZENFS_DEBUG
-#include "utils.h"
-
 /* Number of reserved zones for op log
  * Two non-offline op log zones are needed to be able
  * to roll the log safely. One extra
@@ -53,28 +51,101 @@
 /* Minimum of number of zones that makes sense */
 #define ZENFS_MIN_ZONES (32)
 
+/* Max amount of released write buffers kept for reuse */
+#define ZENFS_WRITE_BUFFER_POOL_SIZE (256 * MB)
+
+/* Threads of the background worker running zone resets, finishes, meta
+ * zone rolls and garbage collection */
+#define ZENFS_BG_WORKER_THREADS (4)
+
+/* Number of zones kept ready for WALs */
+#define ZENFS_WAL_ZONES (2)
+
+/* Files joining a shared zone of matching lifetime while zone resources are
+ * left to open a new one */
+#define ZENFS_MAX_ZONE_SHARERS (4)
+
+/* Active zone use, in percent of the active zone limit, above which closed
+ * partially written zones are finished in the background, and the level
+ * that brings it back down to */
+#define ZENFS_FINISH_PRESSURE_HIGH (80)
+#define ZENFS_FINISH_PRESSURE_LOW (60)
+
+/* The finish policy never gives up more than this percentage of a zone */
+#define ZENFS_FINISH_MAX_WASTE (50)
+
+/* Zone allocations waiting longer than this on average make the finish
+ * policy more aggressive */
+#define ZENFS_FINISH_SLOW_ALLOC_NS (1000 * 1000)
+
+/* Soft limit on write buffer memory in use by all writable files */
+#define ZENFS_WRITE_BUFFER_BUDGET (512 * MB)
+
 namespace ROCKSDB_NAMESPACE {
 
-Zone::Zone(ZonedBlockDevice *zbd, struct zbd_zone *z)
+Zone::Zone(ZonedBlockDevice *zbd, ZbdDevice *dev, struct zbd_zone *z)
     : zbd_(zbd),
-      start_(zbd_zone_start(z)),
+      dev_(dev),
+      start_(dev->start + zbd_zone_start(z)),
       max_capacity_(zbd_zone_capacity(z)),
-      wp_(zbd_zone_wp(z)),
+      wp_(dev->start + zbd_zone_wp(z)),
       open_for_write_(false) {
   lifetime_ = Env::WLTH_NOT_SET;
+  last_write_time_ = time(NULL);
   used_capacity_ = 0;
   capacity_ = 0;
   if (!(zbd_zone_full(z) || zbd_zone_offline(z) || zbd_zone_rdonly(z)))
     capacity_ = zbd_zone_capacity(z) - (zbd_zone_wp(z) - zbd_zone_start(z));
+}
 
-  memset(&wr_ctx.io_ctx, 0, sizeof(wr_ctx.io_ctx));
-  wr_ctx.fd = zbd_->GetWriteFD();
-  wr_ctx.iocbs[0] = &wr_ctx.iocb;
-  wr_ctx.inflight = 0;
+void Zone::StartSpaceAccounting() {
+  accounted_ = true;
+  AccountSpace(max_capacity_, capacity_, wp_ - start_);
+  AddUsedCapacity(0);
+}
+
+/* Apply changes of the max capacity, capacity left and written bytes */
+void Zone::AccountSpace(int64_t total, int64_t free, int64_t written) {
+  if (!accounted_) return;
+
+  ZoneSpaceStats *stats = zbd_->GetSpaceStats();
+  stats->total += total;
+  stats->free += free;
+  stats->written += written;
+  UpdateSpaceClass();
+}
+
+void Zone::AddUsedCapacity(long delta) {
+  used_capacity_ += delta;
+  if (!accounted_) return;
+
+  zbd_->GetSpaceStats()->used += delta;
+  UpdateSpaceClass();
+}
+
+int Zone::GetGarbageBucket() {
+  if (IsEmpty()) return 0;
+
+  double garbage_rate = double((int64_t)(wp_ - start_) - used_capacity_) / max_capacity_;
+  int bucket = int((garbage_rate + 0.1) * 10);
+  return std::max(1, std::min(bucket, ZENFS_GARBAGE_BUCKETS - 1));
+}
 
-  if (io_setup(1, &wr_ctx.io_ctx) < 0) {
-    fprintf(stderr, "Failed to allocate io context\n");
+/* Move the zone to its current garbage bucket and resetable state. Racing
+ * updates may leave a zone in a stale class until its next change, the
+ * counts always add up. */
+void Zone::UpdateSpaceClass() {
+  ZoneSpaceStats *stats = zbd_->GetSpaceStats();
+  int bucket = GetGarbageBucket();
+  bool resetable = IsFull() && used_capacity_ == 0;
+
+  int old_bucket = garbage_bucket_.exchange(bucket);
+  if (old_bucket != bucket) {
+    if (old_bucket >= 0) stats->garbage_hist[old_bucket]--;
+    stats->garbage_hist[bucket]++;
   }
+
+  if (resetable_.exchange(resetable) != resetable) stats->resetable_zones += resetable ? 1 : -1;
 }
 
 bool Zone::IsUsed() { return (used_capacity_ > 0) || open_for_write_; }
@@ -87,13 +158,21 @@ void Zone::CloseWR() {
   assert(open_for_write_);
   Sync();
 
-  std::lock_guard<std::mutex> lock(zbd_->zone_resources_mtx_);
-  if (Close().ok()) {
-    assert(!open_for_write_);
-    zbd_->NotifyIOZoneClosed();
+  {
+    std::lock_guard<std::mutex> lock(zbd_->zone_resources_mtx_);
+    if (Close().ok()) {
+      assert(!open_for_write_);
+      zbd_->NotifyIOZoneClosed();
+    }
+
+    // A zone that was never written does not hold an active zone resource either
+    if (capacity_ == 0 || IsEmpty()) {
+      dev_->active_zones--;
+      zbd_->NotifyIOZoneFull();
+    }
   }
 
-  if (capacity_ == 0) zbd_->NotifyIOZoneFull();
+  zbd_->ReturnZone(this);
 }
 
 void Zone::EncodeJson(std::ostream &json_stream) {
@@ -115,51 +194,72 @@ IOStatus Zone::Reset() {
 
   assert(!IsUsed());
 
-  ret = zbd_reset_zones(zbd_->GetWriteFD(), start_, zone_sz);
+  ZenFSTraceSpan span(zbd_->GetTracer(), kTraceZoneReset, start_);
+  if (dev_->emu)
+    ret = dev_->emu->ResetZones(start_ - dev_->start, zone_sz);
+  else
+    ret = zbd_reset_zones(dev_->write_f, start_ - dev_->start, zone_sz);
   if (ret) return IOStatus::IOError("Zone reset failed\n");
 
-  ret = zbd_report_zones(zbd_->GetReadFD(), start_, zone_sz, ZBD_RO_ALL, &z, &report);
+  if (dev_->emu)
+    ret = dev_->emu->ReportZones(start_ - dev_->start, zone_sz, &z, &report);
+  else
+    ret = zbd_report_zones(dev_->read_f, start_ - dev_->start, zone_sz, ZBD_RO_ALL, &z, &report);
 
   if (ret || (report != 1)) {
 	return IOStatus::IOError("Zone report failed\n");
   }
 
+  uint64_t old_max_capacity = max_capacity_;
+  uint64_t old_capacity = capacity_;
+  uint64_t old_written = wp_ - start_;
+
   if (zbd_zone_offline(&z))
     capacity_ = 0;
   else
     max_capacity_ = capacity_ = zbd_zone_capacity(&z);
 
   wp_ = start_;
+  AccountSpace((int64_t)(max_capacity_ - old_max_capacity), (int64_t)(capacity_ - old_capacity), -(int64_t)old_written);
   lifetime_ = Env::WLTH_NOT_SET;
+  last_write_time_ = time(NULL);
 
   return IOStatus::OK();
 }
 
 IOStatus Zone::Finish() {
   size_t zone_sz = zbd_->GetZoneSize();
-  int fd = zbd_->GetWriteFD();
   int ret;
 
   assert(!open_for_write_);
 
-  ret = zbd_finish_zones(fd, start_, zone_sz);
+  if (dev_->emu)
+    ret = dev_->emu->FinishZones(start_ - dev_->start, zone_sz);
+  else
+    ret = zbd_finish_zones(dev_->write_f, start_ - dev_->start, zone_sz);
   if (ret) return IOStatus::IOError("Zone finish failed\n");
 
+  uint64_t old_capacity = capacity_;
+  uint64_t old_wp = wp_;
+
   capacity_ = 0;
   wp_ = start_ + zone_sz;
+  AccountSpace(0, -(int64_t)old_capacity, wp_ - old_wp);
 
   return IOStatus::OK();
 }
 
 IOStatus Zone::Close() {
   size_t zone_sz = zbd_->GetZoneSize();
-  int fd = zbd_->GetWriteFD();
   int ret;
 
   // assert(open_for_write_);
 
   if (!(IsEmpty() || IsFull())) {
-    ret = zbd_close_zones(fd, start_, zone_sz);
+    if (dev_->emu)
+      ret = dev_->emu->CloseZones(start_ - dev_->start, zone_sz);
+    else
+      ret = zbd_close_zones(dev_->write_f, start_ - dev_->start, zone_sz);
     if (ret) return IOStatus::IOError("Zone close failed\n");
   }
 
@@ -172,8 +272,8 @@ IOStatus Zone::Append(char *data, uint32_t size) {
   char *ptr = data;
   uint32_t left = size;
   int step = 128 << 10; // 128KB per write
-  int fd = zbd_->GetWriteFD();
-  int ret;
+  ZbdIOEngine *engine = zbd_->GetIOEngine();
+  ssize_t ret;
   IOStatus s;
 
   if (capacity_ < size) return IOStatus::NoSpace("Not enough capacity for append");
@@ -185,7 +285,7 @@ IOStatus Zone::Append(char *data, uint32_t size) {
   if (!s.ok()) return s;
 
   while (left) {
-	ret = pwrite(fd, ptr, left, wp_);
+	ret = engine->Write(ptr, left, wp_);
 	/*
 	if(left > step) {
 	  ret = pwrite(fd, ptr, step, wp_);
@@ -202,79 +302,62 @@ IOStatus Zone::Append(char *data, uint32_t size) {
     wp_ += ret;
     capacity_ -= ret;
     left -= ret;
+    AccountSpace(0, -ret, ret);
   }
 
+  last_write_time_ = time(NULL);
   return IOStatus::OK();
 }
 
 IOStatus Zone::Sync() {
-  struct io_event events[1];
-  struct timespec timeout;
-  int ret;
-  timeout.tv_sec = 1;
-  timeout.tv_nsec = 0;
-
-  if (wr_ctx.inflight == 0) return IOStatus::OK();
-
-  ret = io_getevents(wr_ctx.io_ctx, 1, 1, events, &timeout);
-  if (ret != 1) {
-    fprintf(stderr, "Failed to complete io - timeout ret: %d\n", ret);
-    return IOStatus::IOError("Failed to complete io - timeout?");
-  }
-
-  ret = events[0].res;
-  if (ret != (int)(wr_ctx.iocb.u.c.nbytes)) {
-    if (ret >= 0) {
-      /* TODO: we need to handle this case and keep on submittin' until we're done*/
-      fprintf(stderr, "failed to complete io - short write\n");
-      return IOStatus::IOError("Failed to complete io - short write");
-    } else {
-      return IOStatus::IOError("Failed to complete io - io error");
-    }
-  }
-
-  wr_ctx.inflight = 0;
+  if (!wr_queue_) return IOStatus::OK();
+  return wr_queue_->Sync();
+}
 
-  return IOStatus::OK();
+IOStatus Zone::SyncTo(uint64_t seq) {
+  if (!wr_queue_) return IOStatus::OK();
+  return wr_queue_->SyncTo(seq);
 }
 
-IOStatus Zone::Append_async(char *data, uint32_t size) {
-  char *ptr = data;
-  uint32_t left = size;
-  int ret;
+IOStatus Zone::Append_async(char *data, uint32_t size, uint64_t *seq) {
   IOStatus s;
 
   assert((size % zbd_->GetBlockSize()) == 0);
 
-  /* Make sure we don't have any outstanding writes */
-  s = Sync();
-  if (!s.ok()) return s;
-
   if (capacity_ < size) return IOStatus::NoSpace("Not enough capacity for append");
 
-  io_prep_pwrite(&wr_ctx.iocb, wr_ctx.fd, data, size, wp_);
+  if (!wr_queue_) wr_queue_.reset(zbd_->GetIOEngine()->NewWriteQueue(start_));
 
-  ret = io_submit(wr_ctx.io_ctx, 1, wr_ctx.iocbs);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to submit io\n");
-    return IOStatus::IOError("Failed to submit io");
-  }
+  s = wr_queue_->Submit(data, size, wp_, seq);
+  if (!s.ok()) return s;
 
-  wr_ctx.inflight = size;
-  ptr += size;
+  last_write_time_ = time(NULL);
   wp_ += size;
   capacity_ -= size;
-  left -= size;
+  AccountSpace(0, -(int64_t)size, size);
 
   return IOStatus::OK();
 }
 
+/* Writers of a shared zone do not know where their data ends up until they
+ * hold the append lock, like with the zone append command of NVMe ZNS */
+IOStatus Zone::AppendShared(char *data, uint32_t size, uint64_t *offset, uint32_t *written) {
+  std::lock_guard<std::mutex> lock(append_mtx_);
+  uint32_t wr_size = std::min((uint64_t)size, capacity_);
+
+  *offset = wp_;
+  *written = wr_size;
+  if (wr_size == 0) return IOStatus::OK();
+  return Append(data, wr_size);
+}
+
 ZoneExtent::ZoneExtent(uint64_t start, uint32_t length, Zone *zone) : start_(start), length_(length), zone_(zone) {}
 
 Zone *ZonedBlockDevice::GetIOZone(uint64_t offset) {
-  for (const auto z : io_zones_)
-    if (z->start_ <= offset && offset < (z->start_ + zone_sz_)) return z;
-  return nullptr;
+  uint64_t zone_nr = offset / zone_sz_;
+
+  if (zone_nr >= io_zone_index_.size()) return nullptr;
+  return io_zone_index_[zone_nr];
 }
 
 std::vector<ZoneStat> ZonedBlockDevice::GetStat() {
@@ -289,15 +372,23 @@ std::vector<ZoneStat> ZonedBlockDevice::GetStat() {
   return stat;
 }
 
-BackgroundWorker::BackgroundWorker(bool run_at_beginning) {
+BackgroundWorker::BackgroundWorker(bool run_at_beginning, int nr_threads) {
   {
     std::unique_lock<std::mutex> lk(job_mtx_);
     if (run_at_beginning) {
       Run();
+    } else {
+      Wait();
+    }
+    for (int i = 0; i < kNrJobClasses; i++) {
+      running_[i] = 0;
+      max_running_[i] = nr_threads;
     }
   }
 
-  worker_ = std::thread(&BackgroundWorker::ProcessJobs, this);
+  for (int i = 0; i < nr_threads; i++) {
+    workers_.emplace_back(&BackgroundWorker::ProcessJobs, this);
+  }
 }
 
 BackgroundWorker::~BackgroundWorker() {
@@ -307,9 +398,13 @@ BackgroundWorker::~BackgroundWorker() {
     job_cv_.notify_all();
   }
 
-  worker_.join();
-  for (auto &job : jobs_) {
-    (*job)();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  for (auto &jobs : jobs_) {
+    for (auto &queued : jobs) {
+      (*queued.job)();
+    }
   }
 }
 
@@ -319,38 +414,89 @@ void BackgroundWorker::Run() { state_ = kRunning; }
 
 void BackgroundWorker::Terminate() { state_ = kTerminated; }
 
+void BackgroundWorker::SetConcurrency(BackgroundJobClass job_class, int max_running) {
+  std::unique_lock<std::mutex> lk(job_mtx_);
+  max_running_[job_class] = std::max(max_running, 1);
+  job_cv_.notify_all();
+}
+
+void BackgroundWorker::SetMetrics(HistReporterHandle *wait_reporter, HistReporterHandle *queue_depth_reporter) {
+  std::unique_lock<std::mutex> lk(job_mtx_);
+  wait_reporter_ = wait_reporter;
+  queue_depth_reporter_ = queue_depth_reporter;
+}
+
+int BackgroundWorker::NextJobClass() {
+  for (int i = 0; i < kNrJobClasses; i++) {
+    if (!jobs_[i].empty() && running_[i] < max_running_[i]) return i;
+  }
+  return -1;
+}
+
 void BackgroundWorker::ProcessJobs() {
   while (true) {
+    std::unique_ptr<BackgroundJob> job;
+    int job_class;
     {
       std::unique_lock<std::mutex> lk(job_mtx_);
-      job_cv_.wait(lk, [this]() { return !jobs_.empty() || state_ == kTerminated; });
+      job_cv_.wait(lk, [&]() {
+        job_class = NextJobClass();
+        return job_class >= 0 || state_ == kTerminated;
+      });
       if (state_ == kTerminated) {
         return;
       }
-      job_now_.swap(jobs_.front());
-      jobs_.pop_front();
+      QueuedJob &front = jobs_[job_class].front();
+      if (wait_reporter_) {
+        auto wait = std::chrono::steady_clock::now() - front.submit_time;
+        wait_reporter_->AddRecord(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+      }
+      job = std::move(front.job);
+      jobs_[job_class].pop_front();
+      nr_queued_--;
+      running_[job_class]++;
+    }
+
+    (*job)();
+
+    {
+      std::unique_lock<std::mutex> lk(job_mtx_);
+      running_[job_class]--;
+      /* A job of this class may have been held back by the limit */
+      if (!jobs_[job_class].empty()) job_cv_.notify_one();
     }
-    (*job_now_)();
   }
 }
 
-void BackgroundWorker::SubmitJob(std::function<void()> fn) {
-  std::unique_lock<std::mutex> lk(job_mtx_);
-  jobs_.push_back(std::make_unique<SimpleJob>(fn));
-  job_cv_.notify_one();
+void BackgroundWorker::SubmitJob(std::function<void()> fn, BackgroundJobClass job_class) {
+  SubmitJob(std::make_unique<SimpleJob>(fn), job_class);
 }
 
-void BackgroundWorker::SubmitJob(std::unique_ptr<BackgroundJob> &&job) {
+void BackgroundWorker::SubmitJob(std::unique_ptr<BackgroundJob> &&job, BackgroundJobClass job_class) {
   std::unique_lock<std::mutex> lk(job_mtx_);
-  jobs_.push_back(std::move(job));
+  jobs_[job_class].push_back({std::move(job), std::chrono::steady_clock::now()});
+  nr_queued_++;
+  if (queue_depth_reporter_) queue_depth_reporter_->AddRecord(nr_queued_);
   job_cv_.notify_one();
 }
 
 // ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger> logger)
 //    : ZonedBlockDevice(bdevname, logger, "", std::make_shared<ByteDanceMetricsReporterFactory>()) {}
 
-ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger> logger)
-    : filename_("/dev/" + bdevname), logger_(logger) {
+ZonedBlockDevice::ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger> logger) : logger_(logger) {
+  std::istringstream names(bdevname);
+  std::string name;
+
+  while (std::getline(names, name, ':')) {
+    if (name.empty()) continue;
+    ZbdDevice *dev = new ZbdDevice();
+    dev->filename = ZbdEmuDevice::IsEmulated(name) ? name : "/dev/" + name;
+    devices_.emplace_back(dev);
+
+    if (!filename_.empty()) filename_ += ":";
+    filename_ += dev->filename;
+  }
+
   Info(logger_, "New Zoned Block Device: %s (with metrics enabled)", filename_.c_str());
 }
 
@@ -361,140 +507,229 @@ std::string ZonedBlockDevice::ErrorToString(int err) {
 }
 
 IOStatus ZonedBlockDevice::CheckScheduler() {
-  std::ostringstream path;
-  std::string s = filename_;
-  std::fstream f;
+  for (const auto &dev : devices_) {
+    std::ostringstream path;
+    std::string s = dev->filename;
+    std::fstream f;
+
+    if (dev->emu) continue;
+
+    s.erase(0, 5);  // Remove "/dev/" from /dev/nvmeXnY
+    path << "/sys/block/" << s << "/queue/scheduler";
+    f.open(path.str(), std::fstream::in);
+    if (!f.is_open()) {
+      return IOStatus::InvalidArgument("Failed to open " + path.str());
+    }
 
-  s.erase(0, 5);  // Remove "/dev/" from /dev/nvmeXnY
-  path << "/sys/block/" << s << "/queue/scheduler";
-  f.open(path.str(), std::fstream::in);
-  if (!f.is_open()) {
-    return IOStatus::InvalidArgument("Failed to open " + path.str());
-  }
+    std::string buf;
+    getline(f, buf);
+    if (buf.find("[mq-deadline]") == std::string::npos) {
+      f.close();
+      return IOStatus::InvalidArgument("Current ZBD scheduler of " + dev->filename +
+                                       " is not mq-deadline, set it to mq-deadline.");
+    }
 
-  std::string buf;
-  getline(f, buf);
-  if (buf.find("[mq-deadline]") == std::string::npos) {
     f.close();
-    return IOStatus::InvalidArgument("Current ZBD scheduler is not mq-deadline, set it to mq-deadline.");
   }
 
-  f.close();
   return IOStatus::OK();
 }
 
-IOStatus ZonedBlockDevice::Open(bool readonly) {
-  struct zbd_zone *zone_rep;
-  unsigned int reported_zones;
-  uint64_t addr_space_sz;
-  zbd_info info;
-  Status s;
-  uint64_t i = 0;
-  uint64_t m = 0;
-  int ret;
+IOStatus ZonedBlockDevice::OpenDevice(ZbdDevice *dev, bool readonly, zbd_info *info) {
+  if (ZbdEmuDevice::IsEmulated(dev->filename)) {
+    IOStatus s = ZbdEmuDevice::Open(dev->filename, readonly, info, &dev->emu);
+    if (!s.ok()) return s;
 
-  read_f_ = zbd_open(filename_.c_str(), O_RDONLY, &info);
-  if (read_f_ < 0) {
+    dev->read_f = dev->emu->GetReadFd();
+    dev->read_direct_f = dev->emu->GetReadDirectFd();
+    dev->write_f = dev->emu->GetWriteFd();
+    return IOStatus::OK();
+  }
+
+  dev->read_f = zbd_open(dev->filename.c_str(), O_RDONLY, info);
+  if (dev->read_f < 0) {
     return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
   }
 
-  read_direct_f_ = zbd_open(filename_.c_str(), O_RDONLY | O_DIRECT, &info);
-  if (read_direct_f_ < 0) {
+  dev->read_direct_f = zbd_open(dev->filename.c_str(), O_RDONLY | O_DIRECT, info);
+  if (dev->read_direct_f < 0) {
     return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
   }
 
   if (readonly) {
-    write_f_ = -1;
+    dev->write_f = -1;
   } else {
-    write_f_ = zbd_open(filename_.c_str(), O_WRONLY | O_DIRECT | O_EXCL, &info);
-    if (write_f_ < 0) {
+    dev->write_f = zbd_open(dev->filename.c_str(), O_WRONLY | O_DIRECT | O_EXCL, info);
+    if (dev->write_f < 0) {
       return IOStatus::InvalidArgument("Failed to open zoned block device: " + ErrorToString(errno));
     }
   }
 
-  if (info.model != ZBD_DM_HOST_MANAGED) {
+  if (info->model != ZBD_DM_HOST_MANAGED) {
     return IOStatus::NotSupported("Not a host managed block device");
   }
 
-  if (info.nr_zones < ZENFS_MIN_ZONES) {
-    return IOStatus::NotSupported("To few zones on zoned block device (32 required)");
-  }
+  return IOStatus::OK();
+}
 
-  IOStatus ios = CheckScheduler();
-  if (ios != IOStatus::OK()) return ios;
+IOStatus ZonedBlockDevice::Open(bool readonly, const std::string &io_engine) {
+  struct zbd_zone *zone_rep;
+  unsigned int reported_zones;
+  uint64_t start = 0;
+  Status s;
+  IOStatus ios;
+  int ret;
+
+  if (devices_.empty()) return IOStatus::InvalidArgument("No zoned block device given");
 
-  block_sz_ = info.pblock_size;
-  zone_sz_ = info.zone_size;
-  nr_zones_ = info.nr_zones;
+  nr_zones_ = 0;
+  max_nr_active_io_zones_ = 0;
 
-  /* We need 3 open zones for meta data writes , the rest can be used for files
-   */
-  max_nr_active_io_zones_ = info.max_nr_active_zones - 3;
-  max_nr_open_io_zones_ = info.max_nr_active_zones - 3;
+  for (const auto &dev : devices_) {
+    zbd_info info;
 
-  Info(logger_, "Zone block device nr zones: %u max active: %u max open: %u \n", info.nr_zones,
-       info.max_nr_active_zones, info.max_nr_open_zones);
+    ios = OpenDevice(dev.get(), readonly, &info);
+    if (!ios.ok()) return ios;
 
-  addr_space_sz = (uint64_t)nr_zones_ * zone_sz_;
+    if (dev == devices_.front()) {
+      block_sz_ = info.pblock_size;
+      zone_sz_ = info.zone_size;
+    } else if (info.pblock_size != block_sz_ || info.zone_size != zone_sz_) {
+      return IOStatus::NotSupported("Zone or block size of " + dev->filename + " differs from " +
+                                    devices_.front()->filename);
+    }
 
-  ret = zbd_list_zones(read_f_, 0, addr_space_sz, ZBD_RO_ALL, &zone_rep, &reported_zones);
+    dev->start = start;
+    dev->nr_zones = info.nr_zones;
+    /* We need 3 open zones for meta data writes on the first device, the
+     * rest can be used for files */
+    dev->max_active_zones = info.max_nr_active_zones;
+    if (dev == devices_.front()) dev->max_active_zones -= 3;
 
-  if (ret || reported_zones != nr_zones_) {
-    Error(logger_, "Failed to list zones, err: %d", ret);
-    return IOStatus::IOError("Failed to list zones");
+    start += (uint64_t)info.nr_zones * zone_sz_;
+    nr_zones_ += info.nr_zones;
+    max_nr_active_io_zones_ += dev->max_active_zones;
+
+    Info(logger_, "Zone block device %s nr zones: %u max active: %u max open: %u \n", dev->filename.c_str(),
+         info.nr_zones, info.max_nr_active_zones, info.max_nr_open_zones);
   }
 
-  while (m < ZENFS_OP_LOG_ZONES && i < reported_zones) {
-    struct zbd_zone *z = &zone_rep[i++];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        op_zones_.push_back(new Zone(this, z));
-      }
-      m++;
-    }
+  if (nr_zones_ < ZENFS_MIN_ZONES) {
+    return IOStatus::NotSupported("To few zones on zoned block device (32 required)");
   }
 
-  m = 0;
-  // initialize metadata snapshop zones
-  while (m < ZENFS_SNAPSHOT_ZONES && i < reported_zones) {
-    struct zbd_zone *z = &zone_rep[i++];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        snapshot_zones_.push_back(new Zone(this, z));
-      }
-      m++;
+  max_nr_open_io_zones_ = max_nr_active_io_zones_;
+
+  ios = CheckScheduler();
+  if (ios != IOStatus::OK()) return ios;
+
+  for (const auto &dev : devices_) {
+    std::unique_ptr<ZbdIOEngine> engine;
+
+    ios = ZbdIOEngine::Create(io_engine, &engine);
+    if (!ios.ok()) return ios;
+
+    ios = engine->Open(dev->read_f, dev->read_direct_f, dev->write_f);
+    if (!ios.ok()) return ios;
+
+    if (dev->emu) engine.reset(new ZbdEmuIOEngine(dev->emu.get(), std::move(engine)));
+
+    if (devices_.size() == 1) {
+      io_engine_ = std::move(engine);
+    } else {
+      if (!io_engine_) io_engine_.reset(new ZbdConcatIOEngine());
+      static_cast<ZbdConcatIOEngine *>(io_engine_.get())
+          ->AddDevice(dev->start, (uint64_t)dev->nr_zones * zone_sz_, std::move(engine));
     }
   }
 
+  Info(logger_, "Zone block device I/O engine: %s\n", io_engine_->Name());
+
   active_io_zones_ = 0;
   open_io_zones_ = 0;
+  io_zone_index_.assign(nr_zones_, nullptr);
+
+  for (size_t d = 0; d < devices_.size(); d++) {
+    ZbdDevice *dev = devices_[d].get();
+    uint64_t i = 0;
+    uint64_t m = 0;
+
+    /* Hot data goes to the second half of the devices */
+    dev->hot = devices_.size() > 1 && d >= (devices_.size() + 1) / 2;
 
-  for (; i < reported_zones; i++) {
-    struct zbd_zone *z = &zone_rep[i];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        Zone *newZone = new Zone(this, z);
-        io_zones_.push_back(newZone);
-        if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) || zbd_zone_closed(z)) {
-          active_io_zones_++;
-          if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
-            if (!readonly) {
-              newZone->Close();
+    if (dev->emu)
+      ret = dev->emu->ListZones(0, (uint64_t)dev->nr_zones * zone_sz_, &zone_rep, &reported_zones);
+    else
+      ret = zbd_list_zones(dev->read_f, 0, (uint64_t)dev->nr_zones * zone_sz_, ZBD_RO_ALL, &zone_rep, &reported_zones);
+
+    if (ret || reported_zones != dev->nr_zones) {
+      Error(logger_, "Failed to list zones of %s, err: %d", dev->filename.c_str(), ret);
+      return IOStatus::IOError("Failed to list zones");
+    }
+
+    /* Meta data lives on the first device */
+    while (d == 0 && m < ZENFS_OP_LOG_ZONES && i < reported_zones) {
+      struct zbd_zone *z = &zone_rep[i++];
+      /* Only use sequential write required zones */
+      if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
+        if (!zbd_zone_offline(z)) {
+          op_zones_.push_back(new Zone(this, dev, z));
+        }
+        m++;
+      }
+    }
+
+    m = 0;
+    // initialize metadata snapshop zones
+    while (d == 0 && m < ZENFS_SNAPSHOT_ZONES && i < reported_zones) {
+      struct zbd_zone *z = &zone_rep[i++];
+      /* Only use sequential write required zones */
+      if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
+        if (!zbd_zone_offline(z)) {
+          snapshot_zones_.push_back(new Zone(this, dev, z));
+        }
+        m++;
+      }
+    }
+
+    for (; i < reported_zones; i++) {
+      struct zbd_zone *z = &zone_rep[i];
+      /* Only use sequential write required zones */
+      if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
+        if (!zbd_zone_offline(z)) {
+          Zone *newZone = new Zone(this, dev, z);
+          io_zones_.push_back(newZone);
+          newZone->StartSpaceAccounting();
+          io_zone_index_[dev->start / zone_sz_ + i] = newZone;
+          if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) || zbd_zone_closed(z)) {
+            active_io_zones_++;
+            dev->active_zones++;
+            if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
+              if (!readonly) {
+                newZone->Close();
+              }
             }
           }
         }
       }
     }
+
+    free(zone_rep);
   }
 
-  free(zone_rep);
   start_time_ = time(NULL);
 
-  meta_worker_.reset(new BackgroundWorker());
-  data_worker_.reset(new BackgroundWorker());
+  bg_worker_.reset(new BackgroundWorker(true, ZENFS_BG_WORKER_THREADS));
+  /* Snapshots must be written in order, and garbage collection runs one
+   * pass at a time */
+  bg_worker_->SetConcurrency(kMetaRollJob, 1);
+  bg_worker_->SetConcurrency(kGCJob, 1);
+  readahead_worker_.reset(new BackgroundWorker());
+
+  {
+    std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+    RebuildZoneLists();
+  }
 
   return IOStatus::OK();
 }
@@ -509,41 +744,19 @@ void ZonedBlockDevice::NotifyIOZoneClosed() {
   zone_resources_.notify_one();
 }
 
-uint64_t ZonedBlockDevice::GetFreeSpace() {
-  uint64_t free = 0;
-  for (const auto z : io_zones_) {
-    free += z->capacity_;
-  }
-  return free;
-}
+uint64_t ZonedBlockDevice::GetTotalSpace() { return space_stats_.total; }
 
-int ZonedBlockDevice::GetResetableZones() {
-  int zones = 0;
-  for (const auto z : io_zones_) {
-    if (z->IsFull() && z->used_capacity_ == 0) {
-      zones++;
-    }
-  }
-  return zones;
-}
+uint64_t ZonedBlockDevice::GetFreeSpace() { return space_stats_.free; }
 
-uint64_t ZonedBlockDevice::GetUsedSpace() {
-  uint64_t used = 0;
-  for (const auto z : io_zones_) {
-    used += z->used_capacity_;
-  }
-  return used;
-}
+int ZonedBlockDevice::GetResetableZones() { return space_stats_.resetable_zones; }
+
+uint64_t ZonedBlockDevice::GetUsedSpace() { return space_stats_.used; }
 
 uint64_t ZonedBlockDevice::GetReclaimableSpace() {
-  uint64_t reclaimable = 0;
-  for (const auto z : io_zones_) {
-    // if (z->IsFull()) reclaimable += (z->max_capacity_ - z->used_capacity_);
-    // Not only count full zones, but also open zones.
-    uint64_t zone_written_size = (z->wp_ - z->start_);
-    reclaimable += (zone_written_size - z->used_capacity_);
-  }
-  return reclaimable;
+  // Not only count full zones, but also open zones.
+  uint64_t written = space_stats_.written;
+  uint64_t used = space_stats_.used;
+  return written > used ? written - used : 0;
 }
 
 void ZonedBlockDevice::ReportSpaceUtilization() {
@@ -565,22 +778,44 @@ void ZonedBlockDevice::ReportSpaceUtilization() {
 
   // log garbage distribution
   // garbage percent: [0%, <10%, <20% ... <100%, 100%]
-  int zone_gc_stat[12] = {0};
-  for (const auto z : io_zones_) {
-    if (z->IsEmpty()) {
-      zone_gc_stat[0]++;
-      continue;
-    }
-    double garbage_rate = double(z->wp_ - z->start_ - z->used_capacity_) / z->max_capacity_;
-    int idx = int((garbage_rate + 0.1) * 10);
-    zone_gc_stat[idx]++;
-  }
+  int zone_gc_stat[ZENFS_GARBAGE_BUCKETS];
+  for (int i = 0; i < ZENFS_GARBAGE_BUCKETS; i++) zone_gc_stat[i] = space_stats_.garbage_hist[i];
 
   Info(logger_, "Zone Garbage Stats: [%d %d %d %d %d %d %d %d %d %d %d %d]\n", zone_gc_stat[0], zone_gc_stat[1],
        zone_gc_stat[2], zone_gc_stat[3], zone_gc_stat[4], zone_gc_stat[5], zone_gc_stat[6], zone_gc_stat[7],
        zone_gc_stat[8], zone_gc_stat[9], zone_gc_stat[10], zone_gc_stat[11]);
 }
 
+std::vector<Zone *> ZonedBlockDevice::GetGCCandidates(uint32_t min_garbage_pct) {
+  std::vector<std::pair<double, Zone *>> scored;
+  std::vector<Zone *> victims;
+  time_t now = time(NULL);
+
+  for (const auto z : io_zones_) {
+    if (z->open_for_write_ || z->processing_ || !z->IsFull()) continue;
+
+    uint64_t written = z->wp_ - z->start_;
+    uint64_t used = z->used_capacity_;
+    // Zones without valid data are reclaimed by a plain reset.
+    if (written == 0 || used == 0 || used >= written) continue;
+
+    uint64_t garbage = written - used;
+    if (garbage * 100 < written * min_garbage_pct) continue;
+
+    // Cost-benefit: space freed weighted by how long the data has been cold,
+    // divided by the cost of reading and rewriting the valid part.
+    double u = double(used) / written;
+    double age = double(now - z->last_write_time_) + 1;
+    scored.emplace_back((1 - u) * age / (1 + u), z);
+  }
+
+  std::sort(scored.begin(), scored.end(),
+            [](const std::pair<double, Zone *> &a, const std::pair<double, Zone *> &b) { return a.first > b.first; });
+
+  for (const auto &it : scored) victims.push_back(it.second);
+  return victims;
+}
+
 void ZonedBlockDevice::LogZoneStats() {
   uint64_t used_capacity = 0;
   uint64_t reclaimable_capacity = 0;
@@ -607,6 +842,16 @@ void ZonedBlockDevice::LogZoneStats() {
        "%lu %lu %lu %lu %ld %ld\n",
        time(NULL) - start_time_, used_capacity / MB, reclaimable_capacity / MB,
        100 * reclaimable_capacity / reclaimables_max_capacity, active, active_io_zones_.load(), open_io_zones_.load());
+  Info(logger_, "[Zonestats:finish_threshold(%%),proactive_finishes(#),alloc_wait(us)] %u %lu %lu\n",
+       GetFinishThreshold(), proactive_finishes_.load(), alloc_wait_ns_.load() / 1000);
+
+  if (devices_.size() > 1) {
+    std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+    for (const auto &dev : devices_) {
+      Info(logger_, "[Zonestats:device,hot,active_zones(#),empty_zones(#)] %s %d %ld %lu\n", dev->filename.c_str(),
+           dev->hot, dev->active_zones.load(), dev->empty_zones.size());
+    }
+  }
 
   // io_zones_mtx_.unlock();
 }
@@ -621,9 +866,21 @@ void ZonedBlockDevice::LogZoneUsage() {
   }
 }
 
+void ZonedBlockDevice::LogTraceSummary() {
+  ZenFSTracer::Summary summary[kNrTraceOps];
+
+  tracer_.GetSummary(summary);
+  for (uint32_t op = 0; op < kNrTraceOps; op++) {
+    const ZenFSTracer::Summary &s = summary[op];
+    if (!s.count) continue;
+    Info(logger_, "Trace %s: count %lu mean %lu us max %lu us\n", ZenFSTracer::OpName((ZenFSTraceOp)op), s.count,
+         s.total_ns / s.count / 1000, s.max_ns / 1000);
+  }
+}
+
 ZonedBlockDevice::~ZonedBlockDevice() {
-  meta_worker_.reset(nullptr);
-  data_worker_.reset(nullptr);
+  bg_worker_.reset(nullptr);
+  readahead_worker_.reset(nullptr);
 
   for (const auto z : op_zones_) {
     delete z;
@@ -637,29 +894,67 @@ ZonedBlockDevice::~ZonedBlockDevice() {
     delete z;
   }
 
-  zbd_close(read_f_);
-  zbd_close(read_direct_f_);
-  zbd_close(write_f_);
+  for (const auto &it : free_write_buffers_) {
+    for (const auto buf : it.second) {
+      io_engine_->UnregisterBuffer(buf);
+      free(buf);
+    }
+  }
+
+  io_engine_.reset(nullptr);
+
+  for (const auto &dev : devices_) {
+    if (dev->emu) continue;
+    zbd_close(dev->read_f);
+    zbd_close(dev->read_direct_f);
+    zbd_close(dev->write_f);
+  }
 }
 
-#define LIFETIME_DIFF_NOT_GOOD (100)
-#define LIFETIME_DIFF_MEH (2)
+char *ZonedBlockDevice::GetWriteBuffer(size_t size) {
+  char *buf = nullptr;
 
-unsigned int GetLifeTimeDiff(Env::WriteLifeTimeHint zone_lifetime, Env::WriteLifeTimeHint file_lifetime) {
-  assert(file_lifetime >= 0 && file_lifetime <= Env::WLTH_EXTREME);
+  {
+    std::lock_guard<std::mutex> lock(write_buffers_mtx_);
+    auto it = free_write_buffers_.find(size);
+    if (it != free_write_buffers_.end() && !it->second.empty()) {
+      buf = it->second.back();
+      it->second.pop_back();
+      free_write_buffers_sz_ -= size;
+    }
+  }
 
-  if ((file_lifetime == Env::WLTH_NOT_SET) || (file_lifetime == Env::WLTH_NONE)) {
-    if (file_lifetime == zone_lifetime) {
-      return 0;
-    } else {
-      return LIFETIME_DIFF_NOT_GOOD;
+  if (buf == nullptr) {
+    size_t align = std::max((size_t)sysconf(_SC_PAGESIZE), (size_t)block_sz_);
+    if (posix_memalign((void **)&buf, align, size)) return nullptr;
+    io_engine_->RegisterBuffer(buf, size);
+  }
+
+  write_buffers_used_ += size;
+  metrics_->write_buffer_memory_reporter_.AddRecord(write_buffers_used_ >> 10);
+
+  return buf;
+}
+
+void ZonedBlockDevice::PutWriteBuffer(char *buf, size_t size) {
+  write_buffers_used_ -= size;
+  metrics_->write_buffer_memory_reporter_.AddRecord(write_buffers_used_ >> 10);
+
+  {
+    std::lock_guard<std::mutex> lock(write_buffers_mtx_);
+    if (free_write_buffers_sz_ + size <= ZENFS_WRITE_BUFFER_POOL_SIZE) {
+      free_write_buffers_[size].push_back(buf);
+      free_write_buffers_sz_ += size;
+      return;
     }
   }
 
-  if (zone_lifetime == file_lifetime) return LIFETIME_DIFF_MEH;
+  io_engine_->UnregisterBuffer(buf);
+  free(buf);
+}
 
-  if (zone_lifetime > file_lifetime) return zone_lifetime - file_lifetime;
-  return LIFETIME_DIFF_NOT_GOOD;
+bool ZonedBlockDevice::WriteBufferBudgetExceeded(size_t size) {
+  return write_buffers_used_ + size > ZENFS_WRITE_BUFFER_BUDGET;
 }
 
 Zone *ZonedBlockDevice::AllocateMetaZone() {
@@ -692,40 +987,263 @@ void ZonedBlockDevice::ResetUnusedIOZones() {
   const std::lock_guard<std::mutex> lock(zone_resources_mtx_);
   /* Reset any unused zones */
   for (const auto z : io_zones_) {
-    if (!z->IsUsed() && !z->IsEmpty()) {
-      if (!z->IsFull()) active_io_zones_--;
+    if (!z->IsUsed() && !z->IsEmpty() && !z->wal_pooled_) {
+      if (!z->IsFull()) {
+        z->GetDevice()->active_zones--;
+        active_io_zones_--;
+      }
       if (!z->Reset().ok()) Warn(logger_, "Failed reseting zone");
     }
   }
+
+  const std::lock_guard<std::mutex> lists_lock(zone_lists_mtx_);
+  RebuildZoneLists();
+}
+
+void ZonedBlockDevice::AddToZoneList(Zone *z, std::list<Zone *> *list) {
+  assert(z->zone_list_ == nullptr);
+  z->zone_list_pos_ = list->insert(list->end(), z);
+  z->zone_list_ = list;
+}
+
+void ZonedBlockDevice::RemoveFromZoneList(Zone *z) {
+  if (z->zone_list_ == nullptr) return;
+  z->zone_list_->erase(z->zone_list_pos_);
+  z->zone_list_ = nullptr;
+}
+
+void ZonedBlockDevice::RebuildZoneLists() {
+  for (const auto &dev : devices_) dev->empty_zones.clear();
+  for (auto &list : partial_zones_) list.clear();
+
+  for (const auto z : io_zones_) {
+    z->zone_list_ = nullptr;
+    if (z->open_for_write_ || z->processing_ || z->IsFull() || z->wal_pooled_) continue;
+
+    if (z->IsEmpty())
+      AddToZoneList(z, &z->GetDevice()->empty_zones);
+    else
+      AddToZoneList(z, &partial_zones_[z->lifetime_]);
+  }
+}
+
+void ZonedBlockDevice::ReturnZone(Zone *z) {
+  /* WAL zones with data and space left go back to the WAL pool, so WALs
+   * keep sharing zones and those zones go unused all at once */
+  if (z->wal_zone_) {
+    if (!z->open_for_write_ && !z->processing_ && !z->IsFull() && z->IsUsed() && TryPoolWALZone(z)) return;
+    z->wal_zone_ = false;
+  }
+
+  std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+
+  if (z->open_for_write_ || z->processing_ || z->IsFull()) return;
+
+  if (z->IsEmpty()) {
+    AddToZoneList(z, &z->GetDevice()->empty_zones);
+    return;
+  }
+
+  if (!z->IsUsed()) {
+    FinishOrReset(z, true);
+    return;
+  }
+
+  // Finish an almost full zone
+  if (z->capacity_ < (z->max_capacity_ * GetFinishThreshold() / 100)) {
+    FinishOrReset(z, false);
+    return;
+  }
+
+  AddToZoneList(z, &partial_zones_[z->lifetime_]);
+}
+
+/* Take a zone from the WAL pool, nullptr if the pool is empty */
+Zone *ZonedBlockDevice::TakeWALZone(Env::WriteLifeTimeHint lifetime) {
+  Zone *z = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(wal_zones_mtx_);
+    if (!wal_zones_.empty()) {
+      z = wal_zones_.front();
+      wal_zones_.pop_front();
+      nr_wal_zones_ = wal_zones_.size();
+
+      assert(!z->open_for_write_);
+      z->wal_pooled_ = false;
+      z->open_for_write_ = true;
+      if (z->IsEmpty()) z->lifetime_ = lifetime;
+    }
+  }
+
+  ScheduleWALZoneRefill();
+  return z;
+}
+
+/* Pool a closed, partially written WAL zone if there is room in the pool
+ * and an open zone resource to hold */
+bool ZonedBlockDevice::TryPoolWALZone(Zone *z) {
+  std::lock_guard<std::mutex> lock(wal_zones_mtx_);
+
+  if (wal_zones_.size() >= ZENFS_WAL_ZONES) return false;
+
+  {
+    std::lock_guard<std::mutex> resources_lock(zone_resources_mtx_);
+    if (open_io_zones_.load() >= max_nr_open_io_zones_) return false;
+    open_io_zones_++;
+  }
+
+  z->wal_pooled_ = true;
+  wal_zones_.push_front(z);
+  nr_wal_zones_ = wal_zones_.size();
+  return true;
+}
+
+/* Take a pooled zone whose data has all been deleted off the pool so it can
+ * be reset, releasing its open zone resource */
+bool ZonedBlockDevice::UnpoolWALZone(Zone *z) {
+  {
+    std::lock_guard<std::mutex> lock(wal_zones_mtx_);
+    if (!z->wal_pooled_ || z->IsUsed() || z->IsEmpty()) return false;
+
+    wal_zones_.erase(std::find(wal_zones_.begin(), wal_zones_.end(), z));
+    nr_wal_zones_ = wal_zones_.size();
+    z->wal_pooled_ = false;
+    z->wal_zone_ = false;
+  }
+
+  {
+    std::lock_guard<std::mutex> resources_lock(zone_resources_mtx_);
+    NotifyIOZoneClosed();
+  }
+
+  ScheduleWALZoneRefill();
+  return true;
+}
+
+/* Move empty zones to the WAL pool while zone resources are available */
+void ZonedBlockDevice::FillWALZones() {
+  std::lock_guard<std::mutex> lock(wal_zones_mtx_);
+  std::lock_guard<std::mutex> resources_lock(zone_resources_mtx_);
+  std::lock_guard<std::mutex> lists_lock(zone_lists_mtx_);
+
+  while (wal_zones_.size() < ZENFS_WAL_ZONES) {
+    if (open_io_zones_.load() >= max_nr_open_io_zones_ || active_io_zones_.load() >= max_nr_active_io_zones_) break;
+
+    Zone *z = TakeEmptyZone(Env::WLTH_SHORT, true);
+    if (z == nullptr) break;
+    open_io_zones_++;
+    active_io_zones_++;
+
+    z->wal_zone_ = true;
+    z->wal_pooled_ = true;
+    wal_zones_.push_back(z);
+  }
+  nr_wal_zones_ = wal_zones_.size();
+}
+
+void ZonedBlockDevice::ScheduleWALZoneRefill() {
+  if (GetWriteFD() < 0 || nr_wal_zones_ >= ZENFS_WAL_ZONES) return;
+  if (wal_refill_scheduled_.exchange(true)) return;
+
+  bg_worker_->SubmitJob(
+      [this]() {
+        wal_refill_scheduled_ = false;
+        FillWALZones();
+      },
+      kResetJob);
+}
+
+/* Closed zone with the best lifetime match for a file, nullptr if there is
+ * no good match. Zones whose data has been deleted since they went on the
+ * list are reset on the way. */
+Zone *ZonedBlockDevice::TakePartialZone(Env::WriteLifeTimeHint lifetime) {
+  std::vector<int> order;
+
+  if (lifetime == Env::WLTH_NOT_SET || lifetime == Env::WLTH_NONE) {
+    order.push_back(lifetime);
+  } else {
+    /* A slightly longer lived zone is the best match, then an equal one,
+     * then ever longer lived ones */
+    if (lifetime < Env::WLTH_EXTREME) order.push_back(lifetime + 1);
+    order.push_back(lifetime);
+    for (int l = lifetime + 2; l <= Env::WLTH_EXTREME; l++) order.push_back(l);
+  }
+
+  for (int l : order) {
+    auto &list = partial_zones_[l];
+    while (!list.empty()) {
+      Zone *z = list.front();
+      RemoveFromZoneList(z);
+
+      if (!z->IsUsed()) {
+        FinishOrReset(z, true);
+        continue;
+      }
+      return z;
+    }
+  }
+
+  return nullptr;
+}
+
+/* Empty zone of the least loaded device that is below its active zone
+ * limit, the one with the most empty zones on a tie. Hot data prefers hot
+ * devices and long lived data cold ones, data of unknown lifetime goes
+ * anywhere. The caller accounts for the active zone. */
+Zone *ZonedBlockDevice::TakeEmptyZone(Env::WriteLifeTimeHint lifetime, bool is_wal) {
+  bool hot = is_wal || lifetime == Env::WLTH_SHORT;
+  bool any = !is_wal && (lifetime == Env::WLTH_NOT_SET || lifetime == Env::WLTH_NONE);
+  ZbdDevice *best = nullptr;
+
+  for (int pass = 0; pass < 2 && best == nullptr; pass++) {
+    for (const auto &dev : devices_) {
+      if (dev->empty_zones.empty() || dev->active_zones.load() >= (long)dev->max_active_zones) continue;
+      /* Fall back on devices of the other kind only when these are out */
+      if (pass == 0 && !any && devices_.size() > 1 && dev->hot != hot) continue;
+
+      if (best == nullptr || dev->active_zones.load() < best->active_zones.load() ||
+          (dev->active_zones.load() == best->active_zones.load() &&
+           dev->empty_zones.size() > best->empty_zones.size())) {
+        best = dev.get();
+      }
+    }
+  }
+
+  if (best == nullptr) return nullptr;
+
+  Zone *z = best->empty_zones.front();
+  RemoveFromZoneList(z);
+  best->active_zones++;
+  return z;
 }
 
 Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool is_wal) {
   Zone *allocated_zone = nullptr;
-  Zone *finish_victim = nullptr;
-  unsigned int best_diff = LIFETIME_DIFF_NOT_GOOD;
   int new_zone = 0;
   Status s;
 
-  // We reserve one more free zone for WAL files in case RocksDB delay close WAL files.
-  int reserved_zones = 1;
+  // We reserve one more free zone for WAL files in case RocksDB delay close WAL files,
+  // unless the WAL zone pool already holds one for them.
+  int reserved_zones = nr_wal_zones_ > 0 ? 0 : 1;
 
   auto *reporter =
       is_wal ? &metrics_->io_alloc_wal_latency_reporter_ : &metrics_->io_alloc_non_wal_latency_reporter_;
   LatencyHistGuard guard(reporter);
   metrics_->io_alloc_qps_reporter_.AddCount(1);
 
-  auto t0 = std::chrono::system_clock::now();
+  uint64_t t0 = ZenFSTracer::NowNanos();
 
-  // For general data, we need both two locks. 
-  // The general data thread can give up lock to WAL thread during iteration.
-  if (!is_wal) {
-	io_zones_mtx_.lock();
+  // WALs take a pooled zone without waiting for zone resources
+  if (is_wal && (allocated_zone = TakeWALZone(file_lifetime)) != nullptr) {
+    tracer_.Record(kTraceZoneAlloc, t0, ZenFSTracer::NowNanos() - t0, is_wal);
+    return allocated_zone;
   }
 
   // Make sure WAL allocation has better priority
   {
     std::unique_lock<std::mutex> lk(zone_resources_mtx_);
-    zone_resources_.wait(lk, [this, is_wal, reserved_zones, file_lifetime] {
+    zone_resources_.wait(lk, [this, is_wal, reserved_zones] {
       if (is_wal) {
         return open_io_zones_.load() < max_nr_open_io_zones_;
       } else {
@@ -735,93 +1253,168 @@ Zone *ZonedBlockDevice::AllocateZone(Env::WriteLifeTimeHint file_lifetime, bool
     });
   }
 
-  wal_zones_mtx_.lock();
-
-  auto t1 = std::chrono::system_clock::now();
+  uint64_t t1 = ZenFSTracer::NowNanos();
+  tracer_.Record(kTraceZoneAllocWait, t0, t1 - t0, is_wal);
+  alloc_wait_ns_ = (alloc_wait_ns_.load() * 7 + (t1 - t0)) / 8;
 
-  // Reset any unused zones and finish used zones under capacity threshold
-  for (int i = 0; !is_wal && i < io_zones_.size(); i++) {
-    const auto z = io_zones_[i];
-
-    if (z->open_for_write_ || z->IsEmpty() || (z->IsFull() && z->IsUsed())) {
-      continue;
+  {
+    // Only list operations under the lock, so WAL allocations never wait
+    // for more than a handful of pointer updates.
+    std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+
+    /* Try to fill an already open zone(with the best life time diff) */
+    allocated_zone = TakePartialZone(file_lifetime);
+
+    // If we did not find a good match, allocate an empty one
+    if (allocated_zone == nullptr && active_io_zones_.load() < max_nr_active_io_zones_ &&
+        (allocated_zone = TakeEmptyZone(file_lifetime, is_wal)) != nullptr) {
+      allocated_zone->lifetime_ = file_lifetime;
+      active_io_zones_++;
+      new_zone = 1;
     }
 
-	// Note that current function cannot be accessed concurrently, so this is safe.
-	if (z->processing_) continue;
-
-	// Reset an unused zone (valud = 0)
-    if (!z->IsUsed()) {
-      FinishOrReset(z, true);
-      continue;
+    // Out of active zones, settle for any open zone
+    for (int l = 0; allocated_zone == nullptr && l <= Env::WLTH_EXTREME; l++) {
+      allocated_zone = TakePartialZone((Env::WriteLifeTimeHint)l);
     }
 
-    // Finish an almost FULL zone
-    if (!is_wal && (z->capacity_ < (z->max_capacity_ * finish_threshold_ / 100))) {
-      FinishOrReset(z, false);
+    if (allocated_zone) {
+      assert(!allocated_zone->open_for_write_);
+      allocated_zone->open_for_write_ = true;
+      open_io_zones_++;
+      Debug(logger_, "Allocating zone(new=%d) start: 0x%lx wp: 0x%lx lt: %d file lt: %d\n", new_zone,
+            allocated_zone->start_, allocated_zone->wp_, allocated_zone->lifetime_, file_lifetime);
     }
   }
 
-  /* Try to fill an already open zone(with the best life time diff) */
-  for (const auto z : io_zones_) {
-	if(z->processing_) continue;
+  uint64_t t2 = ZenFSTracer::NowNanos();
+  tracer_.Record(kTraceZoneAlloc, t0, t2 - t0, is_wal);
 
-    if ((!z->open_for_write_) && (z->used_capacity_ > 0) && !z->IsFull()) {
-      unsigned int diff = GetLifeTimeDiff(z->lifetime_, file_lifetime);
+  if (new_zone) ScheduleFinish();
 
-      if (diff <= best_diff || allocated_zone == nullptr) {
-        allocated_zone = z;
-        best_diff = diff;
-	  }
+  metrics_->open_zones_reporter_.AddRecord(open_io_zones_);
+  metrics_->active_zones_reporter_.AddRecord(active_io_zones_);
 
-    }
+  if (t2 - t0 >= ZENFS_TRACE_SLOW_NS) {
+    Info(logger_,
+         "Slow zone allocation: is_wal = %d a/o zones %ld,%ld lock wait: %lu us, alloc: %lu us, wlfh: %d, "
+         "pending_bg_work: %d\n",
+         is_wal, active_io_zones_.load(), open_io_zones_.load(), (t1 - t0) / 1000, (t2 - t1) / 1000, file_lifetime,
+         pending_bg_work_.load());
   }
 
-  auto t2 = std::chrono::system_clock::now();
+  return allocated_zone;
+}
 
-  // If we did not find a good match, allocate an empty one
-  if (best_diff >= LIFETIME_DIFF_NOT_GOOD) {
-    if (active_io_zones_.load() < max_nr_active_io_zones_) {
-      for (const auto z : io_zones_) {
-		if(z->processing_) continue;
+/* Percentage of capacity left under which a closed zone is finished. The
+ * superblock threshold is the floor, it goes up with the share of active
+ * zones in use above ZENFS_FINISH_PRESSURE_LOW, and when zone allocations
+ * stall. */
+uint32_t ZonedBlockDevice::GetFinishThreshold() {
+  uint64_t max_active = std::max(max_nr_active_io_zones_, 1u);
+  uint64_t pressure = std::max(active_io_zones_.load(), 0l) * 100 / max_active;
+  uint32_t threshold = finish_threshold_;
+
+  if (pressure > ZENFS_FINISH_PRESSURE_LOW) {
+    uint64_t t = ZENFS_FINISH_MAX_WASTE * std::min(pressure - ZENFS_FINISH_PRESSURE_LOW, 100ul - ZENFS_FINISH_PRESSURE_LOW) /
+                 (100 - ZENFS_FINISH_PRESSURE_LOW);
+    threshold = std::max(threshold, (uint32_t)t);
+  }
+  if (alloc_wait_ns_.load() > ZENFS_FINISH_SLOW_ALLOC_NS) threshold = std::max(threshold, (uint32_t)ZENFS_FINISH_MAX_WASTE / 2);
 
-        if ((!z->open_for_write_) && z->IsEmpty()) {
-          z->lifetime_ = file_lifetime;
-          allocated_zone = z;
-          active_io_zones_++;
-          new_zone = 1;
-          break;
-        }
-      }
+  return threshold;
+}
+
+void ZonedBlockDevice::ScheduleFinish() {
+  uint64_t max_active = std::max(max_nr_active_io_zones_, 1u);
+
+  if (active_io_zones_.load() * 100 < (long)(max_active * ZENFS_FINISH_PRESSURE_HIGH)) return;
+  if (finish_scheduled_.exchange(true)) return;
+
+  bg_worker_->SubmitJob(
+      [this]() {
+        finish_scheduled_ = false;
+        FinishPartialZones();
+      },
+      kFinishJob);
+}
+
+/* Finish closed, partially written zones until active zone use is back at
+ * ZENFS_FINISH_PRESSURE_LOW, the ones with the least capacity left first as
+ * they are the least useful for allocation and waste the least space */
+void ZonedBlockDevice::FinishPartialZones() {
+  std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+  uint64_t max_active = std::max(max_nr_active_io_zones_, 1u);
+  long excess = active_io_zones_.load() - (long)(max_active * ZENFS_FINISH_PRESSURE_LOW / 100);
+  std::vector<Zone *> candidates;
+
+  if (excess <= 0) return;
+
+  for (auto &list : partial_zones_) {
+    for (const auto z : list) {
+      if (z->capacity_ * 100 <= z->max_capacity_ * ZENFS_FINISH_MAX_WASTE) candidates.push_back(z);
     }
   }
+  std::sort(candidates.begin(), candidates.end(), [](Zone *a, Zone *b) { return a->capacity_ < b->capacity_; });
 
-  if (allocated_zone) {
-    assert(!allocated_zone->open_for_write_);
-    allocated_zone->open_for_write_ = true;
-    open_io_zones_++;
-    Debug(logger_, "Allocating zone(new=%d) start: 0x%lx wp: 0x%lx lt: %d file lt: %d\n", new_zone,
-          allocated_zone->start_, allocated_zone->wp_, allocated_zone->lifetime_, file_lifetime);
+  for (const auto z : candidates) {
+    if (excess-- <= 0) break;
+    RemoveFromZoneList(z);
+    FinishOrReset(z, !z->IsUsed());
+    proactive_finishes_++;
   }
+}
+
+/* Shared zone with room left, of the same lifetime and with fewer than
+ * ZENFS_MAX_ZONE_SHARERS writers unless any is set, in which case the one
+ * with the fewest writers is taken */
+Zone *ZonedBlockDevice::JoinSharedZone(Env::WriteLifeTimeHint lifetime, bool any) {
+  Zone *best = nullptr;
 
-  LogZoneStats();
-  wal_zones_mtx_.unlock();
-  if (!is_wal) {
-    io_zones_mtx_.unlock();
+  for (const auto z : shared_zones_) {
+    if (z->capacity_ == 0) continue;
+    if (!any && (z->lifetime_ != lifetime || z->nr_sharers_ >= ZENFS_MAX_ZONE_SHARERS)) continue;
+    if (best == nullptr || z->nr_sharers_ < best->nr_sharers_) best = z;
   }
 
-  auto t5 = std::chrono::system_clock::now();
+  if (best != nullptr) best->nr_sharers_++;
+  return best;
+}
 
-  metrics_->open_zones_reporter_.AddRecord(open_io_zones_);
-  metrics_->active_zones_reporter_.AddRecord(active_io_zones_);
+/* Join a shared zone of matching lifetime, open a new one if there is none
+ * and an open zone resource is left, and share any open zone rather than
+ * wait for a resource */
+Zone *ZonedBlockDevice::AllocateSharedZone(Env::WriteLifeTimeHint lifetime) {
+  int reserved_zones = nr_wal_zones_ > 0 ? 0 : 1;
+  Zone *z;
 
-  std::stringstream ss;
-  ss << " is_wal = " << is_wal << " a/o zones " << active_io_zones_.load() << "," << open_io_zones_.load()
-     << " lock wait: " << TimeDiff(t0, t1) << ", reset: " << TimeDiff(t1, t2) << ", other: " << TimeDiff(t2, t5)
-     << ", wlfh: " << file_lifetime << ", pending_bg_work: " << pending_bg_work_ << "\n";
-  Info(logger_, "%s", ss.str().c_str());
+  {
+    std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+    if ((z = JoinSharedZone(lifetime, false)) != nullptr) return z;
+    if (open_io_zones_.load() >= max_nr_open_io_zones_ - reserved_zones &&
+        (z = JoinSharedZone(lifetime, true)) != nullptr)
+      return z;
+  }
 
-  return allocated_zone;
+  z = AllocateZone(lifetime, false);
+  if (z == nullptr) return nullptr;
+
+  std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+  z->nr_sharers_ = 1;
+  shared_zones_.push_back(z);
+  return z;
+}
+
+/* The last writer of a shared zone closes it */
+void ZonedBlockDevice::ReleaseSharedZone(Zone *z) {
+  {
+    std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+    assert(z->nr_sharers_ > 0);
+    if (--z->nr_sharers_ > 0) return;
+    shared_zones_.erase(std::find(shared_zones_.begin(), shared_zones_.end(), z));
+  }
+
+  z->CloseWR();
 }
 
 std::string ZonedBlockDevice::GetFilename() { return filename_; }
@@ -858,11 +1451,12 @@ void ZonedBlockDevice::EncodeJson(std::ostream &json_stream) {
 // Before entering this function. target zone's mutex was already taken.
 void ZonedBlockDevice::FinishOrReset(Zone *z, bool reset) {
   z->processing_ = true;
-  data_worker_->SubmitJob([&, z]() {
+  bg_worker_->SubmitJob([&, z]() {
     // double check
     if (z->open_for_write_ || z->IsEmpty()) {
 	  std::cout << "shouldn't happend!" << std::endl;
 	  z->processing_ = false;
+      if (!z->open_for_write_) ReturnZone(z);
       return;
     }
 
@@ -874,16 +1468,36 @@ void ZonedBlockDevice::FinishOrReset(Zone *z, bool reset) {
       Warn(logger_, "Failed finishing zone");
     }
     if (!full) {
+      z->GetDevice()->active_zones--;
       active_io_zones_--;
     }
 
 	// Reset only (no need to finish first)
+    bool reset_ok = false;
     if (reset) {
-      z->Reset();
+      /* Resets stall reads and writes on some devices, keep them out of the
+       * way of foreground I/O */
+      io_sched_.Admit(kIOClassGC, 0);
+      reset_ok = z->Reset().ok();
     }
     pending_bg_work_--;
 	z->processing_ = false;
-  });
+
+    // Reset zones are free for allocation again
+    if (reset_ok) ReturnZone(z);
+  }, reset ? kResetJob : kFinishJob);
+}
+
+// Schedule a reset for a zone whose data has been migrated or deleted, taking
+// the zone off the allocation lists first to avoid double submission.
+void ZonedBlockDevice::ResetZoneIfUnused(Zone *z) {
+  UnpoolWALZone(z);
+
+  std::lock_guard<std::mutex> lock(zone_lists_mtx_);
+  /* Open zones, shared ones in particular, are reset once closed */
+  if (z->processing_ || z->open_for_write_ || z->IsUsed() || z->IsEmpty()) return;
+  RemoveFromZoneList(z);
+  FinishOrReset(z, true);
 }
 
 }  // namespace ROCKSDB_NAMESPACE
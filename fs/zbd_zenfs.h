@@ -10,7 +10,6 @@
 #if !defined(ROCKSDB_LITE) && defined(OS_LINUX)
 
 #include <errno.h>
-#include <libaio.h>
 #include <libzbd/zbd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,9 +17,12 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -28,29 +30,49 @@
 #include <utility>
 #include <vector>
 
+#include "io_engine.h"
+#include "io_sched.h"
+#include "lifetime.h"
 #include "metrics.h"
+#include "op_trace.h"
+#include "read_cache.h"
 #include "rocksdb/env.h"
 #include "rocksdb/io_status.h"
 #include "rocksdb/metrics_reporter.h"
+#include "zbd_emu.h"
 #include "zbd_stat.h"
 
 namespace ROCKSDB_NAMESPACE {
 
 class ZonedBlockDevice;
-
-struct zenfs_aio_ctx {
-  struct iocb iocb;
-  struct iocb *iocbs[1];
-  io_context_t io_ctx;
-  int inflight;
-  int fd;
+class Zone;
+
+// One of the zoned block devices backing a ZonedBlockDevice. The zones of
+// all devices are concatenated, in order, into a single address space.
+struct ZbdDevice {
+  std::string filename;
+  int read_f = -1;
+  int read_direct_f = -1;
+  int write_f = -1;
+  uint64_t start = 0; /* offset of the device in the address space */
+  uint32_t nr_zones = 0;
+  // Limit on active io zones, less the meta data zones on the first device
+  uint32_t max_active_zones = 0;
+  std::atomic<long> active_zones{0};
+  // WALs and short lived data go to hot devices, the rest to cold ones
+  bool hot = false;
+  // Empty zones, guarded by the zone_lists_mtx_ of the ZonedBlockDevice
+  std::list<Zone *> empty_zones;
+  // Set for emulated devices, which own the file descriptors
+  std::unique_ptr<ZbdEmuDevice> emu;
 };
 
 class Zone {
   ZonedBlockDevice *zbd_;
+  ZbdDevice *dev_;
 
  public:
-  explicit Zone(ZonedBlockDevice *zbd, struct zbd_zone *z);
+  explicit Zone(ZonedBlockDevice *zbd, ZbdDevice *dev, struct zbd_zone *z);
 
   uint64_t start_;
   uint64_t capacity_; /* remaining capacity */
@@ -58,28 +80,87 @@ class Zone {
   uint64_t wp_;
   bool open_for_write_;
   Env::WriteLifeTimeHint lifetime_;
+  time_t last_write_time_;
   std::atomic<long> used_capacity_;
-  struct zenfs_aio_ctx wr_ctx;
 
   // If current zone is been resetting or finishing.
   std::atomic<bool> processing_{false};
 
+  // Allocation list the zone is on, if any (see ZonedBlockDevice)
+  std::list<Zone *> *zone_list_ = nullptr;
+  std::list<Zone *>::iterator zone_list_pos_;
+
+  // Written by WALs only, and on the WAL zone pool right now
+  bool wal_zone_ = false;
+  bool wal_pooled_ = false;
+
+  // Files writing to the zone in shared zone mode, guarded by the
+  // zone_lists_mtx_ of the ZonedBlockDevice
+  int nr_sharers_ = 0;
+
   IOStatus Reset();
   IOStatus Finish();
   IOStatus Close();
 
   IOStatus Append(char *data, uint32_t size);
-  IOStatus Append_async(char *data, uint32_t size);
+  IOStatus Append_async(char *data, uint32_t size, uint64_t *seq = nullptr);
+  /* Append for zones written by several files: writes as much of the data
+   * as fits, returning the device offset written to and the number of bytes
+   * written, 0 if the zone is full */
+  IOStatus AppendShared(char *data, uint32_t size, uint64_t *offset, uint32_t *written);
+  /* Wait for all writes in flight */
   IOStatus Sync();
+  /* Wait for the write with sequence number seq and all writes before it */
+  IOStatus SyncTo(uint64_t seq);
   bool IsUsed();
   bool IsFull();
   bool IsEmpty();
   uint64_t GetZoneNr();
   uint64_t GetCapacityLeft();
+  ZbdDevice *GetDevice() { return dev_; }
+
+  // Change used_capacity_, keeping the space accounting up to date
+  void AddUsedCapacity(long delta);
+  // Include the zone in the space accounting of the device, io zones only
+  void StartSpaceAccounting();
 
   void EncodeJson(std::ostream &json_stream);
 
   void CloseWR(); /* Done writing */
+
+ private:
+  /* Set up on the first asynchronous append */
+  std::unique_ptr<ZoneWriteQueue> wr_queue_;
+  /* Serializes the writers of a shared zone */
+  std::mutex append_mtx_;
+
+  /* Space accounting, see ZoneSpaceStats */
+  bool accounted_ = false;
+  std::atomic<int> garbage_bucket_{-1};
+  std::atomic<bool> resetable_{false};
+
+  void AccountSpace(int64_t total, int64_t free, int64_t written);
+  void UpdateSpaceClass();
+  int GetGarbageBucket();
+};
+
+#define ZENFS_GARBAGE_BUCKETS (12)
+
+// Space accounting over all io zones, updated by the zones as they are
+// written, reset and finished and as their data is deleted, so that space
+// queries never scan the zones
+struct ZoneSpaceStats {
+  std::atomic<uint64_t> total{0};   /* sum of max capacities */
+  std::atomic<uint64_t> free{0};    /* sum of capacities left */
+  std::atomic<uint64_t> written{0}; /* sum of bytes below the write pointers */
+  std::atomic<uint64_t> used{0};    /* sum of used capacities */
+  std::atomic<int> resetable_zones{0};
+  // Zones by garbage percentage: empty, [0%, 10%), ... [90%, 100%), 100%
+  std::atomic<int> garbage_hist[ZENFS_GARBAGE_BUCKETS];
+
+  ZoneSpaceStats() {
+    for (auto &bucket : garbage_hist) bucket = 0;
+  }
 };
 
 // Abstract class as interface.
@@ -118,50 +199,102 @@ class GeneralJob : public BackgroundJob {
   virtual ~GeneralJob() {}
 };
 
+// Job classes of a BackgroundWorker, highest priority first
+enum BackgroundJobClass { kMetaRollJob = 0, kResetJob, kFinishJob, kGCJob, kDefaultJob, kNrJobClasses };
+
+// Pool of worker threads. Queued jobs are run highest class first, in
+// submission order within a class, as long as their class is below its
+// concurrency limit.
 class BackgroundWorker {
   enum WorkingState { kWaiting = 0, kRunning, kTerminated } state_;
-  std::thread worker_;
-  std::list<std::unique_ptr<BackgroundJob>> jobs_;
-  std::unique_ptr<BackgroundJob> job_now_;
+  struct QueuedJob {
+    std::unique_ptr<BackgroundJob> job;
+    std::chrono::steady_clock::time_point submit_time;
+  };
+  std::vector<std::thread> workers_;
+  std::list<QueuedJob> jobs_[kNrJobClasses];
+  int running_[kNrJobClasses];
+  int max_running_[kNrJobClasses];
+  size_t nr_queued_ = 0;
   std::mutex job_mtx_;
   std::condition_variable job_cv_;
+  HistReporterHandle *wait_reporter_ = nullptr;
+  HistReporterHandle *queue_depth_reporter_ = nullptr;
+
+  // job_mtx_ must be held
+  int NextJobClass();
 
  public:
-  BackgroundWorker(bool run_at_beginning = true);
+  BackgroundWorker(bool run_at_beginning = true, int nr_threads = 1);
   ~BackgroundWorker();
   void Wait();
   void Run();
   void Terminate();
   void ProcessJobs();
+  // Max number of jobs of a class running at the same time, defaults to
+  // the number of threads
+  void SetConcurrency(BackgroundJobClass job_class, int max_running);
+  // Job wait times are reported in microseconds, queue depths on submit
+  void SetMetrics(HistReporterHandle *wait_reporter, HistReporterHandle *queue_depth_reporter);
   // For simple jobs that could be handled in a lambda function.
-  void SubmitJob(std::function<void()> fn);
+  void SubmitJob(std::function<void()> fn, BackgroundJobClass job_class = kDefaultJob);
   // For derived jobs which needs arguments
-  void SubmitJob(std::unique_ptr<BackgroundJob> &&job);
+  void SubmitJob(std::unique_ptr<BackgroundJob> &&job, BackgroundJobClass job_class = kDefaultJob);
 };
 
 class ZonedBlockDevice {
  private:
   std::string filename_;
+  std::vector<std::unique_ptr<ZbdDevice>> devices_;
   uint32_t block_sz_;
   uint64_t zone_sz_;
   uint32_t nr_zones_;
   std::vector<Zone *> io_zones_;
-  std::mutex io_zones_mtx_;
+  // IO zone by zone number, nullptr for meta data and offline zones
+  std::vector<Zone *> io_zone_index_;
+
+  // Allocation candidates, kept up to date as zones change state so that
+  // allocation never has to scan io_zones_. Open and full zones, and zones
+  // being reset or finished, are on no list. Empty zones are on the list of
+  // their device.
+  std::mutex zone_lists_mtx_;
+  // Closed, partially written zones by zone lifetime
+  std::list<Zone *> partial_zones_[Env::WLTH_EXTREME + 1];
+
+  // Zones set aside for WALs, partially written ones first. Every pooled
+  // zone holds an open and an active zone resource, so taking one never
+  // waits. Lock order: wal_zones_mtx_, zone_resources_mtx_, zone_lists_mtx_.
   std::mutex wal_zones_mtx_;
+  std::deque<Zone *> wal_zones_;
+  std::atomic<size_t> nr_wal_zones_{0};
+  std::atomic<bool> wal_refill_scheduled_{false};
+
+  // Open zones written by several files at once, guarded by zone_lists_mtx_
+  bool shared_zones_enabled_ = false;
+  std::vector<Zone *> shared_zones_;
   // meta log zones used to keep track of running record of metadata
   std::vector<Zone *> op_zones_;
   // snapshot zones used to recover entire file system
   std::vector<Zone *> snapshot_zones_;
-  int read_f_;
-  int read_direct_f_;
-  int write_f_;
+  std::unique_ptr<ZbdIOEngine> io_engine_;
+  // Released write buffers by size, kept registered with the I/O engine
+  std::mutex write_buffers_mtx_;
+  std::map<size_t, std::vector<char *>> free_write_buffers_;
+  size_t free_write_buffers_sz_ = 0;
+  // Write buffers handed out to writable files
+  std::atomic<uint64_t> write_buffers_used_{0};
   time_t start_time_;
   std::shared_ptr<Logger> logger_;
+  ZenFSTracer tracer_;
+  ZoneSpaceStats space_stats_;
+  std::unique_ptr<ZenFSReadCache> read_cache_;
+  ZenFSLifetimePredictor lifetime_predictor_;
+  ZenFSIOScheduler io_sched_;
   uint32_t finish_threshold_ = 0;
-
-  // If a thread is allocating a zone fro WAL files, other
-  // thread shouldn't take `io_zones_mtx_` (see AllocateZone())
-  std::atomic<uint32_t> wal_zone_allocating_{0};
+  // Finish policy, see GetFinishThreshold and FinishPartialZones
+  std::atomic<bool> finish_scheduled_{false};
+  std::atomic<uint64_t> alloc_wait_ns_{0}; /* moving average */
+  std::atomic<uint64_t> proactive_finishes_{0};
 
   std::atomic<int> pending_bg_work_{0};
 
@@ -174,6 +307,24 @@ class ZonedBlockDevice {
 
   void EncodeJsonZone(std::ostream &json_stream, const std::vector<Zone *> zones);
 
+  // zone_lists_mtx_ must be held for these
+  void AddToZoneList(Zone *z, std::list<Zone *> *list);
+  void RemoveFromZoneList(Zone *z);
+  void RebuildZoneLists();
+  Zone *TakePartialZone(Env::WriteLifeTimeHint lifetime);
+  Zone *TakeEmptyZone(Env::WriteLifeTimeHint lifetime, bool is_wal);
+  Zone *JoinSharedZone(Env::WriteLifeTimeHint lifetime, bool any);
+
+  void ScheduleFinish();
+  void FinishPartialZones();
+
+  IOStatus OpenDevice(ZbdDevice *dev, bool readonly, zbd_info *info);
+
+  Zone *TakeWALZone(Env::WriteLifeTimeHint lifetime);
+  bool TryPoolWALZone(Zone *z);
+  bool UnpoolWALZone(Zone *z);
+  void FillWALZones();
+
  public:
   std::mutex zone_resources_mtx_; /* Protects active/open io zones */
 
@@ -183,22 +334,38 @@ class ZonedBlockDevice {
   std::shared_ptr<BytedanceMetrics> metrics_;
 
  public:
+  // bdevname is a device name, or a colon separated list of devices with
+  // equal zone and block sizes
   explicit ZonedBlockDevice(std::string bdevname, std::shared_ptr<Logger> logger);
 
   virtual ~ZonedBlockDevice();
 
-  IOStatus Open(bool readonly = false);
+  IOStatus Open(bool readonly = false, const std::string &io_engine = ZENFS_DEFAULT_IO_ENGINE);
   IOStatus CheckScheduler();
 
   Zone *GetIOZone(uint64_t offset);
 
   Zone *AllocateZone(Env::WriteLifeTimeHint lifetime, bool is_wal);
+  // Zone to write to in shared zone mode, possibly written by other files
+  // too. Release with ReleaseSharedZone.
+  Zone *AllocateSharedZone(Env::WriteLifeTimeHint lifetime);
+  void ReleaseSharedZone(Zone *z);
   Zone *AllocateMetaZone();
   Zone *AllocateSnapshotZone();
 
   void FinishOrReset(Zone *z, bool reset = false);
+  void ResetZoneIfUnused(Zone *z);
+  // Put a zone that was closed for writing back on the allocation lists
+  void ReturnZone(Zone *z);
+  // Top up the WAL zone pool in the background
+  void ScheduleWALZoneRefill();
+
+  // Full, closed zones holding at least min_garbage_pct percent of garbage,
+  // best garbage collection victim first.
+  std::vector<Zone *> GetGCCandidates(uint32_t min_garbage_pct);
 
   int GetResetableZones();
+  uint64_t GetTotalSpace();
   uint64_t GetFreeSpace();
   uint64_t GetUsedSpace();
   uint64_t GetReclaimableSpace();
@@ -210,10 +377,37 @@ class ZonedBlockDevice {
   void ResetUnusedIOZones();
   void LogZoneStats();
   void LogZoneUsage();
-
-  int GetReadFD() { return read_f_; }
-  int GetReadDirectFD() { return read_direct_f_; }
-  int GetWriteFD() { return write_f_; }
+  void LogTraceSummary();
+
+  // File descriptors of the first device
+  int GetReadFD() { return devices_.front()->read_f; }
+  int GetReadDirectFD() { return devices_.front()->read_direct_f; }
+  int GetWriteFD() { return devices_.front()->write_f; }
+  uint32_t GetNrDevices() { return devices_.size(); }
+  ZbdIOEngine *GetIOEngine() { return io_engine_.get(); }
+  ZenFSTracer *GetTracer() { return &tracer_; }
+  ZoneSpaceStats *GetSpaceStats() { return &space_stats_; }
+  // nullptr if the read cache is disabled
+  ZenFSReadCache *GetReadCache() { return read_cache_.get(); }
+  // Cache up to size bytes of file data, 0 disables the cache. Must be set
+  // before the file system is mounted.
+  void SetReadCacheSize(size_t size) { read_cache_.reset(size > 0 ? new ZenFSReadCache(size) : nullptr); }
+  ZenFSLifetimePredictor *GetLifetimePredictor() { return &lifetime_predictor_; }
+  ZenFSIOScheduler *GetIOScheduler() { return &io_sched_; }
+  // Let files other than WALs share open zones, so that the number of files
+  // written at once is not limited by the open zone limit. Must be set
+  // before the file system is mounted.
+  void SetSharedZones(bool enabled) { shared_zones_enabled_ = enabled; }
+  bool GetSharedZones() { return shared_zones_enabled_; }
+
+  // Page aligned write buffers shared by all writable files. Returns
+  // nullptr if out of memory.
+  char *GetWriteBuffer(size_t size);
+  void PutWriteBuffer(char *buf, size_t size);
+  uint64_t GetWriteBufferMemory() { return write_buffers_used_; }
+  // True if handing out another size bytes would exceed the write buffer
+  // budget. Writers then fall back to minimum sized buffers.
+  bool WriteBufferBudgetExceeded(size_t size);
 
   uint64_t GetZoneSize() { return zone_sz_; }
   uint32_t GetNrZones() { return nr_zones_; }
@@ -223,7 +417,11 @@ class ZonedBlockDevice {
   std::vector<Zone *> GetOpZones() { return op_zones_; }
   std::vector<Zone *> GetSnapshotZones() { return snapshot_zones_; }
 
+  // The superblock finish threshold is a lower bound, the threshold in use
+  // adapts to the active zone pressure
   void SetFinishTreshold(uint32_t threshold) { finish_threshold_ = threshold; }
+  uint32_t GetFinishThreshold();
+  uint64_t GetProactiveFinishes() { return proactive_finishes_; }
 
   bool SetMaxActiveZones(uint32_t max_active) {
     if (max_active == 0) /* No limit */
@@ -254,8 +452,9 @@ class ZonedBlockDevice {
 
   std::vector<ZoneStat> GetStat();
 
-  std::unique_ptr<BackgroundWorker> meta_worker_;
-  std::unique_ptr<BackgroundWorker> data_worker_;
+  // Meta zone rolls, zone resets and finishes and garbage collection
+  std::unique_ptr<BackgroundWorker> bg_worker_;
+  std::unique_ptr<BackgroundWorker> readahead_worker_;
 
  private:
   std::string ErrorToString(int err);
@@ -12,6 +12,7 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <stdlib.h>
 #include <string>
@@ -104,6 +105,63 @@ int test_background_worker_usage() {
   }
   return 0;
 }
+
+// Jobs queued while the worker is busy are run highest class first, the
+// worker runs what is left in the same order on destruction
+int test_background_worker_priorities() {
+  std::vector<int> order;
+  std::mutex block_mtx;
+
+  {
+    BackgroundWorker bg_worker;
+    std::unique_lock<std::mutex> block(block_mtx);
+
+    // Keep the single thread busy until all jobs are queued
+    bg_worker.SubmitJob([&]() { std::lock_guard<std::mutex> lk(block_mtx); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    bg_worker.SubmitJob([&]() { order.push_back(kGCJob); }, kGCJob);
+    bg_worker.SubmitJob([&]() { order.push_back(kFinishJob); }, kFinishJob);
+    bg_worker.SubmitJob([&]() { order.push_back(kResetJob); }, kResetJob);
+    bg_worker.SubmitJob([&]() { order.push_back(kMetaRollJob); }, kMetaRollJob);
+    block.unlock();
+  }
+
+  assert(order.size() == 4);
+  for (int i = 0; i < 4; i++) assert(order[i] == i);
+
+  return 0;
+}
+
+// A class never runs more jobs at once than its concurrency limit
+int test_background_worker_concurrency() {
+  std::atomic<int> running(0);
+  std::atomic<int> max_running(0);
+  std::atomic<int> done(0);
+
+  {
+    BackgroundWorker bg_worker(true, 4);
+    bg_worker.SetConcurrency(kGCJob, 1);
+
+    for (int i = 0; i < 100; i++) {
+      bg_worker.SubmitJob([&]() {
+        int now = ++running;
+        int max = max_running;
+        while (now > max && !max_running.compare_exchange_weak(max, now)) {
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(rand() % 200));
+        running--;
+        done++;
+      }, kGCJob);
+    }
+
+    while (done < 100) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  assert(max_running == 1);
+
+  return 0;
+}
 }  // namespace ROCKSDB_NAMESPACE
 
 int main(int argc, char **argv) {
@@ -115,6 +173,8 @@ int main(int argc, char **argv) {
 
   ROCKSDB_NAMESPACE::test_sum_in_background_worker();
   ROCKSDB_NAMESPACE::test_background_worker_usage();
+  ROCKSDB_NAMESPACE::test_background_worker_priorities();
+  ROCKSDB_NAMESPACE::test_background_worker_concurrency();
 
   return 0;
 }
\ No newline at end of file
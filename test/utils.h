@@ -8,15 +8,18 @@
 
 #include <rocksdb/file_system.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <random>
 #include <streambuf>
 #include <thread>
+#include <vector>
 
 #include "fs/fs_zenfs.h"
 #include "fs/metrics.h"
@@ -75,8 +78,92 @@ static std::string GetLogFilename(std::string bdev) {
   struct tm *log_start = std::localtime(&t);
   char buf[40];
 
+  /* Emulated device names hold a path */
+  std::replace(bdev.begin(), bdev.end(), '/', '_');
   ss << DEFAULT_ZENV_LOG_PATH << std::string("zenfs_") << bdev << "_test";
 
   return ss.str();
 }
+
+/* Create an empty file system on FLAGS_zbd, e.g. an emulated device */
+Status zenfs_mkfs(std::shared_ptr<Logger> logger) {
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return Status::IOError("Failed to open zoned block device");
+
+  if (FLAGS_aux_path.empty() || FLAGS_aux_path.back() != '/') FLAGS_aux_path.append("/");
+
+  auto metrics = std::make_shared<BytedanceMetrics>(std::make_shared<ByteDanceMetricsReporterFactory>(), "", logger);
+  ZenFS *zenFS = new ZenFS(zbd, FileSystem::Default(), logger, metrics);
+  Status s = zenFS->MkFS(FLAGS_aux_path, FLAGS_finish_threshold, FLAGS_max_open_zones, FLAGS_max_active_zones);
+  delete zenFS;
+
+  return s;
+}
+
+/* Test file contents are a function of a per file seed and the offset, so
+ * misplaced data is caught as well as corrupted data */
+void fill_test_data(char *buf, size_t n, uint64_t offset, uint32_t seed) {
+  for (size_t i = 0; i < n; i++) {
+    uint64_t x = ((offset + i) / 8 + 1) * 0x9E3779B97F4A7C15ULL + seed;
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 29;
+    buf[i] = (char)(x >> (((offset + i) % 8) * 8));
+  }
+}
+
+IOStatus write_test_file(FileSystem *fs, const std::string &fname, uint64_t size, uint32_t seed,
+                         Env::WriteLifeTimeHint lifetime = Env::WLTH_MEDIUM) {
+  std::unique_ptr<FSWritableFile> file;
+  std::vector<char> buf(64 * 1024);
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  s = fs->NewWritableFile(fname, FileOptions(), &file, &dbg);
+  if (!s.ok()) return s;
+  file->SetWriteLifeTimeHint(lifetime);
+
+  for (uint64_t offset = 0; offset < size && s.ok(); offset += buf.size()) {
+    size_t n = std::min((uint64_t)buf.size(), size - offset);
+    fill_test_data(buf.data(), n, offset, seed);
+    s = file->Append(Slice(buf.data(), n), iopts, &dbg);
+  }
+  if (s.ok()) s = file->Close(iopts, &dbg);
+
+  return s;
+}
+
+IOStatus verify_test_file(FileSystem *fs, const std::string &fname, uint64_t size, uint32_t seed) {
+  std::unique_ptr<FSSequentialFile> file;
+  std::vector<char> buf(64 * 1024);
+  std::vector<char> expected(buf.size());
+  uint64_t file_size;
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  s = fs->GetFileSize(fname, iopts, &file_size, &dbg);
+  if (!s.ok()) return s;
+  if (file_size != size) return IOStatus::Corruption("File size mismatch: " + fname);
+
+  s = fs->NewSequentialFile(fname, FileOptions(), &file, &dbg);
+  if (!s.ok()) return s;
+
+  for (uint64_t offset = 0; offset < size;) {
+    Slice result;
+    size_t n = std::min((uint64_t)buf.size(), size - offset);
+
+    s = file->Read(n, iopts, &result, buf.data(), &dbg);
+    if (!s.ok()) return s;
+    if (result.size() != n) return IOStatus::Corruption("Short read: " + fname);
+
+    fill_test_data(expected.data(), n, offset, seed);
+    if (memcmp(result.data(), expected.data(), n))
+      return IOStatus::Corruption("Data mismatch in " + fname + " at offset " + std::to_string(offset));
+    offset += n;
+  }
+
+  return IOStatus::OK();
+}
 }
@@ -0,0 +1,271 @@
+#include <gflags/gflags.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "fs/zbd_emu.h"
+
+DEFINE_string(emu_file, "/dev/shm/zbd_emu_test.img", "Backing file of the emulated device, overwritten");
+
+namespace ROCKSDB_NAMESPACE {
+
+#define MB (1024 * 1024)
+#define ZONE_SZ (2 * MB)
+#define ZONE_CAP (MB)
+
+/* 8 zones of 2MB with a capacity of 1MB, one open and two active zones */
+static std::string GetDeviceName() {
+  return ZENFS_EMU_PREFIX "file=" + FLAGS_emu_file + ",zones=8,zone_mb=2,cap_mb=1,max_active=2,max_open=1";
+}
+
+static uint64_t ZoneStart(uint32_t idx) { return (uint64_t)idx * ZONE_SZ; }
+
+static IOStatus OpenDevice(bool readonly, std::unique_ptr<ZbdEmuDevice> *dev) {
+  struct zbd_info info;
+  return ZbdEmuDevice::Open(GetDeviceName(), readonly, &info, dev);
+}
+
+static bool CheckZone(ZbdEmuDevice *dev, uint32_t idx, unsigned int cond, uint64_t wp) {
+  struct zbd_zone zone;
+  unsigned int nr_zones = 1;
+
+  if (dev->ReportZones(ZoneStart(idx), ZONE_SZ, &zone, &nr_zones) || nr_zones != 1) {
+    fprintf(stderr, "Failed to report zone %u: %s\n", idx, strerror(errno));
+    return false;
+  }
+  if (zone.cond != cond || zone.wp != wp) {
+    fprintf(stderr, "Zone %u: cond %u wp %llu, expected cond %u wp %llu\n", idx, zone.cond,
+            (unsigned long long)zone.wp, cond, (unsigned long long)wp);
+    return false;
+  }
+  return true;
+}
+
+/* Start and account a write, expecting it to fail with err if not 0 */
+static bool CheckWrite(ZbdEmuDevice *dev, uint64_t pos, size_t size, int err) {
+  int ret = dev->StartWrite(pos, size);
+
+  if (err == 0 && ret == 0) {
+    dev->CompleteWrite(pos, size);
+    return true;
+  }
+  if (err != 0 && ret == -1 && errno == err) return true;
+
+  fprintf(stderr, "Write of %zu bytes at %llu: returned %d (%s), expected %s\n", size, (unsigned long long)pos, ret,
+          ret ? strerror(errno) : "success", err ? strerror(err) : "success");
+  return false;
+}
+
+static void RemoveDevice() {
+  unlink(FLAGS_emu_file.c_str());
+  unlink((FLAGS_emu_file + ".zones").c_str());
+}
+
+/* Writes must be at the write pointer and fit in the zone capacity, a zone
+ * written to its capacity is full */
+int test_write_pointer() {
+  std::unique_ptr<ZbdEmuDevice> dev;
+  IOStatus s;
+
+  RemoveDevice();
+  s = OpenDevice(false, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_EMPTY, 0)) return 1;
+  if (!CheckWrite(dev.get(), 0, 4096, 0)) return 1;
+  if (!CheckWrite(dev.get(), 4096, 8192, 0)) return 1;
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_IMP_OPEN, 12288)) return 1;
+
+  /* Behind, ahead of and across the capacity of the zone */
+  if (!CheckWrite(dev.get(), 0, 4096, EIO)) return 1;
+  if (!CheckWrite(dev.get(), 16384, 4096, EIO)) return 1;
+  if (!CheckWrite(dev.get(), 12288, ZONE_CAP, EIO)) return 1;
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_IMP_OPEN, 12288)) return 1;
+
+  if (!CheckWrite(dev.get(), 12288, ZONE_CAP - 12288, 0)) return 1;
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_FULL, ZoneStart(1))) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(1), 4096, 0)) return 1;
+
+  return 0;
+}
+
+/* Writing a zone implicitly opens it, closing another one at the open
+ * limit. New zones can't be opened at the active limit. */
+int test_zone_limits() {
+  std::unique_ptr<ZbdEmuDevice> dev;
+  IOStatus s;
+
+  RemoveDevice();
+  s = OpenDevice(false, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  if (!CheckWrite(dev.get(), ZoneStart(0), 4096, 0)) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(1), 4096, 0)) return 1;
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_CLOSED, ZoneStart(0) + 4096)) return 1;
+  if (!CheckZone(dev.get(), 1, ZBD_ZONE_COND_IMP_OPEN, ZoneStart(1) + 4096)) return 1;
+
+  if (!CheckWrite(dev.get(), ZoneStart(2), 4096, EBUSY)) return 1;
+  if (!CheckZone(dev.get(), 2, ZBD_ZONE_COND_EMPTY, ZoneStart(2))) return 1;
+
+  /* Closed zones are active, writing one again just swaps the open zone */
+  if (!CheckWrite(dev.get(), ZoneStart(0) + 4096, 4096, 0)) return 1;
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_IMP_OPEN, ZoneStart(0) + 8192)) return 1;
+  if (!CheckZone(dev.get(), 1, ZBD_ZONE_COND_CLOSED, ZoneStart(1) + 4096)) return 1;
+
+  /* Closing a zone keeps it active */
+  if (dev->CloseZones(ZoneStart(0), ZONE_SZ)) {
+    fprintf(stderr, "Failed to close zone: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_CLOSED, ZoneStart(0) + 8192)) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(2), 4096, EBUSY)) return 1;
+
+  return 0;
+}
+
+/* Finishing and resetting zones end their activity and keep or drop the
+ * data written to them */
+int test_finish_reset() {
+  std::unique_ptr<ZbdEmuDevice> dev;
+  const size_t size = 4096;
+  char *buf;
+  IOStatus s;
+
+  RemoveDevice();
+  s = OpenDevice(false, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), size)) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  std::unique_ptr<char, decltype(&free)> buf_guard(buf, &free);
+
+  memset(buf, 0x5a, size);
+  if (!CheckWrite(dev.get(), ZoneStart(0), size, 0)) return 1;
+  if (pwrite(dev->GetWriteFd(), buf, size, ZoneStart(0)) != (ssize_t)size) {
+    fprintf(stderr, "Failed to write zone 0: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!CheckWrite(dev.get(), ZoneStart(1), size, 0)) return 1;
+
+  if (dev->FinishZones(ZoneStart(0), ZONE_SZ)) {
+    fprintf(stderr, "Failed to finish zone: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_FULL, ZoneStart(1))) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(0) + size, size, EIO)) return 1;
+
+  /* The finished zone no longer counts against the active limit */
+  if (!CheckWrite(dev.get(), ZoneStart(2), size, 0)) return 1;
+
+  memset(buf, 0, size);
+  if (pread(dev->GetReadFd(), buf, size, ZoneStart(0)) != (ssize_t)size || buf[0] != 0x5a) {
+    fprintf(stderr, "Data of the finished zone is gone\n");
+    return 1;
+  }
+
+  if (dev->ResetZones(ZoneStart(0), ZONE_SZ)) {
+    fprintf(stderr, "Failed to reset zone: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_EMPTY, ZoneStart(0))) return 1;
+  if (pread(dev->GetReadFd(), buf, size, ZoneStart(0)) != (ssize_t)size || buf[0] != 0) {
+    fprintf(stderr, "Reset zone does not read back zeroes\n");
+    return 1;
+  }
+
+  /* Reset zones may be written from their start again, once there is an
+   * active zone to spare */
+  if (!CheckWrite(dev.get(), ZoneStart(0), size, EBUSY)) return 1;
+  if (dev->FinishZones(ZoneStart(2), ZONE_SZ)) {
+    fprintf(stderr, "Failed to finish zone: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!CheckWrite(dev.get(), ZoneStart(0), size, 0)) return 1;
+
+  return 0;
+}
+
+/* Zone state persists across opens, read only opens see it but can't
+ * change it, and the limits account the zones left active */
+int test_reopen() {
+  std::unique_ptr<ZbdEmuDevice> dev;
+  struct zbd_info info;
+  IOStatus s;
+
+  RemoveDevice();
+  s = OpenDevice(false, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+  if (!CheckWrite(dev.get(), ZoneStart(0), 8192, 0)) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(1), 4096, 0)) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(3), ZONE_CAP, EBUSY)) return 1;
+  dev.reset();
+
+  /* The geometry comes from the state file, not the name */
+  s = ZbdEmuDevice::Open(ZENFS_EMU_PREFIX "file=" + FLAGS_emu_file, true, &info, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to reopen emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+  if (info.nr_zones != 8 || info.zone_size != ZONE_SZ || info.max_nr_open_zones != 1 || info.max_nr_active_zones != 2) {
+    fprintf(stderr, "Geometry changed across reopen\n");
+    return 1;
+  }
+  if (dev->GetWriteFd() != -1) {
+    fprintf(stderr, "Read only device has a write fd\n");
+    return 1;
+  }
+  if (!CheckZone(dev.get(), 0, ZBD_ZONE_COND_CLOSED, ZoneStart(0) + 8192)) return 1;
+  if (!CheckZone(dev.get(), 1, ZBD_ZONE_COND_IMP_OPEN, ZoneStart(1) + 4096)) return 1;
+  if (dev->ResetZones(ZoneStart(0), ZONE_SZ) != -1 || errno != EBADF) {
+    fprintf(stderr, "Read only device reset a zone\n");
+    return 1;
+  }
+  dev.reset();
+
+  s = OpenDevice(false, &dev);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to reopen emulated device: %s\n", s.ToString().c_str());
+    return 1;
+  }
+  if (!CheckWrite(dev.get(), ZoneStart(2), 4096, EBUSY)) return 1;
+  if (!CheckWrite(dev.get(), ZoneStart(0) + 8192, 4096, 0)) return 1;
+  if (!CheckZone(dev.get(), 1, ZBD_ZONE_COND_CLOSED, ZoneStart(1) + 4096)) return 1;
+
+  dev.reset();
+  RemoveDevice();
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) + +" [--emu_file=<path>]");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (ROCKSDB_NAMESPACE::test_write_pointer()) return 1;
+  if (ROCKSDB_NAMESPACE::test_zone_limits()) return 1;
+  if (ROCKSDB_NAMESPACE::test_finish_reset()) return 1;
+  if (ROCKSDB_NAMESPACE::test_reopen()) return 1;
+
+  return 0;
+}
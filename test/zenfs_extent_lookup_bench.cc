@@ -0,0 +1,77 @@
+// Microbenchmark for ZoneFile::GetExtent, measuring the extent lookup cost of
+// a random read against the number of extents in a file. No zoned block
+// device is needed, extents are synthetic.
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "fs/io_zenfs.h"
+
+using GFLAGS_NAMESPACE::ParseCommandLineFlags;
+using GFLAGS_NAMESPACE::SetUsageMessage;
+
+DEFINE_int32(lookups, 1000000, "Number of lookups per extent count");
+DEFINE_int32(max_extents, 16384, "Largest extent count to measure");
+DEFINE_int32(extent_size, 1024 * 1024, "Size of each synthetic extent in bytes");
+
+namespace ROCKSDB_NAMESPACE {
+
+// A file with synthetic extents that do not belong to any real zone.
+class BenchZoneFile : public ZoneFile {
+ public:
+  BenchZoneFile() : ZoneFile(nullptr, "bench", 0, nullptr) {}
+
+  // Drop the extents before ~ZoneFile tries to update zone usage.
+  ~BenchZoneFile() { extents_.store(nullptr); }
+
+  void AddSyntheticExtents(int nr_extents, uint32_t extent_size) {
+    for (int i = 0; i < nr_extents; i++) {
+      AddExtent(ZoneExtent((uint64_t)i * 2 * extent_size, extent_size, nullptr));
+    }
+    SetFileSize((uint64_t)nr_extents * extent_size);
+  }
+};
+
+int bench_extent_lookup() {
+  std::mt19937_64 rng(42);
+
+  fprintf(stdout, "%10s %16s\n", "extents", "ns/lookup");
+
+  for (int nr_extents = 1; nr_extents <= FLAGS_max_extents; nr_extents *= 4) {
+    BenchZoneFile file;
+    file.AddSyntheticExtents(nr_extents, FLAGS_extent_size);
+
+    std::uniform_int_distribution<uint64_t> dist(0, file.GetFileSize() - 1);
+    std::vector<uint64_t> offsets(FLAGS_lookups);
+    for (auto &offset : offsets) offset = dist(rng);
+
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto offset : offsets) {
+      uint64_t dev_offset;
+      if (file.GetExtent(offset, &dev_offset) == nullptr) {
+        fprintf(stderr, "Lookup of offset %lu failed\n", offset);
+        return 1;
+      }
+      checksum += dev_offset;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    fprintf(stdout, "%10d %16.1f  (checksum %lu)\n", nr_extents, (double)elapsed.count() / FLAGS_lookups, checksum);
+  }
+
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) + +" [OPTIONS]...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::bench_extent_lookup();
+}
@@ -0,0 +1,152 @@
+#include "utils.h"
+
+DEFINE_int32(gc_files, 16, "Number of files written before collecting garbage");
+
+namespace ROCKSDB_NAMESPACE {
+
+typedef std::vector<std::pair<uint64_t, uint32_t>> ExtentLayout;
+
+static ExtentLayout GetLayout(ZenFS *zenFS, const std::string &fname) {
+  ExtentLayout layout;
+  ZoneFile *zoneFile = zenFS->GetZoneFile(fname);
+
+  if (zoneFile == nullptr) return layout;
+  for (const auto &extent : zoneFile->GetExtents()) layout.emplace_back(extent.start_, extent.length_);
+  return layout;
+}
+
+static std::string GetTestFilename(int i) { return "gc_test/file_" + std::to_string(i); }
+
+/* Fill zones with files, delete every other file so that the zones hold
+ * both valid data and garbage, and collect them. The surviving files must
+ * read back the same, from their new extents, also after a remount. */
+int test_gc() {
+  std::shared_ptr<Logger> logger;
+  std::map<std::string, ExtentLayout> layouts;
+  ZenFS *zenFS;
+  IOOptions iopts;
+  IODebugContext dbg;
+  uint32_t nr_zones = 0;
+  bool moved = false;
+  Status s;
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(DEBUG_LEVEL);
+  }
+
+  s = zenfs_mkfs(logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  /* Files of 3/8 of a zone, written back to back, so most zones hold parts
+   * of three files and files straddle zones */
+  uint64_t file_size = zbd->GetZoneSize() / 8 * 3;
+
+  for (int i = 0; i < FLAGS_gc_files; i++) {
+    s = write_test_file(zenFS, GetTestFilename(i), file_size, i);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to write %s: %s\n", GetTestFilename(i).c_str(), s.ToString().c_str());
+      return 1;
+    }
+  }
+
+  for (int i = 1; i < FLAGS_gc_files; i += 2) {
+    s = zenFS->DeleteFile(GetTestFilename(i), iopts, &dbg);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to delete %s: %s\n", GetTestFilename(i).c_str(), s.ToString().c_str());
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < FLAGS_gc_files; i += 2) layouts[GetTestFilename(i)] = GetLayout(zenFS, GetTestFilename(i));
+
+  s = zenFS->ForceGarbageCollect(1, &nr_zones);
+  if (!s.ok()) {
+    fprintf(stderr, "Garbage collection failed: %s\n", s.ToString().c_str());
+    return 1;
+  }
+  if (nr_zones == 0) {
+    fprintf(stderr, "No zones were collected\n");
+    return 1;
+  }
+
+  for (auto &it : layouts) {
+    ExtentLayout layout = GetLayout(zenFS, it.first);
+    if (layout != it.second) moved = true;
+    it.second = layout;
+  }
+  if (!moved) {
+    fprintf(stderr, "Garbage collection did not move any extents\n");
+    return 1;
+  }
+
+  for (int i = 0; i < FLAGS_gc_files; i += 2) {
+    s = verify_test_file(zenFS, GetTestFilename(i), file_size, i);
+    if (!s.ok()) {
+      fprintf(stderr, "After garbage collection: %s\n", s.ToString().c_str());
+      return 1;
+    }
+  }
+
+  delete zenFS;
+
+  zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to remount filesystem, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  for (int i = 0; i < FLAGS_gc_files; i++) {
+    const std::string fname = GetTestFilename(i);
+    bool deleted = i % 2;
+
+    if (deleted) {
+      if (zenFS->FileExists(fname, iopts, &dbg).ok()) {
+        fprintf(stderr, "Deleted file %s is back after remount\n", fname.c_str());
+        return 1;
+      }
+      continue;
+    }
+
+    if (GetLayout(zenFS, fname) != layouts[fname]) {
+      fprintf(stderr, "Extents of %s changed across remount\n", fname.c_str());
+      return 1;
+    }
+    s = verify_test_file(zenFS, fname, file_size, i);
+    if (!s.ok()) {
+      fprintf(stderr, "After remount: %s\n", s.ToString().c_str());
+      return 1;
+    }
+  }
+
+  fprintf(stdout, "Collected %u zones\n", nr_zones);
+
+  delete zenFS;
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path>");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::test_gc();
+}
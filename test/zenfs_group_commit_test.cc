@@ -0,0 +1,189 @@
+#include "utils.h"
+
+DEFINE_int32(writer_threads, 8, "Number of concurrent metadata writers");
+DEFINE_int32(files_per_thread, 8, "Files renamed over and over by each writer");
+DEFINE_int32(rounds, 64, "Number of times each file is renamed");
+DEFINE_int32(forced_rolls, 8, "Meta zone rolls forced while the writers run");
+
+namespace ROCKSDB_NAMESPACE {
+
+#define TEST_DIR "group_commit_test"
+#define TEST_FILE_SIZE (4096)
+
+static std::string GetTestFilename(int thread, int file, int gen) {
+  return std::string(TEST_DIR) + "/t" + std::to_string(thread) + "_f" + std::to_string(file) + "." +
+         std::to_string(gen);
+}
+
+static uint32_t GetSeed(int thread, int file) { return thread * 1000 + file; }
+
+/* Renames and deletions only write metadata records, so concurrent writers
+ * end up in the same group commits. Every record acknowledged must be
+ * recovered, also those that were queued while the op log was rolled. */
+static IOStatus run_writer(ZenFS *zenFS, int thread) {
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  for (int f = 0; f < FLAGS_files_per_thread; f++) {
+    s = write_test_file(zenFS, GetTestFilename(thread, f, 0), TEST_FILE_SIZE, GetSeed(thread, f));
+    if (!s.ok()) return s;
+  }
+
+  for (int gen = 1; gen <= FLAGS_rounds; gen++) {
+    for (int f = 0; f < FLAGS_files_per_thread; f++) {
+      s = zenFS->RenameFile(GetTestFilename(thread, f, gen - 1), GetTestFilename(thread, f, gen), iopts, &dbg);
+      if (!s.ok()) return s;
+    }
+
+    /* A short lived file, its deletion is batched with those of others */
+    std::string tmp = std::string(TEST_DIR) + "/t" + std::to_string(thread) + "_tmp" + std::to_string(gen);
+    s = write_test_file(zenFS, tmp, TEST_FILE_SIZE, 0);
+    if (!s.ok()) return s;
+    s = zenFS->DeleteFile(tmp, iopts, &dbg);
+    if (!s.ok()) return s;
+  }
+
+  return s;
+}
+
+static int check_files(ZenFS *zenFS) {
+  std::vector<std::string> children;
+  std::set<std::string> expected;
+  IOOptions iopts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  for (int t = 0; t < FLAGS_writer_threads; t++) {
+    for (int f = 0; f < FLAGS_files_per_thread; f++) {
+      std::string fname = GetTestFilename(t, f, FLAGS_rounds);
+
+      expected.insert(fname.substr(strlen(TEST_DIR) + 1));
+      s = verify_test_file(zenFS, fname, TEST_FILE_SIZE, GetSeed(t, f));
+      if (!s.ok()) {
+        fprintf(stderr, "%s\n", s.ToString().c_str());
+        return 1;
+      }
+    }
+  }
+
+  s = zenFS->GetChildren(TEST_DIR, iopts, &children, &dbg);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to list %s: %s\n", TEST_DIR, s.ToString().c_str());
+    return 1;
+  }
+  if (std::set<std::string>(children.begin(), children.end()) != expected) {
+    fprintf(stderr, "Found %lu files in %s, expected %lu\n", children.size(), TEST_DIR, expected.size());
+    return 1;
+  }
+
+  return 0;
+}
+
+int test_group_commit() {
+  std::shared_ptr<Logger> logger;
+  ZenFS *zenFS;
+  IOOptions iopts;
+  IODebugContext dbg;
+  Status s;
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(DEBUG_LEVEL);
+  }
+
+  s = zenfs_mkfs(logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  /* The directory lives in the aux file system */
+  s = zenFS->CreateDirIfMissing(TEST_DIR, iopts, &dbg);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create %s: %s\n", TEST_DIR, s.ToString().c_str());
+    return 1;
+  }
+
+  /* Writes a block per record, so the op log runs out of space and is
+   * rolled by the group commit leader */
+  int nr_records = zbd->GetZoneSize() / zbd->GetBlockSize() * 3 / 2;
+  s = write_test_file(zenFS, TEST_DIR "/roll", TEST_FILE_SIZE, 0);
+  for (int i = 0; i < nr_records && s.ok(); i++) {
+    std::string from = i % 2 ? TEST_DIR "/roll.tmp" : TEST_DIR "/roll";
+    std::string to = i % 2 ? TEST_DIR "/roll" : TEST_DIR "/roll.tmp";
+    s = zenFS->RenameFile(from, to, iopts, &dbg);
+  }
+  if (s.ok()) s = zenFS->DeleteFile(nr_records % 2 ? TEST_DIR "/roll.tmp" : TEST_DIR "/roll", iopts, &dbg);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to fill the op log: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  std::vector<std::thread> writers;
+  std::vector<IOStatus> status(FLAGS_writer_threads);
+  std::atomic<int> running(FLAGS_writer_threads);
+
+  for (int t = 0; t < FLAGS_writer_threads; t++) {
+    writers.emplace_back([&, t]() {
+      status[t] = run_writer(zenFS, t);
+      running--;
+    });
+  }
+
+  IOStatus roll_status;
+  for (int i = 0; i < FLAGS_forced_rolls && running > 0 && roll_status.ok(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    roll_status = zenFS->ForceMetaZoneRoll();
+  }
+
+  for (auto &writer : writers) writer.join();
+
+  if (!roll_status.ok()) {
+    fprintf(stderr, "Forced meta zone roll failed: %s\n", roll_status.ToString().c_str());
+    return 1;
+  }
+  for (int t = 0; t < FLAGS_writer_threads; t++) {
+    if (!status[t].ok()) {
+      fprintf(stderr, "Writer %d failed: %s\n", t, status[t].ToString().c_str());
+      return 1;
+    }
+  }
+
+  if (check_files(zenFS)) return 1;
+  delete zenFS;
+
+  zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to remount filesystem, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  if (check_files(zenFS)) return 1;
+
+  delete zenFS;
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path>");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  return ROCKSDB_NAMESPACE::test_group_commit();
+}
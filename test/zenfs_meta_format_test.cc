@@ -0,0 +1,410 @@
+#include "utils.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* On disk tags of the file encoding, see io_zenfs.cc */
+#define TEST_TAG_FILE_ID (1)
+#define TEST_TAG_FILE_NAME (2)
+#define TEST_TAG_FILE_SIZE (3)
+#define TEST_TAG_LIFETIME (4)
+#define TEST_TAG_EXTENT (5)
+#define TEST_TAG_MTIME (6)
+
+/* Op log record tags, see fs_zenfs.cc */
+#define TEST_TAG_FILE_DELETION (3)
+#define TEST_TAG_FILE_REPLACE (5)
+#define TEST_TAG_FILE_DELETION_BATCH (6)
+
+/* Exposes the extent list encoding of files */
+class FormatTestZoneFile : public ZoneFile {
+ public:
+  explicit FormatTestZoneFile(ZonedBlockDevice *zbd) : ZoneFile(zbd, "format_test", 0, nullptr) {}
+
+  static void Encode(std::string *output, const std::vector<ZoneExtent> &extents, uint64_t zone_sz) {
+    EncodeExtents(output, extents.data(), extents.size(), zone_sz);
+  }
+  Status Decode(Slice *input) { return DecodeExtents(input); }
+};
+
+/* Little endian fields as written by util/coding.h, which is not a public
+ * rocksdb header */
+static void put_fixed32(std::string *dst, uint32_t value) {
+  for (int i = 0; i < 4; i++) dst->push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void put_fixed64(std::string *dst, uint64_t value) {
+  for (int i = 0; i < 8; i++) dst->push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void put_varint64(std::string *dst, uint64_t value) {
+  while (value >= 0x80) {
+    dst->push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  dst->push_back((char)value);
+}
+
+static void put_length_prefixed(std::string *dst, const std::string &value) {
+  put_varint64(dst, value.size());
+  dst->append(value);
+}
+
+static std::string make_record(size_t size, uint32_t seed) {
+  std::string record(size, 0);
+  fill_test_data(&record[0], size, 0, seed);
+  return record;
+}
+
+/* Records written together are packed, with padding wherever less than a
+ * record header is left in a block and at the end of each write. Records
+ * written one at a time, like before superblock version 2, are each padded
+ * to the next block. Reading back must skip all padding. */
+int test_read_record_padding() {
+  std::shared_ptr<Logger> logger;
+  std::vector<std::string> records;
+  std::string scratch;
+  Slice record;
+  IOStatus s;
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(DEBUG_LEVEL);
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+
+  Zone *zone = zbd->GetOpZones().front();
+  size_t bs = zbd->GetBlockSize();
+  const size_t header = 2 * sizeof(uint32_t);
+
+  s = zone->Reset();
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to reset meta zone: %s\n", s.ToString().c_str());
+    delete zbd;
+    return 1;
+  }
+
+  /* A packed group: the second record leaves less than a header in the
+   * block, the third spans blocks and the fourth ends on a block boundary */
+  records.push_back(make_record(10, 1));
+  records.push_back(make_record(bs - (header + 10) - header - header / 2, 2));
+  records.push_back(make_record(3 * bs, 3));
+  records.push_back(make_record(bs - 2 * header, 4));
+  records.push_back(make_record(1, 5));
+  size_t nr_packed = records.size();
+  /* Written one at a time */
+  records.push_back(make_record(20, 6));
+  records.push_back(make_record(bs - header, 7));
+  records.push_back(make_record(20, 8));
+
+  {
+    ZenMetaLog log(zbd, zone);
+    std::vector<Slice> slices(records.begin(), records.begin() + nr_packed);
+
+    s = log.AddRecords(slices.data(), slices.size());
+    for (size_t i = nr_packed; i < records.size() && s.ok(); i++) s = log.AddRecord(records[i]);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to write records: %s\n", s.ToString().c_str());
+      delete zbd;
+      return 1;
+    }
+  }
+
+  {
+    ZenMetaLog log(zbd, zone);
+
+    for (size_t i = 0; i < records.size(); i++) {
+      s = log.ReadRecord(&record, &scratch);
+      if (!s.ok() || record.ToString() != records[i]) {
+        fprintf(stderr, "Record %lu does not read back: %s\n", i, s.ToString().c_str());
+        delete zbd;
+        return 1;
+      }
+    }
+
+    s = log.ReadRecord(&record, &scratch);
+    if (!s.ok() || !record.empty()) {
+      fprintf(stderr, "Expected the end of the log: %s\n", s.ToString().c_str());
+      delete zbd;
+      return 1;
+    }
+  }
+
+  delete zbd;
+  return 0;
+}
+
+/* Extent lists are delta encoded against the previous extent, across zones
+ * in both directions and within a zone, gaps included. Files written before
+ * superblock version 3 encode each extent with fixed size fields, and must
+ * decode to the same extents. */
+int test_extent_encoding() {
+  std::shared_ptr<Logger> logger;
+  std::vector<ZoneExtent> extents;
+  IOStatus s;
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(DEBUG_LEVEL);
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+
+  uint64_t zone_sz = zbd->GetZoneSize();
+  uint32_t bs = zbd->GetBlockSize();
+  uint64_t base = 0;
+  while (zbd->GetIOZone(base) == nullptr) base += zone_sz;
+
+  auto add = [&](uint64_t zone, uint64_t offset, uint32_t length) {
+    uint64_t start = base + zone * zone_sz + offset;
+    extents.emplace_back(start, length, zbd->GetIOZone(start));
+  };
+  add(0, 0, bs);                  /* First extent of the list */
+  add(0, bs, 2 * bs);             /* Contiguous */
+  add(0, 16 * bs, bs);            /* Gap in the same zone */
+  add(2, 0, zone_sz);             /* Next zone but one, whole zone */
+  add(1, 3 * bs, bs);             /* Previous zone */
+  add(1, 2 * bs, bs);             /* Before the previous extent */
+  add(0, zone_sz - bs, bs);       /* Back to an earlier zone */
+
+  int ret = 0;
+  {
+    FormatTestZoneFile decoded(zbd);
+    std::string encoded;
+
+    FormatTestZoneFile::Encode(&encoded, extents, zone_sz);
+    Slice input(encoded);
+    Status ds = decoded.Decode(&input);
+    if (!ds.ok() || decoded.GetExtents() != extents || !input.empty()) {
+      fprintf(stderr, "Extent list does not decode to the encoded extents: %s\n", ds.ToString().c_str());
+      ret = 1;
+    }
+  }
+
+  /* A whole file, encoded the way older versions did */
+  std::string legacy;
+  uint64_t file_size = 0;
+  put_fixed32(&legacy, TEST_TAG_FILE_ID);
+  put_fixed64(&legacy, 42);
+  put_fixed32(&legacy, TEST_TAG_FILE_NAME);
+  put_length_prefixed(&legacy, "legacy_file");
+  put_fixed32(&legacy, TEST_TAG_LIFETIME);
+  put_fixed32(&legacy, (uint32_t)Env::WLTH_MEDIUM);
+  for (const auto &extent : extents) {
+    std::string fields;
+    put_fixed64(&fields, extent.start_);
+    put_fixed32(&fields, extent.length_);
+    put_fixed32(&legacy, TEST_TAG_EXTENT);
+    put_length_prefixed(&legacy, fields);
+    file_size += extent.length_;
+  }
+  put_fixed32(&legacy, TEST_TAG_FILE_SIZE);
+  put_fixed64(&legacy, file_size);
+  put_fixed32(&legacy, TEST_TAG_MTIME);
+  put_fixed64(&legacy, 1234);
+
+  if (ret == 0) {
+    FormatTestZoneFile decoded(zbd);
+    FormatTestZoneFile reencoded(zbd);
+    std::string current;
+
+    Slice input(legacy);
+    Status ds = decoded.DecodeFrom(&input);
+    if (!ds.ok() || decoded.GetID() != 42 || decoded.GetFilename() != "legacy_file" ||
+        decoded.GetFileSize() != file_size || decoded.GetExtents() != extents) {
+      fprintf(stderr, "Legacy file encoding does not decode: %s\n", ds.ToString().c_str());
+      ret = 1;
+    }
+
+    /* And round trips through the current encoding, which is smaller */
+    decoded.EncodeSnapshotTo(&current);
+    input = Slice(current);
+    if (ret == 0) ds = reencoded.DecodeFrom(&input);
+    if (ret == 0 && (!ds.ok() || reencoded.GetExtents() != extents || current.size() >= legacy.size())) {
+      fprintf(stderr, "File does not round trip through the current encoding: %s\n", ds.ToString().c_str());
+      ret = 1;
+    }
+  }
+
+  delete zbd;
+  return ret;
+}
+
+static std::string GetMixedFilename(int i) { return "mixed_version_test/file_" + std::to_string(i); }
+
+static std::string make_tagged(uint32_t tag, const std::string &data) {
+  std::string entry;
+  put_fixed32(&entry, tag);
+  put_length_prefixed(&entry, data);
+  return entry;
+}
+
+/* An op log written by several versions: a single file deletion the way it
+ * was recorded before deletions were batched, a deletion batch, and an
+ * extent replace with the extents of the file in the fixed size encoding.
+ * All of them must be applied on mount, and the file system must carry on
+ * in the current format from there. */
+int test_mixed_version_recovery() {
+  const int nr_files = 5;
+  std::shared_ptr<Logger> logger;
+  std::vector<uint64_t> ids(nr_files);
+  std::vector<std::string> names(nr_files);
+  std::vector<ZoneExtent> replaced;
+  uint64_t file_size = 0;
+  ZenFS *zenFS;
+  IOOptions iopts;
+  IODebugContext dbg;
+  Status s;
+
+  s = Env::Default()->NewLogger(GetLogFilename(FLAGS_zbd), &logger);
+  if (!s.ok()) {
+    fprintf(stderr, "ZenFS: Could not create logger");
+  } else {
+    logger->SetInfoLogLevel(DEBUG_LEVEL);
+  }
+
+  s = zenfs_mkfs(logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to create file system, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  ZonedBlockDevice *zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+  s = zenfs_mount(zbd, &zenFS, false, logger);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  /* Files 0..3 get legacy and batched records, file 4 is written later */
+  file_size = zbd->GetZoneSize() / 4 + 4096;
+  for (int i = 0; i < nr_files - 1; i++) {
+    s = write_test_file(zenFS, GetMixedFilename(i), file_size, i);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to write %s: %s\n", GetMixedFilename(i).c_str(), s.ToString().c_str());
+      return 1;
+    }
+    ZoneFile *zoneFile = zenFS->GetZoneFile(GetMixedFilename(i));
+    ids[i] = zoneFile->GetID();
+    names[i] = zoneFile->GetFilename();
+  }
+  replaced = zenFS->GetZoneFile(GetMixedFilename(3))->GetExtents();
+
+  delete zenFS;
+
+  zbd = zbd_open(false, logger);
+  if (zbd == nullptr) return 1;
+
+  /* Mount rolled to a fresh op log zone and reset the old one */
+  Zone *op_zone = nullptr;
+  for (const auto z : zbd->GetOpZones()) {
+    if (z->wp_ > z->start_) op_zone = z;
+  }
+  if (op_zone == nullptr) {
+    fprintf(stderr, "No op log zone in use\n");
+    delete zbd;
+    return 1;
+  }
+
+  {
+    ZenMetaLog log(zbd, op_zone);
+    std::string deletion;
+    std::string batch;
+    std::string file;
+
+    put_fixed64(&deletion, ids[0]);
+    put_length_prefixed(&deletion, names[0]);
+    s = log.AddRecord(make_tagged(TEST_TAG_FILE_DELETION, deletion));
+
+    put_varint64(&batch, 2);
+    for (int i = 1; i <= 2; i++) {
+      put_varint64(&batch, ids[i]);
+      put_length_prefixed(&batch, names[i]);
+    }
+    if (s.ok()) s = log.AddRecord(make_tagged(TEST_TAG_FILE_DELETION_BATCH, batch));
+
+    put_fixed32(&file, TEST_TAG_FILE_ID);
+    put_fixed64(&file, ids[3]);
+    for (const auto &extent : replaced) {
+      std::string fields;
+      put_fixed64(&fields, extent.start_);
+      put_fixed32(&fields, extent.length_);
+      put_fixed32(&file, TEST_TAG_EXTENT);
+      put_length_prefixed(&file, fields);
+    }
+    if (s.ok()) s = log.AddRecord(make_tagged(TEST_TAG_FILE_REPLACE, file));
+  }
+  delete zbd;
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to append op log records: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    zbd = zbd_open(false, logger);
+    if (zbd == nullptr) return 1;
+    s = zenfs_mount(zbd, &zenFS, false, logger);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to mount a mixed version op log, error: %s\n", s.ToString().c_str());
+      return 1;
+    }
+
+    for (int i = 0; i < nr_files; i++) {
+      const std::string fname = GetMixedFilename(i);
+      /* The second pass also sees file 4 written and file 3 deleted */
+      bool exists = pass == 0 ? i == 3 : i == 4;
+
+      if (!exists) {
+        if (zenFS->FileExists(fname, iopts, &dbg).ok()) {
+          fprintf(stderr, "Deleted file %s exists after mount %d\n", fname.c_str(), pass);
+          return 1;
+        }
+        continue;
+      }
+      if (i == 3 && zenFS->GetZoneFile(fname)->GetExtents() != replaced) {
+        fprintf(stderr, "Replaced extents of %s do not match\n", fname.c_str());
+        return 1;
+      }
+      s = verify_test_file(zenFS, fname, file_size, i);
+      if (!s.ok()) {
+        fprintf(stderr, "After mount %d: %s\n", pass, s.ToString().c_str());
+        return 1;
+      }
+    }
+
+    if (pass == 0) {
+      s = write_test_file(zenFS, GetMixedFilename(4), file_size, 4);
+      if (s.ok()) s = zenFS->DeleteFile(GetMixedFilename(3), iopts, &dbg);
+      if (!s.ok()) {
+        fprintf(stderr, "Failed to update the file system: %s\n", s.ToString().c_str());
+        return 1;
+      }
+    }
+
+    delete zenFS;
+  }
+
+  return 0;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
+                          +" --zbd=<zoned block device> --aux_path=<path>");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (ROCKSDB_NAMESPACE::test_read_record_padding()) return 1;
+  if (ROCKSDB_NAMESPACE::test_extent_encoding()) return 1;
+  if (ROCKSDB_NAMESPACE::test_mixed_version_recovery()) return 1;
+
+  return 0;
+}
@@ -7,11 +7,18 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <streambuf>
+#include <thread>
 
 #include <gflags/gflags.h>
 #include <rocksdb/file_system.h>
@@ -23,7 +30,7 @@ using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::RegisterFlagValidator;
 using GFLAGS_NAMESPACE::SetUsageMessage;
 
-DEFINE_string(zbd, "", "Path to a zoned block device.");
+DEFINE_string(zbd, "", "Path to a zoned block device, or a colon separated list of devices.");
 DEFINE_string(aux_path, "", "Path for auxiliary file storage (log and lock files).");
 DEFINE_bool(force, false, "Force file system creation.");
 DEFINE_string(path, "", "File path");
@@ -32,16 +39,21 @@ DEFINE_string(restore_path, "", "Path to restore files");
 DEFINE_string(backup_path, "", "Path to backup files");
 DEFINE_int32(max_active_zones, 0, "Max active zone limit");
 DEFINE_int32(max_open_zones, 0, "Max active zone limit");
+DEFINE_string(io_engine, "", "I/O engine: sync, libaio, io_uring or io_uring_sqpoll (default libaio)");
+DEFINE_int32(runs, 3, "Number of mounts to time in mount-bench");
+DEFINE_int32(copy_threads, 8, "Number of files backup, restore and migrate copy in parallel");
+DEFINE_uint64(copy_buffer_size, 4 * 1024 * 1024, "Size of the copy buffers, two per copy thread");
+DEFINE_string(dest_zbd, "", "Zoned block device(s) holding the ZenFS file system to migrate to");
 
 namespace ROCKSDB_NAMESPACE {
 
-ZonedBlockDevice *zbd_open(bool readonly) {
+ZonedBlockDevice *zbd_open(bool readonly, const std::string &devices = FLAGS_zbd) {
   auto logger = std::make_shared<test::NullLogger>();
-  ZonedBlockDevice *zbd = new ZonedBlockDevice(FLAGS_zbd, logger);
-  IOStatus open_status = zbd->Open(readonly);
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(devices, logger);
+  IOStatus open_status = zbd->Open(readonly, FLAGS_io_engine);
 
   if (!open_status.ok()) {
-    fprintf(stderr, "Failed to open zoned block device: %s, error: %s\n", FLAGS_zbd.c_str(),
+    fprintf(stderr, "Failed to open zoned block device: %s, error: %s\n", devices.c_str(),
             open_status.ToString().c_str());
     delete zbd;
     return nullptr;
@@ -231,6 +243,42 @@ int zenfs_tool_stat() {
   return 0;
 }
 
+int zenfs_tool_mount_bench() {
+  double total_ms = 0;
+
+  if (FLAGS_runs <= 0) {
+    fprintf(stderr, "--runs must be larger than 0\n");
+    return 1;
+  }
+
+  fprintf(stdout, "%5s %12s %12s %10s\n", "run", "open(ms)", "mount(ms)", "files");
+
+  for (int run = 0; run < FLAGS_runs; run++) {
+    auto start = std::chrono::steady_clock::now();
+    ZonedBlockDevice *zbd = zbd_open(true);
+    if (zbd == nullptr) return 1;
+    auto opened = std::chrono::steady_clock::now();
+
+    ZenFS *zenFS;
+    Status s = zenfs_mount(zbd, &zenFS, true);
+    if (!s.ok()) {
+      fprintf(stderr, "Failed to mount filesystem, error: %s\n", s.ToString().c_str());
+      return 1;
+    }
+    auto mounted = std::chrono::steady_clock::now();
+
+    double open_ms = std::chrono::duration<double, std::milli>(opened - start).count();
+    double mount_ms = std::chrono::duration<double, std::milli>(mounted - opened).count();
+    total_ms += open_ms + mount_ms;
+
+    fprintf(stdout, "%5d %12.1f %12.1f %10lu\n", run, open_ms, mount_ms, zenFS->GetWriteLifeTimeHints().size());
+    delete zenFS;
+  }
+
+  fprintf(stdout, "Average open + mount time: %.1f ms\n", total_ms / FLAGS_runs);
+  return 0;
+}
+
 int zenfs_tool_lsuuid() {
   std::map<std::string, std::string>::iterator it;
   std::map<std::string, std::string> zenFileSystems = ListZenFileSystems();
@@ -285,113 +333,326 @@ void ReadWriteLifeTimeHints() {
   wlth_file.close();
 }
 
-IOStatus zenfs_tool_copy_file(FileSystem *f_fs, std::string f, FileSystem *t_fs, std::string t) {
-  FileOptions fopts;
-  IOOptions iopts;
-  IODebugContext dbg;
-  IOStatus s;
-  std::unique_ptr<FSSequentialFile> f_file;
-  std::unique_ptr<FSWritableFile> t_file;
-  size_t buffer_sz = 1024 * 1024;
-  uint64_t to_copy;
-  char *buffer;
+/* A copy job, one file to copy */
+struct CopyJob {
+  std::string from;
+  std::string to;
+  uint64_t size;
+  Env::WriteLifeTimeHint hint;
+};
+
+/* Reads a file to copy chunk by chunk, an empty chunk marks the end */
+class CopySource {
+ public:
+  virtual ~CopySource() {}
+  virtual IOStatus Read(size_t n, char *buf, Slice *result) = 0;
+};
+
+class FileCopySource : public CopySource {
+  std::unique_ptr<FSSequentialFile> file_;
+
+ public:
+  explicit FileCopySource(std::unique_ptr<FSSequentialFile> file) : file_(std::move(file)) {}
+
+  IOStatus Read(size_t n, char *buf, Slice *result) override {
+    IOOptions iopts;
+    IODebugContext dbg;
+    return file_->Read(n, iopts, result, buf, &dbg);
+  }
+};
+
+/* Reads a ZenFS file straight off the device, following its extents, with
+ * direct reads of up to one buffer per call */
+class ExtentCopySource : public CopySource {
+  ZonedBlockDevice *zbd_;
+  std::vector<ZoneExtent> extents_;
+  uint64_t remaining_;
+  size_t idx_ = 0;
+  uint64_t pos_ = 0;
+
+ public:
+  ExtentCopySource(ZonedBlockDevice *zbd, ZoneFile *zoneFile)
+      : zbd_(zbd), extents_(zoneFile->GetExtents()), remaining_(zoneFile->GetFileSize()) {}
+
+  IOStatus Read(size_t n, char *buf, Slice *result) override {
+    uint64_t bs = zbd_->GetBlockSize();
+
+    while (idx_ < extents_.size() && pos_ == extents_[idx_].length_) {
+      idx_++;
+      pos_ = 0;
+    }
 
-  fprintf(stdout, "%s\n", f.c_str());
+    if (idx_ == extents_.size() || remaining_ == 0) {
+      *result = Slice(buf, 0);
+      return IOStatus::OK();
+    }
 
-  s = f_fs->GetFileSize(f, iopts, &to_copy, &dbg);
-  if (!s.ok()) {
-    return s;
-  }
+    ZoneExtent &extent = extents_[idx_];
+    uint64_t len = std::min<uint64_t>({n, extent.length_ - pos_, remaining_});
+    uint64_t offset = extent.start_ + pos_;
+    /* The extent tail is padded up to the next block on the device, so reads
+     * of whole blocks never reach into other data */
+    uint64_t dev_len = (len + bs - 1) / bs * bs;
+    bool direct = (offset % bs) == 0 && dev_len <= n;
+    uint64_t read = 0;
+
+    if (!direct) dev_len = len;
+
+    while (read < dev_len) {
+      ssize_t r = zbd_->GetIOEngine()->Read(buf + read, dev_len - read, offset + read, direct);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) break;
+      read += r;
+    }
 
-  s = f_fs->NewSequentialFile(f, fopts, &f_file, &dbg);
-  if (!s.ok()) {
-    return s;
-  }
+    if (read < len) return IOStatus::IOError("Failed to read extent");
+
+    pos_ += len;
+    remaining_ -= len;
+    *result = Slice(buf, len);
+    return IOStatus::OK();
+  }
+};
+
+/* Copies files with a pool of worker threads. Each worker reads the next
+ * chunk of a file while the current one is written. Sources on ZenFS are
+ * read extent by extent from the device rather than through the file
+ * system. */
+class CopyEngine {
+  FileSystem *f_fs_;
+  FileSystem *t_fs_;
+  /* Source file system if it is ZenFS */
+  ZenFS *f_zenfs_;
+  size_t buffer_sz_;
+  size_t alignment_;
+
+  std::vector<CopyJob> jobs_;
+  uint64_t total_bytes_ = 0;
+
+  std::atomic<size_t> next_job_{0};
+  std::atomic<uint64_t> bytes_copied_{0};
+  std::atomic<uint64_t> files_copied_{0};
+  std::atomic<bool> failed_{false};
+
+  std::mutex mtx_;
+  std::condition_variable done_cv_;
+  bool done_ = false;
+  IOStatus status_;
+
+ public:
+  CopyEngine(FileSystem *f_fs, FileSystem *t_fs) : f_fs_(f_fs), t_fs_(t_fs) {
+    f_zenfs_ = dynamic_cast<ZenFS *>(f_fs);
+    alignment_ = f_zenfs_ ? f_zenfs_->GetZonedBlockDevice()->GetBlockSize() : 4096;
+    buffer_sz_ = std::max<size_t>(FLAGS_copy_buffer_size, alignment_);
+    buffer_sz_ = (buffer_sz_ + alignment_ - 1) / alignment_ * alignment_;
+  }
+
+  IOStatus AddFile(std::string f, std::string t) {
+    IOOptions iopts;
+    IODebugContext dbg;
+    CopyJob job;
+    IOStatus s;
+
+    s = f_fs_->GetFileSize(f, iopts, &job.size, &dbg);
+    if (!s.ok()) return s;
+
+    job.from = f;
+    job.to = t;
+    job.hint = GetWriteLifeTimeHint(t);
+    if (f_zenfs_) {
+      ZoneFile *zoneFile = f_zenfs_->GetZoneFile(f);
+      if (zoneFile) job.hint = zoneFile->GetWriteLifeTimeHint();
+    }
 
-  s = t_fs->NewWritableFile(t, fopts, &t_file, &dbg);
-  if (!s.ok()) {
+    total_bytes_ += job.size;
+    jobs_.push_back(job);
     return s;
   }
 
-  t_file->SetWriteLifeTimeHint(GetWriteLifeTimeHint(t));
+  /* Queue all files below f_dir, creating the destination directories */
+  IOStatus AddDir(std::string f_dir, std::string t_dir) {
+    IOOptions opts;
+    IODebugContext dbg;
+    IOStatus s;
+    std::vector<std::string> files;
+
+    s = f_fs_->GetChildren(f_dir, opts, &files, &dbg);
+    if (!s.ok()) {
+      return s;
+    }
+
+    for (const auto &f : files) {
+      std::string filename = f_dir + f;
+      bool is_dir;
+
+      if (f == "." || f == ".." || f == "write_lifetime_hints.dat") continue;
+
+      s = f_fs_->IsDirectory(filename, opts, &is_dir, &dbg);
+      if (!s.ok()) {
+        return s;
+      }
+
+      std::string dest_filename;
+
+      if (t_dir == "") {
+        dest_filename = f;
+      } else {
+        dest_filename = t_dir + "/" + f;
+      }
+
+      if (is_dir) {
+        s = t_fs_->CreateDir(dest_filename, opts, &dbg);
+        if (!s.ok()) {
+          return s;
+        }
+        s = AddDir(filename + "/", dest_filename);
+      } else {
+        s = AddFile(filename, dest_filename);
+      }
+      if (!s.ok()) {
+        return s;
+      }
+    }
 
-  buffer = (char *)malloc(buffer_sz);
-  if (buffer == nullptr) {
-    return IOStatus::IOError("Failed to allocate copy buffer");
+    return s;
   }
 
-  while (to_copy > 0) {
-    size_t chunk_sz = to_copy;
-    Slice chunk_slice;
+  IOStatus Run() {
+    int nr_threads = std::max(1, FLAGS_copy_threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
 
-    if (chunk_sz > buffer_sz) chunk_sz = buffer_sz;
+    /* Largest files first, so that no single large file is left to copy at
+     * the end */
+    std::sort(jobs_.begin(), jobs_.end(), [](const CopyJob &a, const CopyJob &b) { return a.size > b.size; });
 
-    s = f_file->Read(chunk_sz, iopts, &chunk_slice, buffer, &dbg);
-    if (!s.ok()) {
-      break;
+    std::thread progress(&CopyEngine::ReportProgress, this, start);
+    for (int i = 0; i < nr_threads; i++) workers.emplace_back(&CopyEngine::Worker, this);
+    for (auto &worker : workers) worker.join();
+
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      done_ = true;
     }
+    done_cv_.notify_all();
+    progress.join();
 
-    s = t_file->Append(chunk_slice, iopts, &dbg);
-    to_copy -= chunk_slice.size();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stdout, "Copied %lu of %lu files, %lu MB in %.1f s, %.1f MB/s\n", files_copied_.load(), jobs_.size(),
+            bytes_copied_.load() / (1024 * 1024), secs,
+            secs > 0 ? bytes_copied_.load() / (1024 * 1024) / secs : 0.0);
+    return status_;
   }
 
-  free(buffer);
-  if (!s.ok()) {
-    return s;
+ private:
+  void Worker() {
+    size_t idx;
+
+    while (!failed_ && (idx = next_job_++) < jobs_.size()) {
+      IOStatus s = CopyFile(jobs_[idx]);
+      if (!s.ok()) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (status_.ok()) status_ = IOStatus::IOError(jobs_[idx].from + ": " + s.ToString());
+        failed_ = true;
+      }
+    }
   }
 
-  return t_file->Fsync(iopts, &dbg);
-}
+  IOStatus OpenSource(const CopyJob &job, std::unique_ptr<CopySource> *source) {
+    FileOptions fopts;
+    IODebugContext dbg;
+    std::unique_ptr<FSSequentialFile> f_file;
 
-IOStatus zenfs_tool_copy_dir(FileSystem *f_fs, std::string f_dir, FileSystem *t_fs, std::string t_dir) {
-  IOOptions opts;
-  IODebugContext dbg;
-  IOStatus s;
-  std::vector<std::string> files;
+    if (f_zenfs_) {
+      ZoneFile *zoneFile = f_zenfs_->GetZoneFile(job.from);
+      if (zoneFile == nullptr) return IOStatus::NotFound("File vanished during copy");
+      source->reset(new ExtentCopySource(f_zenfs_->GetZonedBlockDevice(), zoneFile));
+      return IOStatus::OK();
+    }
 
-  s = f_fs->GetChildren(f_dir, opts, &files, &dbg);
-  if (!s.ok()) {
+    IOStatus s = f_fs_->NewSequentialFile(job.from, fopts, &f_file, &dbg);
+    if (s.ok()) source->reset(new FileCopySource(std::move(f_file)));
     return s;
   }
 
-  for (const auto &f : files) {
-    std::string filename = f_dir + f;
-    bool is_dir;
+  IOStatus CopyFile(const CopyJob &job) {
+    FileOptions fopts;
+    IOOptions iopts;
+    IODebugContext dbg;
+    IOStatus s;
+    std::unique_ptr<CopySource> source;
+    std::unique_ptr<FSWritableFile> t_file;
+    char *buffers[2] = {nullptr, nullptr};
+    Slice chunks[2];
+    std::future<IOStatus> pending;
+    int cur = 0;
 
-    if (f == "." || f == ".." || f == "write_lifetime_hints.dat") continue;
+    s = OpenSource(job, &source);
+    if (!s.ok()) return s;
 
-    s = f_fs->IsDirectory(filename, opts, &is_dir, &dbg);
-    if (!s.ok()) {
-      return s;
+    s = t_fs_->NewWritableFile(job.to, fopts, &t_file, &dbg);
+    if (!s.ok()) return s;
+
+    t_file->SetWriteLifeTimeHint(job.hint);
+
+    for (auto &buffer : buffers) {
+      if (posix_memalign((void **)&buffer, alignment_, buffer_sz_)) {
+        free(buffers[0]);
+        return IOStatus::IOError("Failed to allocate copy buffer");
+      }
     }
 
-    std::string dest_filename;
+    auto read_chunk = [this, &source, &buffers, &chunks](int b) { return source->Read(buffer_sz_, buffers[b], &chunks[b]); };
+
+    pending = std::async(std::launch::async, read_chunk, cur);
+    while (true) {
+      s = pending.get();
+      if (!s.ok() || chunks[cur].empty() || failed_) break;
 
-    if (t_dir == "") {
-      dest_filename = f;
-    } else {
-      dest_filename = t_dir + "/" + f;
+      /* Read ahead into the other buffer while this chunk is written */
+      pending = std::async(std::launch::async, read_chunk, 1 - cur);
+
+      s = t_file->Append(chunks[cur], iopts, &dbg);
+      if (!s.ok()) break;
+
+      bytes_copied_ += chunks[cur].size();
+      cur = 1 - cur;
     }
 
-    if (is_dir) {
-      s = t_fs->CreateDir(dest_filename, opts, &dbg);
-      if (!s.ok()) {
-        return s;
-      }
-      s = zenfs_tool_copy_dir(f_fs, filename + "/", t_fs, dest_filename);
-      if (!s.ok()) {
-        return s;
-      }
-    } else {
-      s = zenfs_tool_copy_file(f_fs, filename, t_fs, dest_filename);
-      if (!s.ok()) {
-        return s;
-      }
+    if (pending.valid()) pending.wait();
+    if (s.ok() && failed_) s = IOStatus::IOError("Copy aborted");
+    free(buffers[0]);
+    free(buffers[1]);
+    if (!s.ok()) {
+      return s;
     }
+
+    s = t_file->Fsync(iopts, &dbg);
+    if (!s.ok()) {
+      return s;
+    }
+
+    s = t_file->Close(iopts, &dbg);
+    if (s.ok()) files_copied_++;
+    return s;
   }
 
-  return s;
-}
+  void ReportProgress(std::chrono::steady_clock::time_point start) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    uint64_t last_bytes = 0;
+
+    while (!done_cv_.wait_for(lock, std::chrono::seconds(1), [this] { return done_; })) {
+      uint64_t bytes = bytes_copied_;
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      fprintf(stdout, "%lu/%lu MB, %lu/%lu files, %.1f MB/s (%.1f MB/s average)\n", bytes / (1024 * 1024),
+              total_bytes_ / (1024 * 1024), files_copied_.load(), jobs_.size(),
+              (double)(bytes - last_bytes) / (1024 * 1024), bytes / (1024 * 1024) / secs);
+      fflush(stdout);
+      last_bytes = bytes;
+    }
+  }
+};
 
 int zenfs_tool_backup() {
   Status status;
@@ -408,12 +669,14 @@ int zenfs_tool_backup() {
     return 1;
   }
 
+  CopyEngine copy(zenFS, FileSystem::Default().get());
   if (!FLAGS_backup_path.empty() && FLAGS_backup_path.back() != '/') {
     std::string dest_filename = FLAGS_path + "/" + FLAGS_backup_path.substr(FLAGS_backup_path.find_last_of('/') + 1);
-    io_status = zenfs_tool_copy_file(zenFS, FLAGS_backup_path, FileSystem::Default().get(), dest_filename);
+    io_status = copy.AddFile(FLAGS_backup_path, dest_filename);
   } else {
-    io_status = zenfs_tool_copy_dir(zenFS, FLAGS_backup_path, FileSystem::Default().get(), FLAGS_path);
+    io_status = copy.AddDir(FLAGS_backup_path, FLAGS_path);
   }
+  if (io_status.ok()) io_status = copy.Run();
   if (!io_status.ok()) {
     fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
     return 1;
@@ -445,12 +708,68 @@ int zenfs_tool_restore() {
     return 1;
   }
 
-  io_status = zenfs_tool_copy_dir(FileSystem::Default().get(), FLAGS_path, zenFS, FLAGS_restore_path);
+  CopyEngine copy(FileSystem::Default().get(), zenFS);
+  io_status = copy.AddDir(FLAGS_path, FLAGS_restore_path);
+  if (io_status.ok()) io_status = copy.Run();
+  if (!io_status.ok()) {
+    fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Copy the files of one ZenFS file system to another. Only the extents of
+ * live files are read, so garbage on the source is left behind. */
+int zenfs_tool_migrate() {
+  Status status;
+  IOStatus io_status;
+  ZonedBlockDevice *f_zbd, *t_zbd;
+  ZenFS *f_zenFS, *t_zenFS;
+
+  if (FLAGS_dest_zbd.empty()) {
+    fprintf(stderr, "Error: Specify --dest_zbd=<device> holding the file system to migrate to\n");
+    return 1;
+  }
+
+  f_zbd = zbd_open(true);
+  if (f_zbd == nullptr) return 1;
+
+  status = zenfs_mount(f_zbd, &f_zenFS, true);
+  if (!status.ok()) {
+    fprintf(stderr, "Failed to mount source filesystem, error: %s\n", status.ToString().c_str());
+    return 1;
+  }
+
+  t_zbd = zbd_open(false, FLAGS_dest_zbd);
+  if (t_zbd == nullptr) return 1;
+
+  status = zenfs_mount(t_zbd, &t_zenFS, false);
+  if (!status.ok()) {
+    fprintf(stderr, "Failed to mount destination filesystem, error: %s\n", status.ToString().c_str());
+    return 1;
+  }
+
+  std::string t_dir;
+  if (!FLAGS_path.empty() && FLAGS_path != "/") {
+    IOOptions opts;
+    IODebugContext dbg;
+
+    format_path(FLAGS_path);
+    t_dir = FLAGS_path.substr(0, FLAGS_path.size() - 1);
+    io_status = t_zenFS->CreateDirIfMissing(t_dir, opts, &dbg);
+  }
+
+  CopyEngine copy(f_zenFS, t_zenFS);
+  if (io_status.ok()) io_status = copy.AddDir(FLAGS_path, t_dir);
+  if (io_status.ok()) io_status = copy.Run();
   if (!io_status.ok()) {
     fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
     return 1;
   }
 
+  delete t_zenFS;
+  delete f_zenFS;
   return 0;
 }
 
@@ -480,7 +799,8 @@ int zenfs_tool_dump() {
 
 int main(int argc, char **argv) {
   gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) +
-                          +" <command> [OPTIONS]...\nCommands: mkfs, list, ls-uuid, df, backup, restore");
+                          +" <command> [OPTIONS]...\nCommands: mkfs, list, ls-uuid, df, backup, restore, dump, stat, "
+                           "mount-bench, migrate");
   if (argc < 2) {
     fprintf(stderr, "You need to specify a command.\n");
     return 1;
@@ -509,6 +829,10 @@ int main(int argc, char **argv) {
     return ROCKSDB_NAMESPACE::zenfs_tool_dump();
   } else if (subcmd == "stat") {
     return ROCKSDB_NAMESPACE::zenfs_tool_stat();
+  } else if (subcmd == "mount-bench") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_mount_bench();
+  } else if (subcmd == "migrate") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_migrate();
   } else {
     fprintf(stderr, "Subcommand not recognized: %s\n", subcmd.c_str());
     return 1;
@@ -0,0 +1,570 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+// Microbenchmarks for the ZenFS layer. Runs against a zoned block device
+// holding a ZenFS file system created with `zenfs mkfs` and prints the
+// results, including latency histograms, as JSON on stdout.
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <rocksdb/file_system.h>
+#include <util/testutil.h>
+
+#include "fs/fs_zenfs.h"
+
+using GFLAGS_NAMESPACE::ParseCommandLineFlags;
+using GFLAGS_NAMESPACE::SetUsageMessage;
+
+DEFINE_string(zbd, "", "Path to a zoned block device, or a colon separated list of devices.");
+DEFINE_string(io_engine, "", "I/O engine: sync, libaio, io_uring or io_uring_sqpoll (default libaio)");
+DEFINE_string(benchmarks, "seq_write,rand_write,wal_sync,rand_read,multi_read,alloc_zone,meta_sync,meta_roll",
+              "Comma separated list of benchmarks to run");
+DEFINE_string(path, "/zenfs_bench/", "ZenFS directory for benchmark files");
+DEFINE_int32(threads, 1, "Number of threads per benchmark");
+DEFINE_int64(file_size, 64 * 1024 * 1024, "Size of each file written by the write benchmarks");
+DEFINE_int32(write_size, 1024 * 1024, "Append size of seq_write, mean append size of rand_write");
+DEFINE_int32(wal_write_size, 4096, "Append size of wal_sync");
+DEFINE_int32(read_size, 4096, "Size of each read of rand_read and multi_read");
+DEFINE_int32(multiread_batch, 16, "Number of reads per MultiRead call");
+DEFINE_int32(ops, 10000, "Operations per thread for wal_sync, rand_read, multi_read, alloc_zone and meta_sync");
+DEFINE_string(roll_file_counts, "100,1000,10000", "File counts to measure meta_roll at");
+DEFINE_bool(keep_files, false, "Do not delete the benchmark files when done");
+DEFINE_string(trace_file, "", "Write the ZenFS operation trace as JSON to this file when done");
+DEFINE_int64(read_cache_size, 0, "Memory budget of the ZenFS read cache in bytes, 0 disables the cache");
+DEFINE_bool(shared_zones, false, "Let files other than WALs share open zones");
+DEFINE_int64(bg_write_rate, 0, "Rate limit of background writes in bytes per second, 0 is unlimited");
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Latency histogram with 8 linear buckets per power of two */
+class BenchHistogram {
+  static const int kSubBuckets = 8;
+  static const int kBuckets = 64 * kSubBuckets;
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+
+  static int BucketOf(uint64_t v) {
+    if (v < kSubBuckets) return v;
+    int msb = 63 - __builtin_clzll(v);
+    return (msb - 2) * kSubBuckets + ((v >> (msb - 3)) & (kSubBuckets - 1));
+  }
+
+  /* Smallest value of the next bucket */
+  static uint64_t BucketLimit(int b) {
+    b++;
+    if (b < kSubBuckets * 2) return b;
+    int msb = b / kSubBuckets + 2;
+    return (uint64_t)(kSubBuckets + b % kSubBuckets) << (msb - 3);
+  }
+
+ public:
+  BenchHistogram() : buckets_(kBuckets, 0) {}
+
+  void Add(uint64_t v) {
+    buckets_[BucketOf(v)]++;
+    count_++;
+    sum_ += v;
+    if (v < min_) min_ = v;
+    if (v > max_) max_ = v;
+  }
+
+  void Merge(const BenchHistogram &other) {
+    for (int i = 0; i < kBuckets; i++) buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.min_ < min_) min_ = other.min_;
+    if (other.max_ > max_) max_ = other.max_;
+  }
+
+  uint64_t Count() const { return count_; }
+
+  uint64_t Percentile(double p) const {
+    uint64_t target = (uint64_t)(count_ * p / 100.0);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < kBuckets; i++) {
+      seen += buckets_[i];
+      if (seen > target) return std::min(BucketLimit(i), max_);
+    }
+    return max_;
+  }
+
+  /* Values are nanoseconds, reported in microseconds */
+  void EncodeJson(std::ostream &json_stream) const {
+    json_stream << "{\"count\":" << count_;
+    json_stream << ",\"min_us\":" << (count_ ? min_ : 0) / 1000.0;
+    json_stream << ",\"max_us\":" << max_ / 1000.0;
+    json_stream << ",\"mean_us\":" << (count_ ? (double)sum_ / count_ : 0) / 1000.0;
+    json_stream << ",\"p50_us\":" << Percentile(50) / 1000.0;
+    json_stream << ",\"p90_us\":" << Percentile(90) / 1000.0;
+    json_stream << ",\"p99_us\":" << Percentile(99) / 1000.0;
+    json_stream << ",\"p999_us\":" << Percentile(99.9) / 1000.0;
+    json_stream << ",\"buckets\":[";
+    bool first = true;
+    for (int i = 0; i < kBuckets; i++) {
+      if (!buckets_[i]) continue;
+      if (!first) json_stream << ",";
+      json_stream << "{\"le_us\":" << BucketLimit(i) / 1000.0 << ",\"count\":" << buckets_[i] << "}";
+      first = false;
+    }
+    json_stream << "]}";
+  }
+};
+
+struct BenchStats {
+  BenchHistogram latency;
+  uint64_t bytes = 0;
+  uint64_t errors = 0;
+};
+
+struct BenchResult {
+  std::string name;
+  std::string params;
+  int threads;
+  double elapsed_s;
+  BenchStats stats;
+};
+
+class LatencyTimer {
+  BenchHistogram *hist_;
+  std::chrono::steady_clock::time_point start_;
+
+ public:
+  explicit LatencyTimer(BenchHistogram *hist) : hist_(hist), start_(std::chrono::steady_clock::now()) {}
+  ~LatencyTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    hist_->Add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+};
+
+class ZenFSBench {
+  ZenFS *zenFS_;
+  ZonedBlockDevice *zbd_;
+  std::vector<BenchResult> results_;
+  char *data_ = nullptr;
+  size_t data_sz_ = 0;
+  /* Files left behind for the read benchmarks */
+  std::vector<std::string> read_files_;
+
+  std::string FileName(const std::string &bench, int tid, int nr) {
+    return FLAGS_path + bench + "_" + std::to_string(tid) + "_" + std::to_string(nr);
+  }
+
+  /* Random, page aligned data like the buffers RocksDB writes from */
+  bool PrepareData(size_t size) {
+    if (posix_memalign((void **)&data_, sysconf(_SC_PAGESIZE), size)) return false;
+    std::mt19937_64 rng(42);
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) ((uint64_t *)data_)[i] = rng();
+    data_sz_ = size;
+    return true;
+  }
+
+  void Run(const std::string &name, const std::string &params, std::function<void(int, BenchStats *)> fn) {
+    std::vector<BenchStats> stats(FLAGS_threads);
+    std::vector<std::thread> threads;
+    BenchResult result;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < FLAGS_threads; t++) threads.emplace_back(fn, t, &stats[t]);
+    for (auto &t : threads) t.join();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    result.name = name;
+    result.params = params;
+    result.threads = FLAGS_threads;
+    result.elapsed_s = std::chrono::duration<double>(elapsed).count();
+    for (const auto &s : stats) {
+      result.stats.latency.Merge(s.latency);
+      result.stats.bytes += s.bytes;
+      result.stats.errors += s.errors;
+    }
+
+    fprintf(stderr, "%-12s %-24s %10.0f ops/s %10.1f MB/s\n", name.c_str(), params.c_str(),
+            result.stats.latency.Count() / result.elapsed_s, result.stats.bytes / result.elapsed_s / (1024 * 1024));
+    results_.push_back(std::move(result));
+  }
+
+  /* Write a file of --file_size, with appends of random size if rand is set */
+  void WriteFile(const std::string &fname, bool rand, std::mt19937_64 *rng, BenchStats *stats) {
+    std::unique_ptr<FSWritableFile> file;
+    std::uniform_int_distribution<int> dist(1, FLAGS_write_size * 2 - 1);
+    FileOptions fopts;
+    IOOptions opts;
+    IODebugContext dbg;
+    uint64_t written = 0;
+
+    if (!zenFS_->NewWritableFile(fname, fopts, &file, &dbg).ok()) {
+      stats->errors++;
+      return;
+    }
+    file->SetWriteLifeTimeHint(Env::WLTH_MEDIUM);
+
+    while (written < (uint64_t)FLAGS_file_size) {
+      size_t sz = rand ? dist(*rng) : FLAGS_write_size;
+      sz = std::min(sz, (size_t)(FLAGS_file_size - written));
+
+      LatencyTimer timer(&stats->latency);
+      if (!file->Append(Slice(data_, sz), opts, &dbg).ok()) {
+        stats->errors++;
+        break;
+      }
+      written += sz;
+      stats->bytes += sz;
+    }
+
+    if (!file->Fsync(opts, &dbg).ok()) stats->errors++;
+    file->Close(opts, &dbg);
+  }
+
+  void BenchWrite(bool rand) {
+    std::string name = rand ? "rand_write" : "seq_write";
+
+    Run(name, "append_size=" + std::to_string(FLAGS_write_size), [&](int tid, BenchStats *stats) {
+      std::mt19937_64 rng(tid);
+      WriteFile(FileName(name, tid, 0), rand, &rng, stats);
+    });
+
+    if (!rand) {
+      for (int t = 0; t < FLAGS_threads; t++) read_files_.push_back(FileName(name, t, 0));
+    }
+  }
+
+  void BenchWALSync() {
+    Run("wal_sync", "append_size=" + std::to_string(FLAGS_wal_write_size), [&](int tid, BenchStats *stats) {
+      std::unique_ptr<FSWritableFile> file;
+      FileOptions fopts;
+      IOOptions opts;
+      IODebugContext dbg;
+
+      if (!zenFS_->NewWritableFile(FileName("wal_sync", tid, 0) + ".log", fopts, &file, &dbg).ok()) {
+        stats->errors++;
+        return;
+      }
+      file->SetWriteLifeTimeHint(Env::WLTH_SHORT);
+
+      for (int i = 0; i < FLAGS_ops; i++) {
+        LatencyTimer timer(&stats->latency);
+        if (!file->Append(Slice(data_, FLAGS_wal_write_size), opts, &dbg).ok() || !file->Sync(opts, &dbg).ok()) {
+          stats->errors++;
+          break;
+        }
+        stats->bytes += FLAGS_wal_write_size;
+      }
+      file->Close(opts, &dbg);
+    });
+  }
+
+  bool PrepareReadFiles() {
+    if (!read_files_.empty()) return true;
+
+    BenchStats stats;
+    std::mt19937_64 rng(0);
+    std::string fname = FileName("read", 0, 0);
+    WriteFile(fname, false, &rng, &stats);
+    if (stats.errors) {
+      fprintf(stderr, "Failed writing %s\n", fname.c_str());
+      return false;
+    }
+    read_files_.push_back(fname);
+    return true;
+  }
+
+  void BenchRead(bool multi) {
+    std::string name = multi ? "multi_read" : "rand_read";
+    std::string params = "read_size=" + std::to_string(FLAGS_read_size);
+
+    if (!PrepareReadFiles()) return;
+    if (multi) params += ",batch=" + std::to_string(FLAGS_multiread_batch);
+
+    Run(name, params, [&](int tid, BenchStats *stats) {
+      std::unique_ptr<FSRandomAccessFile> file;
+      std::mt19937_64 rng(tid);
+      int batch = multi ? FLAGS_multiread_batch : 1;
+      std::vector<char> scratch((size_t)FLAGS_read_size * batch);
+      std::vector<FSReadRequest> reqs(batch);
+      FileOptions fopts;
+      IOOptions opts;
+      IODebugContext dbg;
+
+      const std::string &fname = read_files_[tid % read_files_.size()];
+      if (!zenFS_->NewRandomAccessFile(fname, fopts, &file, &dbg).ok()) {
+        stats->errors++;
+        return;
+      }
+      std::uniform_int_distribution<uint64_t> dist(0, FLAGS_file_size - FLAGS_read_size);
+
+      for (int i = 0; i < FLAGS_ops; i++) {
+        for (int r = 0; r < batch; r++) {
+          reqs[r].offset = dist(rng);
+          reqs[r].len = FLAGS_read_size;
+          reqs[r].scratch = scratch.data() + (size_t)r * FLAGS_read_size;
+        }
+
+        LatencyTimer timer(&stats->latency);
+        if (multi) {
+          if (!file->MultiRead(reqs.data(), batch, opts, &dbg).ok()) stats->errors++;
+          for (const auto &req : reqs) {
+            if (!req.status.ok()) stats->errors++;
+          }
+        } else {
+          reqs[0].status = file->Read(reqs[0].offset, reqs[0].len, opts, &reqs[0].result, reqs[0].scratch, &dbg);
+          if (!reqs[0].status.ok()) stats->errors++;
+        }
+        stats->bytes += (uint64_t)FLAGS_read_size * batch;
+      }
+    });
+  }
+
+  void BenchAllocZone() {
+    Run("alloc_zone", "", [&](int /*tid*/, BenchStats *stats) {
+      for (int i = 0; i < FLAGS_ops; i++) {
+        Zone *z;
+        {
+          LatencyTimer timer(&stats->latency);
+          z = zbd_->AllocateZone(Env::WLTH_MEDIUM, false);
+        }
+        if (z == nullptr) {
+          stats->errors++;
+          continue;
+        }
+        z->CloseWR();
+      }
+    });
+  }
+
+  /* A rename only writes a metadata record */
+  void BenchMetaSync() {
+    Run("meta_sync", "", [&](int tid, BenchStats *stats) {
+      std::unique_ptr<FSWritableFile> file;
+      FileOptions fopts;
+      IOOptions opts;
+      IODebugContext dbg;
+      std::string names[2] = {FileName("meta_sync", tid, 0), FileName("meta_sync", tid, 1)};
+
+      if (!zenFS_->NewWritableFile(names[0], fopts, &file, &dbg).ok()) {
+        stats->errors++;
+        return;
+      }
+      file->Close(opts, &dbg);
+
+      for (int i = 0; i < FLAGS_ops; i++) {
+        LatencyTimer timer(&stats->latency);
+        if (!zenFS_->RenameFile(names[i % 2], names[(i + 1) % 2], opts, &dbg).ok()) {
+          stats->errors++;
+          break;
+        }
+      }
+    });
+  }
+
+  void BenchMetaRoll() {
+    std::stringstream counts(FLAGS_roll_file_counts);
+    std::string count;
+    int nr_files = 0;
+
+    while (std::getline(counts, count, ',')) {
+      int target = std::stoi(count);
+      FileOptions fopts;
+      IOOptions opts;
+      IODebugContext dbg;
+      BenchResult result;
+
+      for (; nr_files < target; nr_files++) {
+        std::unique_ptr<FSWritableFile> file;
+        if (!zenFS_->NewWritableFile(FileName("meta_roll", 0, nr_files), fopts, &file, &dbg).ok()) {
+          fprintf(stderr, "Failed creating files for meta_roll\n");
+          return;
+        }
+        file->Close(opts, &dbg);
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      {
+        LatencyTimer timer(&result.stats.latency);
+        if (!zenFS_->ForceMetaZoneRoll().ok()) result.stats.errors++;
+      }
+      auto elapsed = std::chrono::steady_clock::now() - start;
+
+      result.name = "meta_roll";
+      result.params = "files=" + std::to_string(nr_files);
+      result.threads = 1;
+      result.elapsed_s = std::chrono::duration<double>(elapsed).count();
+      fprintf(stderr, "%-12s %-24s %10.1f ms\n", "meta_roll", result.params.c_str(), result.elapsed_s * 1000);
+      results_.push_back(std::move(result));
+    }
+  }
+
+  void Cleanup() {
+    IOOptions opts;
+    IODebugContext dbg;
+    std::vector<std::string> children;
+
+    if (FLAGS_keep_files) return;
+    zenFS_->GetChildren(FLAGS_path, opts, &children, &dbg);
+    for (const auto &f : children) zenFS_->DeleteFile(FLAGS_path + f, opts, &dbg);
+  }
+
+ public:
+  ZenFSBench(ZenFS *zenFS, ZonedBlockDevice *zbd) : zenFS_(zenFS), zbd_(zbd) {}
+  ~ZenFSBench() { free(data_); }
+
+  int RunAll() {
+    std::stringstream benchmarks(FLAGS_benchmarks);
+    std::string bench;
+
+    if (!PrepareData(std::max(FLAGS_write_size * 2, FLAGS_wal_write_size))) {
+      fprintf(stderr, "Failed allocating data buffer\n");
+      return 1;
+    }
+
+    while (std::getline(benchmarks, bench, ',')) {
+      if (bench == "seq_write") {
+        BenchWrite(false);
+      } else if (bench == "rand_write") {
+        BenchWrite(true);
+      } else if (bench == "wal_sync") {
+        BenchWALSync();
+      } else if (bench == "rand_read") {
+        BenchRead(false);
+      } else if (bench == "multi_read") {
+        BenchRead(true);
+      } else if (bench == "alloc_zone") {
+        BenchAllocZone();
+      } else if (bench == "meta_sync") {
+        BenchMetaSync();
+      } else if (bench == "meta_roll") {
+        BenchMetaRoll();
+      } else {
+        fprintf(stderr, "Unknown benchmark: %s\n", bench.c_str());
+        return 1;
+      }
+    }
+
+    Cleanup();
+    return 0;
+  }
+
+  void EncodeJson(std::ostream &json_stream) {
+    ZenFSReadCache *cache = zbd_->GetReadCache();
+
+    json_stream << "{\"device\":\"" << zbd_->GetFilename() << "\",\"io_engine\":\"" << zbd_->GetIOEngine()->Name()
+                << "\",";
+    if (cache != nullptr) {
+      json_stream << "\"read_cache\":{\"hits\":" << cache->GetHits() << ",\"misses\":" << cache->GetMisses()
+                  << ",\"usage\":" << cache->GetUsage() << "},";
+    }
+    json_stream << "\"io_sched\":{\"deferred\":" << zbd_->GetIOScheduler()->GetDeferred()
+                << ",\"throttled_us\":" << zbd_->GetIOScheduler()->GetThrottledMicros() << "},";
+    json_stream << "\"finish_policy\":{\"threshold\":" << zbd_->GetFinishThreshold()
+                << ",\"proactive_finishes\":" << zbd_->GetProactiveFinishes() << "},";
+    json_stream << "\"lifetime_classes\":";
+    zbd_->GetLifetimePredictor()->EncodeJson(json_stream);
+    json_stream << ",\"results\":[";
+    for (size_t i = 0; i < results_.size(); i++) {
+      const BenchResult &r = results_[i];
+      if (i) json_stream << ",";
+      json_stream << "{\"name\":\"" << r.name << "\",\"params\":\"" << r.params << "\",\"threads\":" << r.threads;
+      json_stream << ",\"elapsed_s\":" << r.elapsed_s;
+      json_stream << ",\"ops\":" << r.stats.latency.Count() << ",\"bytes\":" << r.stats.bytes;
+      json_stream << ",\"errors\":" << r.stats.errors;
+      json_stream << ",\"ops_per_sec\":" << r.stats.latency.Count() / r.elapsed_s;
+      json_stream << ",\"mb_per_sec\":" << r.stats.bytes / r.elapsed_s / (1024 * 1024);
+      json_stream << ",\"latency\":";
+      r.stats.latency.EncodeJson(json_stream);
+      json_stream << "}";
+    }
+    json_stream << "]}";
+  }
+};
+
+int zenfs_bench() {
+  auto logger = std::make_shared<test::NullLogger>();
+  auto metrics = std::make_shared<BytedanceMetrics>(std::make_shared<ByteDanceMetricsReporterFactory>(), "", logger);
+  IOOptions opts;
+  IODebugContext dbg;
+  Status s;
+
+  ZonedBlockDevice *zbd = new ZonedBlockDevice(FLAGS_zbd, logger);
+  IOStatus open_status = zbd->Open(false, FLAGS_io_engine);
+  if (!open_status.ok()) {
+    fprintf(stderr, "Failed to open zoned block device: %s, error: %s\n", FLAGS_zbd.c_str(),
+            open_status.ToString().c_str());
+    delete zbd;
+    return 1;
+  }
+  zbd->SetReadCacheSize(FLAGS_read_cache_size);
+  zbd->SetSharedZones(FLAGS_shared_zones);
+  zbd->GetIOScheduler()->SetRate(kIOClassBackground, FLAGS_bg_write_rate);
+
+  ZenFS *zenFS = new ZenFS(zbd, FileSystem::Default(), logger, metrics);
+  s = zenFS->Mount(false);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n", s.ToString().c_str());
+    delete zenFS;
+    return 1;
+  }
+
+  if (FLAGS_path.back() != '/') FLAGS_path.append("/");
+  zenFS->CreateDirIfMissing(FLAGS_path, opts, &dbg);
+
+  int ret;
+  {
+    ZenFSBench bench(zenFS, zbd);
+    ret = bench.RunAll();
+    if (ret == 0) {
+      std::stringstream json;
+      bench.EncodeJson(json);
+      fprintf(stdout, "%s\n", json.str().c_str());
+    }
+  }
+
+  if (ret == 0 && !FLAGS_trace_file.empty()) {
+    std::ofstream trace(FLAGS_trace_file);
+    zbd->GetTracer()->EncodeJson(trace);
+    trace << "\n";
+    if (!trace.good()) {
+      fprintf(stderr, "Failed writing trace to %s\n", FLAGS_trace_file.c_str());
+      ret = 1;
+    }
+  }
+
+  delete zenFS;
+  return ret;
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(std::string("\nUSAGE:\n") + std::string(argv[0]) + +" --zbd=<device> [OPTIONS]...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_zbd.empty()) {
+    fprintf(stderr, "You need to specify a zoned block device using --zbd\n");
+    return 1;
+  }
+  if (FLAGS_threads <= 0 || FLAGS_write_size <= 0 || FLAGS_wal_write_size <= 0 || FLAGS_read_size <= 0 ||
+      FLAGS_multiread_batch <= 0 || FLAGS_read_size > FLAGS_file_size) {
+    fprintf(stderr, "Invalid benchmark parameters\n");
+    return 1;
+  }
+
+  return ROCKSDB_NAMESPACE::zenfs_bench();
+}
@@ -1,3 +1,8 @@
-zenfs_SOURCES = fs/fs_zenfs.cc fs/zbd_zenfs.cc fs/io_zenfs.cc
-zenfs_HEADERS = fs/fs_zenfs.h fs/zbd_zenfs.h fs/io_zenfs.h fs/zbd_stat.h
+zenfs_SOURCES = fs/fs_zenfs.cc fs/zbd_zenfs.cc fs/io_zenfs.cc fs/io_engine.cc fs/op_trace.cc fs/read_cache.cc fs/lifetime.cc fs/io_sched.cc fs/zbd_emu.cc
+zenfs_HEADERS = fs/fs_zenfs.h fs/zbd_zenfs.h fs/io_zenfs.h fs/io_engine.h fs/zbd_stat.h fs/op_trace.h fs/read_cache.h fs/lifetime.h fs/io_sched.h fs/zbd_emu.h
 zenfs_LDFLAGS = -lzbd -laio -u zenfs_filesystem_reg
+
+ifeq ($(shell pkg-config --exists liburing && echo 1),1)
+zenfs_CXXFLAGS += -DZENFS_HAVE_URING
+zenfs_LDFLAGS += -luring
+endif